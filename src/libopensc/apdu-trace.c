@@ -0,0 +1,401 @@
+/*
+ * apdu-trace.c: In-memory ring of APDU trace records
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <signal.h>
+#endif
+
+#include "common/compat_strlcpy.h"
+#include "internal.h"
+#include "sm.h"
+
+/*
+ * The ring is shared by all contexts of the process. It is published with
+ * its size and options by a single pointer exchange, so that the first
+ * caller of sc_apdu_trace_enable() configures all of them. Writers reserve
+ * a slot by incrementing the head and publish the record by storing its
+ * sequence number last; a reader copies a record and keeps it only if
+ * the sequence number was the expected one before and after the copy.
+ * Neither side ever blocks.
+ */
+#define APDU_TRACE_MAGIC	"OSCTRACE"
+#define APDU_TRACE_VERSION	1
+#define APDU_TRACE_DATA		16
+#define APDU_TRACE_READER	40
+#define APDU_TRACE_MAX_RECORDS	65536
+
+#define APDU_TRACE_FLAG_SM	0x01
+#define APDU_TRACE_FLAG_DATA	0x02
+
+struct apdu_trace_record {
+	uint64_t seq;		/* sequence number + 1, 0 while being written */
+	uint64_t time;		/* start, microseconds since the epoch */
+	uint32_t duration;	/* microseconds */
+	int32_t rv;		/* return value of the reader driver */
+	uint32_t lc, le;
+	uint16_t sw;
+	u8 cla, ins, p1, p2;
+	u8 flags;
+	u8 datalen;
+	u8 data[APDU_TRACE_DATA];
+	char reader[APDU_TRACE_READER];
+};
+
+/* Header of the file written on SIGUSR2 */
+struct apdu_trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t head;
+	uint32_t records;
+	uint32_t reserved;
+};
+
+#if defined(_MSC_VER)
+#define trace_load(p)		((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define trace_store(p, v)	InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v))
+#define trace_fetch_inc(p)	((uint64_t)InterlockedIncrement64((volatile LONG64 *)(p)) - 1)
+#define trace_load_ptr(p)	InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define trace_publish(p, v)	(InterlockedCompareExchangePointer((PVOID volatile *)(p), (v), NULL) == NULL)
+#else
+#define trace_load(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define trace_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define trace_fetch_inc(p)	__atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define trace_load_ptr(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define trace_publish(p, v)	__extension__ ({ \
+	void *_expected = NULL; \
+	__atomic_compare_exchange_n((p), &_expected, (v), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); \
+})
+#endif
+
+struct apdu_trace_ring {
+	size_t size;		/* power of two */
+	int keep_data;
+	struct apdu_trace_record *records;
+};
+
+static struct apdu_trace_ring *trace_ring = NULL;
+static uint64_t trace_head = 0;
+#ifndef _WIN32
+static char trace_file[PATH_MAX];
+#endif
+
+static uint64_t trace_wall_time(void)
+{
+#ifdef _WIN32
+	FILETIME ft;
+	ULARGE_INTEGER t;
+
+	GetSystemTimeAsFileTime(&ft);
+	t.LowPart = ft.dwLowDateTime;
+	t.HighPart = ft.dwHighDateTime;
+	/* 100 ns intervals since 1601 */
+	return t.QuadPart / 10 - 11644473600000000ULL;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+uint64_t sc_monotonic_time_us(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000
+		+ (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	return trace_wall_time();
+#endif
+}
+
+#ifndef _WIN32
+static void trace_signal_handler(int sig)
+{
+	const struct apdu_trace_ring *ring = trace_load_ptr(&trace_ring);
+	struct apdu_trace_file_header hdr;
+	int saved_errno = errno;
+	ssize_t r;
+	int fd;
+
+	(void)sig;
+	if (ring == NULL)
+		return;
+	fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		errno = saved_errno;
+		return;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, APDU_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = APDU_TRACE_VERSION;
+	hdr.record_size = sizeof(struct apdu_trace_record);
+	hdr.head = trace_load(&trace_head);
+	hdr.records = (uint32_t)ring->size;
+	r = write(fd, &hdr, sizeof(hdr));
+	if (r == (ssize_t)sizeof(hdr))
+		r = write(fd, ring->records, ring->size * sizeof(*ring->records));
+	(void)r;
+	close(fd);
+	errno = saved_errno;
+}
+
+/* The handler is only installed if the application does not handle the
+ * signal itself */
+static void trace_install_handler(const char *dump_file)
+{
+	struct sigaction sa;
+
+	if (strlen(dump_file) >= sizeof(trace_file))
+		return;
+	if (sigaction(SIGUSR2, NULL, &sa) != 0
+			|| (sa.sa_flags & SA_SIGINFO) || sa.sa_handler != SIG_DFL)
+		return;
+	strcpy(trace_file, dump_file);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = trace_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR2, &sa, NULL);
+}
+#endif
+
+int sc_apdu_trace_enable(size_t records, int keep_data, const char *dump_file)
+{
+	struct apdu_trace_ring *ring;
+	size_t size = 16;
+
+	if (records == 0)
+		return SC_SUCCESS;
+	if (records > APDU_TRACE_MAX_RECORDS)
+		records = APDU_TRACE_MAX_RECORDS;
+	while (size < records)
+		size <<= 1;
+
+	if (trace_load_ptr(&trace_ring) != NULL)
+		/* The first caller configures the ring of the process */
+		return SC_SUCCESS;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	ring->records = calloc(size, sizeof(*ring->records));
+	if (ring->records == NULL) {
+		free(ring);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	ring->size = size;
+	ring->keep_data = keep_data;
+	if (!trace_publish(&trace_ring, ring)) {
+		free(ring->records);
+		free(ring);
+		return SC_SUCCESS;
+	}
+
+#ifndef _WIN32
+	if (dump_file != NULL)
+		trace_install_handler(dump_file);
+#else
+	(void)dump_file;
+#endif
+	return SC_SUCCESS;
+}
+
+uint64_t sc_apdu_trace_begin(void)
+{
+	if (trace_load_ptr(&trace_ring) == NULL)
+		return 0;
+	return sc_monotonic_time_us();
+}
+
+/* Data of commands that carry PINs is never recorded */
+static int trace_redact(const struct apdu_trace_ring *ring, const sc_apdu_t *apdu)
+{
+	switch (apdu->ins) {
+	case 0x20: /* VERIFY */
+	case 0x21:
+	case 0x24: /* CHANGE REFERENCE DATA */
+	case 0x2C: /* RESET RETRY COUNTER */
+		return 1;
+	}
+	return !ring->keep_data;
+}
+
+void sc_apdu_trace_end(sc_card_t *card, const sc_apdu_t *apdu, int rv, uint64_t start)
+{
+	struct apdu_trace_ring *ring = trace_load_ptr(&trace_ring);
+	struct apdu_trace_record *rec;
+	uint64_t seq;
+
+	if (ring == NULL || start == 0)
+		return;
+
+	seq = trace_fetch_inc(&trace_head);
+	rec = &ring->records[seq & (ring->size - 1)];
+	trace_store(&rec->seq, 0);
+
+	rec->duration = (uint32_t)(sc_monotonic_time_us() - start);
+	rec->time = trace_wall_time() - rec->duration;
+	rec->rv = rv;
+	rec->cla = apdu->cla;
+	rec->ins = apdu->ins;
+	rec->p1 = apdu->p1;
+	rec->p2 = apdu->p2;
+	rec->lc = (uint32_t)apdu->lc;
+	rec->le = (uint32_t)apdu->le;
+	rec->sw = rv == SC_SUCCESS ? (uint16_t)(apdu->sw1 << 8 | apdu->sw2) : 0;
+	rec->flags = 0;
+#ifdef ENABLE_SM
+	if (card->sm_ctx.sm_mode == SM_MODE_TRANSMIT && (apdu->flags & SC_APDU_FLAGS_NO_SM))
+		rec->flags |= APDU_TRACE_FLAG_SM;
+#endif
+	rec->datalen = 0;
+	if (!trace_redact(ring, apdu) && apdu->data != NULL) {
+		rec->datalen = apdu->datalen < APDU_TRACE_DATA ? (u8)apdu->datalen : APDU_TRACE_DATA;
+		memcpy(rec->data, apdu->data, rec->datalen);
+		rec->flags |= APDU_TRACE_FLAG_DATA;
+	}
+	strlcpy(rec->reader, card->reader && card->reader->name ? card->reader->name : "",
+			sizeof(rec->reader));
+
+	trace_store(&rec->seq, seq + 1);
+}
+
+static void trace_print_record(const struct apdu_trace_record *rec, FILE *out)
+{
+	time_t t = (time_t)(rec->time / 1000000);
+	struct tm *tm = localtime(&t);
+	char time_string[40] = "";
+	size_t i;
+
+	if (tm != NULL)
+		strftime(time_string, sizeof(time_string), "%Y-%m-%d %H:%M:%S", tm);
+	fprintf(out, "%s.%06u [%s] %02X %02X %02X %02X Lc=%u Le=%u ",
+			time_string, (unsigned)(rec->time % 1000000), rec->reader,
+			rec->cla, rec->ins, rec->p1, rec->p2, rec->lc, rec->le);
+	if (rec->rv == SC_SUCCESS)
+		fprintf(out, "SW=%04X", rec->sw);
+	else
+		fprintf(out, "error %d", rec->rv);
+	fprintf(out, " %uus%s", rec->duration, rec->flags & APDU_TRACE_FLAG_SM ? " SM" : "");
+	if (rec->flags & APDU_TRACE_FLAG_DATA) {
+		fprintf(out, " data=");
+		for (i = 0; i < rec->datalen; i++)
+			fprintf(out, "%02X", rec->data[i]);
+		if (rec->datalen < rec->lc)
+			fprintf(out, "...");
+	}
+	fprintf(out, "\n");
+}
+
+/* Prints the complete records from the oldest to the newest one */
+static int trace_print_ring(const struct apdu_trace_record *ring, size_t size, uint64_t head, FILE *out)
+{
+	struct apdu_trace_record rec;
+	uint64_t seq = head > size ? head - size : 0;
+	int count = 0;
+
+	for (; seq < head; seq++) {
+		const struct apdu_trace_record *src = &ring[seq & (size - 1)];
+
+		if (trace_load(&src->seq) != seq + 1)
+			continue;
+		memcpy(&rec, src, sizeof(rec));
+		if (trace_load(&src->seq) != seq + 1)
+			continue;
+		trace_print_record(&rec, out);
+		count++;
+	}
+	return count;
+}
+
+int sc_apdu_trace_print(FILE *out)
+{
+	const struct apdu_trace_ring *ring = trace_load_ptr(&trace_ring);
+
+	if (out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (ring == NULL)
+		return SC_ERROR_NOT_ALLOWED;
+	return trace_print_ring(ring->records, ring->size, trace_load(&trace_head), out);
+}
+
+int sc_apdu_trace_print_file(const char *filename, FILE *out)
+{
+	struct apdu_trace_file_header hdr;
+	struct apdu_trace_record *ring = NULL;
+	FILE *in;
+	int r = SC_ERROR_INVALID_DATA;
+
+	if (filename == NULL || out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	in = fopen(filename, "rb");
+	if (in == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1
+			|| memcmp(hdr.magic, APDU_TRACE_MAGIC, sizeof(hdr.magic)) != 0
+			|| hdr.version != APDU_TRACE_VERSION
+			|| hdr.record_size != sizeof(*ring)
+			|| hdr.records == 0 || hdr.records > APDU_TRACE_MAX_RECORDS
+			|| (hdr.records & (hdr.records - 1)) != 0)
+		goto err;
+
+	ring = calloc(hdr.records, sizeof(*ring));
+	if (ring == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	if (fread(ring, sizeof(*ring), hdr.records, in) != hdr.records)
+		goto err;
+
+	r = trace_print_ring(ring, hdr.records, hdr.head, out);
+err:
+	free(ring);
+	fclose(in);
+	return r;
+}
@@ -358,6 +358,8 @@ static int
 sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
+	unsigned long long start;
+	uint64_t trace;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -376,7 +378,11 @@ sc_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 #endif
 
 	/* send APDU to the reader driver */
+	trace = sc_apdu_trace_begin();
+	start = sc_latency_begin(ctx);
 	rv = card->reader->ops->transmit(card->reader, apdu);
+	sc_latency_end(ctx, SC_LATENCY_CARD, start);
+	sc_apdu_trace_end(card, apdu, rv, trace);
 	LOG_TEST_RET(ctx, rv, "unable to transmit APDU");
 
 	LOG_FUNC_RETURN(ctx, rv);
@@ -542,6 +548,7 @@ sc_transmit(sc_card_t *card, sc_apdu_t *apdu)
 
 int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 {
+	unsigned long long start;
 	int r = SC_SUCCESS;
 
 	if (card == NULL || apdu == NULL)
@@ -557,6 +564,7 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	if (r != SC_SUCCESS)
 		return SC_ERROR_INVALID_ARGUMENTS;
 
+	start = sc_latency_begin(card->ctx);
 	r = sc_lock(card);	/* acquire card lock*/
 	if (r != SC_SUCCESS) {
 		sc_log(card->ctx, "unable to acquire lock");
@@ -628,6 +636,7 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 		r = sc_transmit(card, apdu);
 	}
 
+	sc_select_cache_apdu(card, apdu);
 	if (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
 		sc_invalidate_cache(card);
 		/* give card driver a chance to react on resets */
@@ -639,6 +648,7 @@ int sc_transmit_apdu(sc_card_t *card, sc_apdu_t *apdu)
 	if (sc_unlock(card) != SC_SUCCESS)
 		sc_log(card->ctx, "sc_unlock failed");
 
+	sc_latency_end(card->ctx, SC_LATENCY_TRANSMIT_APDU, start);
 	return r;
 }
 
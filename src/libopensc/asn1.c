@@ -41,6 +41,29 @@ static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
 static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 		const u8 * data, size_t datalen, u8 ** out, size_t * outlen);
 
+/*
+ * Encoding takes two passes. The first one encodes the primitive values and
+ * builds a tree of the elements with their tags and exact lengths, the second
+ * one writes the tree into a single buffer. Constructed elements are never
+ * encoded into buffers of their own that their parents would copy again.
+ */
+#define ASN1_HEADER_MAX		(3 + 1 + sizeof(size_t))
+
+struct asn1_node {
+	u8 header[ASN1_HEADER_MAX];	/* tag and length */
+	size_t header_len;
+	const u8 *data;			/* contents of a primitive element */
+	size_t datalen;
+	u8 *buf;			/* data, unless borrowed from the entry */
+	struct asn1_node *child;	/* contents of a constructed element */
+	size_t len;			/* header and contents */
+	struct asn1_node *next;
+};
+
+static int asn1_encode_nodes(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		struct asn1_node **nodes, size_t *size, int depth);
+static void asn1_free_nodes(struct asn1_node *node);
+
 static const char *tag2str(unsigned int tag)
 {
 	static const char *tags[] = {
@@ -1050,11 +1073,13 @@ int sc_asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	return asn1_write_element(ctx, tag, data, datalen, out, outlen);
 }
 
-static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
-	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+/* Writes the tag and length of an element into hdr, which has room for
+ * ASN1_HEADER_MAX bytes */
+static int asn1_write_header(sc_context_t *ctx, unsigned int tag,
+	size_t datalen, u8 *hdr, size_t *hdrlen)
 {
 	unsigned char t;
-	unsigned char *buf, *p;
+	unsigned char *p = hdr;
 	int c = 0;
 	unsigned short_tag;
 	unsigned char tag_char[3] = {0, 0, 0};
@@ -1097,16 +1122,10 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 		t |= SC_ASN1_TAG_CONSTRUCTED;
 	if (datalen > 127) {
 		c = 1;
-		while (datalen >> (c << 3))
+		while (c < (int)sizeof(datalen) && datalen >> (c << 3))
 			c++;
 	}
 
-	*outlen = tag_len + 1 + c + datalen;
-	buf = malloc(*outlen);
-	if (buf == NULL)
-		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
-
-	*out = p = buf;
 	*p++ = t;
 	for (ii=1;ii<tag_len;ii++)
 		*p++ = tag_char[tag_len - ii - 1];
@@ -1119,8 +1138,30 @@ static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
 	else   {
 		*p++ = datalen & 0x7F;
 	}
+	*hdrlen = p - hdr;
+
+	return SC_SUCCESS;
+}
+
+static int asn1_write_element(sc_context_t *ctx, unsigned int tag,
+	const u8 * data, size_t datalen, u8 ** out, size_t * outlen)
+{
+	u8 hdr[ASN1_HEADER_MAX];
+	size_t hdrlen;
+	int r;
+
+	r = asn1_write_header(ctx, tag, datalen, hdr, &hdrlen);
+	if (r != SC_SUCCESS)
+		return r;
+
+	*outlen = hdrlen + datalen;
+	*out = malloc(*outlen);
+	if (*out == NULL)
+		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_ERROR_OUT_OF_MEMORY);
+
+	memcpy(*out, hdr, hdrlen);
 	if (datalen && data) {
-		memcpy(p, data, datalen);
+		memcpy(*out + hdrlen, data, datalen);
 	}
 
 	return SC_SUCCESS;
@@ -1430,21 +1471,22 @@ static int asn1_decode_p15_object(sc_context_t *ctx, const u8 *in,
 }
 
 static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15_object *obj,
-				  u8 **buf, size_t *bufsize, int depth)
+				  struct asn1_node **nodes, size_t *size, int depth)
 {
-	struct sc_pkcs15_object p15_obj = *obj->p15_obj;
+	/* Not copied, the label and IDs are borrowed by the encoded nodes */
+	const struct sc_pkcs15_object *p15_obj = obj->p15_obj;
 	struct sc_asn1_entry    asn1_c_attr[6], asn1_p15_obj[5];
 	struct sc_asn1_entry asn1_ac_rules[SC_PKCS15_MAX_ACCESS_RULES + 1], asn1_ac_rule[SC_PKCS15_MAX_ACCESS_RULES][3];
-	size_t label_len = strlen(p15_obj.label);
+	size_t label_len = strlen(p15_obj->label);
 	size_t flags_len;
 	size_t access_mode_len;
 	int r, ii;
 
-	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "encode p15 obj(type:0x%X,access_mode:0x%X)", p15_obj.type, p15_obj.access_rules[0].access_mode);
-	if (p15_obj.access_rules[0].access_mode)   {
+	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "encode p15 obj(type:0x%X,access_mode:0x%X)", p15_obj->type, p15_obj->access_rules[0].access_mode);
+	if (p15_obj->access_rules[0].access_mode)   {
 		for (ii=0; ii<SC_PKCS15_MAX_ACCESS_RULES; ii++)   {
 			sc_copy_asn1_entry(c_asn1_access_control_rule, asn1_ac_rule[ii]);
-			if (p15_obj.access_rules[ii].auth_id.len == 0)   {
+			if (p15_obj->access_rules[ii].auth_id.len == 0)   {
 				asn1_ac_rule[ii][1].type = SC_ASN1_NULL;
 				asn1_ac_rule[ii][1].tag = SC_ASN1_TAG_NULL;
 			}
@@ -1455,21 +1497,21 @@ static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15
 	sc_copy_asn1_entry(c_asn1_com_obj_attr, asn1_c_attr);
 	sc_copy_asn1_entry(c_asn1_p15_obj, asn1_p15_obj);
 	if (label_len != 0)
-		sc_format_asn1_entry(asn1_c_attr + 0, (void *) p15_obj.label, &label_len, 1);
-	if (p15_obj.flags) {
-		flags_len = sizeof(p15_obj.flags);
-		sc_format_asn1_entry(asn1_c_attr + 1, (void *) &p15_obj.flags, &flags_len, 1);
-	}
-	if (p15_obj.auth_id.len)
-		sc_format_asn1_entry(asn1_c_attr + 2, (void *) &p15_obj.auth_id, NULL, 1);
-	if (p15_obj.user_consent)
-		sc_format_asn1_entry(asn1_c_attr + 3, (void *) &p15_obj.user_consent, NULL, 1);
-
-	if (p15_obj.access_rules[0].access_mode)   {
-		for (ii=0; p15_obj.access_rules[ii].access_mode; ii++)   {
-			access_mode_len = sizeof(p15_obj.access_rules[ii].access_mode);
-			sc_format_asn1_entry(asn1_ac_rule[ii] + 0, (void *) &p15_obj.access_rules[ii].access_mode, &access_mode_len, 1);
-			sc_format_asn1_entry(asn1_ac_rule[ii] + 1, (void *) &p15_obj.access_rules[ii].auth_id, NULL, 1);
+		sc_format_asn1_entry(asn1_c_attr + 0, (void *) p15_obj->label, &label_len, 1);
+	if (p15_obj->flags) {
+		flags_len = sizeof(p15_obj->flags);
+		sc_format_asn1_entry(asn1_c_attr + 1, (void *) &p15_obj->flags, &flags_len, 1);
+	}
+	if (p15_obj->auth_id.len)
+		sc_format_asn1_entry(asn1_c_attr + 2, (void *) &p15_obj->auth_id, NULL, 1);
+	if (p15_obj->user_consent)
+		sc_format_asn1_entry(asn1_c_attr + 3, (void *) &p15_obj->user_consent, NULL, 1);
+
+	if (p15_obj->access_rules[0].access_mode)   {
+		for (ii=0; p15_obj->access_rules[ii].access_mode; ii++)   {
+			access_mode_len = sizeof(p15_obj->access_rules[ii].access_mode);
+			sc_format_asn1_entry(asn1_ac_rule[ii] + 0, (void *) &p15_obj->access_rules[ii].access_mode, &access_mode_len, 1);
+			sc_format_asn1_entry(asn1_ac_rule[ii] + 1, (void *) &p15_obj->access_rules[ii].auth_id, NULL, 1);
 			sc_format_asn1_entry(asn1_ac_rules + ii, asn1_ac_rule[ii], NULL, 1);
 		}
 		sc_format_asn1_entry(asn1_c_attr + 4, asn1_ac_rules, NULL, 1);
@@ -1481,7 +1523,7 @@ static int asn1_encode_p15_object(sc_context_t *ctx, const struct sc_asn1_pkcs15
 		sc_format_asn1_entry(asn1_p15_obj + 2, obj->asn1_subclass_attr, NULL, 1);
 	sc_format_asn1_entry(asn1_p15_obj + 3, obj->asn1_type_attr, NULL, 1);
 
-	r = asn1_encode(ctx, asn1_p15_obj, buf, bufsize, depth + 1);
+	r = asn1_encode_nodes(ctx, asn1_p15_obj, nodes, size, depth + 1);
 	return r;
 }
 
@@ -1572,6 +1614,13 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 				obj++;
 			}
 
+			/* Point into the input, which must outlive the result */
+			if (entry->flags & SC_ASN1_BORROW) {
+				*(const u8 **) parm = obj;
+				*len = objlen;
+				break;
+			}
+
 			/* Allocate buffer if needed */
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
@@ -1595,6 +1644,11 @@ static int asn1_decode_entry(sc_context_t *ctx,struct sc_asn1_entry *entry,
 		if (parm != NULL) {
 			size_t c;
 			assert(len != NULL);
+			if (entry->flags & SC_ASN1_BORROW) {
+				*(const u8 **) parm = obj;
+				*len = objlen;
+				break;
+			}
 			if (entry->flags & SC_ASN1_ALLOC) {
 				u8 **buf = (u8 **) parm;
 				if (objlen > 0) {
@@ -1699,7 +1753,8 @@ static void sc_free_entry(struct sc_asn1_entry *asn1) {
 		case SC_ASN1_GENERALIZEDTIME:
 		case SC_ASN1_PRINTABLESTRING:
 		case SC_ASN1_UTF8STRING:
-			if ((entry->flags & SC_ASN1_ALLOC) && (entry->flags & SC_ASN1_PRESENT)) {
+			if ((entry->flags & SC_ASN1_ALLOC) && !(entry->flags & SC_ASN1_BORROW)
+					&& (entry->flags & SC_ASN1_PRESENT)) {
 				u8 **buf = (u8 **)entry->parm;
 				free(*buf);
 				*buf = NULL;
@@ -1812,17 +1867,20 @@ int sc_asn1_decode_choice(sc_context_t *ctx, struct sc_asn1_entry *asn1,
 }
 
 static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entry,
-			     u8 **obj, size_t *objlen, int depth)
+			     struct asn1_node **node_out, int depth)
 {
 	void *parm = entry->parm;
 	int (*callback_func)(sc_context_t *nctx, void *arg, u8 **nobj,
 			     size_t *nobjlen, int ndepth);
 	const size_t *len = (const size_t *) entry->arg;
-	int r = 0;
+	int r = 0, emit;
 	u8 * buf = NULL;
+	const u8 *data = NULL;
 	size_t buflen = 0;
+	struct asn1_node *node, *child = NULL;
 
 	callback_func = parm;
+	*node_out = NULL;
 
 	sc_debug(ctx, SC_LOG_DEBUG_ASN1, "%*.*sencoding '%s'%s\n",
 	       	depth, depth, "", entry->name,
@@ -1856,7 +1914,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		}
 		if (choice == NULL)
 			goto no_object;
-		return asn1_encode_entry(ctx, choice, obj, objlen, depth + 1);
+		return asn1_encode_entry(ctx, choice, node_out, depth + 1);
 	}
 
 	if (entry->type != SC_ASN1_NULL && parm == NULL) {
@@ -1866,7 +1924,7 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 
 	switch (entry->type) {
 	case SC_ASN1_STRUCT:
-		r = asn1_encode(ctx, (const struct sc_asn1_entry *) parm, &buf,
+		r = asn1_encode_nodes(ctx, (const struct sc_asn1_entry *) parm, &child,
 				&buflen, depth + 1);
 		break;
 	case SC_ASN1_NULL:
@@ -1908,32 +1966,29 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 	case SC_ASN1_OCTET_STRING:
 	case SC_ASN1_UTF8STRING:
 		if (len != NULL) {
-			buf = malloc(*len + 1);
-			if (buf == NULL) {
-				r = SC_ERROR_OUT_OF_MEMORY;
-				break;
-			}
-			buflen = 0;
 			/* If the integer is supposed to be unsigned, insert
 			 * a padding byte if the MSB is one */
 			if ((entry->flags & SC_ASN1_UNSIGNED)
 					&& (((u8 *) parm)[0] & 0x80)) {
-				buf[buflen++] = 0x00;
+				buf = malloc(*len + 1);
+				if (buf == NULL) {
+					r = SC_ERROR_OUT_OF_MEMORY;
+					break;
+				}
+				buf[0] = 0x00;
+				memcpy(buf + 1, parm, *len);
+				buflen = *len + 1;
+				break;
 			}
-			memcpy(buf + buflen, parm, *len);
-			buflen += *len;
+			data = (const u8 *) parm;
+			buflen = *len;
 		} else {
 			r = SC_ERROR_INVALID_ARGUMENTS;
 		}
 		break;
 	case SC_ASN1_GENERALIZEDTIME:
 		if (len != NULL) {
-			buf = malloc(*len);
-			if (buf == NULL) {
-				r = SC_ERROR_OUT_OF_MEMORY;
-				break;
-			}
-			memcpy(buf, parm, *len);
+			data = (const u8 *) parm;
 			buflen = *len;
 		} else {
 			r = SC_ERROR_INVALID_ARGUMENTS;
@@ -1949,17 +2004,12 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		{
 			const struct sc_pkcs15_id *id = (const struct sc_pkcs15_id *) parm;
 
-			buf = malloc(id->len);
-			if (buf == NULL) {
-				r = SC_ERROR_OUT_OF_MEMORY;
-				break;
-			}
-			memcpy(buf, id->value, id->len);
+			data = id->value;
 			buflen = id->len;
 		}
 		break;
 	case SC_ASN1_PKCS15_OBJECT:
-		r = asn1_encode_p15_object(ctx, (const struct sc_asn1_pkcs15_object *) parm, &buf, &buflen, depth);
+		r = asn1_encode_p15_object(ctx, (const struct sc_asn1_pkcs15_object *) parm, &child, &buflen, depth);
 		break;
 	case SC_ASN1_ALGORITHM_ID:
 		r = sc_asn1_encode_algorithm_id(ctx, &buf, &buflen, (const struct sc_algorithm_id *) parm, depth);
@@ -1981,8 +2031,11 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 		      sc_strerror(r));
 		if (buf)
 			free(buf);
+		asn1_free_nodes(child);
 		return r;
 	}
+	if (buf)
+		data = buf;
 
 	/* Treatment of OPTIONAL elements:
 	 *  -	if the encoding has 0 length, and the element is OPTIONAL,
@@ -1995,23 +2048,15 @@ static int asn1_encode_entry(sc_context_t *ctx, const struct sc_asn1_entry *entr
 	 *  -	any other empty objects are considered bogus
 	 */
 no_object:
+	emit = 0;
 	if (!buflen && entry->flags & SC_ASN1_OPTIONAL && !(entry->flags & SC_ASN1_PRESENT)) {
 		/* This happens when we try to encode e.g. the
 		 * subClassAttributes, which may be empty */
-		*obj = NULL;
-		*objlen = 0;
 		r = 0;
 	} else if (!buflen && (entry->flags & SC_ASN1_EMPTY_ALLOWED)) {
-		*obj = NULL;
-		*objlen = 0;
-		r = asn1_write_element(ctx, entry->tag, buf, buflen, obj, objlen);
-		if (r)
-			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n", sc_strerror(r));
+		emit = 1;
 	} else if (buflen || entry->type == SC_ASN1_NULL || entry->tag & SC_ASN1_CONS) {
-		r = asn1_write_element(ctx, entry->tag, buf, buflen, obj, objlen);
-		if (r)
-			sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n",
-					sc_strerror(r));
+		emit = 1;
 	} else if (!(entry->flags & SC_ASN1_PRESENT)) {
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "cannot encode non-optional ASN.1 object: not given by caller\n");
 		r = SC_ERROR_INVALID_ASN1_OBJECT;
@@ -2019,58 +2064,183 @@ no_object:
 		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "cannot encode empty non-optional ASN.1 object\n");
 		r = SC_ERROR_INVALID_ASN1_OBJECT;
 	}
-	if (buf)
-		free(buf);
-	if (r >= 0)
-		sc_debug(ctx, SC_LOG_DEBUG_ASN1,
-			 "%*.*slength of encoded item=%"SC_FORMAT_LEN_SIZE_T"u\n",
-			 depth, depth, "", *objlen);
+	if (!emit) {
+		if (buf)
+			free(buf);
+		asn1_free_nodes(child);
+		if (r >= 0)
+			sc_debug(ctx, SC_LOG_DEBUG_ASN1,
+				 "%*.*slength of encoded item=0\n", depth, depth, "");
+		return r;
+	}
+
+	node = calloc(1, sizeof(*node));
+	if (node == NULL) {
+		if (buf)
+			free(buf);
+		asn1_free_nodes(child);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	node->data = data;
+	node->datalen = buflen;
+	node->buf = buf;
+	node->child = child;
+	r = asn1_write_header(ctx, entry->tag, buflen, node->header, &node->header_len);
+	if (r) {
+		sc_debug(ctx, SC_LOG_DEBUG_ASN1, "error writing ASN.1 tag and length: %s\n", sc_strerror(r));
+		asn1_free_nodes(node);
+		return r;
+	}
+	node->len = node->header_len + buflen;
+	*node_out = node;
+	sc_debug(ctx, SC_LOG_DEBUG_ASN1,
+		 "%*.*slength of encoded item=%"SC_FORMAT_LEN_SIZE_T"u\n",
+		 depth, depth, "", node->len);
 	return r;
 }
 
-static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
-		      u8 **ptr, size_t *size, int depth)
+static int asn1_encode_nodes(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		struct asn1_node **nodes, size_t *size, int depth)
 {
-	int r, idx = 0;
-	u8 *obj = NULL, *buf = NULL, *tmp;
-	size_t total = 0, objsize;
+	struct asn1_node *node, **last = nodes;
+	size_t total = 0;
+	int r, idx;
 
+	*nodes = NULL;
 	if (asn1 == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 
 	for (idx = 0; asn1[idx].name != NULL; idx++) {
-		r = asn1_encode_entry(ctx, &asn1[idx], &obj, &objsize, depth);
+		r = asn1_encode_entry(ctx, &asn1[idx], &node, depth);
 		if (r) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
+			asn1_free_nodes(*nodes);
+			*nodes = NULL;
 			return r;
 		}
 		/* in case of an empty (optional) element continue with
 		 * the next asn1 element */
-		if (!objsize)
+		if (node == NULL)
 			continue;
-		tmp = (u8 *) realloc(buf, total + objsize);
-		if (!tmp) {
-			if (obj)
-				free(obj);
-			if (buf)
-				free(buf);
-			return SC_ERROR_OUT_OF_MEMORY;
+		*last = node;
+		last = &node->next;
+		total += node->len;
+	}
+	*size = total;
+	return 0;
+}
+
+static void asn1_free_nodes(struct asn1_node *node)
+{
+	struct asn1_node *next;
+
+	for (; node != NULL; node = next) {
+		next = node->next;
+		asn1_free_nodes(node->child);
+		free(node->buf);
+		free(node);
+	}
+}
+
+static u8 *asn1_write_nodes(const struct asn1_node *node, u8 *p)
+{
+	for (; node != NULL; node = node->next) {
+		memcpy(p, node->header, node->header_len);
+		p += node->header_len;
+		if (node->child != NULL) {
+			p = asn1_write_nodes(node->child, p);
+		} else if (node->datalen) {
+			memcpy(p, node->data, node->datalen);
+			p += node->datalen;
 		}
-		buf = tmp;
-		memcpy(buf + total, obj, objsize);
-		free(obj);
-		obj = NULL;
-		total += objsize;
+	}
+	return p;
+}
+
+static int asn1_encode_append(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		struct sc_asn1_encoding *enc, int depth)
+{
+	struct asn1_node *nodes = NULL;
+	size_t total = 0;
+	int r;
+
+	r = asn1_encode_nodes(ctx, asn1, &nodes, &total, depth);
+	if (r)
+		return r;
+	*enc->last = nodes;
+	for (; nodes != NULL; nodes = nodes->next)
+		enc->last = &nodes->next;
+	enc->len += total;
+	return 0;
+}
+
+static int asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		      u8 **ptr, size_t *size, int depth)
+{
+	struct sc_asn1_encoding enc;
+	int r;
+
+	_sc_asn1_encoding_init(&enc);
+	r = asn1_encode_append(ctx, asn1, &enc, depth);
+	if (r == 0)
+		r = _sc_asn1_encoding_finish(&enc, ptr, size);
+	_sc_asn1_encoding_free(&enc);
+	return r;
+}
+
+void _sc_asn1_encoding_init(struct sc_asn1_encoding *enc)
+{
+	enc->nodes = NULL;
+	enc->last = &enc->nodes;
+	enc->len = 0;
+}
+
+int _sc_asn1_encode_append(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
+		struct sc_asn1_encoding *enc)
+{
+	return asn1_encode_append(ctx, asn1, enc, 0);
+}
+
+int _sc_asn1_encoding_keep(struct sc_asn1_encoding *enc, void *buf)
+{
+	struct asn1_node *node;
+
+	/* An empty node that only owns the buffer until the encoding is freed */
+	node = calloc(1, sizeof(*node));
+	if (node == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	node->buf = buf;
+	*enc->last = node;
+	enc->last = &node->next;
+	return 0;
+}
+
+void _sc_asn1_encoding_write(const struct sc_asn1_encoding *enc, u8 *buf)
+{
+	asn1_write_nodes(enc->nodes, buf);
+}
+
+int _sc_asn1_encoding_finish(struct sc_asn1_encoding *enc, u8 **ptr, size_t *size)
+{
+	u8 *buf = NULL;
+
+	if (enc->len) {
+		buf = malloc(enc->len);
+		if (buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		asn1_write_nodes(enc->nodes, buf);
 	}
 	*ptr = buf;
-	*size = total;
+	*size = enc->len;
 	return 0;
 }
 
+void _sc_asn1_encoding_free(struct sc_asn1_encoding *enc)
+{
+	asn1_free_nodes(enc->nodes);
+	_sc_asn1_encoding_init(enc);
+}
+
 int sc_asn1_encode(sc_context_t *ctx, const struct sc_asn1_entry *asn1,
 		   u8 **ptr, size_t *size)
 {
@@ -2136,8 +2306,8 @@ static struct sc_asn1_entry c_asn1_sig_value[C_ASN1_SIG_VALUE_SIZE] = {
 
 #define C_ASN1_SIG_VALUE_COEFFICIENTS_SIZE 3
 static struct sc_asn1_entry c_asn1_sig_value_coefficients[C_ASN1_SIG_VALUE_COEFFICIENTS_SIZE] = {
-		{ "r", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC|SC_ASN1_UNSIGNED, NULL, NULL },
-		{ "s", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC|SC_ASN1_UNSIGNED, NULL, NULL },
+		{ "r", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_BORROW|SC_ASN1_UNSIGNED, NULL, NULL },
+		{ "s", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_BORROW|SC_ASN1_UNSIGNED, NULL, NULL },
 		{ NULL, 0, 0, 0, NULL, NULL }
 };
 
@@ -2184,7 +2354,7 @@ sc_asn1_sig_value_sequence_to_rs(struct sc_context *ctx, const unsigned char *in
 {
 	struct sc_asn1_entry asn1_sig_value[C_ASN1_SIG_VALUE_SIZE];
 	struct sc_asn1_entry asn1_sig_value_coefficients[C_ASN1_SIG_VALUE_COEFFICIENTS_SIZE];
-	unsigned char *r = NULL, *s = NULL;
+	const unsigned char *r = NULL, *s = NULL;
 	size_t r_len = 0, s_len = 0, halflen = buflen/2;
 	int rv;
 
@@ -2220,9 +2390,6 @@ sc_asn1_sig_value_sequence_to_rs(struct sc_context *ctx, const unsigned char *in
 
 	rv = SC_SUCCESS;
 err:
-	free(r);
-	free(s);
-
 	LOG_FUNC_RETURN(ctx, rv);
 }
 
@@ -72,6 +72,27 @@ int _sc_asn1_decode(struct sc_context *, struct sc_asn1_entry *,
 int _sc_asn1_encode(struct sc_context *, const struct sc_asn1_entry *,
 		   u8 **, size_t *, int);
 
+/* Elements that are encoded but not written out yet. Several encodings can be
+ * appended and then written into a single buffer. Contents borrowed from the
+ * entries must stay valid until the encoding is finished. */
+struct asn1_node;
+struct sc_asn1_encoding {
+	struct asn1_node *nodes;
+	struct asn1_node **last;
+	size_t len;
+};
+
+void _sc_asn1_encoding_init(struct sc_asn1_encoding *enc);
+int _sc_asn1_encode_append(struct sc_context *ctx, const struct sc_asn1_entry *asn1,
+		   struct sc_asn1_encoding *enc);
+/* Frees buf with the encoding, for contents borrowed from a temporary */
+int _sc_asn1_encoding_keep(struct sc_asn1_encoding *enc, void *buf);
+/* Writes the elements into buf, which has room for enc->len bytes */
+void _sc_asn1_encoding_write(const struct sc_asn1_encoding *enc, u8 *buf);
+/* Writes the elements into a buffer of their exact length */
+int _sc_asn1_encoding_finish(struct sc_asn1_encoding *enc, u8 **buf, size_t *len);
+void _sc_asn1_encoding_free(struct sc_asn1_encoding *enc);
+
 int sc_asn1_read_tag(const u8 ** buf, size_t buflen, unsigned int *cla_out,
 		     unsigned int *tag_out, size_t *taglen);
 const u8 *sc_asn1_find_tag(struct sc_context *ctx, const u8 * buf,
@@ -149,6 +170,11 @@ int sc_asn1_decode_ecdsa_signature(sc_context_t *ctx, const u8 *data, size_t dat
 #define SC_ASN1_ALLOC			0x00000004
 #define SC_ASN1_UNSIGNED		0x00000008
 #define SC_ASN1_EMPTY_ALLOWED           0x00000010
+/* Decoding only: OCTET STRING and GeneralizedTime entries get a const u8 *
+ * into the input instead of a copy, valid as long as the input buffer.
+ * Values kept after the decode need a reference on the input, like the
+ * certificates of a CDF on its struct sc_pkcs15_df_data */
+#define SC_ASN1_BORROW			0x00000020
 
 #define SC_ASN1_BOOLEAN                 1
 #define SC_ASN1_INTEGER                 2
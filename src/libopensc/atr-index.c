@@ -0,0 +1,391 @@
+/*
+ * atr-index.c: ATR index of the card_atr blocks and ATR to driver memo
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/compat_strlcpy.h"
+#include "internal.h"
+
+/*
+ * The ATRs of the drivers' atr_map are parsed once per context. Entries with
+ * the same length and mask form a group, hashed by the masked ATR, so that a
+ * lookup masks the card's ATR once per group instead of formatting and
+ * parsing every table entry. Entries without a mask have a mask of all ones.
+ */
+#define ATR_INDEX_BUCKETS	64
+
+struct atr_index_entry {
+	u8 atr[SC_MAX_ATR_SIZE];	/* masked */
+	int driver;			/* index in ctx->card_drivers */
+	int idx;			/* index in the driver's atr_map */
+	struct atr_index_entry *next;
+};
+
+struct atr_index_group {
+	size_t len;
+	u8 mask[SC_MAX_ATR_SIZE];
+	struct atr_index_entry *buckets[ATR_INDEX_BUCKETS];
+	struct atr_index_group *next;
+};
+
+struct sc_atr_index {
+	struct atr_index_group *groups;
+};
+
+/*
+ * Drivers remembered for the ATRs of cards that needed the match_card()
+ * probes. The memo is only valid for the list of enabled drivers it was
+ * learned with, any change of the list discards it.
+ */
+#define ATR_MEMO_FILE		"atr_drivers"
+#define ATR_MEMO_MAX		64
+
+struct atr_memo_entry {
+	struct sc_atr atr;
+	char driver[32];
+};
+
+struct sc_atr_memo {
+	unsigned long drivers_hash;
+	size_t count;
+	struct atr_memo_entry entries[ATR_MEMO_MAX];
+};
+
+static unsigned int atr_hash(const u8 *atr, size_t len)
+{
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ atr[i]) * 16777619U;
+	return h % ATR_INDEX_BUCKETS;
+}
+
+/* Only ATRs in the "3b:8f:..." form of sc_bin_to_hex() ever matched */
+static int atr_parse(const char *hex, u8 *bin, size_t *len)
+{
+	*len = SC_MAX_ATR_SIZE;
+	if (sc_hex_to_bin(hex, bin, len) != SC_SUCCESS || *len == 0
+			|| strlen(hex) != 3 * *len - 1)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	return SC_SUCCESS;
+}
+
+static int atr_index_add(struct sc_atr_index *index, const struct sc_atr_table *entry,
+		int driver, int idx)
+{
+	struct atr_index_group *group;
+	struct atr_index_entry *e;
+	u8 atr[SC_MAX_ATR_SIZE], mask[SC_MAX_ATR_SIZE];
+	size_t len, mask_len, i;
+	unsigned int h;
+
+	if (atr_parse(entry->atr, atr, &len) != SC_SUCCESS)
+		return SC_SUCCESS;
+	if (entry->atrmask != NULL) {
+		if (atr_parse(entry->atrmask, mask, &mask_len) != SC_SUCCESS || mask_len != len)
+			return SC_SUCCESS;
+	} else {
+		memset(mask, 0xFF, len);
+	}
+	for (i = 0; i < len; i++)
+		atr[i] &= mask[i];
+
+	for (group = index->groups; group != NULL; group = group->next)
+		if (group->len == len && memcmp(group->mask, mask, len) == 0)
+			break;
+	if (group == NULL) {
+		group = calloc(1, sizeof(*group));
+		if (group == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		group->len = len;
+		memcpy(group->mask, mask, len);
+		group->next = index->groups;
+		index->groups = group;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	memcpy(e->atr, atr, len);
+	e->driver = driver;
+	e->idx = idx;
+	h = atr_hash(atr, len);
+	e->next = group->buckets[h];
+	group->buckets[h] = e;
+	return SC_SUCCESS;
+}
+
+void sc_atr_index_free(sc_context_t *ctx)
+{
+	struct atr_index_group *group;
+	struct atr_index_entry *e;
+	int i;
+
+	if (ctx == NULL || ctx->atr_index == NULL)
+		return;
+	while ((group = ctx->atr_index->groups) != NULL) {
+		for (i = 0; i < ATR_INDEX_BUCKETS; i++) {
+			while ((e = group->buckets[i]) != NULL) {
+				group->buckets[i] = e->next;
+				free(e);
+			}
+		}
+		ctx->atr_index->groups = group->next;
+		free(group);
+	}
+	free(ctx->atr_index);
+	ctx->atr_index = NULL;
+}
+
+int sc_atr_index_build(sc_context_t *ctx)
+{
+	struct sc_atr_index *index;
+	struct sc_card_driver *drv;
+	int i, j, r = SC_SUCCESS;
+
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	sc_atr_index_free(ctx);
+	ctx->atr_index = index;
+
+	for (i = 0; ctx->card_drivers[i] != NULL && r == SC_SUCCESS; i++) {
+		drv = ctx->card_drivers[i];
+		for (j = 0; drv->atr_map != NULL && drv->atr_map[j].atr != NULL && r == SC_SUCCESS; j++)
+			r = atr_index_add(index, &drv->atr_map[j], i, j);
+	}
+	if (r != SC_SUCCESS)
+		sc_atr_index_free(ctx);
+	return r;
+}
+
+int sc_atr_index_match(sc_context_t *ctx, const struct sc_atr *atr, int skip_default,
+		struct sc_card_driver **driver_out)
+{
+	struct atr_index_group *group;
+	struct atr_index_entry *e, *best = NULL;
+	u8 masked[SC_MAX_ATR_SIZE];
+	size_t i;
+
+	if (ctx == NULL || ctx->atr_index == NULL || atr == NULL || atr->len > SC_MAX_ATR_SIZE)
+		return -1;
+
+	/* Same result as trying the drivers and their tables in order */
+	for (group = ctx->atr_index->groups; group != NULL; group = group->next) {
+		if (group->len != atr->len)
+			continue;
+		for (i = 0; i < atr->len; i++)
+			masked[i] = atr->value[i] & group->mask[i];
+		for (e = group->buckets[atr_hash(masked, atr->len)]; e != NULL; e = e->next) {
+			if (memcmp(e->atr, masked, atr->len) != 0)
+				continue;
+			if (skip_default && !strcmp(ctx->card_drivers[e->driver]->short_name, "default"))
+				continue;
+			if (best == NULL || e->driver < best->driver
+					|| (e->driver == best->driver && e->idx < best->idx))
+				best = e;
+		}
+	}
+	if (best == NULL || (size_t)best->idx >= ctx->card_drivers[best->driver]->natrs)
+		return -1;
+	if (driver_out != NULL)
+		*driver_out = ctx->card_drivers[best->driver];
+	return best->idx;
+}
+
+static unsigned long atr_memo_drivers_hash(sc_context_t *ctx)
+{
+	unsigned long h = 5381;
+	const char *p;
+	int i;
+
+	for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		for (p = ctx->card_drivers[i]->short_name; *p; p++)
+			h = h * 33 + (unsigned char)*p;
+		h = h * 33 + ',';
+	}
+	return h & 0xFFFFFFFFUL;
+}
+
+static int atr_memo_file(sc_context_t *ctx, char *fname, size_t fname_len)
+{
+	char dir[PATH_MAX];
+	int r;
+
+	r = sc_get_cache_dir(ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	if ((size_t)snprintf(fname, fname_len, "%s/%s", dir, ATR_MEMO_FILE) >= fname_len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static void atr_memo_load(sc_context_t *ctx, struct sc_atr_memo *memo)
+{
+	char fname[PATH_MAX], line[3 * SC_MAX_ATR_SIZE + 64], hex[3 * SC_MAX_ATR_SIZE];
+	struct atr_memo_entry *e;
+	unsigned long hash;
+	FILE *f;
+
+	if (atr_memo_file(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return;
+	if (fgets(line, sizeof(line), f) == NULL
+			|| sscanf(line, "# OpenSC ATR drivers %lx", &hash) != 1
+			|| hash != memo->drivers_hash) {
+		sc_log(ctx, "Discarding ATR driver memo of another driver list");
+		fclose(f);
+		return;
+	}
+	while (memo->count < ATR_MEMO_MAX && fgets(line, sizeof(line), f) != NULL) {
+		e = &memo->entries[memo->count];
+		if (sscanf(line, "%98s %31s", hex, e->driver) != 2)
+			continue;
+		if (atr_parse(hex, e->atr.value, &e->atr.len) != SC_SUCCESS)
+			continue;
+		memo->count++;
+	}
+	fclose(f);
+}
+
+static void atr_memo_save(sc_context_t *ctx, struct sc_atr_memo *memo)
+{
+	char fname[PATH_MAX], tmpname[PATH_MAX + 32], hex[3 * SC_MAX_ATR_SIZE];
+	size_t i;
+	FILE *f;
+
+	if (atr_memo_file(ctx, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+	f = sc_open_cache_tmp(ctx, fname, tmpname, sizeof(tmpname));
+	if (f == NULL)
+		return;
+	fprintf(f, "# OpenSC ATR drivers %08lx\n", memo->drivers_hash);
+	for (i = 0; i < memo->count; i++) {
+		sc_bin_to_hex(memo->entries[i].atr.value, memo->entries[i].atr.len,
+				hex, sizeof(hex), ':');
+		fprintf(f, "%s %s\n", hex, memo->entries[i].driver);
+	}
+	if (fclose(f) != 0 || rename(tmpname, fname) != 0) {
+		sc_log(ctx, "Failed to write ATR driver memo %s: %s", fname, strerror(errno));
+		remove(tmpname);
+	}
+}
+
+/* Called with ctx->mutex locked */
+static struct sc_atr_memo *atr_memo_get(sc_context_t *ctx)
+{
+	if (ctx->atr_memo == NULL) {
+		ctx->atr_memo = calloc(1, sizeof(*ctx->atr_memo));
+		if (ctx->atr_memo == NULL)
+			return NULL;
+		ctx->atr_memo->drivers_hash = atr_memo_drivers_hash(ctx);
+		atr_memo_load(ctx, ctx->atr_memo);
+	}
+	return ctx->atr_memo;
+}
+
+static struct atr_memo_entry *atr_memo_find(struct sc_atr_memo *memo, const struct sc_atr *atr)
+{
+	size_t i;
+
+	for (i = 0; i < memo->count; i++)
+		if (memo->entries[i].atr.len == atr->len
+				&& memcmp(memo->entries[i].atr.value, atr->value, atr->len) == 0)
+			return &memo->entries[i];
+	return NULL;
+}
+
+struct sc_card_driver *sc_atr_memo_lookup(sc_context_t *ctx, const struct sc_atr *atr)
+{
+	struct sc_card_driver *driver = NULL;
+	struct sc_atr_memo *memo;
+	struct atr_memo_entry *e;
+	int i;
+
+	if (ctx == NULL || atr == NULL || atr->len == 0)
+		return NULL;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	memo = atr_memo_get(ctx);
+	e = memo ? atr_memo_find(memo, atr) : NULL;
+	for (i = 0; e != NULL && ctx->card_drivers[i] != NULL; i++) {
+		if (!strcmp(ctx->card_drivers[i]->short_name, e->driver)) {
+			driver = ctx->card_drivers[i];
+			break;
+		}
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+
+	if (driver != NULL && (driver->ops == NULL || driver->ops->match_card == NULL
+				|| driver->ops->init == NULL))
+		driver = NULL;
+	return driver;
+}
+
+void sc_atr_memo_store(sc_context_t *ctx, const struct sc_atr *atr,
+		const struct sc_card_driver *driver)
+{
+	struct sc_atr_memo *memo;
+	struct atr_memo_entry *e;
+
+	if (ctx == NULL || atr == NULL || atr->len == 0 || driver == NULL
+			|| !strcmp(driver->short_name, "default"))
+		return;
+
+	sc_mutex_lock(ctx, ctx->mutex);
+	memo = atr_memo_get(ctx);
+	if (memo != NULL) {
+		e = atr_memo_find(memo, atr);
+		if (e == NULL) {
+			/* Forget the oldest entry when full */
+			if (memo->count == ATR_MEMO_MAX) {
+				memmove(&memo->entries[0], &memo->entries[1],
+						(ATR_MEMO_MAX - 1) * sizeof(memo->entries[0]));
+				memo->count--;
+			}
+			e = &memo->entries[memo->count++];
+			e->atr = *atr;
+		}
+		strlcpy(e->driver, driver->short_name, sizeof(e->driver));
+		sc_log(ctx, "Remembering driver '%s' for this ATR", e->driver);
+		atr_memo_save(ctx, memo);
+	}
+	sc_mutex_unlock(ctx, ctx->mutex);
+}
+
+void sc_atr_memo_free(sc_context_t *ctx)
+{
+	if (ctx == NULL)
+		return;
+	free(ctx->atr_memo);
+	ctx->atr_memo = NULL;
+}
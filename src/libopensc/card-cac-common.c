@@ -37,6 +37,9 @@
 #include "internal.h"
 #include "iso7816.h"
 #include "card-cac-common.h"
+#ifdef ENABLE_ZLIB
+#include "compression.h"
+#endif
 
 /* default certificate labels for the CAC card */
 const char *cac_labels[MAX_CAC_SLOTS] = {
@@ -111,6 +114,9 @@ void cac_free_private_data(cac_private_data_t *priv)
 	free(priv->cac_id);
 	free(priv->cache_buf);
 	free(priv->aca_path);
+#ifdef ENABLE_ZLIB
+	sc_decompress_stream_free(priv->inflater);
+#endif
 	list_destroy(&priv->pki_list);
 	list_destroy(&priv->general_list);
 	free(priv);
@@ -124,3 +130,29 @@ int cac_add_object_to_list(list_t *list, const cac_object_t *object)
 	return SC_SUCCESS;
 }
 
+#ifdef ENABLE_ZLIB
+/* Decompress a certificate into the cache buffer, with the inflate state
+ * kept for all the certificates of the card */
+int cac_decompress_certificate(cac_private_data_t *priv, const u8 *in, size_t inlen)
+{
+	int r;
+
+	free(priv->cache_buf);
+	priv->cache_buf = NULL;
+	priv->cache_buf_len = 0;
+	if (priv->inflater == NULL)
+		priv->inflater = sc_decompress_stream_new();
+	if (priv->inflater == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	r = sc_decompress_stream_start(priv->inflater, COMPRESSION_AUTO, NULL,
+		inlen < 1024 ? 2048 : inlen * 2, COMPRESSION_MAX_OUTPUT_SIZE);
+	if (r == SC_SUCCESS)
+		r = sc_decompress_stream_update(priv->inflater, in, inlen);
+	if (r == SC_SUCCESS)
+		r = sc_decompress_stream_finish(priv->inflater,
+			&priv->cache_buf, &priv->cache_buf_len);
+	return r;
+}
+#endif
+
@@ -56,6 +56,7 @@ typedef struct cac_private_data {
 	list_t general_list;            /* list of general containers */
 	cac_object_t *general_current;  /* current object for _ctl function */
 	sc_path_t *aca_path;		/* ACA path to be selected before pin verification */
+	struct sc_decompress_stream *inflater; /* for all compressed certificates */
 } cac_private_data_t;
 
 #define CAC_DATA(card) ((cac_private_data_t*)card->drv_data)
@@ -84,6 +85,9 @@ static const cac_cuid_t cac_cac_cuid = {
 cac_private_data_t *cac_new_private_data(void);
 void cac_free_private_data(cac_private_data_t *priv);
 int cac_add_object_to_list(list_t *list, const cac_object_t *object);
+#ifdef ENABLE_ZLIB
+int cac_decompress_certificate(cac_private_data_t *priv, const u8 *in, size_t inlen);
+#endif
 const char *get_cac_label(int index);
 
 #endif /* HAVE_CARD_CAC_COMMON_H */
@@ -578,8 +578,7 @@ static int cac_read_binary(sc_card_t *card, unsigned int idx,
 		/* if the info byte is 1, then the cert is compressed, decompress it */
 		if ((cert_type & 0x3) == 1) {
 #ifdef ENABLE_ZLIB
-			r = sc_decompress_alloc(&priv->cache_buf, &priv->cache_buf_len,
-				cert_ptr, cert_len, COMPRESSION_AUTO);
+			r = cac_decompress_certificate(priv, cert_ptr, cert_len);
 #else
 			sc_log(card->ctx, "CAC compression not supported, no zlib");
 			r = SC_ERROR_NOT_SUPPORTED;
@@ -81,6 +81,9 @@ typedef struct idprime_private_data {
 	idprime_object_t *pki_current;	/* current pki object _ctl function */
 	int tinfo_present;		/* Token Info Label object is present*/
 	u8 tinfo_df[2];			/* DF of object with Token Info Label */
+#ifdef ENABLE_ZLIB
+	struct sc_decompress_stream *inflater;	/* for all compressed certificates */
+#endif
 } idprime_private_data_t;
 
 /* For SimCList autocopy, we need to know the size of the data elements */
@@ -91,6 +94,9 @@ static size_t idprime_list_meter(const void *el) {
 void idprime_free_private_data(idprime_private_data_t *priv)
 {
 	free(priv->cache_buf);
+#ifdef ENABLE_ZLIB
+	sc_decompress_stream_free(priv->inflater);
+#endif
 	list_destroy(&priv->pki_list);
 	free(priv);
 	return;
@@ -573,6 +579,11 @@ static int idprime_read_binary(sc_card_t *card, unsigned int offset,
 		/* Read what was reported by FCI from select command */
 		int left = priv->file_size;
 		size_t read = 0;
+#ifdef ENABLE_ZLIB
+		int compressed = -1;	/* not known before the header is read */
+		size_t inflated = 0;	/* bytes of buffer given to the inflater */
+		int rv;
+#endif
 
 		// this function is called to read and uncompress the certificate
 		u8 buffer[SC_MAX_EXT_APDU_BUFFER_SIZE];
@@ -586,6 +597,33 @@ static int idprime_read_binary(sc_card_t *card, unsigned int offset,
 			}
 			left -= r;
 			read += r;
+#ifdef ENABLE_ZLIB
+			/* Inflate every chunk as soon as it is read, into a buffer
+			 * of the size given in the header */
+			if (compressed < 0 && read >= 4) {
+				compressed = buffer[0] == 1 && buffer[1] == 0;
+				if (compressed) {
+					size_t expectedsize = buffer[2] + buffer[3] * 0x100;
+					if (priv->inflater == NULL)
+						priv->inflater = sc_decompress_stream_new();
+					if (priv->inflater == NULL)
+						LOG_FUNC_RETURN(card->ctx, SC_ERROR_OUT_OF_MEMORY);
+					rv = sc_decompress_stream_start(priv->inflater, COMPRESSION_AUTO,
+						NULL, expectedsize, expectedsize);
+					LOG_TEST_RET(card->ctx, rv, "Zlib error");
+					inflated = 4;
+				}
+			}
+			if (compressed == 1) {
+				rv = sc_decompress_stream_update(priv->inflater,
+					buffer + inflated, read - inflated);
+				inflated = read;
+				if (rv != SC_SUCCESS) {
+					sc_log(card->ctx, "Zlib error: %d", rv);
+					LOG_FUNC_RETURN(card->ctx, rv);
+				}
+			}
+#endif /* ENABLE_ZLIB */
 		}
 		if (read < 4 || read != priv->file_size) {
 			LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_DATA);
@@ -593,8 +631,8 @@ static int idprime_read_binary(sc_card_t *card, unsigned int offset,
 		if (buffer[0] == 1 && buffer[1] == 0) {
 #ifdef ENABLE_ZLIB
 			size_t expectedsize = buffer[2] + buffer[3] * 0x100;
-			r = sc_decompress_alloc(&priv->cache_buf, &(priv->cache_buf_len),
-				buffer+4, priv->file_size-4, COMPRESSION_AUTO);
+			r = sc_decompress_stream_finish(priv->inflater,
+				&priv->cache_buf, &(priv->cache_buf_len));
 			if (r != SC_SUCCESS) {
 				sc_log(card->ctx, "Zlib error: %d", r);
 				LOG_FUNC_RETURN(card->ctx, r);
@@ -806,6 +806,9 @@ pgp_get_card_features(sc_card_t *card)
 		card->caps |= SC_CARD_CAP_ISO7816_PIN_INFO;
 	}
 
+	/* pgp_set_security_env() only stores the environment in priv->sec_env */
+	card->caps |= SC_CARD_CAP_KEEPS_SECURITY_ENV;
+
 	if (priv->bcd_version >= OPENPGP_CARD_3_4) {
 		/* Parse supported algorithms from Algorithm Information DO
 		 * see OpenPGP card spec 3.4 section 4.4.3.11 */
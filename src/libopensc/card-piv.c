@@ -27,8 +27,10 @@
 #endif
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -128,10 +130,13 @@ enum {
  * If the file lilsted in the history object offCardCertURL was found,
  * its certs will be read into the cache and PIV_OBJ_CACHE_VALID set
  * and PIV_OBJ_CACHE_NOT_PRESENT unset.
+ * PIV_OBJ_CACHE_FROM_FILE means the data was loaded from the file cache
+ * and is checked with the card before it is used.
  */
 
 #define PIV_OBJ_CACHE_VALID			1
 #define PIV_OBJ_CACHE_NOT_PRESENT	8
+#define PIV_OBJ_CACHE_FROM_FILE		16
 
 typedef struct piv_obj_cache {
 	u8* obj_data;
@@ -185,6 +190,8 @@ typedef struct piv_private_data {
 	int object_test_verify; /* Can test this object to set verification state of card */
 	int yubico_version; /* 3 byte version number of NEO or Yubikey4  as integer */
 	unsigned int ccc_flags;	    /* From  CCC indicate if CAC card */
+	int file_cache; /* public objects are kept in the cache directory */
+	int file_cache_dirty; /* objects were read from the card since */
 } piv_private_data_t;
 
 #define PIV_DATA(card) ((piv_private_data_t*)card->drv_data)
@@ -510,6 +517,9 @@ static struct sc_card_driver piv_drv = {
 };
 
 static int piv_match_card_continued(sc_card_t *card);
+static int piv_file_cacheable(int enumtag);
+static int piv_file_cache_check(sc_card_t *card, int enumtag);
+static void piv_file_cache_remove(sc_card_t *card);
 
 static int
 piv_find_obj_by_containerid(sc_card_t *card, const u8 * str)
@@ -980,6 +990,16 @@ piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 
 	assert(enumtag >= 0 && enumtag < PIV_OBJ_LAST_ENUM);
 
+	if ((priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_FROM_FILE)
+			&& !piv_file_cache_check(card, enumtag)) {
+		sc_log(card->ctx, "#%d changed on the card, not using the file cache", enumtag);
+		free(priv->obj_cache[enumtag].obj_data);
+		priv->obj_cache[enumtag].obj_data = NULL;
+		priv->obj_cache[enumtag].obj_len = 0;
+		priv->obj_cache[enumtag].flags &= ~PIV_OBJ_CACHE_VALID;
+	}
+	priv->obj_cache[enumtag].flags &= ~PIV_OBJ_CACHE_FROM_FILE;
+
 	/* see if we have it cached */
 	if (priv->obj_cache[enumtag].flags & PIV_OBJ_CACHE_VALID) {
 
@@ -1023,6 +1043,8 @@ piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
 		priv->obj_cache[enumtag].obj_len = r;
 		priv->obj_cache[enumtag].obj_data = rbuf;
+		if (piv_file_cacheable(enumtag))
+			priv->file_cache_dirty = 1;
 		*buf = rbuf;
 		*buf_len = r;
 
@@ -1040,6 +1062,8 @@ piv_get_cached_data(sc_card_t * card, int enumtag, u8 **buf, size_t *buf_len)
 			r = SC_ERROR_FILE_NOT_FOUND;
 			priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
 			priv->obj_cache[enumtag].obj_len = 0;
+			if (piv_file_cacheable(enumtag))
+				priv->file_cache_dirty = 1;
 		} else {
 			goto err;
 		}
@@ -1413,6 +1437,10 @@ static int piv_write_binary(sc_card_t *card, unsigned int idx,
 			r = piv_put_data(card, enumtag, priv->w_buf, priv->w_buf_len);
 			break;
 	}
+	/* the next process reads the objects from the card again */
+	if (r >= 0)
+		piv_file_cache_remove(card);
+
 	/* if it worked, will cache it */
 	if (r >= 0 && priv->w_buf) {
 		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID;
@@ -2172,6 +2200,243 @@ piv_get_serial_nr_from_CHUI(sc_card_t* card, sc_serial_number_t* serial)
 	LOG_FUNC_RETURN(card->ctx, r);
 }
 
+/*
+ * Objects that can be read without a PIN may be kept in a file of the
+ * cache directory, named after the GUID or FASC-N of the card, so other
+ * processes do not have to read them from the card again. The file starts
+ * with the CHUID it was written for: a card that was reissued has a new
+ * CHUID signature and its file is not used. Objects that were not found on
+ * the card are kept too, with a zero length.
+ *
+ * Objects can be replaced without changing the CHUID, so each object from
+ * the file is compared on its first use with the start of the object on
+ * the card, which one GET DATA returns without GET RESPONSE. It holds the
+ * length of the object and for certificates their serial number.
+ *
+ * Every object is stored as its 3 byte tag, a byte that is 1 if it was
+ * found, 4 bytes of length and the data as returned by GET DATA.
+ */
+#define PIV_FILE_CACHE_MAGIC	"OpenSC PIV cache 1\n"
+
+static int piv_file_cacheable(int enumtag)
+{
+	return enumtag == PIV_OBJ_CCC || enumtag == PIV_OBJ_DISCOVERY
+		|| enumtag == PIV_OBJ_HISTORY
+		|| (piv_objects[enumtag].flags & PIV_OBJECT_TYPE_CERT);
+}
+
+static int piv_file_cache_name(sc_card_t *card, char *fname, size_t fname_len)
+{
+	char dir[PATH_MAX], id[2 * SC_MAX_SERIALNR + 1];
+	sc_serial_number_t serial;
+	int r;
+
+	memset(&serial, 0, sizeof(serial));
+	r = piv_get_serial_nr_from_CHUI(card, &serial);
+	if (r != SC_SUCCESS || serial.len == 0)
+		return SC_ERROR_OBJECT_NOT_FOUND;
+	r = sc_bin_to_hex(serial.value, serial.len, id, sizeof(id), 0);
+	if (r != SC_SUCCESS)
+		return r;
+	r = sc_get_cache_dir(card->ctx, dir, sizeof(dir));
+	if (r != SC_SUCCESS)
+		return r;
+	if ((size_t)snprintf(fname, fname_len, "%s/piv_%s", dir, id) >= fname_len)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+static int piv_find_obj_by_tag(const u8 *tag)
+{
+	int i;
+
+	for (i = 0; i < PIV_OBJ_LAST_ENUM; i++) {
+		if (piv_objects[i].tag_len == 3 && memcmp(piv_objects[i].tag_value, tag, 3) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* Reads one object, or returns -1 at the end of the file or on errors */
+static int piv_file_cache_read_obj(FILE *f, int *enumtag, u8 **data, size_t *len)
+{
+	u8 hdr[8];
+
+	if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+		return -1;
+	*enumtag = piv_find_obj_by_tag(hdr);
+	*len = ((size_t)hdr[4] << 24) | ((size_t)hdr[5] << 16) | ((size_t)hdr[6] << 8) | hdr[7];
+	if (*enumtag < 0 || hdr[3] > 1 || (hdr[3] == 0 && *len != 0)
+			|| (hdr[3] == 1 && *len == 0) || *len > MAX_FILE_SIZE)
+		return -1;
+	*data = NULL;
+	if (*len == 0)
+		return 0;
+	*data = malloc(*len);
+	if (*data == NULL)
+		return -1;
+	if (fread(*data, 1, *len, f) != *len) {
+		free(*data);
+		return -1;
+	}
+	return 0;
+}
+
+static int piv_file_cache_write_obj(FILE *f, int enumtag, const u8 *data, size_t len)
+{
+	u8 hdr[8];
+
+	memcpy(hdr, piv_objects[enumtag].tag_value, 3);
+	hdr[3] = len != 0;
+	hdr[4] = (len >> 24) & 0xFF;
+	hdr[5] = (len >> 16) & 0xFF;
+	hdr[6] = (len >> 8) & 0xFF;
+	hdr[7] = len & 0xFF;
+	if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr)
+			|| (len != 0 && fwrite(data, 1, len, f) != len))
+		return -1;
+	return 0;
+}
+
+/* Returns 1 if the start of the object on the card matches the file cache */
+static int piv_file_cache_check(sc_card_t *card, int enumtag)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	u8 tagbuf[8], head[256], *p = tagbuf;
+	size_t len;
+	int r;
+
+	r = sc_asn1_put_tag(0x5c, piv_objects[enumtag].tag_value, piv_objects[enumtag].tag_len,
+			tagbuf, sizeof(tagbuf), &p);
+	if (r != SC_SUCCESS)
+		return 0;
+	r = piv_general_io(card, 0xCB, 0x3F, 0xFF, tagbuf, p - tagbuf, head, sizeof(head));
+	if (r == 0 || r == SC_ERROR_FILE_NOT_FOUND)
+		return priv->obj_cache[enumtag].obj_len == 0;
+	if (r < 0)
+		return 0;
+	len = MIN(priv->obj_cache[enumtag].obj_len, sizeof(head));
+	return (size_t)r == len && memcmp(head, priv->obj_cache[enumtag].obj_data, len) == 0;
+}
+
+static int piv_use_file_cache(sc_card_t *card)
+{
+	scconf_block **found_blocks;
+	int i, use = 0;
+
+	for (i = 0; card->ctx->conf_blocks[i]; i++) {
+		found_blocks = scconf_find_blocks(card->ctx->conf, card->ctx->conf_blocks[i],
+				"card_driver", "PIV-II");
+		if (!found_blocks)
+			continue;
+		if (found_blocks[0])
+			use = scconf_get_bool(found_blocks[0], "use_file_caching", use);
+		free(found_blocks);
+	}
+	return use;
+}
+
+/*
+ * Called from piv_init: one GET DATA of the CHUID tells which file to
+ * use and whether it is still valid for the card.
+ */
+static void piv_file_cache_load(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	char fname[PATH_MAX], magic[sizeof(PIV_FILE_CACHE_MAGIC)];
+	u8 *chuid, *data;
+	size_t chuid_len, len;
+	int enumtag, loaded = 0;
+	FILE *f;
+
+	if (piv_get_cached_data(card, PIV_OBJ_CHUI, &chuid, &chuid_len) <= 0
+			|| piv_file_cache_name(card, fname, sizeof(fname)) != SC_SUCCESS) {
+		sc_log(card->ctx, "No CHUID to identify the card, not using the file cache");
+		return;
+	}
+	priv->file_cache = 1;
+	priv->file_cache_dirty = 1;
+
+	f = fopen(fname, "rb");
+	if (f == NULL)
+		return;
+	if (fread(magic, 1, sizeof(magic) - 1, f) != sizeof(magic) - 1
+			|| memcmp(magic, PIV_FILE_CACHE_MAGIC, sizeof(magic) - 1) != 0
+			|| piv_file_cache_read_obj(f, &enumtag, &data, &len) != 0) {
+		fclose(f);
+		return;
+	}
+	if (enumtag != PIV_OBJ_CHUI || len != chuid_len || memcmp(data, chuid, len) != 0) {
+		sc_log(card->ctx, "CHUID changed, discarding %s", fname);
+		free(data);
+		fclose(f);
+		return;
+	}
+	free(data);
+
+	while (piv_file_cache_read_obj(f, &enumtag, &data, &len) == 0) {
+		if (!piv_file_cacheable(enumtag)
+				|| priv->obj_cache[enumtag].flags & (PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_NOT_PRESENT)) {
+			free(data);
+			continue;
+		}
+		priv->obj_cache[enumtag].flags |= PIV_OBJ_CACHE_VALID | PIV_OBJ_CACHE_FROM_FILE;
+		priv->obj_cache[enumtag].obj_data = data;
+		priv->obj_cache[enumtag].obj_len = len;
+		loaded++;
+	}
+	fclose(f);
+	priv->file_cache_dirty = 0;
+	sc_log(card->ctx, "Loaded %d objects from %s", loaded, fname);
+}
+
+static void piv_file_cache_save(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	char fname[PATH_MAX], tmpname[PATH_MAX + 32];
+	int i, r = 0;
+	FILE *f;
+
+	if (!priv->file_cache || !priv->file_cache_dirty
+			|| !(priv->obj_cache[PIV_OBJ_CHUI].flags & PIV_OBJ_CACHE_VALID)
+			|| priv->obj_cache[PIV_OBJ_CHUI].obj_len == 0
+			|| piv_file_cache_name(card, fname, sizeof(fname)) != SC_SUCCESS)
+		return;
+
+	f = sc_open_cache_tmp(card->ctx, fname, tmpname, sizeof(tmpname));
+	if (f == NULL)
+		return;
+	if (fwrite(PIV_FILE_CACHE_MAGIC, 1, strlen(PIV_FILE_CACHE_MAGIC), f) != strlen(PIV_FILE_CACHE_MAGIC))
+		r = -1;
+	if (r == 0)
+		r = piv_file_cache_write_obj(f, PIV_OBJ_CHUI, priv->obj_cache[PIV_OBJ_CHUI].obj_data,
+				priv->obj_cache[PIV_OBJ_CHUI].obj_len);
+	for (i = 0; r == 0 && i < PIV_OBJ_LAST_ENUM; i++) {
+		if (piv_file_cacheable(i) && priv->obj_cache[i].flags & PIV_OBJ_CACHE_VALID)
+			r = piv_file_cache_write_obj(f, i, priv->obj_cache[i].obj_data,
+					priv->obj_cache[i].obj_len);
+	}
+	if (fclose(f) != 0 || r != 0 || rename(tmpname, fname) != 0) {
+		sc_log(card->ctx, "Failed to write PIV object cache %s: %s", fname, strerror(errno));
+		remove(tmpname);
+		return;
+	}
+	priv->file_cache_dirty = 0;
+}
+
+/* Objects were written to the card: stop using the file for this card */
+static void piv_file_cache_remove(sc_card_t *card)
+{
+	piv_private_data_t * priv = PIV_DATA(card);
+	char fname[PATH_MAX];
+
+	if (!priv->file_cache)
+		return;
+	priv->file_cache = 0;
+	if (piv_file_cache_name(card, fname, sizeof(fname)) == SC_SUCCESS)
+		remove(fname);
+}
+
 /*
  * If the object can not be present on the card, because the History
  * object is not present or the History object says its not present,
@@ -3034,6 +3299,7 @@ piv_finish(sc_card_t *card)
 			priv->context_specific = 0;
 			sc_unlock(card);
 		}
+		piv_file_cache_save(card);
 		if (priv->w_buf)
 			free(priv->w_buf);
 		if (priv->offCardCertURL)
@@ -3503,6 +3769,9 @@ static int piv_init(sc_card_t *card)
 	/* May turn off SC_CARD_CAP_ISO7816_PIN_INFO later */
 	card->caps |=  SC_CARD_CAP_ISO7816_PIN_INFO;
 
+	/* piv_set_security_env() only stores the key reference */
+	card->caps |= SC_CARD_CAP_KEEPS_SECURITY_ENV;
+
 	/*
 	 * 800-73-3 cards may have a history object and/or a discovery object
 	 * We want to process them now as this has information on what
@@ -3511,6 +3780,9 @@ static int piv_init(sc_card_t *card)
 	 * NIST 800-73-3 and NIST 800-73-2 so some older cards may
 	 * not handle the request.
 	 */
+	if (piv_use_file_cache(card))
+		piv_file_cache_load(card);
+
 	piv_process_history(card);
 
 	piv_process_discovery(card);
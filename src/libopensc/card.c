@@ -178,6 +178,7 @@ static void sc_card_free(sc_card_t *card)
 
 	sc_file_free(card->cache.current_ef);
 	sc_file_free(card->cache.current_df);
+	sc_select_cache_clear(card);
 
 	if (card->mutex != NULL) {
 		int r = sc_mutex_destroy(card->ctx, card->mutex);
@@ -207,7 +208,7 @@ size_t sc_get_max_recv_size(const sc_card_t *card)
 
 	/*  Override card limitations with reader limitations. */
 	if (card->reader->max_recv_size != 0
-			&& (card->reader->max_recv_size < card->max_recv_size))
+			&& (card->reader->max_recv_size < max_recv_size))
 		max_recv_size = card->reader->max_recv_size;
 
 	return max_recv_size;
@@ -235,7 +236,7 @@ size_t sc_get_max_send_size(const sc_card_t *card)
 
 	/*  Override card limitations with reader limitations. */
 	if (card->reader->max_send_size != 0
-			&& (card->reader->max_send_size < card->max_send_size))
+			&& (card->reader->max_send_size < max_send_size))
 		max_send_size = card->reader->max_send_size;
 
 	return max_send_size;
@@ -277,26 +278,16 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	/* See if the ATR matches any ATR specified in the config file */
 	if ((driver = ctx->forced_driver) == NULL) {
 		sc_log(ctx, "matching configured ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			driver = ctx->card_drivers[i];
-
-			if (driver->atr_map == NULL ||
-			    !strcmp(driver->short_name, "default")) {
-				driver = NULL;
-				continue;
-			}
-			sc_log(ctx, "trying driver '%s'", driver->short_name);
-			idx = _sc_match_atr(card, driver->atr_map, NULL);
-			if (idx >= 0) {
-				struct sc_atr_table *src = &driver->atr_map[idx];
-
-				sc_log(ctx, "matched driver '%s'", driver->name);
-				/* It's up to card driver to notice these correctly */
-				card->name = src->name;
-				card->type = src->type;
-				card->flags = src->flags;
-				break;
-			}
+		idx = sc_atr_index_match(ctx, &card->atr, 1, &driver);
+		if (idx >= 0) {
+			struct sc_atr_table *src = &driver->atr_map[idx];
+
+			sc_log(ctx, "matched driver '%s'", driver->name);
+			/* It's up to card driver to notice these correctly */
+			card->name = src->name;
+			card->type = src->type;
+			card->flags = src->flags;
+		} else {
 			driver = NULL;
 		}
 	}
@@ -320,8 +311,30 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 	}
 	else {
 		sc_card_t uninitialized = *card;
+		struct sc_card_driver *learned = NULL;
+
+		if (ctx->flags & SC_CTX_FLAG_CARD_DRIVER_MEMO)
+			learned = sc_atr_memo_lookup(ctx, &card->atr);
+		if (learned != NULL) {
+			/* Skip the probes of the drivers before, but let the driver
+			 * check the card: other applets may come with the same ATR */
+			sc_log(ctx, "trying driver '%s' learned for the ATR", learned->short_name);
+			*card->ops = *learned->ops;
+			if (learned->ops->match_card(card) == 1) {
+				memcpy(card->ops, learned->ops, sizeof(struct sc_card_operations));
+				card->driver = learned;
+				r = learned->ops->init(card);
+				if (r) {
+					sc_log(ctx, "driver '%s' init() failed: %s", learned->name, sc_strerror(r));
+					card->driver = NULL;
+				}
+			}
+			if (card->driver == NULL)
+				*card = uninitialized;
+		}
+
 		sc_log(ctx, "matching built-in ATRs");
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
+		for (i = 0; card->driver == NULL && ctx->card_drivers[i] != NULL; i++) {
 			/* FIXME If we had a clean API description, we'd probably get a
 			 * cleaner implementation of the driver's match_card and init,
 			 * which should normally *not* modify the card object if
@@ -366,6 +379,9 @@ int sc_connect_card(sc_reader_t *reader, sc_card_t **card_out)
 			}
 			break;
 		}
+		if (card->driver != NULL && card->driver != learned
+				&& (ctx->flags & SC_CTX_FLAG_CARD_DRIVER_MEMO))
+			sc_atr_memo_store(ctx, &card->atr, card->driver);
 	}
 	if (card->driver == NULL) {
 		sc_log(ctx, "unable to find driver for inserted card");
@@ -449,6 +465,7 @@ int sc_reset(sc_card_t *card, int do_cold_reset)
 
 	r = card->reader->ops->reset(card->reader, do_cold_reset);
 	sc_invalidate_cache(card);
+	sc_pkcs15_shared_cache_invalidate(card->reader->name);
 
 	r2 = sc_mutex_unlock(card->ctx, card->mutex);
 	if (r2 != SC_SUCCESS) {
@@ -475,13 +492,17 @@ int sc_lock(sc_card_t *card)
 		return r;
 	if (card->lock_count == 0) {
 		if (card->reader->ops->lock != NULL) {
+			unsigned long long start = sc_latency_begin(card->ctx);
+
 			r = card->reader->ops->lock(card->reader);
 			while (r == SC_ERROR_CARD_RESET || r == SC_ERROR_READER_REATTACHED) {
 				sc_invalidate_cache(card);
+				sc_pkcs15_shared_cache_invalidate(card->reader->name);
 				if (was_reset++ > 4) /* TODO retry a few times */
 					break;
 				r = card->reader->ops->lock(card->reader);
 			}
+			sc_latency_end(card->ctx, SC_LATENCY_READER_LOCK, start);
 			if (r == 0)
 				reader_lock_obtained = 1;
 		}
@@ -530,6 +551,8 @@ int sc_unlock(sc_card_t *card)
 		LOG_FUNC_RETURN(card->ctx, SC_ERROR_INVALID_ARGUMENTS);
 	}
 	if (--card->lock_count == 0) {
+		/* Others may select or change files until we lock again */
+		sc_select_cache_clear(card);
 		if (card->flags & SC_CARD_FLAG_KEEP_ALIVE) {
 			/* Multiple processes accessing the card will most likely render
 			 * the card cache useless. To not have a bad cache, we explicitly
@@ -1366,18 +1389,11 @@ scconf_block *_sc_match_atr_block(sc_context_t *ctx, struct sc_card_driver *driv
 			return NULL;
 		return table[res].card_atr;
 	} else {
-		unsigned int i;
-
-		for (i = 0; ctx->card_drivers[i] != NULL; i++) {
-			drv = ctx->card_drivers[i];
-			table = drv->atr_map;
-			res = match_atr_table(ctx, table, atr);
-			if (res < 0)
-				continue;
-			return table[res].card_atr;
-		}
+		res = sc_atr_index_match(ctx, atr, 0, &drv);
+		if (res < 0)
+			return NULL;
+		return drv->atr_map[res].card_atr;
 	}
-	return NULL;
 }
 
 int _sc_add_atr(sc_context_t *ctx, struct sc_card_driver *driver, struct sc_atr_table *src)
@@ -1472,11 +1488,99 @@ void sc_invalidate_cache(struct sc_card *card)
 	if (card) {
 		sc_file_free(card->cache.current_ef);
 		sc_file_free(card->cache.current_df);
+		sc_select_cache_clear(card);
 		memset(&card->cache, 0, sizeof(card->cache));
 		card->cache.valid = 0;
 	}
 }
 
+void sc_select_cache_forget(struct sc_card *card)
+{
+	card->cache.selected = 0;
+	memset(&card->cache.selected_path, 0, sizeof(card->cache.selected_path));
+}
+
+void sc_select_cache_clear(struct sc_card *card)
+{
+	size_t i;
+
+	sc_select_cache_forget(card);
+	for (i = 0; i < SC_CACHE_MAX_FCI; i++) {
+		sc_file_free(card->cache.fci[i]);
+		card->cache.fci[i] = NULL;
+	}
+	card->cache.fci_next = 0;
+}
+
+/*
+ * Commands that select another file as a side effect make the current file
+ * unknown, commands that create, delete, resize or append to files, change
+ * their life cycle or generate keys into them also make the FCIs stale.
+ * Proprietary commands might do either. After authentication the current
+ * file is forgotten too, as drivers select the MF or their application
+ * again to reset the security status.
+ */
+void sc_select_cache_apdu(struct sc_card *card, const struct sc_apdu *apdu)
+{
+	if (!card->cache.selected && card->cache.fci[0] == NULL)
+		return;
+
+	if ((apdu->cla & 0x80) && apdu->cla != 0xFF) {
+		sc_select_cache_clear(card);
+		return;
+	}
+	switch (apdu->ins) {
+	case 0x04:	/* DEACTIVATE FILE */
+	case 0x44:	/* ACTIVATE FILE */
+	case 0x46:	/* GENERATE ASYMMETRIC KEY PAIR */
+	case 0x47:
+	case 0xD4:	/* RESIZE FILE */
+	case 0xE0:	/* CREATE FILE */
+	case 0xE2:	/* APPEND RECORD */
+	case 0xE4:	/* DELETE FILE */
+	case 0xE6:	/* TERMINATE DF */
+	case 0xE8:	/* TERMINATE EF */
+		sc_select_cache_clear(card);
+		break;
+	case 0x20:	/* VERIFY */
+	case 0x24:	/* CHANGE REFERENCE DATA */
+	case 0x2C:	/* RESET RETRY COUNTER */
+	case 0x82:	/* EXTERNAL AUTHENTICATE */
+	case 0x86:	/* GENERAL AUTHENTICATE */
+	case 0x87:
+	case 0x70:	/* MANAGE CHANNEL */
+	case 0xA4:	/* SELECT */
+		sc_select_cache_forget(card);
+		break;
+	case 0x0E:	/* ERASE BINARY */
+	case 0xB0:	/* READ BINARY */
+	case 0xD0:	/* WRITE BINARY */
+	case 0xD6:	/* UPDATE BINARY */
+		/* With a short EF identifier */
+		if (apdu->p1 & 0x80)
+			sc_select_cache_forget(card);
+		break;
+	case 0x0F:
+	case 0xB1:
+	case 0xD1:
+	case 0xD7:
+		/* With a file identifier */
+		if (apdu->p1 || apdu->p2)
+			sc_select_cache_forget(card);
+		break;
+	case 0xA2:	/* SEARCH RECORD */
+	case 0xB2:	/* READ RECORD */
+	case 0xB3:
+	case 0xD2:	/* WRITE RECORD */
+	case 0xDC:	/* UPDATE RECORD */
+	case 0xDD:
+		/* With a short EF identifier */
+		if (apdu->p2 >> 3)
+			sc_select_cache_forget(card);
+		break;
+	}
+}
+
 void sc_print_cache(struct sc_card *card)
 {
 	struct sc_context *ctx = NULL;
@@ -179,75 +179,206 @@ int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int metho
 	}
 }
 
-static int sc_decompress_zlib_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int gzip) {
-	/* Since uncompress does not offer a way to make it uncompress gzip... manually set it up */
+struct sc_decompress_stream {
 	z_stream gz;
-	int err;
-	int window_size = 15;
-	const size_t startSize = inLen < 1024 ? 2048 : inLen * 2;
-	const size_t blockSize = inLen < 1024 ? 512 : inLen / 2;
-	size_t bufferSize = startSize;
-	if (gzip)
-		window_size += 0x20;
-	memset(&gz, 0, sizeof(gz));
+	int window_bits;	/* of the z_stream, 0 before inflateInit2() */
+	int ended;		/* the end of the compressed data was seen */
+	int error;
+	int own_out;		/* out is allocated by the stream */
+	u8 *out;
+	size_t out_len;		/* inflated bytes */
+	size_t out_size;
+	size_t max_size;
+};
 
-	if (!out || !outLen)
-		return SC_ERROR_INVALID_ARGUMENTS;
-	
-	gz.next_in = (u8*)in;
-	gz.avail_in = inLen;
+static void stream_release(struct sc_decompress_stream *stream)
+{
+	if (stream->window_bits)
+		inflateEnd(&stream->gz);
+	stream->window_bits = 0;
+	if (stream->own_out)
+		free(stream->out);
+	stream->out = NULL;
+	stream->own_out = 0;
+}
 
-	err = inflateInit2(&gz, window_size);
-	if (err != Z_OK)
-		return zerr_to_opensc(err);
+static int stream_fail(struct sc_decompress_stream *stream, int error)
+{
+	stream->error = error;
+	return error;
+}
 
-	*outLen = 0;
+static int stream_grow(struct sc_decompress_stream *stream)
+{
+	size_t size;
+	u8 *buf;
+
+	if (!stream->own_out || stream->out_size >= stream->max_size)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	size = stream->out_size * 2;
+	if (size > stream->max_size)
+		size = stream->max_size;
+	buf = realloc(stream->out, size);
+	if (buf == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	stream->out = buf;
+	stream->out_size = size;
+	return SC_SUCCESS;
+}
+
+/* Inflates the pending input, growing the output as needed. Unless
+ * finishing, output that inflate() still holds back once all input was
+ * consumed is left for the next call, which keeps exactly sized buffers
+ * from being grown. */
+static int stream_inflate(struct sc_decompress_stream *stream, int finishing)
+{
+	int err, r;
 
 	while (1) {
-		/* Setup buffer... */
-		size_t num;
-		u8* buf = realloc(*out, bufferSize);
-		if (!buf) {
-			free(*out);
-			*out = NULL;
-			return SC_ERROR_OUT_OF_MEMORY;
-		}
-		*out = buf;
-		gz.next_out = buf + *outLen;
-		gz.avail_out = bufferSize - *outLen;
-
-		err = inflate(&gz, Z_FULL_FLUSH);
-		if (err != Z_STREAM_END && err != Z_OK) {
-			free(*out);
-			*out = NULL;
-			break;
-		}
-		num = *outLen + gz.avail_out;
-		if (bufferSize > num) {
-			*outLen += bufferSize - num;
-			bufferSize += bufferSize - num + blockSize;
-		}
+		stream->gz.next_out = stream->out + stream->out_len;
+		stream->gz.avail_out = stream->out_size - stream->out_len;
+		err = inflate(&stream->gz, Z_NO_FLUSH);
+		stream->out_len = stream->out_size - stream->gz.avail_out;
 		if (err == Z_STREAM_END) {
-			if (*outLen > 0) {
-				/* Shrink it down, if it fails, just use old data */
-				buf = realloc(buf, *outLen);
-				if (buf) {
-					*out = buf;
-				}
-			} else {
-				free(*out);
-				*out = NULL;
-				err = Z_DATA_ERROR;
-			}
-			break;
+			stream->ended = 1;
+			return SC_SUCCESS;
 		}
+		if (err != Z_OK && err != Z_BUF_ERROR)
+			return stream_fail(stream, zerr_to_opensc(err));
+		if (stream->gz.avail_out != 0 || (stream->gz.avail_in == 0 && !finishing))
+			return SC_SUCCESS;
+		r = stream_grow(stream);
+		if (r != SC_SUCCESS)
+			return stream_fail(stream, r);
 	}
-	inflateEnd(&gz);
-	return zerr_to_opensc(err);
+}
+
+struct sc_decompress_stream *sc_decompress_stream_new(void)
+{
+	return calloc(1, sizeof(struct sc_decompress_stream));
+}
+
+void sc_decompress_stream_free(struct sc_decompress_stream *stream)
+{
+	if (stream == NULL)
+		return;
+	stream_release(stream);
+	free(stream);
+}
+
+int sc_decompress_stream_start(struct sc_decompress_stream *stream, int method,
+		u8 *out, size_t outLen, size_t maxLen)
+{
+	int window_bits, err;
+
+	if (stream == NULL || (out != NULL && outLen == 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	switch (method) {
+	case COMPRESSION_ZLIB:
+		window_bits = 15;
+		break;
+	case COMPRESSION_AUTO:
+	case COMPRESSION_GZIP:
+		/* zlib detects the gzip or zlib header itself */
+		window_bits = 15 + 0x20;
+		break;
+	default:
+		return SC_ERROR_INVALID_ARGUMENTS;
+	}
+
+	if (stream->own_out)
+		free(stream->out);
+	stream->out = NULL;
+	stream->own_out = 0;
+
+	if (stream->window_bits == 0)
+		err = inflateInit2(&stream->gz, window_bits);
+	else
+		err = inflateReset2(&stream->gz, window_bits);
+	if (err != Z_OK) {
+		stream_release(stream);
+		return zerr_to_opensc(err);
+	}
+	stream->window_bits = window_bits;
+	stream->gz.next_in = NULL;
+	stream->gz.avail_in = 0;
+	stream->ended = 0;
+	stream->error = SC_SUCCESS;
+	stream->out_len = 0;
+
+	if (out != NULL) {
+		stream->out = out;
+		stream->out_size = outLen;
+		stream->max_size = outLen;
+		return SC_SUCCESS;
+	}
+	stream->max_size = maxLen ? maxLen : COMPRESSION_MAX_OUTPUT_SIZE;
+	stream->out_size = outLen ? outLen : 2048;
+	if (stream->out_size > stream->max_size)
+		stream->out_size = stream->max_size;
+	stream->out = malloc(stream->out_size);
+	if (stream->out == NULL)
+		return stream_fail(stream, SC_ERROR_OUT_OF_MEMORY);
+	stream->own_out = 1;
+	return SC_SUCCESS;
+}
+
+int sc_decompress_stream_update(struct sc_decompress_stream *stream, const u8 *in, size_t inLen)
+{
+	if (stream == NULL || stream->window_bits == 0 || (in == NULL && inLen != 0))
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (stream->error != SC_SUCCESS || stream->ended || inLen == 0)
+		return stream->error;
+
+	stream->gz.next_in = (u8 *)in;
+	stream->gz.avail_in = inLen;
+	return stream_inflate(stream, 0);
+}
+
+int sc_decompress_stream_finish(struct sc_decompress_stream *stream, u8 **out, size_t *outLen)
+{
+	int r;
+
+	if (stream == NULL || stream->window_bits == 0 || outLen == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	*outLen = 0;
+	if (out)
+		*out = NULL;
+	r = stream->error;
+	if (r == SC_SUCCESS && !stream->ended) {
+		stream->gz.next_in = NULL;
+		stream->gz.avail_in = 0;
+		r = stream_inflate(stream, 1);
+	}
+	/* truncated data, or nothing at all */
+	if (r == SC_SUCCESS && (!stream->ended || stream->out_len == 0))
+		r = stream_fail(stream, SC_ERROR_UNKNOWN_DATA_RECEIVED);
+	if (r != SC_SUCCESS)
+		return r;
+
+	if (stream->own_out) {
+		/* Shrink it down, if it fails, just use old data */
+		u8 *buf = realloc(stream->out, stream->out_len);
+		if (buf)
+			stream->out = buf;
+		stream->own_out = 0;
+	}
+	if (out)
+		*out = stream->out;
+	*outLen = stream->out_len;
+	stream->out = NULL;
+	/* the next object needs sc_decompress_stream_start() first */
+	stream->error = SC_ERROR_INVALID_ARGUMENTS;
+	return SC_SUCCESS;
 }
 
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method)
 {
+	struct sc_decompress_stream stream;
+	int r;
+
 	if (in == NULL || out == NULL) {
 		return SC_ERROR_UNKNOWN_DATA_RECEIVED;
 	}
@@ -259,13 +390,22 @@ int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, in
 		}
 	}
 
-	switch (method) {
-	case COMPRESSION_ZLIB:
-		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 0);
-	case COMPRESSION_GZIP:
-		return sc_decompress_zlib_alloc(out, outLen, in, inLen, 1);
-	default:
+	if (method != COMPRESSION_ZLIB && method != COMPRESSION_GZIP)
 		return SC_ERROR_INVALID_ARGUMENTS;
-	}
+	if (!outLen)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	free(*out);
+	*out = NULL;
+	*outLen = 0;
+	memset(&stream, 0, sizeof(stream));
+	r = sc_decompress_stream_start(&stream, method, NULL,
+			inLen < 1024 ? 2048 : inLen * 2, COMPRESSION_MAX_OUTPUT_SIZE);
+	if (r == SC_SUCCESS)
+		r = sc_decompress_stream_update(&stream, in, inLen);
+	if (r == SC_SUCCESS)
+		r = sc_decompress_stream_finish(&stream, out, outLen);
+	stream_release(&stream);
+	return r;
 }
 #endif /* ENABLE_ZLIB */
@@ -30,8 +30,39 @@
 
 int sc_compress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
 
+/* Limit of the buffers allocated for decompressed data, far more than any
+ * certificate or other object stored on a card */
+#define COMPRESSION_MAX_OUTPUT_SIZE	(1024 * 1024)
+
 int sc_decompress_alloc(u8** out, size_t* outLen, const u8* in, size_t inLen, int method);
 int sc_decompress(u8* out, size_t* outLen, const u8* in, size_t inLen, int method);
 
+/*
+ * Streaming decompression. The inflate state of a stream is kept between
+ * objects, so a card driver can create one stream and use it for all the
+ * objects it reads. Input may be given in chunks as it is read from the
+ * card.
+ *
+ * sc_decompress_stream_start() starts a new object. If out is given,
+ * data is inflated into that buffer of outLen bytes. Otherwise a buffer
+ * of outLen bytes is allocated, or of a default size if outLen is 0, and
+ * grown as needed up to maxLen bytes (COMPRESSION_MAX_OUTPUT_SIZE if 0).
+ * A full buffer makes sc_decompress_stream_update() fail with
+ * SC_ERROR_BUFFER_TOO_SMALL.
+ *
+ * sc_decompress_stream_finish() fails if the data was truncated. Otherwise
+ * it returns the buffer and the length of the inflated data. A buffer
+ * allocated by the stream is then owned by the caller. Data after the end
+ * of the compressed stream is ignored.
+ */
+struct sc_decompress_stream;
+
+struct sc_decompress_stream *sc_decompress_stream_new(void);
+void sc_decompress_stream_free(struct sc_decompress_stream *stream);
+int sc_decompress_stream_start(struct sc_decompress_stream *stream, int method,
+		u8 *out, size_t outLen, size_t maxLen);
+int sc_decompress_stream_update(struct sc_decompress_stream *stream, const u8 *in, size_t inLen);
+int sc_decompress_stream_finish(struct sc_decompress_stream *stream, u8 **out, size_t *outLen);
+
 #endif
 
@@ -28,7 +28,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <limits.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -383,7 +390,7 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 	int err = 0;
 	const scconf_list *list;
 	const char *val;
-	int debug;
+	int debug, trace;
 #ifdef _WIN32
 	char expanded_val[PATH_MAX];
 	DWORD expanded_len;
@@ -419,6 +426,22 @@ load_parameters(sc_context_t *ctx, scconf_block *block, struct _sc_ctx_options *
 				ctx->flags & SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER))
 		ctx->flags |= SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER;
 
+	if (scconf_get_bool(block, "card_driver_memo",
+				ctx->flags & SC_CTX_FLAG_CARD_DRIVER_MEMO))
+		ctx->flags |= SC_CTX_FLAG_CARD_DRIVER_MEMO;
+
+	if (!scconf_get_bool(block, "select_cache",
+				!(ctx->flags & SC_CTX_FLAG_DISABLE_SELECT_CACHE)))
+		ctx->flags |= SC_CTX_FLAG_DISABLE_SELECT_CACHE;
+
+	if (scconf_get_bool(block, "latency_stats", 0))
+		sc_latency_enable(ctx, scconf_get_str(block, "latency_stats_file", NULL));
+
+	trace = scconf_get_int(block, "apdu_trace", 0);
+	if (trace > 0)
+		sc_apdu_trace_enable(trace, scconf_get_bool(block, "apdu_trace_data", 0),
+				scconf_get_str(block, "apdu_trace_file", NULL));
+
 	list = scconf_find_list(block, "card_drivers");
 	set_drivers(opts, list);
 
@@ -677,6 +700,141 @@ static int load_card_atrs(sc_context_t *ctx)
 	return SC_SUCCESS;
 }
 
+/*
+ * Configuration files are parsed and compiled (see scconf_compile()) once
+ * per process. Contexts reference the entry of their file, which is parsed
+ * again when the size or modification time of the file changed. Entries
+ * stay around for the contexts created later and are only freed once
+ * superseded and unused. Contexts created with SC_CTX_FLAG_PRIVATE_CONF
+ * parse their own copy, which they may change.
+ */
+struct conf_entry {
+	char *path;
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+	unsigned int refs;
+	int valid;
+	scconf_context *conf;
+	struct conf_entry *next;
+};
+
+static struct conf_entry *conf_entries = NULL;
+
+#if defined(HAVE_PTHREAD)
+static pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER;
+#define conf_entries_lock()	pthread_mutex_lock(&conf_lock)
+#define conf_entries_unlock()	pthread_mutex_unlock(&conf_lock)
+#elif defined(_WIN32)
+static SRWLOCK conf_lock = SRWLOCK_INIT;
+#define conf_entries_lock()	AcquireSRWLockExclusive(&conf_lock)
+#define conf_entries_unlock()	ReleaseSRWLockExclusive(&conf_lock)
+#else
+#define conf_entries_lock()
+#define conf_entries_unlock()
+#endif
+
+static void conf_entry_free(struct conf_entry *entry)
+{
+	scconf_free(entry->conf);
+	free(entry->path);
+	free(entry);
+}
+
+/* Sub-second part of the modification time, so a file rewritten with the
+ * same size within a second is parsed again */
+static long conf_mtime_nsec(const struct stat *st)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+	return st->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+	return st->st_mtimespec.tv_nsec;
+#else
+	(void)st;
+	return 0;
+#endif
+}
+
+/* Returns the configuration of the file at path and what scconf_parse()
+ * returned for it. Only parsed configurations are shared, others belong to
+ * the caller. */
+static scconf_context *conf_get(const char *path, int private_conf, int *r)
+{
+	struct conf_entry *entry, **link;
+	scconf_context *conf;
+	struct stat st;
+
+	if (private_conf || stat(path, &st) != 0) {
+		conf = scconf_new(path);
+		*r = conf ? scconf_parse(conf) : 0;
+		return conf;
+	}
+
+	conf_entries_lock();
+	for (link = &conf_entries; (entry = *link) != NULL; ) {
+		if (entry->valid && strcmp(entry->path, path) == 0) {
+			if (entry->mtime == st.st_mtime && entry->mtime_nsec == conf_mtime_nsec(&st)
+					&& entry->size == st.st_size) {
+				entry->refs++;
+				conf_entries_unlock();
+				*r = 1;
+				return entry->conf;
+			}
+			/* The file changed */
+			entry->valid = 0;
+		}
+		if (!entry->valid && entry->refs == 0) {
+			*link = entry->next;
+			conf_entry_free(entry);
+			continue;
+		}
+		link = &entry->next;
+	}
+
+	conf = scconf_new(path);
+	*r = conf ? scconf_parse(conf) : 0;
+	if (*r < 1) {
+		conf_entries_unlock();
+		return conf;
+	}
+	scconf_compile(conf);
+	entry = calloc(1, sizeof(*entry));
+	if (entry != NULL && (entry->path = strdup(path)) != NULL) {
+		entry->mtime = st.st_mtime;
+		entry->mtime_nsec = conf_mtime_nsec(&st);
+		entry->size = st.st_size;
+		entry->refs = 1;
+		entry->valid = 1;
+		entry->conf = conf;
+		entry->next = conf_entries;
+		conf_entries = entry;
+	} else {
+		free(entry);
+	}
+	conf_entries_unlock();
+	return conf;
+}
+
+static void conf_release(scconf_context *conf)
+{
+	struct conf_entry *entry, **link;
+
+	conf_entries_lock();
+	for (link = &conf_entries; (entry = *link) != NULL; link = &entry->next) {
+		if (entry->conf == conf) {
+			if (--entry->refs == 0 && !entry->valid) {
+				*link = entry->next;
+				conf_entry_free(entry);
+			}
+			conf_entries_unlock();
+			return;
+		}
+	}
+	conf_entries_unlock();
+	/* Not shared */
+	scconf_free(conf);
+}
+
 static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 {
 	int i, r, count = 0;
@@ -709,14 +867,16 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 	if (!conf_path)
 		conf_path = OPENSC_CONF_PATH;
 #endif
-	ctx->conf = scconf_new(conf_path);
+	ctx->conf = conf_get(conf_path, ctx->flags & SC_CTX_FLAG_PRIVATE_CONF, &r);
 	if (ctx->conf == NULL)
 		return;
-	r = scconf_parse(ctx->conf);
 #ifdef OPENSC_CONFIG_STRING
 	/* Parse the string if config file didn't exist */
-	if (r < 0)
+	if (r < 0) {
 		r = scconf_parse_string(ctx->conf, OPENSC_CONFIG_STRING);
+		if (r > 0)
+			scconf_compile(ctx->conf);
+	}
 #endif
 	if (r < 1) {
 		/* A negative return value means the config file isn't
@@ -726,7 +886,7 @@ static void process_config_file(sc_context_t *ctx, struct _sc_ctx_options *opts)
 			sc_log(ctx, "scconf_parse failed: %s", ctx->conf->errmsg);
 		else
 			sc_log(ctx, "scconf_parse failed: %s", ctx->conf->errmsg);
-		scconf_free(ctx->conf);
+		conf_release(ctx->conf);
 		ctx->conf = NULL;
 		return;
 	}
@@ -805,6 +965,7 @@ int sc_context_repair(sc_context_t **ctx_out)
 	 * card drivers - so rebuild the ATR's
 	 */
 	load_card_atrs(*ctx_out);
+	sc_atr_index_build(*ctx_out);
 
 	/* TODO: May need to re-open any card driver DLL's */
 
@@ -879,6 +1040,8 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 
 	ctx->flags = parm->flags;
 	set_defaults(ctx, &opts);
+	/* Needed before the configuration is read */
+	ctx->flags |= parm->flags & SC_CTX_FLAG_PRIVATE_CONF;
 
 	if (0 != list_init(&ctx->readers)) {
 		del_drvs(&opts);
@@ -942,6 +1105,12 @@ int sc_context_create(sc_context_t **ctx_out, const sc_context_param_t *parm)
 
 	load_card_drivers(ctx, &opts);
 	load_card_atrs(ctx);
+	r = sc_atr_index_build(ctx);
+	if (r != SC_SUCCESS) {
+		del_drvs(&opts);
+		sc_release_context(ctx);
+		return r;
+	}
 
 	del_drvs(&opts);
 	sc_ctx_detect_readers(ctx);
@@ -1007,6 +1176,9 @@ int sc_release_context(sc_context_t *ctx)
 #ifdef USE_OPENSSL3_LIBCTX
 	sc_openssl3_deinit(ctx);
 #endif
+	sc_latency_release(ctx);
+	sc_atr_index_free(ctx);
+	sc_atr_memo_free(ctx);
 	if (ctx->preferred_language != NULL)
 		free(ctx->preferred_language);
 	if (ctx->mutex != NULL) {
@@ -1017,7 +1189,7 @@ int sc_release_context(sc_context_t *ctx)
 		}
 	}
 	if (ctx->conf != NULL)
-		scconf_free(ctx->conf);
+		conf_release(ctx->conf);
 	if (ctx->debug_file && (ctx->debug_file != stdout && ctx->debug_file != stderr))
 		fclose(ctx->debug_file);
 	if (ctx->debug_filename != NULL)
@@ -1145,3 +1317,64 @@ failed:
 	sc_log(ctx, "failed to create cache directory");
 	return SC_ERROR_INTERNAL;
 }
+
+static int
+cache_tmp_create(const char *fname, char *tmpname, size_t tmpname_len)
+{
+#ifdef _WIN32
+	static volatile LONG counter;
+	int fd, i;
+
+	for (i = 0; i < 100; i++) {
+		if ((size_t)snprintf(tmpname, tmpname_len, "%s.%lu.%ld", fname,
+				(unsigned long)GetCurrentProcessId(),
+				(long)InterlockedIncrement(&counter)) >= tmpname_len) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		fd = _open(tmpname, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY,
+				_S_IREAD | _S_IWRITE);
+		if (fd >= 0 || errno != EEXIST)
+			return fd;
+	}
+	return -1;
+#else
+	if ((size_t)snprintf(tmpname, tmpname_len, "%s.XXXXXX", fname) >= tmpname_len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return mkstemp(tmpname);
+#endif
+}
+
+/*
+ * Create a new file with a unique name next to fname, to be renamed over
+ * fname once written. The name is returned in tmpname; the caller renames
+ * or removes the file.
+ */
+FILE *sc_open_cache_tmp(sc_context_t *ctx, const char *fname, char *tmpname, size_t tmpname_len)
+{
+	FILE *f;
+	int fd;
+
+	fd = cache_tmp_create(fname, tmpname, tmpname_len);
+	if (fd < 0 && errno == ENOENT) {
+		if (sc_make_cache_dir(ctx) < 0)
+			return NULL;
+		fd = cache_tmp_create(fname, tmpname, tmpname_len);
+	}
+	if (fd < 0)
+		return NULL;
+#ifdef _WIN32
+	f = _fdopen(fd, "wb");
+	if (f == NULL)
+		_close(fd);
+#else
+	f = fdopen(fd, "wb");
+	if (f == NULL)
+		close(fd);
+#endif
+	if (f == NULL)
+		remove(tmpname);
+	return f;
+}
@@ -153,6 +153,77 @@ static void cwa_iso7816_padding(u8 * buf, size_t * buflen)
 		buf[*buflen] = 0x00;
 }
 
+/**
+ * Release the ciphers keyed with the session keys.
+ *
+ * @param sm Secure Messaging session data
+ */
+static void cwa_free_session_ciphers(struct sm_cwa_session * sm)
+{
+	sc_sm_cipher_free(&sm->enc_cipher);
+	sc_sm_cipher_free(&sm->dec_cipher);
+	sc_sm_cipher_free(&sm->mac_cipher);
+	sc_sm_cipher_free(&sm->mac3_cipher);
+}
+
+/**
+ * Key the ciphers with the session keys, once per secure channel.
+ *
+ * @param card card info structure
+ * @param sm Secure Messaging session data
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int cwa_init_session_ciphers(sc_card_t * card, struct sm_cwa_session * sm)
+{
+	int res;
+
+	if (sm->enc_cipher.evp_ctx && sm->dec_cipher.evp_ctx
+	    && sm->mac_cipher.evp_ctx && sm->mac3_cipher.evp_ctx)
+		return SC_SUCCESS;
+
+	res = sc_sm_cipher_init(card->ctx, &sm->enc_cipher, "DES-EDE-CBC", sm->session_enc, 1);
+	if (res == SC_SUCCESS)
+		res = sc_sm_cipher_init(card->ctx, &sm->dec_cipher, "DES-EDE-CBC", sm->session_enc, 0);
+	/* single DES with the first half of kmac for all blocks but the last */
+	if (res == SC_SUCCESS)
+		res = sc_sm_cipher_init(card->ctx, &sm->mac_cipher, "DES-ECB", sm->session_mac, 1);
+	if (res == SC_SUCCESS)
+		res = sc_sm_cipher_init(card->ctx, &sm->mac3_cipher, "DES-EDE-ECB", sm->session_mac, 1);
+	if (res != SC_SUCCESS)
+		cwa_free_session_ciphers(sm);
+	return res;
+}
+
+/**
+ * Compute the MAC cryptographic checksum of padded data with kmac and the
+ * current SSC.
+ *
+ * @param sm Secure Messaging session data with keyed ciphers
+ * @param data padded data
+ * @param datalen data length, a multiple of 8
+ * @param mac where to store the 8 bytes of the checksum
+ * @return SC_SUCCESS if ok; else error code
+ */
+static int cwa_compute_mac(struct sm_cwa_session * sm, const u8 * data,
+			   size_t datalen, u8 * mac)
+{
+	size_t i, j;
+
+	memcpy(mac, sm->ssc, 8);	/* start with computed SSC */
+	for (i = 0; i < datalen; i += 8) {	/* divide data in 8 byte blocks */
+		/* compute DES */
+		if (sc_sm_cipher_crypt(&sm->mac_cipher, NULL, mac, 8, mac) != SC_SUCCESS)
+			return SC_ERROR_INTERNAL;
+		/* XOR with next data and repeat */
+		for (j = 0; j < 8; j++)
+			mac[j] ^= data[i + j];
+	}
+	/* and apply 3DES to result */
+	if (sc_sm_cipher_crypt(&sm->mac3_cipher, NULL, mac, 8, mac) != SC_SUCCESS)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
+
 /**
  * compose a BER-TLV data in provided buffer.
  *
@@ -784,6 +855,9 @@ static int cwa_compute_session_keys(sc_card_t * card)
 		res = SC_ERROR_OUT_OF_MEMORY;
 		goto compute_session_keys_end;
 	}
+	/* ciphers of the previous channel are keyed again on first use */
+	cwa_free_session_ciphers(sm);
+
 	/* compose kseed  (cwa-14890-1 sect 8.7.2) */
 	for (n = 0; n < 32; n++)
 		*(kseed + n) = sm->icc.k[n] ^ sm->ifd.k[n];
@@ -1123,6 +1197,7 @@ int cwa_create_secure_channel(sc_card_t * card,
 	switch (flag) {
 	case CWA_SM_OFF:	/* disable SM */
 		card->sm_ctx.sm_mode = SM_MODE_NONE;
+		cwa_free_session_ciphers(sm);
 		sc_log(ctx, "Setting CWA SM status to none");
 		LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 	case CWA_SM_ON:	/* force sm initialization process */
@@ -1463,17 +1538,10 @@ int cwa_encode_apdu(sc_card_t * card,
 	u8 macbuf[8];		/* to store and compute CC */
 	char *msg = NULL;
 
-	size_t i, j;		/* for xor loops */
 	int res = SC_SUCCESS;
 	sc_context_t *ctx = NULL;
 	struct sm_cwa_session * sm_session = &card->sm_ctx.info.session.cwa;
 	u8 *msgbuf = NULL;	/* to encrypt apdu data */
-	u8 *cryptbuf = NULL;
-
-	EVP_CIPHER_CTX *cctx = NULL;
-	EVP_CIPHER *alg = NULL;
-	unsigned char *key = NULL;
-	int tmplen = 0;
 
 	/* mandatory check */
 	if (!card || !card->ctx || !provider)
@@ -1487,10 +1555,9 @@ int cwa_encode_apdu(sc_card_t * card,
 	if (card->sm_ctx.sm_mode != SM_MODE_TRANSMIT)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_SM_INVALID_LEVEL);
 
-	/* reserve extra bytes for padding and tlv header */
+	/* reserve extra bytes for padding indicator and padding */
 	msgbuf = calloc(12 + from->lc, sizeof(u8));	/* to encrypt apdu data */
-	cryptbuf = calloc(12 + from->lc, sizeof(u8));
-	if (!msgbuf || !cryptbuf) {
+	if (!msgbuf) {
 		res = SC_ERROR_OUT_OF_MEMORY;
 		goto err;
 	}
@@ -1542,40 +1609,32 @@ int cwa_encode_apdu(sc_card_t * card,
 	*(ccbuf + cclen++) = to->p2;
 	cwa_iso7816_padding(ccbuf, &cclen);	/* pad header (4 bytes pad) */
 
-	if (!(cctx = EVP_CIPHER_CTX_new())) {
-		res = SC_ERROR_INTERNAL;
-		goto err;
+	res = cwa_init_session_ciphers(card, sm_session);
+	if (res != SC_SUCCESS) {
+		msg = "Cannot set up session keys";
+		goto encode_end;
 	}
 
 	/* if no data, skip data encryption step */
 	if (from->lc != 0) {
-		unsigned char iv[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-		int dlen = from->lc;
-		size_t len = dlen;
-
-		/* pad message */
-		memcpy(msgbuf, from->data, dlen);
-		cwa_iso7816_padding(msgbuf, &len);
-		dlen = len;
+		static const unsigned char iv[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+		size_t dlen = from->lc;
 
-		/* start kriptbuff with iso padding indicator */
-		*cryptbuf = 0x01;
-		key = sm_session->session_enc;
+		/* start with iso padding indicator, then padded message */
+		msgbuf[0] = 0x01;
+		memcpy(msgbuf + 1, from->data, dlen);
+		cwa_iso7816_padding(msgbuf + 1, &dlen);
 
-		alg = sc_evp_cipher(card->ctx, "DES-EDE-CBC");
-
-		if (EVP_EncryptInit_ex(cctx, alg, NULL, key, iv) != 1 ||
-			EVP_CIPHER_CTX_set_padding(cctx, 0) != 1 ||
-			EVP_EncryptUpdate(cctx, cryptbuf + 1, &dlen, msgbuf, dlen) != 1 ||
-			EVP_EncryptFinal_ex(cctx, cryptbuf + 1 + dlen, &tmplen) != 1) {
+		/* encrypt in place by mean of kenc and iv={0,...0} */
+		if (sc_sm_cipher_crypt(&sm_session->enc_cipher, iv,
+				msgbuf + 1, dlen, msgbuf + 1) != SC_SUCCESS) {
 			msg = "Error in encrypting APDU";
 			res = SC_ERROR_INTERNAL;
 			goto encode_end;
 		}
-		dlen += tmplen;
 
 		/* compose data TLV and add to result buffer */
-		res = cwa_compose_tlv(card, 0x87, dlen + 1, cryptbuf, &ccbuf, &cclen);
+		res = cwa_compose_tlv(card, 0x87, dlen + 1, msgbuf, &ccbuf, &cclen);
 		if (res != SC_SUCCESS) {
 			msg = "Error in compose tag 8x87 TLV";
 			goto encode_end;
@@ -1612,47 +1671,9 @@ int cwa_encode_apdu(sc_card_t * card,
 		goto encode_end;
 	}
 
-	memcpy(macbuf, sm_session->ssc, 8);	/* start with computed SSC */
-
-	tmplen = 0;
-	key = sm_session->session_mac;
-
-	sc_evp_cipher_free(alg);
-	alg = sc_evp_cipher(card->ctx, "DES-ECB");
-	if (EVP_EncryptInit_ex(cctx, alg, NULL, key, NULL) != 1 ||
-		EVP_CIPHER_CTX_set_padding(cctx, 0) != 1) {
-		msg = "Error in DES ECB encryption";
-		res = SC_ERROR_INTERNAL;
-		goto encode_end;
-	 }
-
-	for (i = 0; i < cclen; i += 8) {	/* divide data in 8 byte blocks */
-		/* compute DES */
-		if (EVP_EncryptUpdate(cctx, macbuf, &tmplen, macbuf , 8) != 1) {
-			msg = "Error in DES ECB encryption";
-			res = SC_ERROR_INTERNAL;
-			goto encode_end;
-		}
-		/* XOR with next data and repeat */
-		for (j = 0; j < 8; j++)
-			macbuf[j] ^= ccbuf[i + j];
-	}
-	if (EVP_EncryptFinal_ex(cctx, macbuf + tmplen, &tmplen) != 1) {
+	res = cwa_compute_mac(sm_session, ccbuf, cclen, macbuf);
+	if (res != SC_SUCCESS) {
 		msg = "Error in DES ECB encryption";
-		res = SC_ERROR_INTERNAL;
-		goto encode_end;
-	}
-
-	/* and apply 3DES to result */
-	sc_evp_cipher_free(alg);
-	alg = sc_evp_cipher(card->ctx, "DES-EDE-ECB");
-
-	if (EVP_EncryptInit_ex(cctx, alg, NULL, key, NULL) != 1 ||
-		EVP_CIPHER_CTX_set_padding(cctx, 0) != 1 ||
-		EVP_EncryptUpdate(cctx, macbuf, &tmplen, macbuf, 8) != 1 ||
-		EVP_EncryptFinal_ex(cctx, macbuf + tmplen, &tmplen) != 1) {
-		msg = "Error in 3DEC ECB encryption";
-		res = SC_ERROR_INTERNAL;
 		goto encode_end;
 	}
 
@@ -1681,13 +1702,9 @@ encode_end:
 	if (from->resp != to->resp)
 		free(to->resp);
 encode_end_apdu_valid:
-	sc_evp_cipher_free(alg);
-	if (cctx)
-		EVP_CIPHER_CTX_free(cctx);
 	if (msg)
 		sc_log(ctx, "%s", msg);
 	free(msgbuf);
-	free(cryptbuf);
 	free(ccbuf);
 	LOG_FUNC_RETURN(ctx, res);
 }
@@ -1710,7 +1727,7 @@ int cwa_decode_response(sc_card_t * card,
 			cwa_provider_t * provider,
 			sc_apdu_t * apdu)
 {
-	size_t i, j, tlv_len;
+	size_t tlv_len;
 	cwa_tlv_t tlv_array[4];
 	cwa_tlv_t *p_tlv = &tlv_array[0];	/* to store plain data (Tag 0x81) */
 	cwa_tlv_t *e_tlv = &tlv_array[1];	/* to store pad encoded data (Tag 0x87) */
@@ -1726,14 +1743,6 @@ int cwa_decode_response(sc_card_t * card,
 	sc_context_t *ctx = NULL;
 	struct sm_cwa_session * sm_session = &card->sm_ctx.info.session.cwa;
 
-	EVP_CIPHER_CTX *cctx = NULL;
-	EVP_CIPHER *alg = NULL;
-	unsigned char *key = NULL;
-	int tmplen = 0;
-
-	if ((cctx = EVP_CIPHER_CTX_new()) == NULL)
-		return SC_ERROR_INTERNAL;
-
 	/* mandatory check */
 	if (!card || !card->ctx || !provider)
 		return SC_ERROR_INVALID_ARGUMENTS;
@@ -1853,45 +1862,16 @@ int cwa_decode_response(sc_card_t * card,
 		msg = "Error in computing SSC";
 		goto response_decode_end;
 	}
-	/* set up key for mac computing */
-	key = sm_session->session_mac;
-
-	alg = sc_evp_cipher(card->ctx, "DES-ECB");
-	if (EVP_EncryptInit_ex(cctx, alg, NULL, key, NULL) != 1 ||
-		EVP_CIPHER_CTX_set_padding(cctx, 0) != 1) {
-		msg = "Error in DES ECB encryption";
-		res = SC_ERROR_INTERNAL;
-		goto response_decode_end;
-	 }
-
-	memcpy(macbuf, sm_session->ssc, 8);	/* start with computed SSC */
-	for (i = 0; i < cclen; i += 8) {	/* divide data in 8 byte blocks */
-		/* compute DES */
-		if (EVP_EncryptUpdate(cctx, macbuf, &tmplen, macbuf, 8) != 1) {
-			msg = "Error in DES ECB encryption";
-			res = SC_ERROR_INTERNAL;
-			goto response_decode_end;
-		}
-		/* XOR with data and repeat */
-		for (j = 0; j < 8; j++)
-			macbuf[j] ^= ccbuf[i + j];
-	}
-	if (EVP_EncryptFinal_ex(cctx, macbuf + tmplen, &tmplen) != 1) {
-		msg = "Error in DES ECB encryption";
-		res = SC_ERROR_INTERNAL;
+	/* set up keys for mac computing */
+	res = cwa_init_session_ciphers(card, sm_session);
+	if (res != SC_SUCCESS) {
+		msg = "Cannot set up session keys";
 		goto response_decode_end;
 	}
 
-	/* finally apply 3DES to result */
-	sc_evp_cipher_free(alg);
-	alg = sc_evp_cipher(card->ctx, "DES-EDE-ECB");
-
-	if (EVP_EncryptInit_ex(cctx, alg, NULL, key, NULL) != 1 ||
-		EVP_CIPHER_CTX_set_padding(cctx, 0) != 1 ||
-		EVP_EncryptUpdate(cctx, macbuf, &tmplen, macbuf, 8) != 1 ||
-		EVP_EncryptFinal_ex(cctx, macbuf + tmplen, &tmplen) != 1) {
-		msg = "Error in 3DEC ECB encryption";
-		res = SC_ERROR_INTERNAL;
+	res = cwa_compute_mac(sm_session, ccbuf, cclen, macbuf);
+	if (res != SC_SUCCESS) {
+		msg = "Error in DES ECB encryption";
 		goto response_decode_end;
 	}
 
@@ -1923,8 +1903,7 @@ int cwa_decode_response(sc_card_t * card,
 
 	/* if encoded data, decode and store into apdu response */
 	else if (e_tlv->buf) {	/* encoded data */
-		unsigned char iv[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-		int dlen = apdu->resplen;
+		static const unsigned char iv[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 		/* check data len */
 		if ((e_tlv->len < 9) || ((e_tlv->len - 1) % 8) != 0) {
 			msg = "Invalid length for Encoded data TLV";
@@ -1937,23 +1916,15 @@ int cwa_decode_response(sc_card_t * card,
 			res = SC_ERROR_INVALID_DATA;
 			goto response_decode_end;
 		}
-		/* prepare keys to decode */
-		key = sm_session->session_enc;
-
 		/* decrypt into response buffer
 		 * by using 3DES CBC by mean of kenc and iv={0,...0} */
-		sc_evp_cipher_free(alg);
-		alg = sc_evp_cipher(card->ctx, "DES-EDE-CBC");
-
-		if (EVP_DecryptInit_ex(cctx, alg, NULL, key, iv) != 1 ||
-			EVP_CIPHER_CTX_set_padding(cctx, 0) != 1 ||
-			EVP_DecryptUpdate(cctx, apdu->resp, &dlen, &e_tlv->data[1], e_tlv->len - 1) != 1 ||
-			EVP_DecryptFinal_ex(cctx, apdu->resp + dlen, &tmplen) != 1) {
+		if (sc_sm_cipher_crypt(&sm_session->dec_cipher, iv, &e_tlv->data[1],
+				e_tlv->len - 1, apdu->resp) != SC_SUCCESS) {
 			res = SC_ERROR_INTERNAL;
 			msg = "Can not decrypt 3DES CBC";
 			goto response_decode_end;
 		}
-		apdu->resplen = dlen + tmplen;
+		apdu->resplen = e_tlv->len - 1;
 
 		/* remove iso padding from response length */
 		for (; (apdu->resplen > 0) && *(apdu->resp + apdu->resplen - 1) == 0x00; apdu->resplen--) ;	/* empty loop */
@@ -1974,8 +1945,6 @@ int cwa_decode_response(sc_card_t * card,
 	res = SC_SUCCESS;
 
  response_decode_end:
-	sc_evp_cipher_free(alg);
- 	EVP_CIPHER_CTX_free(cctx);
 	if (buffer)
 		free(buffer);
 	if (ccbuf)
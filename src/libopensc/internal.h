@@ -31,6 +31,7 @@ extern "C" {
 #endif
 
 #include <assert.h>
+#include <stdint.h>
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -85,6 +86,42 @@ int _sc_parse_atr(struct sc_reader *reader);
 int _sc_add_atr(struct sc_context *ctx, struct sc_card_driver *driver, struct sc_atr_table *src);
 int _sc_free_atr(struct sc_context *ctx, struct sc_card_driver *driver);
 
+/* Unique file next to a cache file, which replaces it by rename() when written */
+FILE *sc_open_cache_tmp(struct sc_context *ctx, const char *fname, char *tmpname, size_t tmpname_len);
+
+/* Index of the ATRs of all drivers' atr_map, built with the context. Returns
+ * the index in the atr_map of the matching driver like _sc_match_atr(). */
+int sc_atr_index_build(struct sc_context *ctx);
+void sc_atr_index_free(struct sc_context *ctx);
+int sc_atr_index_match(struct sc_context *ctx, const struct sc_atr *atr, int skip_default,
+		struct sc_card_driver **driver_out);
+
+/* Card drivers learned for ATRs, kept in the cache directory */
+struct sc_card_driver *sc_atr_memo_lookup(struct sc_context *ctx, const struct sc_atr *atr);
+void sc_atr_memo_store(struct sc_context *ctx, const struct sc_atr *atr,
+		const struct sc_card_driver *driver);
+void sc_atr_memo_free(struct sc_context *ctx);
+
+/* Select cache of iso7816_select_file(): sc_select_cache_forget() makes the
+ * current file unknown, sc_select_cache_clear() also drops the FCIs.
+ * sc_select_cache_apdu() is told about every APDU that was transmitted. */
+void sc_select_cache_forget(struct sc_card *card);
+void sc_select_cache_clear(struct sc_card *card);
+void sc_select_cache_apdu(struct sc_card *card, const struct sc_apdu *apdu);
+
+/* Drops the PKCS#15 data shared between contexts for the card in the reader */
+void sc_pkcs15_shared_cache_invalidate(const char *reader);
+
+/* Microseconds from a monotonic clock */
+uint64_t sc_monotonic_time_us(void);
+
+/* Records a transmitted APDU in the trace ring, see sc_apdu_trace_enable().
+ * sc_apdu_trace_begin() returns 0 if tracing is off. */
+uint64_t sc_apdu_trace_begin(void);
+void sc_apdu_trace_end(struct sc_card *card, const struct sc_apdu *apdu, int rv, uint64_t start);
+
+void sc_latency_release(struct sc_context *ctx);
+
 /**
  * Convert an unsigned long into 4 bytes in big endian order
  * @param  buf   the byte array for the result, should be 4 bytes long
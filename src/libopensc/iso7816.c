@@ -626,6 +626,79 @@ iso7816_process_fci(struct sc_card *card, struct sc_file *file,
 }
 
 
+/*
+ * Select cache: selecting the file that is already selected sends nothing,
+ * and the FCIs of absolute paths are remembered, so that selecting such a
+ * path again does not need the FCI returned and parsed. sc_select_cache_apdu()
+ * forgets what other commands may have changed. Everything is dropped when
+ * the card is unlocked or reset, or when secure messaging is switched.
+ */
+static int
+select_cache_sm_mode(struct sc_card *card)
+{
+#ifdef ENABLE_SM
+	return card->sm_ctx.sm_mode;
+#else
+	return 0;
+#endif
+}
+
+static int
+select_cache_usable(struct sc_card *card, const struct sc_path *path)
+{
+	if ((card->ctx->flags & SC_CTX_FLAG_DISABLE_SELECT_CACHE)
+			|| !card->cache.valid || card->lock_count == 0)
+		return 0;
+	if (card->cache.selected_sm_mode != select_cache_sm_mode(card)) {
+		sc_select_cache_clear(card);
+		card->cache.selected_sm_mode = select_cache_sm_mode(card);
+	}
+	/* Only paths that do not depend on the current DF */
+	return (path->type == SC_PATH_TYPE_PATH || path->type == SC_PATH_TYPE_DF_NAME)
+		&& (path->len > 0 || path->aid.len > 0);
+}
+
+static int
+select_cache_path_equal(const struct sc_path *a, const struct sc_path *b)
+{
+	return a->type == b->type && a->len == b->len
+		&& memcmp(a->value, b->value, a->len) == 0
+		&& a->aid.len == b->aid.len
+		&& memcmp(a->aid.value, b->aid.value, a->aid.len) == 0;
+}
+
+static int
+select_cache_find(struct sc_card *card, const struct sc_path *path)
+{
+	int i;
+
+	for (i = 0; i < SC_CACHE_MAX_FCI; i++)
+		if (card->cache.fci[i] != NULL
+				&& select_cache_path_equal(&card->cache.fci_path[i], path))
+			return i;
+	return -1;
+}
+
+static void
+select_cache_store(struct sc_card *card, const struct sc_path *path, const struct sc_file *file)
+{
+	int i;
+
+	card->cache.selected_path = *path;
+	card->cache.selected = 1;
+	if (file == NULL)
+		return;
+
+	i = select_cache_find(card, path);
+	if (i < 0) {
+		i = card->cache.fci_next;
+		card->cache.fci_next = (card->cache.fci_next + 1) % SC_CACHE_MAX_FCI;
+	}
+	sc_file_free(card->cache.fci[i]);
+	sc_file_dup(&card->cache.fci[i], file);
+	card->cache.fci_path[i] = *path;
+}
+
 static int
 iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct sc_file **file_out)
 {
@@ -639,11 +712,32 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 	const u8 *buffer;
 	size_t buffer_len;
 	unsigned int cla, tag;
+	struct sc_file *cached = NULL;
+	int cacheable, i;
 
 	if (card == NULL || in_path == NULL) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	ctx = card->ctx;
+
+	cacheable = select_cache_usable(card, in_path);
+	if (cacheable) {
+		i = select_cache_find(card, in_path);
+		if (file_out != NULL && i >= 0) {
+			sc_file_dup(&cached, card->cache.fci[i]);
+			if (cached == NULL)
+				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
+		if (card->cache.selected
+				&& select_cache_path_equal(&card->cache.selected_path, in_path)
+				&& (file_out == NULL || cached != NULL)) {
+			sc_log(ctx, "File %s already selected", sc_print_path(in_path));
+			if (file_out != NULL)
+				*file_out = cached;
+			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+		}
+	}
+
 	memcpy(path, in_path->value, in_path->len);
 	pathlen = in_path->len;
 	pathtype = in_path->type;
@@ -661,10 +755,12 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 			apdu.lc = in_path->aid.len;
 
 			r = sc_transmit_apdu(card, &apdu);
-			LOG_TEST_RET(ctx, r, "APDU transmit failed");
-			r = sc_check_sw(card, apdu.sw1, apdu.sw2);
-			if (r)
+			if (r == SC_SUCCESS)
+				r = sc_check_sw(card, apdu.sw1, apdu.sw2);
+			if (r) {
+				sc_file_free(cached);
 				LOG_FUNC_RETURN(ctx, r);
+			}
 
 			if (pathtype == SC_PATH_TYPE_PATH
 					|| pathtype == SC_PATH_TYPE_DF_NAME)
@@ -710,7 +806,7 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 	apdu.data = path;
 	apdu.datalen = pathlen;
 
-	if (file_out != NULL) {
+	if (file_out != NULL && cached == NULL) {
 		apdu.p2 = 0;		/* first record, return FCI */
 		apdu.resp = buf;
 		apdu.resplen = sizeof(buf);
@@ -722,8 +818,10 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 	}
 
 	r = sc_transmit_apdu(card, &apdu);
+	if (r != SC_SUCCESS)
+		sc_file_free(cached);
 	LOG_TEST_RET(ctx, r, "APDU transmit failed");
-	if (file_out == NULL) {
+	if (file_out == NULL || cached != NULL) {
 		/* For some cards 'SELECT' can be only with request to return FCI/FCP. */
 		r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 		if (apdu.sw1 == 0x6A && apdu.sw2 == 0x86)   {
@@ -732,7 +830,17 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 				r = sc_check_sw(card, apdu.sw1, apdu.sw2);
 		}
 		if (apdu.sw1 == 0x61)
-			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
+			r = SC_SUCCESS;
+		if (cached != NULL && r != SC_SUCCESS) {
+			/* Ask for the FCI once more, without the cache */
+			sc_file_free(cached);
+			sc_select_cache_clear(card);
+			return iso7816_select_file(card, in_path, file_out);
+		}
+		if (r == SC_SUCCESS && cacheable)
+			select_cache_store(card, in_path, NULL);
+		if (cached != NULL)
+			*file_out = cached;
 		LOG_FUNC_RETURN(ctx, r);
 	}
 
@@ -748,6 +856,8 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 				LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
 			file->path = *in_path;
 
+			if (cacheable)
+				select_cache_store(card, in_path, file);
 			*file_out = file;
 			LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 		}
@@ -770,6 +880,8 @@ iso7816_select_file(struct sc_card *card, const struct sc_path *in_path, struct
 		r = sc_asn1_read_tag(&buffer, apdu.resplen, &cla, &tag, &buffer_len);
 		if (r == SC_SUCCESS)
 			card->ops->process_fci(card, file, buffer, buffer_len);
+		if (cacheable)
+			select_cache_store(card, in_path, file);
 		*file_out = file;
 		break;
 	case 0x00: /* proprietary coding */
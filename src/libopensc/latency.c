@@ -0,0 +1,258 @@
+/*
+ * latency.c: Latency histograms of card and token operations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#define getpid() GetCurrentProcessId()
+#endif
+
+#include "internal.h"
+
+/*
+ * Buckets are log-linear as in HDR histograms: values below 8 us have a
+ * bucket each, above that every power of two is split into 8 buckets, so
+ * the relative error stays below 12.5 %. The last bucket takes everything
+ * from about 2^33 us, some hours, on.
+ */
+#define LATENCY_SUB_BITS	3
+#define LATENCY_SUB		(1 << LATENCY_SUB_BITS)
+
+struct sc_latency_stats {
+	char *file;
+	struct sc_latency_histogram hist[SC_LATENCY_OPS];
+};
+
+#if defined(_MSC_VER)
+#define latency_add(p, v)	InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v))
+#define latency_load(p)		((unsigned long long)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define latency_cas(p, old, v)	(InterlockedCompareExchange64((volatile LONG64 *)(p), (LONG64)(v), (LONG64)(old)) == (LONG64)(old))
+#else
+#define latency_add(p, v)	__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define latency_load(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define latency_cas(p, old, v)	__extension__ ({ \
+	unsigned long long _old = (old); \
+	__atomic_compare_exchange_n((p), &_old, (v), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED); \
+})
+#endif
+
+static const char *latency_names[SC_LATENCY_OPS] = {
+	"pkcs11-lock",
+	"pkcs11-sign",
+	"pkcs11-decrypt",
+	"host-crypto",
+	"pkcs15-sign",
+	"pkcs15-decipher",
+	"set-security-env",
+	"compute-signature",
+	"decipher",
+	"transmit-apdu",
+	"reader-lock",
+	"sm-wrap",
+	"sm-unwrap",
+	"card",
+};
+
+static int latency_bucket(uint64_t us)
+{
+	int msb = 0;
+	int bucket;
+
+	if (us < LATENCY_SUB)
+		return (int)us;
+	while ((us >> msb) > 1)
+		msb++;
+	bucket = (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB
+		+ (int)((us >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+	return bucket < SC_LATENCY_BUCKETS ? bucket : SC_LATENCY_BUCKETS - 1;
+}
+
+/* Largest value that falls into the bucket */
+static unsigned long long latency_bucket_max(int bucket)
+{
+	int shift;
+
+	if (bucket < LATENCY_SUB)
+		return bucket;
+	shift = bucket / LATENCY_SUB - 1;
+	return ((unsigned long long)(LATENCY_SUB + bucket % LATENCY_SUB + 1) << shift) - 1;
+}
+
+int sc_latency_enable(sc_context_t *ctx, const char *file)
+{
+	if (ctx == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (ctx->latency != NULL)
+		return SC_SUCCESS;
+
+	ctx->latency = calloc(1, sizeof(*ctx->latency));
+	if (ctx->latency == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	if (file != NULL) {
+		ctx->latency->file = strdup(file);
+		if (ctx->latency->file == NULL) {
+			free(ctx->latency);
+			ctx->latency = NULL;
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+	}
+	sc_latency_reset(ctx);
+	return SC_SUCCESS;
+}
+
+void sc_latency_reset(sc_context_t *ctx)
+{
+	int i;
+
+	if (ctx == NULL || ctx->latency == NULL)
+		return;
+	memset(ctx->latency->hist, 0, sizeof(ctx->latency->hist));
+	for (i = 0; i < SC_LATENCY_OPS; i++)
+		ctx->latency->hist[i].min = ~0ULL;
+}
+
+void sc_latency_release(sc_context_t *ctx)
+{
+	FILE *out;
+
+	if (ctx == NULL || ctx->latency == NULL)
+		return;
+	if (ctx->latency->file != NULL) {
+		out = fopen(ctx->latency->file, "a");
+		if (out != NULL) {
+			fprintf(out, "# %s, process %lu\n", ctx->app_name ? ctx->app_name : "",
+					(unsigned long)getpid());
+			sc_latency_print(ctx, out);
+			fclose(out);
+		}
+		free(ctx->latency->file);
+	}
+	free(ctx->latency);
+	ctx->latency = NULL;
+}
+
+unsigned long long sc_latency_begin(sc_context_t *ctx)
+{
+	if (ctx == NULL || ctx->latency == NULL)
+		return 0;
+	return sc_monotonic_time_us();
+}
+
+void sc_latency_end(sc_context_t *ctx, int op, unsigned long long start)
+{
+	struct sc_latency_histogram *hist;
+	unsigned long long us, cur;
+
+	if (start == 0 || ctx == NULL || ctx->latency == NULL || op < 0 || op >= SC_LATENCY_OPS)
+		return;
+
+	us = sc_monotonic_time_us() - start;
+	hist = &ctx->latency->hist[op];
+	latency_add(&hist->count, 1);
+	latency_add(&hist->total, us);
+	latency_add(&hist->buckets[latency_bucket(us)], 1);
+	for (cur = latency_load(&hist->min); us < cur; cur = latency_load(&hist->min))
+		if (latency_cas(&hist->min, cur, us))
+			break;
+	for (cur = latency_load(&hist->max); us > cur; cur = latency_load(&hist->max))
+		if (latency_cas(&hist->max, cur, us))
+			break;
+}
+
+int sc_latency_get(sc_context_t *ctx, int op, struct sc_latency_histogram *hist)
+{
+	const struct sc_latency_histogram *src;
+	int i;
+
+	if (ctx == NULL || hist == NULL || op < 0 || op >= SC_LATENCY_OPS)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (ctx->latency == NULL)
+		return SC_ERROR_NOT_ALLOWED;
+
+	src = &ctx->latency->hist[op];
+	hist->count = latency_load(&src->count);
+	hist->total = latency_load(&src->total);
+	hist->min = latency_load(&src->min);
+	hist->max = latency_load(&src->max);
+	for (i = 0; i < SC_LATENCY_BUCKETS; i++)
+		hist->buckets[i] = latency_load(&src->buckets[i]);
+	if (hist->count == 0)
+		hist->min = 0;
+	return SC_SUCCESS;
+}
+
+const char *sc_latency_name(int op)
+{
+	if (op < 0 || op >= SC_LATENCY_OPS)
+		return NULL;
+	return latency_names[op];
+}
+
+unsigned long long sc_latency_percentile(const struct sc_latency_histogram *hist, double percent)
+{
+	unsigned long long seen = 0, rank;
+	int i;
+
+	if (hist == NULL || hist->count == 0)
+		return 0;
+	rank = (unsigned long long)(hist->count * percent / 100.0 + 0.5);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < SC_LATENCY_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	if (i == SC_LATENCY_BUCKETS || latency_bucket_max(i) > hist->max)
+		return hist->max;
+	return latency_bucket_max(i);
+}
+
+int sc_latency_print(sc_context_t *ctx, FILE *out)
+{
+	struct sc_latency_histogram hist;
+	int op, r;
+
+	if (out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	fprintf(out, "%-18s %10s %10s %10s %10s %10s %10s %10s\n", "operation (us)",
+			"count", "min", "mean", "p50", "p90", "p99", "max");
+	for (op = 0; op < SC_LATENCY_OPS; op++) {
+		r = sc_latency_get(ctx, op, &hist);
+		if (r != SC_SUCCESS)
+			return r;
+		if (hist.count == 0)
+			continue;
+		fprintf(out, "%-18s %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+				latency_names[op], hist.count, hist.min, hist.total / hist.count,
+				sc_latency_percentile(&hist, 50), sc_latency_percentile(&hist, 90),
+				sc_latency_percentile(&hist, 99), hist.max);
+	}
+	return SC_SUCCESS;
+}
@@ -65,9 +65,18 @@ enum {
 #define FILENAME __FILE__
 #endif
 
+/* Would a message of the level be logged? The logging macros test this
+ * before evaluating their arguments, so helpers like sc_dump_hex() or
+ * sc_print_path() in a log call cost nothing while debugging is off. */
+#define SC_LOG_ENABLED(ctx, level) ((ctx) != NULL && (ctx)->debug >= (level))
+
 #if defined(__GNUC__)
-#define sc_debug(ctx, level, format, args...)	sc_do_log(ctx, level, FILENAME, __LINE__, __FUNCTION__, format , ## args)
-#define sc_log(ctx, format, args...)   sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, FILENAME, __LINE__, __FUNCTION__, format , ## args)
+#define sc_debug(ctx, level, format, args...) \
+	(SC_LOG_ENABLED(ctx, level) ? \
+	 sc_do_log(ctx, level, FILENAME, __LINE__, __FUNCTION__, format , ## args) : (void)0)
+#define sc_log(ctx, format, args...) \
+	(SC_LOG_ENABLED(ctx, SC_LOG_DEBUG_NORMAL) ? \
+	 sc_do_log(ctx, SC_LOG_DEBUG_NORMAL, FILENAME, __LINE__, __FUNCTION__, format , ## args) : (void)0)
 #else
 #define sc_debug _sc_debug
 #define sc_log _sc_log
@@ -115,7 +124,8 @@ int sc_color_fprintf(int colors, struct sc_context *ctx, FILE * stream, const ch
  * @param[in] len   Length of \a data
  */
 #define sc_debug_hex(ctx, level, label, data, len) \
-    _sc_debug_hex(ctx, level, FILENAME, __LINE__, __FUNCTION__, label, data, len)
+    (SC_LOG_ENABLED(ctx, level) ? \
+     _sc_debug_hex(ctx, level, FILENAME, __LINE__, __FUNCTION__, label, data, len) : (void)0)
 #define sc_log_hex(ctx, label, data, len) \
     sc_debug_hex(ctx, SC_LOG_DEBUG_NORMAL, label, data, len)
 /** 
@@ -137,12 +147,15 @@ void sc_hex_dump(const u8 *buf, size_t len, char *out, size_t outlen);
 const char * sc_dump_hex(const u8 * in, size_t count);
 const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_FUNC_CALLED(ctx, level) do { \
-	 sc_do_log(ctx, level, FILENAME, __LINE__, __FUNCTION__, "called\n"); \
+	if (SC_LOG_ENABLED(ctx, level)) \
+		sc_do_log(ctx, level, FILENAME, __LINE__, __FUNCTION__, "called\n"); \
 } while (0)
 #define LOG_FUNC_CALLED(ctx) SC_FUNC_CALLED((ctx), SC_LOG_DEBUG_NORMAL)
 
 #define SC_FUNC_RETURN(ctx, level, r) do { \
 	int _ret = r; \
+	if (!SC_LOG_ENABLED(ctx, level)) \
+		return _ret; \
 	if (_ret <= 0) { \
 		sc_do_log_color(ctx, level, FILENAME, __LINE__, __FUNCTION__, _ret ? SC_COLOR_FG_RED : 0, \
 			"returning with: %d (%s)\n", _ret, sc_strerror(_ret)); \
@@ -157,8 +170,9 @@ const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_RET(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log_color(ctx, level, FILENAME, __LINE__, __FUNCTION__, SC_COLOR_FG_RED, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log_color(ctx, level, FILENAME, __LINE__, __FUNCTION__, SC_COLOR_FG_RED, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		return _ret; \
 	} \
 } while(0)
@@ -167,8 +181,9 @@ const char * sc_dump_oid(const struct sc_object_id *oid);
 #define SC_TEST_GOTO_ERR(ctx, level, r, text) do { \
 	int _ret = (r); \
 	if (_ret < 0) { \
-		sc_do_log_color(ctx, level, FILENAME, __LINE__, __FUNCTION__, SC_COLOR_FG_RED, \
-			"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
+		if (SC_LOG_ENABLED(ctx, level)) \
+			sc_do_log_color(ctx, level, FILENAME, __LINE__, __FUNCTION__, SC_COLOR_FG_RED, \
+				"%s: %d (%s)\n", (text), _ret, sc_strerror(_ret)); \
 		goto err; \
 	} \
 } while(0)
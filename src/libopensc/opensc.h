@@ -344,6 +344,8 @@ struct sc_ef_atr {
 	unsigned status;
 };
 
+#define SC_CACHE_MAX_FCI	8
+
 struct sc_card_cache {
 	struct sc_path current_path;
 
@@ -351,6 +353,15 @@ struct sc_card_cache {
         struct sc_file *current_df;
 
 	int valid;
+
+	/* Kept by iso7816_select_file() while the card is locked: the
+	 * absolute path selected last and the FCIs returned for some paths */
+	struct sc_path selected_path;
+	int selected;
+	int selected_sm_mode;
+	struct sc_path fci_path[SC_CACHE_MAX_FCI];
+	struct sc_file *fci[SC_CACHE_MAX_FCI];
+	size_t fci_next;
 };
 
 #define SC_PROTO_T0		0x00000001
@@ -576,6 +587,11 @@ struct sc_reader_operations {
 /* Card (or card driver) supports key unwrapping operations */
 #define SC_CARD_CAP_UNWRAP_KEY			0x00001000
 
+/* Card driver keeps the security environment of set_security_env() in its
+ * own memory and sends the key reference with every compute_signature(), so
+ * a batch of signatures with the same key may skip all but the first MSE */
+#define SC_CARD_CAP_KEEPS_SECURITY_ENV		0x00002000
+
 typedef struct sc_card {
 	struct sc_context *ctx;
 	struct sc_reader *reader;
@@ -866,10 +882,17 @@ typedef struct {
 #define SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER	0x00000008
 #define SC_CTX_FLAG_DISABLE_POPUPS			0x00000010
 #define SC_CTX_FLAG_DISABLE_COLORS			0x00000020
+#define SC_CTX_FLAG_CARD_DRIVER_MEMO			0x00000040
+#define SC_CTX_FLAG_DISABLE_SELECT_CACHE		0x00000080
+/** parse a configuration of the context's own, for callers that change it */
+#define SC_CTX_FLAG_PRIVATE_CONF			0x00000100
 
 typedef struct ossl3ctx ossl3ctx_t;
 
 typedef struct sc_context {
+	/* Compiled configuration, shared by the contexts of the process that
+	 * use the same configuration file. Not to be changed unless the
+	 * context was created with SC_CTX_FLAG_PRIVATE_CONF */
 	scconf_context *conf;
 	scconf_block *conf_blocks[3];
 	char *app_name;
@@ -895,6 +918,10 @@ typedef struct sc_context {
 	ossl3ctx_t *ossl3ctx;
 #endif
 
+	struct sc_latency_stats *latency;
+	struct sc_atr_index *atr_index;
+	struct sc_atr_memo *atr_memo;
+
 	unsigned int magic;
 } sc_context_t;
 
@@ -957,6 +984,90 @@ size_t sc_apdu_get_length(const sc_apdu_t *apdu, unsigned int proto);
 
 int sc_check_sw(struct sc_card *card, unsigned int sw1, unsigned int sw2);
 
+/* Operations timed by the latency statistics, see sc_latency_enable() */
+enum {
+	SC_LATENCY_PKCS11_LOCK,		/* waiting for the module or card lock */
+	SC_LATENCY_PKCS11_SIGN,		/* C_Sign(), C_SignFinal() */
+	SC_LATENCY_PKCS11_DECRYPT,	/* C_Decrypt() */
+	SC_LATENCY_HOST_CRYPTO,		/* hashing and verifying on the host */
+	SC_LATENCY_PKCS15_SIGN,		/* sc_pkcs15_compute_signature() */
+	SC_LATENCY_PKCS15_DECIPHER,	/* sc_pkcs15_decipher() */
+	SC_LATENCY_SET_SECURITY_ENV,	/* sc_set_security_env() */
+	SC_LATENCY_COMPUTE_SIGNATURE,	/* sc_compute_signature() */
+	SC_LATENCY_DECIPHER,		/* sc_decipher() */
+	SC_LATENCY_TRANSMIT_APDU,	/* sc_transmit_apdu() */
+	SC_LATENCY_READER_LOCK,		/* waiting for the reader, e.g. a PC/SC transaction */
+	SC_LATENCY_SM_WRAP,		/* secure messaging wrap of an APDU */
+	SC_LATENCY_SM_UNWRAP,		/* secure messaging unwrap of a response */
+	SC_LATENCY_CARD,		/* one APDU in the reader driver */
+	SC_LATENCY_OPS
+};
+
+#define SC_LATENCY_BUCKETS	256
+
+/* Latency histogram of one operation, all values in microseconds */
+struct sc_latency_histogram {
+	unsigned long long count;
+	unsigned long long total;
+	unsigned long long min, max;
+	unsigned long long buckets[SC_LATENCY_BUCKETS];
+};
+
+/**
+ * Starts timing the operations listed above for the context. The counters
+ * are updated atomically, so contexts used by several threads are fine, but
+ * this function must be called before the context is shared.
+ * @param  ctx   OpenSC context
+ * @param  file  if not NULL, the statistics are appended to this file when
+ *               the context is released
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_latency_enable(sc_context_t *ctx, const char *file);
+void sc_latency_reset(sc_context_t *ctx);
+
+/* Times an operation. sc_latency_begin() returns 0 if timing is off,
+ * which sc_latency_end() ignores. */
+unsigned long long sc_latency_begin(sc_context_t *ctx);
+void sc_latency_end(sc_context_t *ctx, int op, unsigned long long start);
+
+/**
+ * Copies the histogram of an operation.
+ * @param  op    one of SC_LATENCY_*
+ * @return SC_SUCCESS, or SC_ERROR_NOT_ALLOWED if timing is off
+ */
+int sc_latency_get(sc_context_t *ctx, int op, struct sc_latency_histogram *hist);
+const char *sc_latency_name(int op);
+/** Upper bound of the given percentile, within the 12.5 % bucket precision */
+unsigned long long sc_latency_percentile(const struct sc_latency_histogram *hist, double percent);
+/** Prints count, min, mean, p50, p90, p99 and max of every timed operation */
+int sc_latency_print(sc_context_t *ctx, FILE *out);
+
+/**
+ * Starts recording transmitted APDUs in a ring buffer shared by all contexts
+ * of the process. Records hold the time, reader, header, Lc, Le, status word,
+ * duration and whether secure messaging was used. Command data is dropped
+ * unless @a keep_data is set; data of PIN commands is always dropped.
+ * Only the first call configures the ring, later calls are ignored.
+ * @param  records    number of records kept, 0 leaves tracing off
+ * @param  keep_data  keep the first bytes of the command data
+ * @param  dump_file  if not NULL, SIGUSR2 writes the ring to this file,
+ *                    unless the application handles SIGUSR2 itself
+ * @return SC_SUCCESS on success and an error code otherwise
+ */
+int sc_apdu_trace_enable(size_t records, int keep_data, const char *dump_file);
+
+/**
+ * Prints the recorded APDUs from the oldest to the newest one.
+ * @return number of records printed or an error code
+ */
+int sc_apdu_trace_print(FILE *out);
+
+/**
+ * Prints the APDUs of a file written on SIGUSR2, see sc_apdu_trace_enable().
+ * @return number of records printed or an error code
+ */
+int sc_apdu_trace_print_file(const char *filename, FILE *out);
+
 /********************************************************************/
 /*                  opensc context functions                        */
 /********************************************************************/
@@ -1576,12 +1687,39 @@ int sc_base64_decode(const char *in, u8 *out, size_t outlen);
  * @param  len  length of the memory buffer
  */
 void sc_mem_clear(void *ptr, size_t len);
+/**
+ * Allocates zeroed memory for secrets that is locked in memory if
+ * possible. Small buffers share pools that are locked once.
+ * @param  len  length of the memory buffer
+ * @return pointer to the memory or NULL if out of memory
+ */
 void *sc_mem_secure_alloc(size_t len);
+/**
+ * Wipes and frees memory of sc_mem_secure_alloc()
+ * @param  ptr  pointer to the memory buffer
+ * @param  len  length that was allocated
+ */
 void sc_mem_secure_free(void *ptr, size_t len);
-#define sc_mem_secure_clear_free(ptr, len) do { \
-	sc_mem_clear(ptr, len); \
-	sc_mem_secure_free(ptr, len); \
-} while (0);
+#define sc_mem_secure_clear_free(ptr, len) sc_mem_secure_free(ptr, len)
+
+struct sc_mem_secure_stats {
+	unsigned long allocs;		/* allocations that succeeded */
+	unsigned long pool_allocs;	/* of those served from the pools */
+	unsigned long page_allocs;	/* of those with pages of their own */
+	unsigned long frees;
+	unsigned long pools;		/* pools in use */
+	unsigned long lock_failures;	/* pools that could not be locked */
+	size_t pool_bytes;		/* size of the pools */
+	size_t pool_locked_bytes;	/* of that locked in memory */
+	size_t pool_used_bytes;		/* handed out, in whole units */
+	size_t pool_peak_bytes;		/* highest pool_used_bytes so far */
+};
+
+/**
+ * Returns usage statistics of sc_mem_secure_alloc() in this process
+ * @param  stats  receives the statistics
+ */
+int sc_mem_secure_get_stats(struct sc_mem_secure_stats *stats);
 int sc_mem_reverse(unsigned char *buf, size_t len);
 
 int sc_get_cache_dir(sc_context_t *ctx, char *buf, size_t bufsize);
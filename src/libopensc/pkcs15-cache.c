@@ -22,6 +22,7 @@
 #include "config.h"
 #endif
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,18 +30,32 @@
 #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
 #include "internal.h"
 #include "pkcs15.h"
+#include "common/compat_strlcat.h"
 #include "common/compat_strlcpy.h"
 
 #define RANDOM_UID_INDICATOR 0x08
+/* The file name ends with a key of the path, starting at key_offset;
+ * the part before it identifies the token. */
 static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 				   const sc_path_t *path,
-				   char *buf, size_t bufsize)
+				   char *buf, size_t bufsize,
+				   size_t *key_offset)
 {
 	char dir[PATH_MAX];
 	char *last_update = NULL;
@@ -72,6 +87,8 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 					p15card->card->uid.value,
 					p15card->card->uid.len), last_update);
 	}
+	if (key_offset)
+		*key_offset = strlen(dir);
 
 	if (path->aid.len &&
 		(path->type == SC_PATH_TYPE_FILE_ID || path->type == SC_PATH_TYPE_PATH))   {
@@ -102,6 +119,324 @@ static int generate_cache_filename(struct sc_pkcs15_card *p15card,
 	return SC_SUCCESS;
 }
 
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * Pack backend (file_cache_pack): all cached files of a token are kept in
+ * one "<token>.pack" file, which is mapped read-only. The file starts with
+ * an index of the file keys sorted by name, followed by the contents.
+ * Updates write a complete new pack next to the old one and rename it
+ * over, so concurrent readers always map a consistent pack.
+ */
+#define PACK_MAGIC	"OSC15PAK"
+#define PACK_VERSION	1
+#define PACK_SUFFIX	".pack"
+#define PACK_KEY_SIZE	88
+#define PACK_MAX_FILES	1024
+
+struct pack_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
+struct pack_entry {
+	char key[PACK_KEY_SIZE];
+	uint32_t offset, len;
+};
+
+struct sc_pkcs15_cache_pack {
+	char fname[PATH_MAX];
+	u8 *map;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	const struct pack_entry *entries;
+	uint32_t count;
+};
+
+static void pack_unmap(struct sc_pkcs15_cache_pack *pack)
+{
+	if (pack->map)
+		munmap(pack->map, pack->size);
+	pack->map = NULL;
+	pack->size = 0;
+	pack->entries = NULL;
+	pack->count = 0;
+}
+
+static int pack_map(struct sc_pkcs15_cache_pack *pack)
+{
+	const struct pack_header *header;
+	struct stat stbuf;
+	void *map;
+	uint32_t i;
+	int fd;
+
+	fd = open(pack->fname, O_RDONLY);
+	if (fd < 0)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fd, &stbuf) || (size_t)stbuf.st_size < sizeof(*header)) {
+		close(fd);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	map = mmap(NULL, (size_t)stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return SC_ERROR_FILE_NOT_FOUND;
+
+	pack->map = map;
+	pack->size = (size_t)stbuf.st_size;
+	pack->dev = stbuf.st_dev;
+	pack->ino = stbuf.st_ino;
+
+	header = map;
+	if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != PACK_VERSION
+			|| header->count > PACK_MAX_FILES
+			|| sizeof(*header) + header->count * sizeof(struct pack_entry) > pack->size)
+		goto corrupted;
+	pack->entries = (const struct pack_entry *)(header + 1);
+	for (i = 0; i < header->count; i++) {
+		const struct pack_entry *e = &pack->entries[i];
+
+		if (memchr(e->key, '\0', sizeof(e->key)) == NULL
+				|| (size_t)e->offset + e->len > pack->size
+				|| (i > 0 && strcmp(pack->entries[i - 1].key, e->key) >= 0))
+			goto corrupted;
+	}
+	pack->count = header->count;
+	return SC_SUCCESS;
+
+corrupted:
+	pack_unmap(pack);
+	return SC_ERROR_CORRUPTED_DATA;
+}
+
+/* Remaps the pack if it was replaced by another process */
+static void pack_refresh(struct sc_pkcs15_cache_pack *pack)
+{
+	struct stat stbuf;
+
+	if (stat(pack->fname, &stbuf) != 0) {
+		pack_unmap(pack);
+		return;
+	}
+	if (pack->map && stbuf.st_dev == pack->dev && stbuf.st_ino == pack->ino)
+		return;
+	pack_unmap(pack);
+	pack_map(pack);
+}
+
+/* Returns the pack of the token, the file name is cut at key_offset */
+static struct sc_pkcs15_cache_pack *
+pack_open(struct sc_pkcs15_card *p15card, const char *fname, size_t key_offset)
+{
+	struct sc_pkcs15_cache_pack *pack = p15card->cache_pack;
+	char pname[PATH_MAX];
+
+	if (key_offset + sizeof(PACK_SUFFIX) > sizeof(pname))
+		return NULL;
+	memcpy(pname, fname, key_offset);
+	memcpy(pname + key_offset, PACK_SUFFIX, sizeof(PACK_SUFFIX));
+
+	if (pack == NULL) {
+		pack = calloc(1, sizeof(*pack));
+		if (pack == NULL)
+			return NULL;
+		p15card->cache_pack = pack;
+	}
+	if (strcmp(pack->fname, pname) != 0) {
+		pack_unmap(pack);
+		strlcpy(pack->fname, pname, sizeof(pack->fname));
+		pack_map(pack);
+	}
+	return pack;
+}
+
+static const struct pack_entry *
+pack_find(const struct sc_pkcs15_cache_pack *pack, const char *key)
+{
+	uint32_t lo = 0, hi = pack->count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int c = strcmp(key, pack->entries[mid].key);
+
+		if (c == 0)
+			return &pack->entries[mid];
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+static int pack_read_file(struct sc_pkcs15_card *p15card, const char *fname, size_t key_offset,
+		const sc_path_t *path, u8 **buf, size_t *bufsize)
+{
+	struct sc_pkcs15_cache_pack *pack;
+	const struct pack_entry *entry;
+	const u8 *content;
+	size_t count, size;
+	u8 *data;
+
+	pack = pack_open(p15card, fname, key_offset);
+	if (pack == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	entry = pack_find(pack, fname + key_offset);
+	if (entry == NULL) {
+		pack_refresh(pack);
+		entry = pack_find(pack, fname + key_offset);
+	}
+	if (entry == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	sc_log(p15card->card->ctx, "read cached file %s from %s", fname + key_offset, pack->fname);
+
+	content = pack->map + entry->offset;
+	size = entry->len;
+	if (path->count < 0) {
+		count = size;
+	}
+	else {
+		count = path->count;
+		if (path->index + count > size)
+			return SC_ERROR_FILE_NOT_FOUND; /* cache file bad? */
+		content += path->index;
+	}
+
+	if (*buf == NULL) {
+		data = malloc(count ? count : 1);
+		if (data == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+	}
+	else {
+		if (count > *bufsize)
+			return SC_ERROR_BUFFER_TOO_SMALL;
+		data = *buf;
+	}
+	memcpy(data, content, count);
+	*buf = data;
+	*bufsize = count;
+	return SC_SUCCESS;
+}
+
+static int pack_cache_file(struct sc_pkcs15_card *p15card, const char *fname, size_t key_offset,
+		const u8 *buf, size_t bufsize)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct sc_pkcs15_cache_pack *pack;
+	struct pack_entry *entries = NULL;
+	const u8 **contents = NULL;
+	struct pack_header header;
+	const char *key = fname + key_offset;
+	char tmpname[PATH_MAX + 32];
+	uint32_t i, n, pos;
+	size_t offset;
+	FILE *f = NULL;
+	int r;
+
+	if (strlen(key) >= PACK_KEY_SIZE)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	pack = pack_open(p15card, fname, key_offset);
+	if (pack == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	/* Keep the files other processes added in the meantime */
+	pack_refresh(pack);
+
+	/* The new index, with the entry inserted or replaced */
+	entries = calloc(pack->count + 1, sizeof(*entries));
+	contents = calloc(pack->count + 1, sizeof(*contents));
+	if (entries == NULL || contents == NULL) {
+		r = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	for (i = 0, n = 0, pos = UINT32_MAX; i < pack->count; i++) {
+		int c = strcmp(key, pack->entries[i].key);
+
+		if (c == 0)
+			continue;
+		if (c < 0 && pos == UINT32_MAX)
+			pos = n++;
+		entries[n] = pack->entries[i];
+		contents[n++] = pack->map + pack->entries[i].offset;
+	}
+	if (pos == UINT32_MAX)
+		pos = n++;
+	if (n > PACK_MAX_FILES) {
+		r = SC_ERROR_NOT_ENOUGH_MEMORY;
+		goto err;
+	}
+	strlcpy(entries[pos].key, key, sizeof(entries[pos].key));
+	entries[pos].len = (uint32_t)bufsize;
+	contents[pos] = buf;
+
+	offset = sizeof(header) + n * sizeof(*entries);
+	for (i = 0; i < n; i++) {
+		if (offset + entries[i].len > UINT32_MAX) {
+			r = SC_ERROR_NOT_ENOUGH_MEMORY;
+			goto err;
+		}
+		entries[i].offset = (uint32_t)offset;
+		offset += entries[i].len;
+	}
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.version = PACK_VERSION;
+	header.count = n;
+
+	f = sc_open_cache_tmp(ctx, pack->fname, tmpname, sizeof(tmpname));
+	if (f == NULL) {
+		r = SC_SUCCESS;
+		goto err;
+	}
+	r = SC_ERROR_INTERNAL;
+	if (fwrite(&header, sizeof(header), 1, f) != 1
+			|| fwrite(entries, sizeof(*entries), n, f) != n)
+		goto err;
+	for (i = 0; i < n; i++)
+		if (entries[i].len && fwrite(contents[i], 1, entries[i].len, f) != entries[i].len)
+			goto err;
+	if (fclose(f) != 0) {
+		f = NULL;
+		goto err;
+	}
+	f = NULL;
+	if (rename(tmpname, pack->fname) != 0) {
+		sc_log(ctx, "rename() of %s failed: %s", tmpname, strerror(errno));
+		goto err;
+	}
+	pack_unmap(pack);
+	pack_map(pack);
+	r = SC_SUCCESS;
+
+err:
+	if (f) {
+		fclose(f);
+		unlink(tmpname);
+	} else if (r == SC_ERROR_INTERNAL) {
+		unlink(tmpname);
+	}
+	free(contents);
+	free(entries);
+	return r;
+}
+
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card)
+{
+	sc_pkcs15_shared_cache_release(p15card);
+	if (p15card->cache_pack) {
+		pack_unmap(p15card->cache_pack);
+		free(p15card->cache_pack);
+		p15card->cache_pack = NULL;
+	}
+}
+#else
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card)
+{
+	sc_pkcs15_shared_cache_release(p15card);
+}
+#endif
+
 int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 				const sc_path_t *path,
 				u8 **buf, size_t *bufsize)
@@ -109,7 +444,7 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 	char fname[PATH_MAX];
 	int rv;
 	FILE *f;
-	size_t count;
+	size_t count, key_offset;
 	struct stat stbuf;
 	u8 *data = NULL;
 
@@ -121,9 +456,13 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 		return SC_ERROR_INVALID_ARGUMENTS;
 
 	sc_log(p15card->card->ctx, "try to read cache for %s", sc_print_path(path));
-	rv = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	rv = generate_cache_filename(p15card, path, fname, sizeof(fname), &key_offset);
 	if (rv != SC_SUCCESS)
 		return rv;
+#ifdef HAVE_SYS_MMAN_H
+	if (p15card->use_file_cache_pack)
+		return pack_read_file(p15card, fname, key_offset, path, buf, bufsize);
+#endif
 	sc_log(p15card->card->ctx, "read cached file %s", fname);
 
 	f = fopen(fname, "rb");
@@ -192,11 +531,15 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 	char fname[PATH_MAX];
 	int r;
 	FILE *f;
-	size_t c;
+	size_t c, key_offset;
 
-	r = generate_cache_filename(p15card, path, fname, sizeof(fname));
+	r = generate_cache_filename(p15card, path, fname, sizeof(fname), &key_offset);
 	if (r != 0)
 		return r;
+#ifdef HAVE_SYS_MMAN_H
+	if (p15card->use_file_cache_pack)
+		return pack_cache_file(p15card, fname, key_offset, buf, bufsize);
+#endif
 
 	f = fopen(fname, "wb");
 	/* If the open failed because the cache directory does
@@ -221,3 +564,900 @@ int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 	}
 	return 0;
 }
+
+/*
+ * Snapshot of the decoded object directory files (PrKDF, PuKDF, SKDF,
+ * CDF, DODF and AODF) of an application. It is stored next to the
+ * cached files and keyed the same way, so a card with a new lastUpdate
+ * never sees an old snapshot. The objects are stored as their in-memory
+ * structures with the pointers replaced by length prefixed blobs; the
+ * header records the structure sizes, so a snapshot written by another
+ * build is simply ignored.
+ */
+#define SNAPSHOT_MAGIC		"OSC15OBJ"
+#define SNAPSHOT_VERSION	1
+#define SNAPSHOT_SUFFIX		"_objects"
+#define SNAPSHOT_MAX_SIZE	(1024 * 1024)
+
+struct snapshot_buf {
+	u8 *data;
+	size_t len, size;
+	int error;
+};
+
+struct snapshot_reader {
+	const u8 *p;
+	size_t left;
+};
+
+static uint32_t snapshot_checksum(const u8 *data, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len--) {
+		h ^= *data++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static void snapshot_put(struct snapshot_buf *b, const void *data, size_t len)
+{
+	if (b->error)
+		return;
+	if (b->len + len > b->size) {
+		size_t size = b->size ? b->size : 4096;
+		u8 *p;
+
+		while (size < b->len + len)
+			size *= 2;
+		if (size > SNAPSHOT_MAX_SIZE) {
+			b->error = 1;
+			return;
+		}
+		p = realloc(b->data, size);
+		if (p == NULL) {
+			b->error = 1;
+			return;
+		}
+		b->data = p;
+		b->size = size;
+	}
+	if (len)
+		memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void snapshot_put_u32(struct snapshot_buf *b, uint32_t v)
+{
+	snapshot_put(b, &v, sizeof(v));
+}
+
+static void snapshot_put_blob(struct snapshot_buf *b, const void *data, size_t len)
+{
+	if (data == NULL)
+		len = 0;
+	snapshot_put_u32(b, (uint32_t)len);
+	snapshot_put(b, data, len);
+}
+
+static int snapshot_get(struct snapshot_reader *r, void *data, size_t len)
+{
+	if (len > r->left)
+		return -1;
+	memcpy(data, r->p, len);
+	r->p += len;
+	r->left -= len;
+	return 0;
+}
+
+static int snapshot_get_u32(struct snapshot_reader *r, uint32_t *v)
+{
+	return snapshot_get(r, v, sizeof(*v));
+}
+
+/* Reads a blob into a newly allocated buffer; an empty blob gives NULL */
+static int snapshot_get_blob(struct snapshot_reader *r, void *data, size_t *len)
+{
+	uint32_t l;
+	u8 *p = NULL;
+
+	if (snapshot_get_u32(r, &l) || l > r->left)
+		return -1;
+	if (l) {
+		p = malloc(l);
+		if (p == NULL)
+			return -1;
+		snapshot_get(r, p, l);
+	}
+	*(u8 **)data = p;
+	*len = l;
+	return 0;
+}
+
+static void snapshot_put_header(struct snapshot_buf *b, struct sc_pkcs15_card *p15card)
+{
+	snapshot_put(b, SNAPSHOT_MAGIC, 8);
+	snapshot_put_u32(b, SNAPSHOT_VERSION);
+	snapshot_put_u32(b, sizeof(struct sc_pkcs15_object));
+	snapshot_put_u32(b, sizeof(struct sc_pkcs15_prkey_info));
+	snapshot_put_u32(b, sizeof(struct sc_pkcs15_pubkey_info));
+	snapshot_put_u32(b, sizeof(struct sc_pkcs15_skey_info));
+	snapshot_put_u32(b, sizeof(struct sc_pkcs15_cert_info));
+	snapshot_put_u32(b, sizeof(struct sc_pkcs15_data_info));
+	snapshot_put_u32(b, sizeof(struct sc_pkcs15_auth_info));
+	snapshot_put_u32(b, sizeof(struct sc_auxiliary_data));
+	snapshot_put_u32(b, sizeof(struct sc_path));
+	/* Certificates are decoded depending on this option */
+	snapshot_put_u32(b, (uint32_t)p15card->opts.private_certificate);
+}
+
+static int snapshot_filename(struct sc_pkcs15_card *p15card, char *buf, size_t bufsize)
+{
+	int r;
+
+	if (p15card->file_app == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	r = generate_cache_filename(p15card, &p15card->file_app->path, buf, bufsize, NULL);
+	if (r != SC_SUCCESS)
+		return r;
+	if (strlcat(buf, SNAPSHOT_SUFFIX, bufsize) >= bufsize)
+		return SC_ERROR_BUFFER_TOO_SMALL;
+	return SC_SUCCESS;
+}
+
+/* Whether the objects of the DF can go into the snapshot */
+static int snapshot_df(struct sc_pkcs15_df *df)
+{
+	return df->enumerated && df->parsed;
+}
+
+static void snapshot_put_object(struct snapshot_buf *b, struct sc_pkcs15_object *obj)
+{
+	struct sc_pkcs15_object o = *obj;
+
+	o.data = o.emulated = NULL;
+	o.df = NULL;
+	o.next = o.prev = NULL;
+	o.content.value = NULL;
+	snapshot_put(b, &o, sizeof(o));
+	/* The content holds the cached PIN for auth objects */
+	if ((obj->type & SC_PKCS15_TYPE_CLASS_MASK) == SC_PKCS15_TYPE_PUBKEY)
+		snapshot_put_blob(b, obj->content.value, obj->content.len);
+	else
+		snapshot_put_blob(b, NULL, 0);
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		struct sc_pkcs15_prkey_info info = *(struct sc_pkcs15_prkey_info *)obj->data;
+
+		info.subject.value = NULL;
+		info.params.data = NULL;
+		info.params.free_params = NULL;
+		info.aux_data = NULL;
+		snapshot_put(b, &info, sizeof(info));
+		info = *(struct sc_pkcs15_prkey_info *)obj->data;
+		snapshot_put_blob(b, info.subject.value, info.subject.len);
+		/* Only the flat GOST parameters are decoded from the PrKDF */
+		if (info.params.free_params != NULL)
+			b->error = 1;
+		snapshot_put_blob(b, info.params.data, info.params.len);
+		snapshot_put_blob(b, info.aux_data, info.aux_data ? sizeof(*info.aux_data) : 0);
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		struct sc_pkcs15_pubkey_info info = *(struct sc_pkcs15_pubkey_info *)obj->data;
+
+		info.subject.value = NULL;
+		info.params.data = NULL;
+		info.params.free_params = NULL;
+		info.direct.raw.value = NULL;
+		info.direct.spki.value = NULL;
+		snapshot_put(b, &info, sizeof(info));
+		info = *(struct sc_pkcs15_pubkey_info *)obj->data;
+		snapshot_put_blob(b, info.subject.value, info.subject.len);
+		if (info.params.free_params != NULL)
+			b->error = 1;
+		snapshot_put_blob(b, info.params.data, info.params.len);
+		snapshot_put_blob(b, info.direct.raw.value, info.direct.raw.len);
+		snapshot_put_blob(b, info.direct.spki.value, info.direct.spki.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_SKEY: {
+		struct sc_pkcs15_skey_info info = *(struct sc_pkcs15_skey_info *)obj->data;
+
+		info.data.value = NULL;
+		snapshot_put(b, &info, sizeof(info));
+		info = *(struct sc_pkcs15_skey_info *)obj->data;
+		snapshot_put_blob(b, info.data.value, info.data.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT: {
+		struct sc_pkcs15_cert_info info = *(struct sc_pkcs15_cert_info *)obj->data;
+
+		info.value.value = NULL;
+		info.value_data = NULL;
+		snapshot_put(b, &info, sizeof(info));
+		info = *(struct sc_pkcs15_cert_info *)obj->data;
+		snapshot_put_blob(b, info.value.value, info.value.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		struct sc_pkcs15_data_info info = *(struct sc_pkcs15_data_info *)obj->data;
+
+		info.data.value = NULL;
+		snapshot_put(b, &info, sizeof(info));
+		info = *(struct sc_pkcs15_data_info *)obj->data;
+		snapshot_put_blob(b, info.data.value, info.data.len);
+		break;
+	}
+	case SC_PKCS15_TYPE_AUTH: {
+		struct sc_pkcs15_auth_info info = *(struct sc_pkcs15_auth_info *)obj->data;
+
+		/* The PIN state is not part of the AODF */
+		info.tries_left = -1;
+		info.logged_in = SC_PIN_STATE_UNKNOWN;
+		snapshot_put(b, &info, sizeof(info));
+		break;
+	}
+	default:
+		if (obj->data != NULL)
+			b->error = 1;
+	}
+}
+
+static struct sc_pkcs15_object *
+snapshot_get_object(struct snapshot_reader *r)
+{
+	struct sc_pkcs15_object *obj;
+	void *data = NULL;
+	int rv = -1;
+
+	obj = calloc(1, sizeof(*obj));
+	if (obj == NULL)
+		return NULL;
+	if (snapshot_get(r, obj, sizeof(*obj))
+			|| snapshot_get_blob(r, &obj->content.value, &obj->content.len)) {
+		obj->content.value = NULL;
+		free(obj);
+		return NULL;
+	}
+	obj->label[sizeof(obj->label) - 1] = '\0';
+
+	switch (obj->type & SC_PKCS15_TYPE_CLASS_MASK) {
+	case SC_PKCS15_TYPE_PRKEY: {
+		struct sc_pkcs15_prkey_info *info = calloc(1, sizeof(*info));
+		size_t aux_len = 0;
+
+		data = info;
+		if (info == NULL || snapshot_get(r, info, sizeof(*info)))
+			break;
+		info->subject.value = NULL;
+		info->params.data = NULL;
+		info->params.free_params = NULL;
+		info->aux_data = NULL;
+		if (snapshot_get_blob(r, &info->subject.value, &info->subject.len)
+				|| snapshot_get_blob(r, &info->params.data, &info->params.len)
+				|| snapshot_get_blob(r, &info->aux_data, &aux_len))
+			break;
+		if (aux_len != 0 && aux_len != sizeof(*info->aux_data))
+			break;
+		rv = 0;
+		break;
+	}
+	case SC_PKCS15_TYPE_PUBKEY: {
+		struct sc_pkcs15_pubkey_info *info = calloc(1, sizeof(*info));
+
+		data = info;
+		if (info == NULL || snapshot_get(r, info, sizeof(*info)))
+			break;
+		info->subject.value = NULL;
+		info->params.data = NULL;
+		info->params.free_params = NULL;
+		info->direct.raw.value = NULL;
+		info->direct.spki.value = NULL;
+		if (snapshot_get_blob(r, &info->subject.value, &info->subject.len)
+				|| snapshot_get_blob(r, &info->params.data, &info->params.len)
+				|| snapshot_get_blob(r, &info->direct.raw.value, &info->direct.raw.len)
+				|| snapshot_get_blob(r, &info->direct.spki.value, &info->direct.spki.len))
+			break;
+		rv = 0;
+		break;
+	}
+	case SC_PKCS15_TYPE_SKEY: {
+		struct sc_pkcs15_skey_info *info = calloc(1, sizeof(*info));
+
+		data = info;
+		if (info == NULL || snapshot_get(r, info, sizeof(*info)))
+			break;
+		info->data.value = NULL;
+		if (snapshot_get_blob(r, &info->data.value, &info->data.len))
+			break;
+		rv = 0;
+		break;
+	}
+	case SC_PKCS15_TYPE_CERT: {
+		struct sc_pkcs15_cert_info *info = calloc(1, sizeof(*info));
+
+		data = info;
+		if (info == NULL || snapshot_get(r, info, sizeof(*info)))
+			break;
+		info->value.value = NULL;
+		info->value_data = NULL;
+		if (snapshot_get_blob(r, &info->value.value, &info->value.len))
+			break;
+		rv = 0;
+		break;
+	}
+	case SC_PKCS15_TYPE_DATA_OBJECT: {
+		struct sc_pkcs15_data_info *info = calloc(1, sizeof(*info));
+
+		data = info;
+		if (info == NULL || snapshot_get(r, info, sizeof(*info)))
+			break;
+		info->data.value = NULL;
+		if (snapshot_get_blob(r, &info->data.value, &info->data.len))
+			break;
+		rv = 0;
+		break;
+	}
+	case SC_PKCS15_TYPE_AUTH: {
+		struct sc_pkcs15_auth_info *info = calloc(1, sizeof(*info));
+
+		data = info;
+		if (info == NULL || snapshot_get(r, info, sizeof(*info)))
+			break;
+		rv = 0;
+		break;
+	}
+	default:
+		/* Objects left undecoded, like ignored private certificates */
+		rv = 0;
+	}
+
+	obj->data = data;
+	obj->emulated = NULL;
+	obj->df = NULL;
+	obj->next = obj->prev = NULL;
+	if (rv != 0) {
+		if (data == NULL)
+			obj->type = 0;
+		sc_pkcs15_free_object(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+/*
+ * Serializes the objects of all DFs parsed so far. Session objects and
+ * the objects of DFs that could not be parsed completely are left out.
+ */
+static int snapshot_build(struct sc_pkcs15_card *p15card, struct snapshot_buf *b)
+{
+	struct sc_pkcs15_df *df;
+	struct sc_pkcs15_object *obj;
+	uint32_t count, idx;
+
+	memset(b, 0, sizeof(*b));
+	snapshot_put_header(b, p15card);
+
+	for (count = 0, df = p15card->df_list; df; df = df->next)
+		if (snapshot_df(df))
+			count++;
+	snapshot_put_u32(b, count);
+	for (df = p15card->df_list; df; df = df->next) {
+		if (!snapshot_df(df))
+			continue;
+		snapshot_put_u32(b, df->type);
+		snapshot_put(b, &df->path, sizeof(df->path));
+	}
+
+	for (count = 0, obj = p15card->obj_list; obj; obj = obj->next)
+		if (obj->df && !obj->session_object && snapshot_df(obj->df))
+			count++;
+	snapshot_put_u32(b, count);
+	for (obj = p15card->obj_list; obj; obj = obj->next) {
+		if (!obj->df || obj->session_object || !snapshot_df(obj->df))
+			continue;
+		for (idx = 0, df = p15card->df_list; df != obj->df; df = df->next)
+			if (snapshot_df(df))
+				idx++;
+		snapshot_put_u32(b, idx);
+		snapshot_put_object(b, obj);
+	}
+	snapshot_put_u32(b, b->error ? 0 : snapshot_checksum(b->data, b->len));
+
+	if (b->error) {
+		sc_log(p15card->card->ctx, "Cannot create object snapshot");
+		free(b->data);
+		b->data = NULL;
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	return SC_SUCCESS;
+}
+
+/*
+ * Adds the objects of the snapshot to the card and marks their DFs as
+ * enumerated. The snapshot is used only if each of its DFs is still in
+ * the DF list and has not been enumerated yet.
+ */
+static int snapshot_load(struct sc_pkcs15_card *p15card, const u8 *data, size_t len,
+		const char *name)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct snapshot_buf header;
+	struct snapshot_reader r;
+	struct sc_pkcs15_df **dfs = NULL, *df;
+	struct sc_pkcs15_object *objects = NULL, *obj, *next;
+	uint32_t df_count, obj_count, i, type, idx, sum;
+	struct sc_path path;
+	int rv;
+
+	if (len < 4)
+		return SC_ERROR_CORRUPTED_DATA;
+	memset(&header, 0, sizeof(header));
+	snapshot_put_header(&header, p15card);
+	rv = SC_ERROR_CORRUPTED_DATA;
+	memcpy(&sum, data + len - 4, 4);
+	if (header.error || len < header.len + 4
+			|| memcmp(data, header.data, header.len) != 0
+			|| sum != snapshot_checksum(data, len - 4)) {
+		sc_log(ctx, "object snapshot %s is outdated or corrupted", name);
+		goto err;
+	}
+	r.p = data + header.len;
+	r.left = len - header.len - 4;
+
+	if (snapshot_get_u32(&r, &df_count) || df_count > r.left)
+		goto err;
+	dfs = calloc(df_count + 1, sizeof(*dfs));
+	if (dfs == NULL) {
+		rv = SC_ERROR_OUT_OF_MEMORY;
+		goto err;
+	}
+	for (i = 0; i < df_count; i++) {
+		if (snapshot_get_u32(&r, &type) || snapshot_get(&r, &path, sizeof(path)))
+			goto err;
+		for (df = p15card->df_list; df; df = df->next)
+			if (df->type == type && !df->enumerated && sc_compare_path(&df->path, &path))
+				break;
+		if (df == NULL) {
+			sc_log(ctx, "object snapshot %s does not match the DFs", name);
+			goto err;
+		}
+		dfs[i] = df;
+	}
+
+	if (snapshot_get_u32(&r, &obj_count))
+		goto err;
+	for (i = 0; i < obj_count; i++) {
+		if (snapshot_get_u32(&r, &idx) || idx >= df_count)
+			goto err;
+		obj = snapshot_get_object(&r);
+		if (obj == NULL)
+			goto err;
+		obj->df = dfs[idx];
+		obj->next = objects;
+		objects = obj;
+	}
+	if (r.left != 0)
+		goto err;
+
+	/* The objects were collected in reverse order */
+	for (obj = objects, objects = NULL; obj; obj = next) {
+		next = obj->next;
+		obj->next = objects;
+		objects = obj;
+	}
+	for (obj = objects; obj; obj = next) {
+		next = obj->next;
+		sc_pkcs15_add_object(p15card, obj);
+	}
+	objects = NULL;
+	for (i = 0; i < df_count; i++) {
+		dfs[i]->enumerated = 1;
+		dfs[i]->parsed = 1;
+	}
+	sc_log(ctx, "%u objects of %u DFs read from snapshot %s", obj_count, df_count, name);
+	rv = SC_SUCCESS;
+
+err:
+	for (obj = objects; obj; obj = next) {
+		next = obj->next;
+		sc_pkcs15_free_object(obj);
+	}
+	free(dfs);
+	free(header.data);
+	return rv;
+}
+
+/* The snapshot is written next to the old one and renamed over it, so that
+ * other processes binding the card meanwhile never read a partial file */
+int sc_pkcs15_cache_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_context *ctx = p15card->card->ctx;
+	struct snapshot_buf b;
+	char fname[PATH_MAX], tmpname[PATH_MAX + 32];
+	FILE *f;
+	size_t c;
+	int r;
+
+	r = snapshot_filename(p15card, fname, sizeof(fname));
+	if (r != SC_SUCCESS)
+		return r;
+	r = snapshot_build(p15card, &b);
+	if (r != SC_SUCCESS)
+		return r;
+
+	f = sc_open_cache_tmp(ctx, fname, tmpname, sizeof(tmpname));
+	if (f == NULL) {
+		free(b.data);
+		return 0;
+	}
+
+	c = fwrite(b.data, 1, b.len, f);
+	free(b.data);
+	if (fclose(f) != 0 || c != b.len) {
+		sc_log(ctx, "fwrite() wrote only %"SC_FORMAT_LEN_SIZE_T"u bytes", c);
+		remove(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+	if (rename(tmpname, fname) != 0) {
+		sc_log(ctx, "rename() of %s failed: %s", tmpname, strerror(errno));
+		remove(tmpname);
+		return SC_ERROR_INTERNAL;
+	}
+	sc_log(ctx, "object snapshot %s written", fname);
+	return 0;
+}
+
+int sc_pkcs15_read_cached_objects(struct sc_pkcs15_card *p15card)
+{
+	char fname[PATH_MAX];
+	u8 *data = NULL;
+	size_t len;
+	struct stat stbuf;
+	FILE *f;
+	int rv;
+
+	rv = snapshot_filename(p15card, fname, sizeof(fname));
+	if (rv != SC_SUCCESS)
+		return rv;
+
+	f = fopen(fname, "rb");
+	if (!f)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (fstat(fileno(f), &stbuf) || stbuf.st_size < 4 || stbuf.st_size > SNAPSHOT_MAX_SIZE) {
+		fclose(f);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	len = (size_t)stbuf.st_size;
+	data = malloc(len);
+	if (data == NULL) {
+		fclose(f);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	if (fread(data, 1, len, f) != len) {
+		fclose(f);
+		free(data);
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	fclose(f);
+
+	rv = snapshot_load(p15card, data, len, fname);
+	free(data);
+	return rv;
+}
+
+/*
+ * Process wide cache (use_shared_cache) of the decoded objects and the
+ * public files of bound tokens, shared by all contexts of the process.
+ * An entry is keyed by reader, serial number, lastUpdate and application
+ * path and is referenced by the cards using it. The entries of a reader
+ * are dropped when its card is changed or reset, or when another token
+ * or lastUpdate shows up in it.
+ */
+#define SHARED_MAX_ENTRIES	16
+
+struct shared_file {
+	char key[SC_MAX_PATH_STRING_SIZE + 32];
+	u8 *data;
+	size_t len;
+	struct shared_file *next;
+};
+
+struct sc_pkcs15_shared_entry {
+	char *reader;
+	char *key;
+	unsigned int refs;
+	int valid;
+	u8 *objects;
+	size_t objects_len;
+	struct shared_file *files;
+	struct sc_pkcs15_shared_entry *next;
+};
+
+static struct sc_pkcs15_shared_entry *shared_entries = NULL;
+
+#if defined(HAVE_PTHREAD)
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+#define shared_cache_lock()	pthread_mutex_lock(&shared_lock)
+#define shared_cache_unlock()	pthread_mutex_unlock(&shared_lock)
+#elif defined(_WIN32)
+static SRWLOCK shared_lock = SRWLOCK_INIT;
+#define shared_cache_lock()	AcquireSRWLockExclusive(&shared_lock)
+#define shared_cache_unlock()	ReleaseSRWLockExclusive(&shared_lock)
+#else
+#define shared_cache_lock()
+#define shared_cache_unlock()
+#endif
+
+static void shared_entry_free(struct sc_pkcs15_shared_entry *entry)
+{
+	struct shared_file *file, *next;
+
+	for (file = entry->files; file; file = next) {
+		next = file->next;
+		free(file->data);
+		free(file);
+	}
+	free(entry->objects);
+	free(entry->reader);
+	free(entry->key);
+	free(entry);
+}
+
+/* Unlinks the entry; it is freed once the last card releases it.
+ * Called with the lock held. */
+static void shared_entry_invalidate(struct sc_pkcs15_shared_entry **link)
+{
+	struct sc_pkcs15_shared_entry *entry = *link;
+
+	*link = entry->next;
+	entry->next = NULL;
+	entry->valid = 0;
+	if (entry->refs == 0)
+		shared_entry_free(entry);
+}
+
+static int shared_entry_key(struct sc_pkcs15_card *p15card, char *buf, size_t bufsize)
+{
+	struct sc_card *card = p15card->card;
+	char *last_update;
+	size_t u;
+
+	if (card->reader == NULL || p15card->file_app == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (p15card->tokeninfo->serial_number == NULL
+			&& (card->uid.len == 0 || card->uid.value[0] == RANDOM_UID_INDICATOR))
+		return SC_ERROR_INVALID_ARGUMENTS;
+
+	last_update = sc_pkcs15_get_lastupdate(p15card);
+	if (p15card->tokeninfo->serial_number) {
+		snprintf(buf, bufsize, "%s_%s_", p15card->tokeninfo->serial_number,
+				last_update ? last_update : "NODATE");
+	} else {
+		/* Not sc_dump_hex(), which returns a static buffer */
+		char uid[SC_MAX_UID_SIZE * 2 + 1];
+
+		sc_bin_to_hex(card->uid.value, card->uid.len, uid, sizeof(uid), 0);
+		snprintf(buf, bufsize, "uid-%s_%s_", uid, last_update ? last_update : "NODATE");
+	}
+	for (u = 0; u < p15card->file_app->path.len; u++)
+		snprintf(buf + strlen(buf), bufsize - strlen(buf), "%02X",
+				p15card->file_app->path.value[u]);
+	return SC_SUCCESS;
+}
+
+/* Returns the entry of the card, referenced by it, with the lock held */
+static struct sc_pkcs15_shared_entry *shared_entry_get(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_shared_entry *entry, **link;
+	const char *reader;
+	char key[256];
+	unsigned int count;
+
+	if (shared_entry_key(p15card, key, sizeof(key)) != SC_SUCCESS)
+		return NULL;
+	reader = p15card->card->reader->name;
+
+	shared_cache_lock();
+	entry = p15card->shared_entry;
+	if (entry != NULL) {
+		if (entry->valid && strcmp(entry->key, key) == 0)
+			return entry;
+		/* The token was updated meanwhile */
+		p15card->shared_entry = NULL;
+		if (--entry->refs == 0 && !entry->valid)
+			shared_entry_free(entry);
+	}
+
+	for (count = 0, link = &shared_entries; (entry = *link) != NULL; ) {
+		if (strcmp(entry->reader, reader) == 0) {
+			if (strcmp(entry->key, key) == 0)
+				break;
+			/* Another token or lastUpdate in the reader */
+			shared_entry_invalidate(link);
+			continue;
+		}
+		count++;
+		link = &entry->next;
+	}
+	if (entry == NULL) {
+		/* Make room by dropping an unused entry */
+		for (link = &shared_entries; count >= SHARED_MAX_ENTRIES && *link; ) {
+			if ((*link)->refs == 0) {
+				shared_entry_invalidate(link);
+				count--;
+			}
+			else {
+				link = &(*link)->next;
+			}
+		}
+		entry = calloc(1, sizeof(*entry));
+		if (entry == NULL || (entry->reader = strdup(reader)) == NULL
+				|| (entry->key = strdup(key)) == NULL) {
+			if (entry)
+				free(entry->reader);
+			free(entry);
+			shared_cache_unlock();
+			return NULL;
+		}
+		entry->valid = 1;
+		entry->next = shared_entries;
+		shared_entries = entry;
+	}
+	entry->refs++;
+	p15card->shared_entry = entry;
+	return entry;
+}
+
+void sc_pkcs15_shared_cache_invalidate(const char *reader)
+{
+	struct sc_pkcs15_shared_entry **link;
+
+	if (reader == NULL)
+		return;
+	shared_cache_lock();
+	for (link = &shared_entries; *link; ) {
+		if (strcmp((*link)->reader, reader) == 0)
+			shared_entry_invalidate(link);
+		else
+			link = &(*link)->next;
+	}
+	shared_cache_unlock();
+}
+
+void sc_pkcs15_shared_cache_release(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_shared_entry *entry;
+
+	shared_cache_lock();
+	entry = p15card->shared_entry;
+	p15card->shared_entry = NULL;
+	if (entry && --entry->refs == 0 && !entry->valid)
+		shared_entry_free(entry);
+	shared_cache_unlock();
+}
+
+int sc_pkcs15_shared_cache_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_shared_entry *entry;
+	struct snapshot_buf b;
+	int r;
+
+	r = snapshot_build(p15card, &b);
+	if (r != SC_SUCCESS)
+		return r;
+	entry = shared_entry_get(p15card);
+	if (entry == NULL) {
+		free(b.data);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+	free(entry->objects);
+	entry->objects = b.data;
+	entry->objects_len = b.len;
+	shared_cache_unlock();
+	return SC_SUCCESS;
+}
+
+int sc_pkcs15_shared_read_objects(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_shared_entry *entry;
+	u8 *data;
+	size_t len;
+	int r;
+
+	entry = shared_entry_get(p15card);
+	if (entry == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	if (entry->objects == NULL) {
+		shared_cache_unlock();
+		return SC_ERROR_FILE_NOT_FOUND;
+	}
+	/* Objects are added outside of the lock */
+	len = entry->objects_len;
+	data = malloc(len);
+	if (data != NULL)
+		memcpy(data, entry->objects, len);
+	shared_cache_unlock();
+	if (data == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+
+	r = snapshot_load(p15card, data, len, "shared");
+	free(data);
+	return r;
+}
+
+static void shared_file_key(const sc_path_t *path, char *buf, size_t bufsize)
+{
+	size_t len;
+
+	/* Not sc_print_path(), which returns a static buffer */
+	if (sc_path_print(buf, bufsize, path) != SC_SUCCESS)
+		buf[0] = '\0';
+	len = strlen(buf);
+	snprintf(buf + len, bufsize - len, ":%d:%d", path->index, path->count);
+}
+
+int sc_pkcs15_shared_read_file(struct sc_pkcs15_card *p15card, const sc_path_t *path,
+		u8 **buf, size_t *bufsize)
+{
+	struct sc_pkcs15_shared_entry *entry;
+	struct shared_file *file;
+	char key[sizeof(file->key)];
+	int r = SC_ERROR_FILE_NOT_FOUND;
+
+	shared_file_key(path, key, sizeof(key));
+	entry = shared_entry_get(p15card);
+	if (entry == NULL)
+		return SC_ERROR_FILE_NOT_FOUND;
+	for (file = entry->files; file; file = file->next) {
+		if (file->data == NULL || strcmp(file->key, key) != 0)
+			continue;
+		*buf = malloc(file->len);
+		if (*buf == NULL) {
+			r = SC_ERROR_OUT_OF_MEMORY;
+			break;
+		}
+		memcpy(*buf, file->data, file->len);
+		*bufsize = file->len;
+		r = SC_SUCCESS;
+		break;
+	}
+	shared_cache_unlock();
+	return r;
+}
+
+int sc_pkcs15_shared_cache_file(struct sc_pkcs15_card *p15card, const sc_path_t *path,
+		const u8 *buf, size_t bufsize)
+{
+	struct sc_pkcs15_shared_entry *entry;
+	struct shared_file *file;
+	char key[sizeof(file->key)];
+
+	shared_file_key(path, key, sizeof(key));
+	entry = shared_entry_get(p15card);
+	if (entry == NULL)
+		return SC_ERROR_OUT_OF_MEMORY;
+	for (file = entry->files; file; file = file->next)
+		if (strcmp(file->key, key) == 0)
+			break;
+	if (file == NULL) {
+		file = calloc(1, sizeof(*file));
+		if (file == NULL) {
+			shared_cache_unlock();
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		strlcpy(file->key, key, sizeof(file->key));
+		file->next = entry->files;
+		entry->files = file;
+	}
+	free(file->data);
+	file->data = malloc(bufsize);
+	file->len = file->data ? bufsize : 0;
+	if (file->data)
+		memcpy(file->data, buf, bufsize);
+	shared_cache_unlock();
+	return SC_SUCCESS;
+}
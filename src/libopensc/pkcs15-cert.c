@@ -41,7 +41,8 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	int r;
 	struct sc_algorithm_id sig_alg;
 	struct sc_pkcs15_pubkey *pubkey = NULL;
-	unsigned char *serial = NULL, *issuer = NULL, *subject = NULL, *buf =  der->value;
+	const unsigned char *serial = NULL, *issuer = NULL, *subject = NULL;
+	unsigned char *buf = der->value;
 	size_t serial_len = 0, issuer_len = 0, subject_len = 0, data_len = 0, buflen = der->len;
 	struct sc_asn1_entry asn1_version[] = {
 		{ "version", SC_ASN1_INTEGER, SC_ASN1_TAG_INTEGER, 0, &cert->version, NULL },
@@ -53,11 +54,11 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 	};
 	struct sc_asn1_entry asn1_tbscert[] = {
 		{ "version",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 0 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_version, NULL },
-		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_ALLOC, &serial, &serial_len },
+		{ "serialNumber",	SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_BORROW, &serial, &serial_len },
 		{ "signature",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &issuer, &issuer_len },
+		{ "issuer",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_BORROW, &issuer, &issuer_len },
 		{ "validity",		SC_ASN1_STRUCT,    SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
-		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_ALLOC, &subject, &subject_len },
+		{ "subject",		SC_ASN1_OCTET_STRING, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, SC_ASN1_BORROW, &subject, &subject_len },
 		/* Use a callback to get the algorithm, parameters and pubkey into sc_pkcs15_pubkey */
 		{ "subjectPublicKeyInfo",SC_ASN1_CALLBACK, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, sc_pkcs15_pubkey_from_spki_fields,  &pubkey },
 		{ "extensions",		SC_ASN1_STRUCT,    SC_ASN1_CTX | 3 | SC_ASN1_CONS, SC_ASN1_OPTIONAL, asn1_extensions, NULL },
@@ -110,19 +111,19 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 
 
 	if (serial && serial_len)   {
-		sc_format_asn1_entry(asn1_serial_number + 0, serial, &serial_len, 1);
+		sc_format_asn1_entry(asn1_serial_number + 0, (u8 *) serial, &serial_len, 1);
 		r = sc_asn1_encode(ctx, asn1_serial_number, &cert->serial, &cert->serial_len);
 		LOG_TEST_GOTO_ERR(ctx, r, "ASN.1 encoding of serial failed");
 	}
 
 	if (subject && subject_len)   {
-		sc_format_asn1_entry(asn1_subject + 0, subject, &subject_len, 1);
+		sc_format_asn1_entry(asn1_subject + 0, (u8 *) subject, &subject_len, 1);
 		r = sc_asn1_encode(ctx, asn1_subject, &cert->subject, &cert->subject_len);
 		LOG_TEST_GOTO_ERR(ctx, r, "ASN.1 encoding of subject");
 	}
 
 	if (issuer && issuer_len)   {
-		sc_format_asn1_entry(asn1_issuer + 0, issuer, &issuer_len, 1);
+		sc_format_asn1_entry(asn1_issuer + 0, (u8 *) issuer, &issuer_len, 1);
 		r = sc_asn1_encode(ctx, asn1_issuer, &cert->issuer, &cert->issuer_len);
 		LOG_TEST_GOTO_ERR(ctx, r, "ASN.1 encoding of issuer");
 	}
@@ -130,9 +131,6 @@ parse_x509_cert(sc_context_t *ctx, struct sc_pkcs15_der *der, struct sc_pkcs15_c
 err:
 	/* not used for anything */
 	sc_asn1_clear_algorithm_id(&sig_alg);
-	free(serial);
-	free(subject);
-	free(issuer);
 
 	LOG_FUNC_RETURN(ctx, r);
 }
@@ -251,14 +249,14 @@ sc_pkcs15_get_extension(struct sc_context *ctx, struct sc_pkcs15_cert *cert,
 	size_t ext_len = 0;
 	size_t next_ext_len = 0;
 	struct sc_object_id oid;
-	u8 *val = NULL;
+	const u8 *val = NULL;
 	size_t val_len = 0;
 	int critical;
 	int r;
 	struct sc_asn1_entry asn1_cert_ext[] = {
 		{ "x509v3 entry OID", SC_ASN1_OBJECT, SC_ASN1_TAG_OBJECT, 0, &oid, 0 },
 		{ "criticalFlag",  SC_ASN1_BOOLEAN, SC_ASN1_TAG_BOOLEAN, SC_ASN1_OPTIONAL, &critical, NULL },
-		{ "extensionValue",SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, SC_ASN1_ALLOC, &val, &val_len },
+		{ "extensionValue",SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, SC_ASN1_BORROW, &val, &val_len },
 		{ NULL, 0, 0, 0, NULL, NULL }
 	};
 
@@ -271,12 +269,11 @@ sc_pkcs15_get_extension(struct sc_context *ctx, struct sc_pkcs15_cert *cert,
 		if (ext == NULL)
 			LOG_TEST_RET(ctx, SC_ERROR_INVALID_ASN1_OBJECT, "ASN.1 decoding of AVA");
 
-		/*
-		 * use the sc_asn1_decoder for clarity. NOTE it would be more efficient to do this by hand
-		 * so we avoid the many malloc/frees here, but one hopes that one day the asn1_decode will allow
-		 * a 'static pointer' flag that returns a const pointer to the actual asn1 space so we only need
-		 * to make a final copy of the extension value before we return */
+		/* The extension value points into cert->extensions, only the
+		 * value we return is copied */
 		critical = 0;
+		val = NULL;
+		val_len = 0;
 		r = sc_asn1_decode(ctx, asn1_cert_ext, ext, ext_len, NULL, NULL);
 		if (r < 0)
 			LOG_FUNC_RETURN(ctx, r);
@@ -284,17 +281,18 @@ sc_pkcs15_get_extension(struct sc_context *ctx, struct sc_pkcs15_cert *cert,
 		/* is it the RN we are looking for */
 		if (sc_compare_oid(&oid, type) != 0) {
 			if (*ext_val == NULL) {
-				*ext_val = val;
-				val = NULL;
+				if (val_len > 0) {
+					*ext_val = malloc(val_len);
+					if (*ext_val == NULL)
+						LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+					memcpy(*ext_val, val, val_len);
+				}
 				*ext_val_len = val_len;
-				/* do not free here -- return the allocated value to caller */
 			}
 			else {
 				*ext_val_len = MIN(*ext_val_len, val_len);
-				if (val) {
+				if (val_len > 0)
 					memcpy(*ext_val, val, *ext_val_len);
-					free(val);
-				}
 			}
 
 			if (is_critical)
@@ -303,13 +301,7 @@ sc_pkcs15_get_extension(struct sc_context *ctx, struct sc_pkcs15_cert *cert,
 			r = val_len;
 			LOG_FUNC_RETURN(ctx, r);
 		}
-		if (val) {
-			free(val);
-			val = NULL;
-		}
 	}
-	if (val)
-	    free(val);
 
 	LOG_FUNC_RETURN(ctx, SC_ERROR_ASN1_OBJECT_NOT_FOUND);
 }
@@ -440,9 +432,9 @@ static const struct sc_asn1_entry c_asn1_cert[] = {
 };
 
 
-int
-sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj,
-		const u8 ** buf, size_t *buflen)
+static int
+decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj,
+		const u8 ** buf, size_t *buflen, struct sc_pkcs15_df_data *df_data)
 {
 	sc_context_t *ctx = p15card->card->ctx;
 	struct sc_pkcs15_cert_info info;
@@ -476,21 +468,29 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 	sc_format_asn1_entry(asn1_type_cert_attr + 0, asn1_x509_cert_attr, NULL, 0);
 	sc_format_asn1_entry(asn1_cert + 0, &cert_obj, NULL, 0);
 
+	if (df_data != NULL) {
+		asn1_x509_cert_value_choice[1].flags &= ~SC_ASN1_ALLOC;
+		asn1_x509_cert_value_choice[1].flags |= SC_ASN1_BORROW;
+	}
+
 	/* Fill in defaults */
 	memset(&info, 0, sizeof(info));
 	info.authority = 0;
 
 	r = sc_asn1_decode(ctx, asn1_cert, *buf, *buflen, buf, buflen);
 	/* In case of error, trash the cert value (direct coding) */
-	if (r < 0 && der->value)
+	if (r < 0 && der->value && df_data == NULL)
 		free(der->value);
 	if (r == SC_ERROR_ASN1_END_OF_CONTENTS)
 		return r;
 	LOG_TEST_RET(ctx, r, "ASN.1 decoding failed");
+	if (df_data != NULL && der->len == 0)
+		der->value = NULL;
 
 	if (!p15card->app || !p15card->app->ddo.aid.len) {
 		if (!p15card->file_app) {
-			free(der->value);
+			if (df_data == NULL)
+				free(der->value);
 			return SC_ERROR_INTERNAL;
 		}
 		r = sc_pkcs15_make_absolute_path(&p15card->file_app->path, &info.path);
@@ -508,7 +508,8 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 			break;
 		case SC_PKCS15_CARD_OPTS_PRIV_CERT_IGNORE:
 			sc_log(ctx, "Ignoring certificate");
-			free(der->value);
+			if (df_data == NULL)
+				free(der->value);
 			return 0;
 	}
 
@@ -516,15 +517,31 @@ sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obje
 	obj->data = malloc(sizeof(info));
 	if (obj->data == NULL)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+	if (df_data != NULL && der->value != NULL)
+		info.value_data = sc_pkcs15_df_data_hold(df_data);
 	memcpy(obj->data, &info, sizeof(info));
 
 	return 0;
 }
 
+int
+sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj,
+		const u8 ** buf, size_t *buflen)
+{
+	return decode_cdf_entry(p15card, obj, buf, buflen, NULL);
+}
 
 int
-sc_pkcs15_encode_cdf_entry(sc_context_t *ctx, const struct sc_pkcs15_object *obj,
-		u8 **buf, size_t *bufsize)
+sc_pkcs15_decode_cdf_entry_borrow(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *obj,
+		const u8 ** buf, size_t *buflen, struct sc_pkcs15_df_data *df_data)
+{
+	return decode_cdf_entry(p15card, obj, buf, buflen, df_data);
+}
+
+
+int
+sc_pkcs15_append_cdf_entry(sc_context_t *ctx, const struct sc_pkcs15_object *obj,
+		struct sc_asn1_encoding *enc)
 {
 	struct sc_asn1_entry	asn1_cred_ident[3], asn1_com_cert_attr[4],
 				asn1_x509_cert_attr[2], asn1_type_cert_attr[2],
@@ -554,11 +571,18 @@ sc_pkcs15_encode_cdf_entry(sc_context_t *ctx, const struct sc_pkcs15_object *obj
 	sc_format_asn1_entry(asn1_type_cert_attr + 0, &asn1_x509_cert_value_choice, NULL, 1);
 	sc_format_asn1_entry(asn1_cert + 0, (void *) &cert_obj, NULL, 1);
 
-	r = sc_asn1_encode(ctx, asn1_cert, buf, bufsize);
+	r = _sc_asn1_encode_append(ctx, asn1_cert, enc);
 
 	return r;
 }
 
+int
+sc_pkcs15_encode_cdf_entry(sc_context_t *ctx, const struct sc_pkcs15_object *obj,
+		u8 **buf, size_t *bufsize)
+{
+	return sc_pkcs15_encode_entry(ctx, obj, sc_pkcs15_append_cdf_entry, buf, bufsize);
+}
+
 /* Only certain usages are valid for a given algorithm, return all the usages
  * that the algorithm supports so we can use it as a filter for all
  * the public and private key usages
@@ -661,6 +685,9 @@ sc_pkcs15_free_cert_info(sc_pkcs15_cert_info_t *cert)
 {
 	if (!cert)
 		return;
-	free(cert->value.value);
+	if (cert->value_data)
+		sc_pkcs15_df_data_release(cert->value_data);
+	else
+		free(cert->value.value);
 	free(cert);
 }
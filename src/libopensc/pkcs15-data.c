@@ -144,9 +144,9 @@ int sc_pkcs15_decode_dodf_entry(struct sc_pkcs15_card *p15card,
 	return SC_SUCCESS;
 }
 
-int sc_pkcs15_encode_dodf_entry(sc_context_t *ctx,
+int sc_pkcs15_append_dodf_entry(sc_context_t *ctx,
 			       const struct sc_pkcs15_object *obj,
-			       u8 **buf, size_t *bufsize)
+			       struct sc_asn1_encoding *enc)
 {
 	struct sc_asn1_entry	asn1_com_data_attr[4],
 				asn1_type_data_attr[2],
@@ -173,7 +173,14 @@ int sc_pkcs15_encode_dodf_entry(sc_context_t *ctx,
 	sc_format_asn1_entry(asn1_type_data_attr + 0, &info->path, NULL, 1);
 	sc_format_asn1_entry(asn1_data + 0, &data_obj, NULL, 1);
 
-	return sc_asn1_encode(ctx, asn1_data, buf, bufsize);
+	return _sc_asn1_encode_append(ctx, asn1_data, enc);
+}
+
+int sc_pkcs15_encode_dodf_entry(sc_context_t *ctx,
+			       const struct sc_pkcs15_object *obj,
+			       u8 **buf, size_t *bufsize)
+{
+	return sc_pkcs15_encode_entry(ctx, obj, sc_pkcs15_append_dodf_entry, buf, bufsize);
 }
 
 void sc_pkcs15_free_data_object(struct sc_pkcs15_data *data_object)
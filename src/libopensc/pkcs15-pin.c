@@ -207,9 +207,9 @@ sc_pkcs15_decode_aodf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obj
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_ASN1, SC_SUCCESS);
 }
 
-int sc_pkcs15_encode_aodf_entry(sc_context_t *ctx,
+int sc_pkcs15_append_aodf_entry(sc_context_t *ctx,
 				 const struct sc_pkcs15_object *obj,
-				 u8 **buf, size_t *buflen)
+				 struct sc_asn1_encoding *enc)
 {
 	struct sc_asn1_entry asn1_com_ao_attr[2], asn1_pin_attr[10], asn1_type_pin_attr[2];
 	struct sc_asn1_entry asn1_auth_type[2];
@@ -250,11 +250,18 @@ int sc_pkcs15_encode_aodf_entry(sc_context_t *ctx,
 
 	sc_format_asn1_entry(asn1_com_ao_attr + 0, &info->auth_id, NULL, 1);
 
-	r = sc_asn1_encode(ctx, asn1_auth_type, buf, buflen);
+	r = _sc_asn1_encode_append(ctx, asn1_auth_type, enc);
 
 	return r;
 }
 
+int sc_pkcs15_encode_aodf_entry(sc_context_t *ctx,
+				 const struct sc_pkcs15_object *obj,
+				 u8 **buf, size_t *buflen)
+{
+	return sc_pkcs15_encode_entry(ctx, obj, sc_pkcs15_append_aodf_entry, buf, buflen);
+}
+
 
 static int
 _validate_pin(struct sc_pkcs15_card *p15card, struct sc_pkcs15_auth_info *auth_info, size_t pinlen)
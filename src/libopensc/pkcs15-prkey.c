@@ -364,8 +364,8 @@ err:
 	return r;
 }
 
-int sc_pkcs15_encode_prkdf_entry(sc_context_t *ctx, const struct sc_pkcs15_object *obj,
-				 u8 **buf, size_t *buflen)
+int sc_pkcs15_append_prkdf_entry(sc_context_t *ctx, const struct sc_pkcs15_object *obj,
+				 struct sc_asn1_encoding *enc)
 {
 	struct sc_asn1_entry asn1_com_key_attr[C_ASN1_COM_KEY_ATTR_SIZE];
 	struct sc_asn1_entry asn1_com_prkey_attr[C_ASN1_COM_PRKEY_ATTR_SIZE];
@@ -461,12 +461,18 @@ int sc_pkcs15_encode_prkdf_entry(sc_context_t *ctx, const struct sc_pkcs15_objec
 	else
 		memset(asn1_com_prkey_attr, 0, sizeof(asn1_com_prkey_attr));
 
-	r = sc_asn1_encode(ctx, asn1_prkey, buf, buflen);
+	r = _sc_asn1_encode_append(ctx, asn1_prkey, enc);
 
 	sc_log(ctx, "Key path %s", sc_print_path(&prkey->path));
 	return r;
 }
 
+int sc_pkcs15_encode_prkdf_entry(sc_context_t *ctx, const struct sc_pkcs15_object *obj,
+				 u8 **buf, size_t *buflen)
+{
+	return sc_pkcs15_encode_entry(ctx, obj, sc_pkcs15_append_prkdf_entry, buf, buflen);
+}
+
 int
 sc_pkcs15_prkey_attrs_from_cert(struct sc_pkcs15_card *p15card, struct sc_pkcs15_object *cert_object,
 		struct sc_pkcs15_object **out_key_object)
@@ -358,8 +358,8 @@ err:
 
 
 int
-sc_pkcs15_encode_pukdf_entry(struct sc_context *ctx, const struct sc_pkcs15_object *obj,
-		unsigned char **buf, size_t *buflen)
+sc_pkcs15_append_pukdf_entry(struct sc_context *ctx, const struct sc_pkcs15_object *obj,
+		struct sc_asn1_encoding *enc)
 {
 	struct sc_asn1_entry asn1_com_key_attr[C_ASN1_COM_KEY_ATTR_SIZE];
 	struct sc_asn1_entry asn1_com_pubkey_attr[C_ASN1_COM_PUBKEY_ATTR_SIZE];
@@ -502,15 +502,27 @@ sc_pkcs15_encode_pukdf_entry(struct sc_context *ctx, const struct sc_pkcs15_obje
 	else
 		memset(asn1_com_pubkey_attr, 0, sizeof(asn1_com_pubkey_attr));
 
-	r = sc_asn1_encode(ctx, asn1_pubkey, buf, buflen);
+	/* The encoded nodes borrow the SPKI copy, the encoding frees it */
+	if (spki_value) {
+		r = _sc_asn1_encoding_keep(enc, spki_value);
+		if (r) {
+			free(spki_value);
+			LOG_FUNC_RETURN(ctx, r);
+		}
+	}
+	r = _sc_asn1_encode_append(ctx, asn1_pubkey, enc);
 
 	sc_log(ctx, "Key path %s", sc_print_path(&pubkey->path));
-
-	if (spki_value)
-		free(spki_value);
 	return r;
 }
 
+int
+sc_pkcs15_encode_pukdf_entry(struct sc_context *ctx, const struct sc_pkcs15_object *obj,
+		unsigned char **buf, size_t *buflen)
+{
+	return sc_pkcs15_encode_entry(ctx, obj, sc_pkcs15_append_pukdf_entry, buf, buflen);
+}
+
 #define C_ASN1_PUBLIC_KEY_SIZE 2
 static struct sc_asn1_entry c_asn1_public_key[C_ASN1_PUBLIC_KEY_SIZE] = {
 		{ "publicKeyCoefficients", SC_ASN1_STRUCT, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
@@ -23,6 +23,7 @@
 #include "config.h"
 #endif
 
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -123,13 +124,21 @@ static int select_key_file(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, SC_SUCCESS);
 }
 
+/* Security environment left by the previous use_key() call of a batch, only
+ * reused for drivers with SC_CARD_CAP_KEEPS_SECURITY_ENV */
+struct use_key_env {
+	int set;
+	unsigned long algorithm_flags;
+};
+
 static int use_key(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_object *obj,
 		sc_security_env_t *senv,
 		int (*card_command)(sc_card_t *card,
 			 const u8 * in, size_t inlen,
 			 u8 * out, size_t outlen),
-		const u8 * in, size_t inlen, u8 * out, size_t outlen)
+		const u8 * in, size_t inlen, u8 * out, size_t outlen,
+		struct use_key_env *env)
 {
 	int r = SC_SUCCESS;
 	int revalidated_cached_pin = 0;
@@ -139,6 +148,18 @@ static int use_key(struct sc_pkcs15_card *p15card,
 	r = sc_lock(p15card->card);
 	LOG_TEST_RET(p15card->card->ctx, r, "sc_lock() failed");
 
+	if (env != NULL && env->set && env->algorithm_flags == senv->algorithm_flags
+			&& (p15card->card->caps & SC_CARD_CAP_KEEPS_SECURITY_ENV)) {
+		r = card_command(p15card->card, in, inlen, out, outlen);
+		if (r >= 0) {
+			sc_unlock(p15card->card);
+			LOG_FUNC_RETURN(p15card->card->ctx, r);
+		}
+		/* The card forgot the environment or the PIN, set up everything again */
+		sc_log(p15card->card->ctx, "Reusing security environment failed: %d", r);
+		r = SC_SUCCESS;
+	}
+
 	do {
 		if (path.len != 0 || path.aid.len != 0) {
 			r = select_key_file(p15card, obj, senv);
@@ -164,6 +185,10 @@ static int use_key(struct sc_pkcs15_card *p15card,
 		}
 	} while (revalidated_cached_pin);
 
+	if (env != NULL) {
+		env->set = r >= 0;
+		env->algorithm_flags = senv->algorithm_flags;
+	}
 	sc_unlock(p15card->card);
 
 	LOG_FUNC_RETURN(p15card->card->ctx, r);
@@ -277,7 +302,7 @@ static int format_senv(struct sc_pkcs15_card *p15card,
 	return SC_SUCCESS;
 }
 
-int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
+static int pkcs15_decipher(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_object *obj,
 		unsigned long flags,
 		const u8 * in, size_t inlen, u8 *out, size_t outlen, void *pMechanism)
@@ -303,7 +328,7 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 	senv.algorithm_flags = sec_flags;
 
 	r = use_key(p15card, obj, &senv, sc_decipher, in, inlen, out,
-			outlen);
+			outlen, NULL);
 	LOG_TEST_RET(ctx, r, "use_key() failed");
 
 	/* Strip any padding */
@@ -335,6 +360,20 @@ int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+int sc_pkcs15_decipher(struct sc_pkcs15_card *p15card,
+		const struct sc_pkcs15_object *obj,
+		unsigned long flags,
+		const u8 * in, size_t inlen, u8 *out, size_t outlen, void *pMechanism)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	unsigned long long start = sc_latency_begin(ctx);
+	int r;
+
+	r = pkcs15_decipher(p15card, obj, flags, in, inlen, out, outlen, pMechanism);
+	sc_latency_end(ctx, SC_LATENCY_PKCS15_DECIPHER, start);
+	return r;
+}
+
 /* derive one key from another. RSA can use decipher, so this is for only ECDH
  * Since the value may be returned, and the call is expected to provide
  * the buffer, we used the PKCS#11 convention of outlen == 0 and out == NULL
@@ -381,7 +420,7 @@ int sc_pkcs15_derive(struct sc_pkcs15_card *p15card,
 	senv.algorithm_flags = sec_flags;
 
 	r = use_key(p15card, obj, &senv, sc_decipher, in, inlen, out,
-			*poutlen);
+			*poutlen, NULL);
 	LOG_TEST_RET(ctx, r, "use_key() failed");
 
 	/* If card stores derived key on card, then no data is returned
@@ -470,7 +509,7 @@ int sc_pkcs15_unwrap(struct sc_pkcs15_card *p15card,
 	}
 
 	r = use_key(p15card, key, &senv, sc_unwrap, in, inlen, out,
-		    poutlen);
+		    poutlen, NULL);
 	LOG_TEST_RET(ctx, r, "use_key() failed");
 
 	LOG_FUNC_RETURN(ctx, r);
@@ -569,7 +608,7 @@ int sc_pkcs15_wrap(struct sc_pkcs15_card *p15card,
 		LOG_TEST_RET(ctx, sec_env_add_param(&senv, &senv_param), "failed to add IV to security environment");
 	}
 
-	r = use_key(p15card, key, &senv, sc_wrap, NULL, 0, cryptogram, crgram_len ? *crgram_len : 0);
+	r = use_key(p15card, key, &senv, sc_wrap, NULL, 0, cryptogram, crgram_len ? *crgram_len : 0, NULL);
 
 	if (r > -1 && crgram_len) {
 		if (*crgram_len < (size_t) r) {
@@ -590,10 +629,11 @@ int sc_pkcs15_wrap(struct sc_pkcs15_card *p15card,
 #define USAGE_ANY_DECIPHER      (SC_PKCS15_PRKEY_USAGE_DECRYPT|\
                                  SC_PKCS15_PRKEY_USAGE_UNWRAP)
 
-int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
+static int pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				const struct sc_pkcs15_object *obj,
 				unsigned long flags, const u8 *in, size_t inlen,
-				u8 *out, size_t outlen, void *pMechanism)
+				u8 *out, size_t outlen, void *pMechanism,
+				struct use_key_env *env)
 {
 	sc_context_t *ctx = p15card->card->ctx;
 	int r;
@@ -664,7 +704,7 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 			(prkey->usage & USAGE_ANY_DECIPHER)) ) {
 			size_t tmplen = buflen;
 			if (flags & SC_ALGORITHM_RSA_RAW) {
-				r = sc_pkcs15_decipher(p15card, obj, flags, in, inlen, out, outlen, NULL);
+				r = pkcs15_decipher(p15card, obj, flags, in, inlen, out, outlen, NULL);
 				goto err;
 			}
 			if (modlen > tmplen)
@@ -680,7 +720,7 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 
 			LOG_TEST_GOTO_ERR(ctx, r, "Unable to add padding");
 
-			r = sc_pkcs15_decipher(p15card, obj, flags, buf, modlen, out, outlen, NULL);
+			r = pkcs15_decipher(p15card, obj, flags, buf, modlen, out, outlen, NULL);
 			goto err;
 		}
 
@@ -767,7 +807,7 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 
 
 	r = use_key(p15card, obj, &senv, sc_compute_signature, tmp, inlen,
-			out, outlen);
+			out, outlen, env);
 	LOG_TEST_GOTO_ERR(ctx, r, "use_key() failed");
 
 	/* Some cards may return RSA signature as integer without leading zero bytes */
@@ -784,6 +824,65 @@ err:
 	LOG_FUNC_RETURN(ctx, r);
 }
 
+int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *obj,
+				unsigned long flags, const u8 *in, size_t inlen,
+				u8 *out, size_t outlen, void *pMechanism)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	unsigned long long start = sc_latency_begin(ctx);
+	int r;
+
+	r = pkcs15_compute_signature(p15card, obj, flags, in, inlen, out, outlen, pMechanism, NULL);
+	sc_latency_end(ctx, SC_LATENCY_PKCS15_SIGN, start);
+	return r;
+}
+
+int sc_pkcs15_compute_signatures(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *obj,
+				unsigned long flags, struct sc_pkcs15_sign_request *requests,
+				size_t count, void *pMechanism)
+{
+	sc_context_t *ctx = p15card->card->ctx;
+	struct use_key_env env = {0, 0};
+	unsigned long long start;
+	size_t i;
+	int r;
+
+	LOG_FUNC_CALLED(ctx);
+	if (requests == NULL || count == 0 || count > INT_MAX)
+		LOG_FUNC_RETURN(ctx, SC_ERROR_INVALID_ARGUMENTS);
+	/* Every single signature has to be authorized by the user */
+	if (obj->user_consent)
+		LOG_TEST_RET(ctx, SC_ERROR_NOT_ALLOWED, "Key requires user consent for each signature");
+
+	r = sc_lock(p15card->card);
+	LOG_TEST_RET(ctx, r, "sc_lock() failed");
+
+	/* With SC_CARD_CAP_KEEPS_SECURITY_ENV the key file is selected, the
+	 * security environment set and the PIN revalidated for the first request
+	 * only, the others are just PSO:CDS as long as the card accepts them.
+	 * Other cards may drop the environment after each operation and sign
+	 * with a default key, so every request gets the full setup. */
+	for (i = 0; i < count; i++) {
+		start = sc_latency_begin(ctx);
+		r = pkcs15_compute_signature(p15card, obj, flags, requests[i].in, requests[i].inlen,
+				requests[i].out, requests[i].outlen, pMechanism, &env);
+		sc_latency_end(ctx, SC_LATENCY_PKCS15_SIGN, start);
+		if (r < 0)
+			break;
+		requests[i].outlen = r;
+	}
+
+	sc_unlock(p15card->card);
+
+	sc_log(ctx, "%"SC_FORMAT_LEN_SIZE_T"u of %"SC_FORMAT_LEN_SIZE_T"u signatures computed",
+			i, count);
+	if (i == 0)
+		LOG_FUNC_RETURN(ctx, r);
+	LOG_FUNC_RETURN(ctx, (int)i);
+}
+
 int
 sc_pkcs15_encrypt_sym(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_object *obj,
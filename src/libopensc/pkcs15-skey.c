@@ -195,9 +195,9 @@ sc_pkcs15_decode_skdf_entry(struct sc_pkcs15_card *p15card, struct sc_pkcs15_obj
 }
 
 
-int sc_pkcs15_encode_skdf_entry(struct sc_context *ctx,
+int sc_pkcs15_append_skdf_entry(struct sc_context *ctx,
 				 const struct sc_pkcs15_object *obj,
-				 u8 **buf, size_t *buflen)
+				 struct sc_asn1_encoding *enc)
 {
 	struct sc_pkcs15_skey_info *skey = (struct sc_pkcs15_skey_info *) obj->data;
 	int r, i;
@@ -264,8 +264,15 @@ int sc_pkcs15_encode_skdf_entry(struct sc_context *ctx,
 
 	sc_format_asn1_entry(asn1_generic_skey_value_attr + 0, &skey->path, NULL, 1);
 
-	r = sc_asn1_encode(ctx, asn1_skey, buf, buflen);
+	r = _sc_asn1_encode_append(ctx, asn1_skey, enc);
 
 	sc_log(ctx, "Key path %s", sc_print_path(&skey->path));
 	LOG_FUNC_RETURN(ctx, r);
 }
+
+int sc_pkcs15_encode_skdf_entry(struct sc_context *ctx,
+				 const struct sc_pkcs15_object *obj,
+				 u8 **buf, size_t *buflen)
+{
+	return sc_pkcs15_encode_entry(ctx, obj, sc_pkcs15_append_skdf_entry, buf, buflen);
+}
@@ -805,6 +805,7 @@ sc_pkcs15_card_free(struct sc_pkcs15_card *p15card)
 	sc_file_free(p15card->file_tokeninfo);
 	sc_file_free(p15card->file_odf);
 	sc_file_free(p15card->file_unusedspace);
+	sc_pkcs15_cache_release(p15card);
 
 	p15card->magic = 0;
 	sc_pkcs15_free_tokeninfo(p15card->tokeninfo);
@@ -828,6 +829,7 @@ sc_pkcs15_card_clear(struct sc_pkcs15_card *p15card)
 
 	sc_pkcs15_remove_objects(p15card);
 	sc_pkcs15_remove_dfs(p15card);
+	p15card->snapshot_read = 0;
 
 	p15card->df_list = NULL;
 	sc_file_free(p15card->file_app);
@@ -838,6 +840,7 @@ sc_pkcs15_card_clear(struct sc_pkcs15_card *p15card)
 	p15card->file_odf = NULL;
 	sc_file_free(p15card->file_unusedspace);
 	p15card->file_unusedspace = NULL;
+	sc_pkcs15_cache_release(p15card);
 
 	free(p15card->tokeninfo->label);
 	p15card->tokeninfo->label = NULL;
@@ -1297,6 +1300,8 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 		p15card->opts.pin_cache_ignore_user_consent = scconf_get_bool(conf_block, "pin_cache_ignore_user_consent",
 				p15card->opts.pin_cache_ignore_user_consent);
 		private_certificate = scconf_get_str(conf_block, "private_certificate", private_certificate);
+		p15card->use_file_cache_pack = scconf_get_bool(conf_block, "file_cache_pack", 0);
+		p15card->use_shared_cache = scconf_get_bool(conf_block, "use_shared_caching", 0);
 	}
 
 	if (0 == strcmp(use_file_cache, "yes")) {
@@ -1314,8 +1319,10 @@ sc_pkcs15_bind(struct sc_card *card, struct sc_aid *aid,
 	} else if (0 == strcmp(private_certificate, "declassify")) {
 		p15card->opts.private_certificate = SC_PKCS15_CARD_OPTS_PRIV_CERT_DECLASSIFY;
 	}
-	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d private_certificate=%d",
-			p15card->opts.use_file_cache, p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
+	sc_log(ctx, "PKCS#15 options: use_file_cache=%d use_file_cache_pack=%d use_shared_cache=%d use_pin_cache=%d pin_cache_counter=%d pin_cache_ignore_user_consent=%d private_certificate=%d",
+			p15card->opts.use_file_cache, p15card->use_file_cache_pack,
+			p15card->use_shared_cache,
+			p15card->opts.use_pin_cache,p15card->opts.pin_cache_counter,
 			p15card->opts.pin_cache_ignore_user_consent, p15card->opts.private_certificate);
 
 	r = sc_lock(card);
@@ -1377,13 +1384,88 @@ sc_pkcs15_unbind(struct sc_pkcs15_card *p15card)
 }
 
 
+/* The snapshot holds the objects as decoded by sc_pkcs15_parse_df() */
+static int
+use_object_snapshot(struct sc_pkcs15_card *p15card)
+{
+	return (p15card->opts.use_file_cache || p15card->use_shared_cache)
+		&& !(p15card->flags & SC_PKCS15_CARD_FLAG_EMULATED)
+		&& p15card->ops.parse_df == NULL;
+}
+
+
+/* The card stays locked from the first read to the last, so no other
+ * application can change the EFs read ahead meanwhile */
+static int
+readahead_begin(struct sc_pkcs15_card *p15card)
+{
+	int r = sc_lock(p15card->card);
+
+	if (r == SC_SUCCESS)
+		p15card->readahead.active++;
+	return r;
+}
+
+
+static void
+readahead_end(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_readahead_ef *ef;
+
+	if (--p15card->readahead.active == 0) {
+		while ((ef = p15card->readahead.efs) != NULL) {
+			p15card->readahead.efs = ef->next;
+			free(ef->data);
+			free(ef);
+		}
+	}
+	sc_unlock(p15card->card);
+}
+
+
+static void
+parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	/* Enumerate the DF's, so p15card->obj_list is populated. */
+	if (p15card->ops.parse_df)
+		p15card->ops.parse_df(p15card, df);
+	else
+		sc_pkcs15_parse_df(p15card, df);
+}
+
+
+/* Parses the DFs in the order of p15card->df_list, which is the order of
+ * EF(ODF), so p15card->obj_list and the object handles do not depend on
+ * where the DFs are stored. The EFs holding several DFs are read ahead. */
+static void
+parse_df_group(struct sc_pkcs15_card *p15card, unsigned int df_mask)
+{
+	struct sc_pkcs15_df *df;
+	size_t count = 0;
+	int read_ahead = 0;
+
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		if ((df_mask & (1 << df->type)) && !df->enumerated)
+			count++;
+	/* Without the lock the DFs are still parsed, just with no read ahead */
+	if (count > 1 && readahead_begin(p15card) == SC_SUCCESS)
+		read_ahead = 1;
+
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		if ((df_mask & (1 << df->type)) && !df->enumerated)
+			parse_df(p15card, df);
+
+	if (read_ahead)
+		readahead_end(p15card);
+}
+
+
 static int
 __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_mask, unsigned int type,
 			int (*func)(sc_pkcs15_object_t *, void *), void *func_arg,
 			sc_pkcs15_object_t **ret, size_t ret_size)
 {
 	struct sc_pkcs15_object *obj = NULL;
-	struct sc_pkcs15_df	*df = NULL;
 	unsigned int	df_mask = 0;
 	size_t		match_count = 0;
 	int r;
@@ -1416,23 +1498,23 @@ __sc_pkcs15_search_objects(struct sc_pkcs15_card *p15card, unsigned int class_ma
 	if (class_mask & SC_PKCS15_SEARCH_CLASS_SKEY)
 		df_mask |= (1 << SC_PKCS15_SKDF);
 
-	/* Make sure all the DFs we want to search have been
-	 * enumerated. */
-	for (df = p15card->df_list; df != NULL; df = df->next) {
-		if (!(df_mask & (1 << df->type)))   {
-			continue;
+	/* Objects of DFs decoded in an earlier bind */
+	if (!p15card->snapshot_read && use_object_snapshot(p15card)) {
+		p15card->snapshot_read = 1;
+		r = SC_ERROR_FILE_NOT_FOUND;
+		if (p15card->use_shared_cache)
+			r = sc_pkcs15_shared_read_objects(p15card);
+		if (r != SC_SUCCESS && p15card->opts.use_file_cache) {
+			r = sc_pkcs15_read_cached_objects(p15card);
+			if (r == SC_SUCCESS && p15card->use_shared_cache)
+				sc_pkcs15_shared_cache_objects(p15card);
 		}
-		if (df->enumerated)
-			continue;
-		/* Enumerate the DF's, so p15card->obj_list is populated. */
-		if (p15card->ops.parse_df)
-			r = p15card->ops.parse_df(p15card, df);
-		else
-			r = sc_pkcs15_parse_df(p15card, df);
-		if (r != SC_SUCCESS)
-			continue;
 	}
 
+	/* Make sure all the DFs we want to search have been
+	 * enumerated. */
+	parse_df_group(p15card, df_mask);
+
 	/* And now loop over all objects */
 	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
 		/* Check object type */
@@ -1994,6 +2076,25 @@ sc_pkcs15_free_object(struct sc_pkcs15_object *obj)
 }
 
 
+struct sc_pkcs15_df_data *
+sc_pkcs15_df_data_hold(struct sc_pkcs15_df_data *df_data)
+{
+	/* Not atomic, the objects of a DF belong to one card */
+	df_data->refs++;
+	return df_data;
+}
+
+
+void
+sc_pkcs15_df_data_release(struct sc_pkcs15_df_data *df_data)
+{
+	if (!df_data || --df_data->refs)
+		return;
+	free(df_data->data);
+	free(df_data);
+}
+
+
 int
 sc_pkcs15_add_df(struct sc_pkcs15_card *p15card, unsigned int type, const sc_path_t *path)
 {
@@ -2037,41 +2138,60 @@ sc_pkcs15_remove_dfs(struct sc_pkcs15_card *p15card)
 }
 
 
+int
+sc_pkcs15_encode_entry(struct sc_context *ctx, const struct sc_pkcs15_object *obj,
+		int (*append)(struct sc_context *, const struct sc_pkcs15_object *,
+			struct sc_asn1_encoding *),
+		unsigned char **buf, size_t *bufsize)
+{
+	struct sc_asn1_encoding enc;
+	int r;
+
+	_sc_asn1_encoding_init(&enc);
+	r = append(ctx, obj, &enc);
+	if (r == 0)
+		r = _sc_asn1_encoding_finish(&enc, buf, bufsize);
+	_sc_asn1_encoding_free(&enc);
+	return r;
+}
+
+
 int
 sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
 		unsigned char **buf_out, size_t *bufsize_out)
 {
-	unsigned char *buf = NULL, *tmp = NULL, *p;
-	size_t bufsize = 0, tmpsize;
+	struct sc_asn1_encoding enc;
+	unsigned char *buf = NULL, *p;
+	size_t bufsize = 0, allocated = 0;
 	const struct sc_pkcs15_object *obj;
 	int (* func)(struct sc_context *, const struct sc_pkcs15_object *nobj,
-		     unsigned char **nbuf, size_t *nbufsize) = NULL;
-	int r;
+		     struct sc_asn1_encoding *nenc) = NULL;
+	int r = 0;
 
 	if (p15card == NULL || p15card->magic != SC_PKCS15_CARD_MAGIC) {
 		return SC_ERROR_INVALID_ARGUMENTS;
 	}
 	switch (df->type) {
 	case SC_PKCS15_PRKDF:
-		func = sc_pkcs15_encode_prkdf_entry;
+		func = sc_pkcs15_append_prkdf_entry;
 		break;
 	case SC_PKCS15_PUKDF:
 	case SC_PKCS15_PUKDF_TRUSTED:
-		func = sc_pkcs15_encode_pukdf_entry;
+		func = sc_pkcs15_append_pukdf_entry;
 		break;
 	case SC_PKCS15_SKDF:
-		func = sc_pkcs15_encode_skdf_entry;
+		func = sc_pkcs15_append_skdf_entry;
 		break;
 	case SC_PKCS15_CDF:
 	case SC_PKCS15_CDF_TRUSTED:
 	case SC_PKCS15_CDF_USEFUL:
-		func = sc_pkcs15_encode_cdf_entry;
+		func = sc_pkcs15_append_cdf_entry;
 		break;
 	case SC_PKCS15_DODF:
-		func = sc_pkcs15_encode_dodf_entry;
+		func = sc_pkcs15_append_dodf_entry;
 		break;
 	case SC_PKCS15_AODF:
-		func = sc_pkcs15_encode_aodf_entry;
+		func = sc_pkcs15_append_aodf_entry;
 		break;
 	}
 	if (func == NULL) {
@@ -2080,32 +2200,36 @@ sc_pkcs15_encode_df(struct sc_context *ctx, struct sc_pkcs15_card *p15card, stru
 		*bufsize_out = 0;
 		return 0;
 	}
+	/* Each entry is sized and then written directly into the DF, which
+	 * grows geometrically. Keeping the nodes of all entries until the
+	 * DF size is known costs more than the few reallocs. */
+	_sc_asn1_encoding_init(&enc);
 	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
 		if (obj->df != df)
 			continue;
-		r = func(ctx, obj, &tmp, &tmpsize);
-		if (r) {
-			free(tmp);
-			free(buf);
-			return r;
-		}
-		if (!tmpsize)
-			continue;
-		p = (u8 *) realloc(buf, bufsize + tmpsize);
-		if (!p) {
-			free(tmp);
-			free(buf);
-			return SC_ERROR_OUT_OF_MEMORY;
+		r = func(ctx, obj, &enc);
+		if (r)
+			break;
+		if (bufsize + enc.len > allocated) {
+			allocated = MAX(2 * allocated, bufsize + enc.len);
+			p = realloc(buf, allocated);
+			if (p == NULL) {
+				r = SC_ERROR_OUT_OF_MEMORY;
+				break;
+			}
+			buf = p;
 		}
-		buf = p;
-		memcpy(buf + bufsize, tmp, tmpsize);
-		free(tmp);
-		tmp = NULL;
-		bufsize += tmpsize;
+		_sc_asn1_encoding_write(&enc, buf + bufsize);
+		bufsize += enc.len;
+		_sc_asn1_encoding_free(&enc);
+	}
+	_sc_asn1_encoding_free(&enc);
+	if (r) {
+		free(buf);
+		return r;
 	}
 	*buf_out = buf;
 	*bufsize_out = bufsize;
-
 	return 0;
 }
 
@@ -2119,6 +2243,7 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 	size_t bufsize;
 	int r;
 	struct sc_pkcs15_object *obj = NULL;
+	struct sc_pkcs15_df_data *df_data = NULL;
 	int (* func)(struct sc_pkcs15_card *, struct sc_pkcs15_object *,
 		     const u8 **nbuf, size_t *nbufsize) = NULL;
 
@@ -2156,6 +2281,19 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 	r = sc_pkcs15_read_file(p15card, &df->path, &buf, &bufsize, 0);
 	LOG_TEST_RET(ctx, r, "pkcs15 read file failed");
 
+	/* Certificates stored in the CDF point into the DF contents, which are
+	 * kept as long as one of them does */
+	if (func == sc_pkcs15_decode_cdf_entry) {
+		df_data = calloc(1, sizeof(*df_data));
+		if (df_data == NULL) {
+			free(buf);
+			LOG_FUNC_RETURN(ctx, SC_ERROR_OUT_OF_MEMORY);
+		}
+		df_data->refs = 1;
+		df_data->data = buf;
+		df_data->len = bufsize;
+	}
+
 	p = buf;
 	while (bufsize && *p != 0x00) {
 
@@ -2164,7 +2302,10 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 			r = SC_ERROR_OUT_OF_MEMORY;
 			goto ret;
 		}
-		r = func(p15card, obj, &p, &bufsize);
+		if (df_data != NULL)
+			r = sc_pkcs15_decode_cdf_entry_borrow(p15card, obj, &p, &bufsize, df_data);
+		else
+			r = func(p15card, obj, &p, &bufsize);
 		if (r) {
 			free(obj);
 			if (r == SC_ERROR_ASN1_END_OF_CONTENTS) {
@@ -2178,9 +2319,7 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		obj->df = df;
 		r = sc_pkcs15_add_object(p15card, obj);
 		if (r) {
-			if (obj->data)
-				free(obj->data);
-			free(obj);
+			sc_pkcs15_free_object(obj);
 			sc_log(ctx, "%s: Error adding object", sc_strerror(r));
 			goto ret;
 		}
@@ -2194,7 +2333,17 @@ sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
 		r = 0;
 ret:
 	df->enumerated = 1;
-	free(buf);
+	if (df_data != NULL)
+		sc_pkcs15_df_data_release(df_data);
+	else
+		free(buf);
+	if (r == SC_SUCCESS) {
+		df->parsed = 1;
+		if (use_object_snapshot(p15card) && p15card->use_shared_cache)
+			sc_pkcs15_shared_cache_objects(p15card);
+		if (use_object_snapshot(p15card) && p15card->opts.use_file_cache)
+			sc_pkcs15_cache_objects(p15card);
+	}
 	LOG_FUNC_RETURN(ctx, r);
 }
 
@@ -2418,6 +2567,91 @@ sc_decode_do53(sc_context_t *ctx, u8 **data, size_t *data_len,
 }
 
 
+/* Returns the EF at path read as a whole, NULL if it cannot be read ahead */
+static struct sc_pkcs15_readahead_ef *
+read_ahead_ef(struct sc_pkcs15_card *p15card, const struct sc_path *path)
+{
+	struct sc_pkcs15_readahead *ra = &p15card->readahead;
+	struct sc_pkcs15_readahead_ef *ef;
+	struct sc_file *file = NULL;
+	int r;
+
+	for (ef = ra->efs; ef != NULL; ef = ef->next)
+		if (ef->path.type == path->type && sc_compare_path(&ef->path, path)
+				&& ef->path.aid.len == path->aid.len
+				&& !memcmp(ef->path.aid.value, path->aid.value, path->aid.len))
+			return ef->data != NULL ? ef : NULL;
+
+	ef = calloc(1, sizeof(*ef));
+	if (ef == NULL)
+		return NULL;
+	ef->path = *path;
+	/* EFs that cannot be read as a whole are remembered too, so they are
+	 * not selected once more for every DF in them */
+	ef->next = ra->efs;
+	ra->efs = ef;
+
+	r = sc_select_file(p15card->card, path, &file);
+	if (r != SC_SUCCESS)
+		return NULL;
+	if (file->ef_structure != SC_FILE_EF_TRANSPARENT
+			|| file->size == 0 || file->size > MAX_FILE_SIZE) {
+		sc_file_free(file);
+		return NULL;
+	}
+	ef->data = malloc(file->size);
+	if (ef->data == NULL) {
+		sc_file_free(file);
+		return NULL;
+	}
+	r = sc_read_binary(p15card->card, 0, ef->data, file->size, 0);
+	sc_file_free(file);
+	if (r <= 0) {
+		free(ef->data);
+		ef->data = NULL;
+		return NULL;
+	}
+	ef->len = r;
+	return ef;
+}
+
+
+/* Returns 1 with the part of the EF at in_path from the EF read ahead as a
+ * whole, 0 if in_path is not to be read ahead */
+static int
+read_ahead(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
+		unsigned char **buf, size_t *buflen)
+{
+	struct sc_pkcs15_readahead_ef *ef;
+	struct sc_path path;
+	size_t offset, len;
+
+	if (!p15card->readahead.active || in_path->count < 0)
+		return 0;
+	path = *in_path;
+	path.index = 0;
+	path.count = -1;
+	ef = read_ahead_ef(p15card, &path);
+	if (ef == NULL)
+		return 0;
+
+	offset = in_path->index;
+	len = in_path->count;
+	/* Make sure we're within proper bounds */
+	if (offset >= ef->len || len > ef->len - offset)
+		return SC_ERROR_INVALID_ASN1_OBJECT;
+	*buf = NULL;
+	*buflen = len;
+	if (len) {
+		*buf = malloc(len);
+		if (*buf == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		memcpy(*buf, ef->data + offset, len);
+	}
+	return 1;
+}
+
+
 int
 sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_path,
 		unsigned char **buf, size_t *buflen, int private_data)
@@ -2437,23 +2671,33 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 	sc_log(ctx, "path=%s, index=%u, count=%d", sc_print_path(in_path), in_path->index, in_path->count);
 
 	r = -1; /* file state: not in cache */
-	if (p15card->opts.use_file_cache
+	if (p15card->use_shared_cache && !private_data)
+		r = sc_pkcs15_shared_read_file(p15card, in_path, &data, &len);
+	if (r && p15card->opts.use_file_cache
 	    && ((p15card->opts.use_file_cache & SC_PKCS15_OPTS_CACHE_ALL_FILES) || !private_data)) {
 		r = sc_pkcs15_read_cached_file(p15card, in_path, &data, &len);
+		if (!r && p15card->use_shared_cache && !private_data)
+			sc_pkcs15_shared_cache_file(p15card, in_path, data, len);
+	}
+	if (!r && in_path->aid.len > 0 && in_path->len >= 2)   {
+		struct sc_path parent = *in_path;
 
-		if (!r && in_path->aid.len > 0 && in_path->len >= 2)   {
-			struct sc_path parent = *in_path;
-
-			parent.len -= 2;
-			parent.type = SC_PATH_TYPE_PATH;
-			r = sc_select_file(p15card->card, &parent, NULL);
-		}
+		parent.len -= 2;
+		parent.type = SC_PATH_TYPE_PATH;
+		r = sc_select_file(p15card->card, &parent, NULL);
 	}
 
 	if (r) {
 		r = sc_lock(p15card->card);
 		if (r)
 			goto fail;
+		if (!private_data) {
+			r = read_ahead(p15card, in_path, &data, &len);
+			if (r < 0)
+				goto fail_unlock;
+			if (r > 0)
+				goto read_done;
+		}
 		r = sc_select_file(p15card->card, in_path, &file);
 		if (r)
 			goto fail_unlock;
@@ -2557,6 +2801,7 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 			/* sc_read_binary may return less than requested */
 			len = r;
 		}
+read_done:
 		sc_unlock(p15card->card);
 
 		sc_file_free(file);
@@ -2565,6 +2810,8 @@ sc_pkcs15_read_file(struct sc_pkcs15_card *p15card, const struct sc_path *in_pat
 		    && ((p15card->opts.use_file_cache & SC_PKCS15_OPTS_CACHE_ALL_FILES) || !private_data)) {
 			sc_pkcs15_cache_file(p15card, in_path, data, len);
 		}
+		if (len && p15card->use_shared_cache && !private_data)
+			sc_pkcs15_shared_cache_file(p15card, in_path, data, len);
 		if (len == 0) {
 			free(data);
 			data = NULL;
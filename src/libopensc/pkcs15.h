@@ -287,6 +287,14 @@ struct sc_pkcs15_cert {
 };
 typedef struct sc_pkcs15_cert sc_pkcs15_cert_t;
 
+/* Contents of a DF that the objects decoded from it point into instead of
+ * owning copies of their fields. Freed with the last reference. */
+struct sc_pkcs15_df_data {
+	unsigned int refs;
+	u8 *data;
+	size_t len;
+};
+
 struct sc_pkcs15_cert_info {
 	struct sc_pkcs15_id id;	/* correlates to private key id */
 	int authority;		/* boolean */
@@ -294,6 +302,8 @@ struct sc_pkcs15_cert_info {
 	struct sc_path path;
 
 	struct sc_pkcs15_der value;
+	/* If set, value points into it and is not owned */
+	struct sc_pkcs15_df_data *value_data;
 };
 typedef struct sc_pkcs15_cert_info sc_pkcs15_cert_info_t;
 
@@ -512,6 +522,7 @@ struct sc_pkcs15_df {
 	int enumerated;
 
 	struct sc_pkcs15_df *next, *prev;
+	int parsed;	/* all entries were decoded, see sc_pkcs15_cache_objects() */
 };
 typedef struct sc_pkcs15_df sc_pkcs15_df_t;
 
@@ -596,6 +607,23 @@ typedef struct sc_pkcs15_card {
 
 	struct sc_pkcs15_operations ops;
 
+	int snapshot_read;	/* objects loaded by sc_pkcs15_read_cached_objects() */
+	struct sc_pkcs15_cache_pack *cache_pack;	/* mapped pack of cached files */
+	int use_file_cache_pack;	/* file_cache_pack option */
+	struct sc_pkcs15_shared_entry *shared_entry;	/* process wide cache entry */
+	int use_shared_cache;		/* use_shared_caching option */
+
+	/* Transparent EFs read as a whole while the card is locked to parse
+	 * several DFs, parts of them are then served without SELECT */
+	struct sc_pkcs15_readahead {
+		int active;
+		struct sc_pkcs15_readahead_ef {
+			struct sc_path path;
+			unsigned char *data;	/* NULL if the EF is not read ahead */
+			size_t len;
+			struct sc_pkcs15_readahead_ef *next;
+		} *efs;
+	} readahead;
 } sc_pkcs15_card_t;
 
 /* flags suitable for sc_pkcs15_tokeninfo_t */
@@ -685,6 +713,24 @@ int sc_pkcs15_compute_signature(struct sc_pkcs15_card *p15card,
 				unsigned long alg_flags, const u8 *in,
 				size_t inlen, u8 *out, size_t outlen, void *pMechanism);
 
+struct sc_pkcs15_sign_request {
+	const u8 *in;
+	size_t inlen;
+	u8 *out;
+	size_t outlen;	/* size of out, on success the length of the signature */
+};
+
+/*
+ * Signs a batch of inputs with the same key and mechanism under one card
+ * lock, setting up the security environment only once. Returns the number of
+ * signatures computed, fewer than count if a later request failed, or the
+ * error of the first request.
+ */
+int sc_pkcs15_compute_signatures(struct sc_pkcs15_card *p15card,
+				const struct sc_pkcs15_object *prkey_obj,
+				unsigned long alg_flags, struct sc_pkcs15_sign_request *requests,
+				size_t count, void *pMechanism);
+
 int sc_pkcs15_encrypt_sym(struct sc_pkcs15_card *p15card,
 		const struct sc_pkcs15_object *obj,
 		unsigned long flags,
@@ -875,6 +921,34 @@ int sc_pkcs15_encode_aodf_entry(struct sc_context *ctx,
 			const struct sc_pkcs15_object *obj, u8 **buf,
 			size_t *bufsize);
 
+/* The entries encoded into nodes that sc_pkcs15_encode_df() writes directly
+ * into the DF, see _sc_asn1_encode_append() */
+struct sc_asn1_encoding;
+int sc_pkcs15_append_cdf_entry(struct sc_context *ctx,
+			const struct sc_pkcs15_object *obj,
+			struct sc_asn1_encoding *enc);
+int sc_pkcs15_append_prkdf_entry(struct sc_context *ctx,
+			const struct sc_pkcs15_object *obj,
+			struct sc_asn1_encoding *enc);
+int sc_pkcs15_append_pukdf_entry(struct sc_context *ctx,
+			const struct sc_pkcs15_object *obj,
+			struct sc_asn1_encoding *enc);
+int sc_pkcs15_append_skdf_entry(struct sc_context *ctx,
+			const struct sc_pkcs15_object *obj,
+			struct sc_asn1_encoding *enc);
+int sc_pkcs15_append_dodf_entry(struct sc_context *ctx,
+			const struct sc_pkcs15_object *obj,
+			struct sc_asn1_encoding *enc);
+int sc_pkcs15_append_aodf_entry(struct sc_context *ctx,
+			const struct sc_pkcs15_object *obj,
+			struct sc_asn1_encoding *enc);
+int sc_pkcs15_encode_entry(struct sc_context *ctx,
+			const struct sc_pkcs15_object *obj,
+			int (*append)(struct sc_context *,
+				const struct sc_pkcs15_object *,
+				struct sc_asn1_encoding *),
+			u8 **buf, size_t *bufsize);
+
 int sc_pkcs15_parse_df(struct sc_pkcs15_card *p15card,
 		       struct sc_pkcs15_df *df);
 int sc_pkcs15_read_df(struct sc_pkcs15_card *p15card,
@@ -882,6 +956,12 @@ int sc_pkcs15_read_df(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_decode_cdf_entry(struct sc_pkcs15_card *p15card,
 			       struct sc_pkcs15_object *obj,
 			       const u8 **buf, size_t *bufsize);
+/* Like sc_pkcs15_decode_cdf_entry(), with a direct value pointing into
+ * df_data, which *buf is part of */
+int sc_pkcs15_decode_cdf_entry_borrow(struct sc_pkcs15_card *p15card,
+			       struct sc_pkcs15_object *obj,
+			       const u8 **buf, size_t *bufsize,
+			       struct sc_pkcs15_df_data *df_data);
 int sc_pkcs15_decode_dodf_entry(struct sc_pkcs15_card *p15card,
 			       struct sc_pkcs15_object *obj,
 			       const u8 **buf, size_t *bufsize);
@@ -922,6 +1002,8 @@ void sc_pkcs15_free_cert_info(sc_pkcs15_cert_info_t *cert);
 void sc_pkcs15_free_data_info(sc_pkcs15_data_info_t *data);
 void sc_pkcs15_free_auth_info(sc_pkcs15_auth_info_t *auth_info);
 void sc_pkcs15_free_object(struct sc_pkcs15_object *obj);
+struct sc_pkcs15_df_data *sc_pkcs15_df_data_hold(struct sc_pkcs15_df_data *df_data);
+void sc_pkcs15_df_data_release(struct sc_pkcs15_df_data *df_data);
 
 /* Generic file i/o */
 int sc_pkcs15_read_file(struct sc_pkcs15_card *p15card,
@@ -935,6 +1017,20 @@ int sc_pkcs15_read_cached_file(struct sc_pkcs15_card *p15card,
 int sc_pkcs15_cache_file(struct sc_pkcs15_card *p15card,
 			 const struct sc_path *path,
 			 const u8 *buf, size_t bufsize);
+int sc_pkcs15_read_cached_objects(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_cache_objects(struct sc_pkcs15_card *p15card);
+void sc_pkcs15_cache_release(struct sc_pkcs15_card *p15card);
+
+/* Process wide cache shared by all contexts */
+int sc_pkcs15_shared_read_objects(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_shared_cache_objects(struct sc_pkcs15_card *p15card);
+int sc_pkcs15_shared_read_file(struct sc_pkcs15_card *p15card,
+			const struct sc_path *path,
+			u8 **buf, size_t *bufsize);
+int sc_pkcs15_shared_cache_file(struct sc_pkcs15_card *p15card,
+			const struct sc_path *path,
+			const u8 *buf, size_t bufsize);
+void sc_pkcs15_shared_cache_release(struct sc_pkcs15_card *p15card);
 
 /* PKCS #15 ID handling functions */
 int sc_pkcs15_compare_id(const struct sc_pkcs15_id *id1,
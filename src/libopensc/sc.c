@@ -27,9 +27,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-#ifdef HAVE_SYS_MMAN_H
-#include <sys/mman.h>
-#endif
 #ifdef ENABLE_OPENSSL
 #include <openssl/crypto.h>     /* for OPENSSL_cleanse */
 #endif
@@ -45,16 +42,10 @@ static const char *sc_version = "(undef)";
 
 #ifdef _WIN32
 #include <windows.h>
-#define PAGESIZE 0
 #else
-#include <sys/mman.h>
 #include <limits.h>
 #include <unistd.h>
-#ifndef PAGESIZE
-#define PAGESIZE 0
-#endif
 #endif
-static size_t page_size = PAGESIZE;
 
 const char *sc_get_version(void)
 {
@@ -348,6 +339,9 @@ int sc_detect_card_presence(sc_reader_t *reader)
 	if (r && !(r & SC_READER_CARD_PRESENT))
 		LOG_FUNC_RETURN(reader->ctx, SC_ERROR_INTERNAL);
 
+	if (r >= 0 && (!(r & SC_READER_CARD_PRESENT) || (r & SC_READER_CARD_CHANGED)))
+		sc_pkcs15_shared_cache_invalidate(reader->name);
+
 	LOG_FUNC_RETURN(reader->ctx, r);
 }
 
@@ -897,55 +891,6 @@ int _sc_parse_atr(sc_reader_t *reader)
 	return SC_SUCCESS;
 }
 
-static void init_page_size()
-{
-	if (page_size == 0) {
-#ifdef _WIN32
-		SYSTEM_INFO system_info;
-		GetSystemInfo(&system_info);
-		page_size = system_info.dwPageSize;
-#else
-		page_size = sysconf(_SC_PAGESIZE);
-		if ((long) page_size < 0) {
-			page_size = 0;
-		}
-#endif
-	}
-}
-
-void *sc_mem_secure_alloc(size_t len)
-{
-	void *p;
-
-	init_page_size();
-	if (page_size > 0) {
-		size_t pages = (len + page_size - 1) / page_size;
-		len = pages * page_size;
-	}
-
-	p = calloc(1, len);
-	if (p == NULL) {
-		return NULL;
-	}
-#ifdef _WIN32
-	VirtualLock(p, len);
-#else
-	mlock(p, len);
-#endif
-
-	return p;
-}
-
-void sc_mem_secure_free(void *ptr, size_t len)
-{
-#ifdef _WIN32
-	VirtualUnlock(ptr, len);
-#else
-	munlock(ptr, len);
-#endif
-	free(ptr);
-}
-
 void sc_mem_clear(void *ptr, size_t len)
 {
 	if (len > 0)   {
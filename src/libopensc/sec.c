@@ -35,6 +35,7 @@
 int sc_decipher(sc_card_t *card,
 		const u8 * crgram, size_t crgram_len, u8 * out, size_t outlen)
 {
+	unsigned long long start;
 	int r;
 
 	if (card == NULL) {
@@ -46,7 +47,9 @@ int sc_decipher(sc_card_t *card,
 	LOG_FUNC_CALLED(card->ctx);
 	if (card->ops->decipher == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	start = sc_latency_begin(card->ctx);
 	r = card->ops->decipher(card, crgram, crgram_len, out, outlen);
+	sc_latency_end(card->ctx, SC_LATENCY_DECIPHER, start);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -54,6 +57,7 @@ int sc_compute_signature(sc_card_t *card,
 			 const u8 * data, size_t datalen,
 			 u8 * out, size_t outlen)
 {
+	unsigned long long start;
 	int r;
 
 	if (card == NULL) {
@@ -62,7 +66,9 @@ int sc_compute_signature(sc_card_t *card,
 	LOG_FUNC_CALLED(card->ctx);
 	if (card->ops->compute_signature == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	start = sc_latency_begin(card->ctx);
 	r = card->ops->compute_signature(card, data, datalen, out, outlen);
+	sc_latency_end(card->ctx, SC_LATENCY_COMPUTE_SIGNATURE, start);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
@@ -100,6 +106,7 @@ int sc_set_security_env(sc_card_t *card,
 			const sc_security_env_t *env,
 			int se_num)
 {
+	unsigned long long start;
 	int r;
 
 	if (card == NULL) {
@@ -108,7 +115,9 @@ int sc_set_security_env(sc_card_t *card,
 	LOG_FUNC_CALLED(card->ctx);
 	if (card->ops->set_security_env == NULL)
 		SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, SC_ERROR_NOT_SUPPORTED);
+	start = sc_latency_begin(card->ctx);
 	r = card->ops->set_security_env(card, env, se_num);
+	sc_latency_end(card->ctx, SC_LATENCY_SET_SECURITY_ENV, start);
         SC_FUNC_RETURN(card->ctx, SC_LOG_DEBUG_VERBOSE, r);
 }
 
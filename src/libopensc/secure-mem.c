@@ -0,0 +1,326 @@
+/*
+ * secure-mem.c: Locked memory for PINs, keys and other secrets
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "internal.h"
+
+/*
+ * Small secrets are carved out of pools that are locked in memory once, in
+ * units of SECURE_UNIT bytes. Every unit is wiped when it is freed, so pools
+ * only ever hand out zeroed memory. Buffers larger than a quarter of a pool
+ * get pages of their own, as before. A pool that cannot be locked, because
+ * RLIMIT_MEMLOCK is reached for example, is used unlocked: the memory is
+ * still wiped on free, it may just be swapped out meanwhile.
+ */
+#define SECURE_POOL_SIZE	32768
+#define SECURE_UNIT		32
+
+#if !defined(_WIN32) && !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct secure_pool {
+	u8 *base;
+	size_t size;
+	size_t units;
+	size_t used;		/* units handed out */
+	size_t hint;		/* no unit below is free */
+	int locked;
+	uint64_t *used_map;	/* units handed out */
+	uint64_t *end_map;	/* last unit of every allocation */
+	struct secure_pool *next;
+};
+
+static struct secure_pool *pools = NULL;
+static struct sc_mem_secure_stats stats;
+static size_t page_size = 0;
+
+#if defined(HAVE_PTHREAD)
+static pthread_mutex_t secure_lock = PTHREAD_MUTEX_INITIALIZER;
+#define secure_mem_lock()	pthread_mutex_lock(&secure_lock)
+#define secure_mem_unlock()	pthread_mutex_unlock(&secure_lock)
+#elif defined(_WIN32)
+static SRWLOCK secure_lock = SRWLOCK_INIT;
+#define secure_mem_lock()	AcquireSRWLockExclusive(&secure_lock)
+#define secure_mem_unlock()	ReleaseSRWLockExclusive(&secure_lock)
+#else
+#define secure_mem_lock()
+#define secure_mem_unlock()
+#endif
+
+#define unit_bit(map, i)	(((map)[(i) / 64] >> ((i) % 64)) & 1)
+#define unit_set(map, i)	((map)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+#define unit_clear(map, i)	((map)[(i) / 64] &= ~((uint64_t)1 << ((i) % 64)))
+
+static void init_page_size(void)
+{
+	if (page_size == 0) {
+#ifdef _WIN32
+		SYSTEM_INFO system_info;
+		GetSystemInfo(&system_info);
+		page_size = system_info.dwPageSize;
+#else
+		long size = sysconf(_SC_PAGESIZE);
+		page_size = size > 0 ? (size_t)size : 1;
+#endif
+	}
+}
+
+static size_t round_pages(size_t len)
+{
+	return (len + page_size - 1) / page_size * page_size;
+}
+
+static int lock_pages(void *p, size_t len)
+{
+#ifdef _WIN32
+	return VirtualLock(p, len) ? 0 : -1;
+#else
+	return mlock(p, len);
+#endif
+}
+
+static void unlock_pages(void *p, size_t len)
+{
+#ifdef _WIN32
+	VirtualUnlock(p, len);
+#else
+	munlock(p, len);
+#endif
+}
+
+static void pool_free(struct secure_pool *pool)
+{
+	if (pool->base != NULL) {
+		if (pool->locked)
+			unlock_pages(pool->base, pool->size);
+#ifdef _WIN32
+		VirtualFree(pool->base, 0, MEM_RELEASE);
+#else
+		munmap(pool->base, pool->size);
+#endif
+	}
+	free(pool->used_map);
+	free(pool->end_map);
+	free(pool);
+}
+
+static struct secure_pool *pool_new(void)
+{
+	struct secure_pool *pool;
+	size_t words;
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+	pool->size = round_pages(SECURE_POOL_SIZE);
+	pool->units = pool->size / SECURE_UNIT;
+	words = (pool->units + 63) / 64;
+	pool->used_map = calloc(words, sizeof(uint64_t));
+	pool->end_map = calloc(words, sizeof(uint64_t));
+	if (pool->used_map == NULL || pool->end_map == NULL) {
+		pool_free(pool);
+		return NULL;
+	}
+
+	/* Fresh anonymous pages are zeroed */
+#ifdef _WIN32
+	pool->base = VirtualAlloc(NULL, pool->size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	pool->base = mmap(NULL, pool->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pool->base == MAP_FAILED)
+		pool->base = NULL;
+#endif
+	if (pool->base == NULL) {
+		pool_free(pool);
+		return NULL;
+	}
+#if defined(MADV_DONTDUMP)
+	madvise(pool->base, pool->size, MADV_DONTDUMP);
+#endif
+
+	pool->locked = lock_pages(pool->base, pool->size) == 0;
+	stats.pools++;
+	stats.pool_bytes += pool->size;
+	if (pool->locked)
+		stats.pool_locked_bytes += pool->size;
+	else
+		stats.lock_failures++;
+	return pool;
+}
+
+/* First fit of n free units */
+static void *pool_alloc(struct secure_pool *pool, size_t n)
+{
+	size_t i = pool->hint, run = 0, start;
+
+	while (i < pool->units) {
+		if (run == 0 && i % 64 == 0 && pool->used_map[i / 64] == UINT64_MAX) {
+			i += 64;
+			continue;
+		}
+		if (unit_bit(pool->used_map, i))
+			run = 0;
+		else if (++run == n)
+			break;
+		i++;
+	}
+	if (run < n)
+		return NULL;
+
+	start = i + 1 - n;
+	for (i = start; i < start + n; i++)
+		unit_set(pool->used_map, i);
+	unit_set(pool->end_map, start + n - 1);
+	if (start == pool->hint)
+		pool->hint = start + n;
+	pool->used += n;
+	return pool->base + start * SECURE_UNIT;
+}
+
+static size_t pool_release(struct secure_pool *pool, u8 *p)
+{
+	size_t start = (p - pool->base) / SECURE_UNIT, i;
+
+	if ((size_t)(p - pool->base) % SECURE_UNIT != 0 || !unit_bit(pool->used_map, start))
+		return 0;
+	for (i = start; !unit_bit(pool->end_map, i); i++)
+		unit_clear(pool->used_map, i);
+	unit_clear(pool->used_map, i);
+	unit_clear(pool->end_map, i);
+	i++;
+
+	sc_mem_clear(p, (i - start) * SECURE_UNIT);
+	if (start < pool->hint)
+		pool->hint = start;
+	pool->used -= i - start;
+	return i - start;
+}
+
+void *sc_mem_secure_alloc(size_t len)
+{
+	struct secure_pool *pool, **last;
+	size_t units;
+	void *p = NULL;
+
+	init_page_size();
+	if (len > round_pages(SECURE_POOL_SIZE) / 4) {
+		len = round_pages(len);
+		p = calloc(1, len);
+		if (p == NULL)
+			return NULL;
+		lock_pages(p, len);
+		secure_mem_lock();
+		stats.allocs++;
+		stats.page_allocs++;
+		secure_mem_unlock();
+		return p;
+	}
+
+	units = len ? (len + SECURE_UNIT - 1) / SECURE_UNIT : 1;
+	secure_mem_lock();
+	for (last = &pools; *last != NULL; last = &(*last)->next) {
+		p = pool_alloc(*last, units);
+		if (p != NULL)
+			break;
+	}
+	if (p == NULL) {
+		pool = pool_new();
+		if (pool != NULL) {
+			*last = pool;
+			p = pool_alloc(pool, units);
+		}
+	}
+	if (p != NULL) {
+		stats.allocs++;
+		stats.pool_allocs++;
+		stats.pool_used_bytes += units * SECURE_UNIT;
+		if (stats.pool_used_bytes > stats.pool_peak_bytes)
+			stats.pool_peak_bytes = stats.pool_used_bytes;
+	}
+	secure_mem_unlock();
+	return p;
+}
+
+void sc_mem_secure_free(void *ptr, size_t len)
+{
+	struct secure_pool *pool, **prev;
+	u8 *p = ptr;
+	size_t units;
+
+	if (ptr == NULL)
+		return;
+
+	secure_mem_lock();
+	for (prev = &pools; (pool = *prev) != NULL; prev = &pool->next) {
+		if (p < pool->base || p >= pool->base + pool->size)
+			continue;
+		units = pool_release(pool, p);
+		if (units != 0) {
+			stats.frees++;
+			stats.pool_used_bytes -= units * SECURE_UNIT;
+		}
+		/* Keep the first pool around, give back the others when empty */
+		if (pool->used == 0 && pool != pools) {
+			*prev = pool->next;
+			stats.pools--;
+			stats.pool_bytes -= pool->size;
+			if (pool->locked)
+				stats.pool_locked_bytes -= pool->size;
+			pool_free(pool);
+		}
+		secure_mem_unlock();
+		return;
+	}
+	stats.frees++;
+	secure_mem_unlock();
+
+	/* Pages of its own, or memory that was not allocated here at all */
+	sc_mem_clear(ptr, len);
+	init_page_size();
+	if (len > 0)
+		unlock_pages(ptr, round_pages(len));
+	free(ptr);
+}
+
+int sc_mem_secure_get_stats(struct sc_mem_secure_stats *out)
+{
+	if (out == NULL)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	secure_mem_lock();
+	*out = stats;
+	secure_mem_unlock();
+	return SC_SUCCESS;
+}
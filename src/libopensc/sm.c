@@ -31,6 +31,12 @@
 #include "asn1.h"
 #include "sm.h"
 
+#if defined(ENABLE_SM) && defined(ENABLE_OPENSSL)
+#include <limits.h>
+#include <openssl/evp.h>
+#include "sc-ossl-compat.h"
+#endif
+
 #ifdef ENABLE_SM
 static const struct sc_asn1_entry c_asn1_sm_response[4] = {
 	{ "encryptedData",	SC_ASN1_OCTET_STRING,   SC_ASN1_CTX | 7,        SC_ASN1_OPTIONAL,       NULL, NULL },
@@ -128,6 +134,7 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 {
 	struct sc_context *ctx  = card->ctx;
 	struct sc_apdu *sm_apdu = NULL;
+	unsigned long long start;
 	int rv;
 
 	LOG_FUNC_CALLED(ctx);
@@ -136,11 +143,18 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 		LOG_FUNC_RETURN(ctx, SC_ERROR_NOT_SUPPORTED);
 
 	/* get SM encoded APDU */
+	start = sc_latency_begin(ctx);
 	rv = card->sm_ctx.ops.get_sm_apdu(card, apdu, &sm_apdu);
+	sc_latency_end(ctx, SC_LATENCY_SM_WRAP, start);
 	if (rv == SC_ERROR_SM_NOT_APPLIED)   {
 		/* SM wrap of this APDU is ignored by card driver.
 		 * Send plain APDU to the reader driver */
+		uint64_t trace = sc_apdu_trace_begin();
+
+		start = sc_latency_begin(ctx);
 		rv = card->reader->ops->transmit(card->reader, apdu);
+		sc_latency_end(ctx, SC_LATENCY_CARD, start);
+		sc_apdu_trace_end(card, apdu, rv, trace);
 		LOG_FUNC_RETURN(ctx, rv);
 	} else {
 		if (rv < 0)
@@ -166,7 +180,9 @@ sc_sm_single_transmit(struct sc_card *card, struct sc_apdu *apdu)
 	}
 
 	/* decode SM answer and free temporary SM related data */
+	start = sc_latency_begin(ctx);
 	rv = card->sm_ctx.ops.free_sm_apdu(card, apdu, &sm_apdu);
+	sc_latency_end(ctx, SC_LATENCY_SM_UNWRAP, start);
 	if (rv < 0)
 		sc_sm_stop(card);
 
@@ -188,6 +204,88 @@ sc_sm_stop(struct sc_card *card)
     return r;
 }
 
+#ifdef ENABLE_OPENSSL
+int
+sc_sm_cipher_init(struct sc_context *ctx, struct sm_cipher *cipher,
+		const char *algorithm, const unsigned char *key, int encrypt)
+{
+	EVP_CIPHER_CTX *cctx = NULL;
+	EVP_CIPHER *alg = NULL;
+	int r = SC_SUCCESS;
+
+	if (!ctx || !cipher || !algorithm || !key)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	sc_sm_cipher_free(cipher);
+
+	cctx = EVP_CIPHER_CTX_new();
+	alg = sc_evp_cipher(ctx, algorithm);
+	if (!cctx || !alg
+			|| EVP_CipherInit_ex(cctx, alg, NULL, key, NULL, encrypt) != 1
+			|| EVP_CIPHER_CTX_set_padding(cctx, 0) != 1) {
+		sc_log(ctx, "SM cipher %s: cannot set key", algorithm);
+		EVP_CIPHER_CTX_free(cctx);
+		r = SC_ERROR_INTERNAL;
+	} else {
+		cipher->evp_ctx = cctx;
+		cipher->encrypt = encrypt;
+	}
+	sc_evp_cipher_free(alg);
+	return r;
+}
+
+int
+sc_sm_cipher_crypt(struct sm_cipher *cipher, const unsigned char *iv,
+		const unsigned char *in, size_t in_len, unsigned char *out)
+{
+	EVP_CIPHER_CTX *cctx;
+	int out_len = 0;
+
+	if (!cipher || !cipher->evp_ctx || (!in && in_len) || in_len > INT_MAX)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	cctx = cipher->evp_ctx;
+	if (in_len % EVP_CIPHER_CTX_block_size(cctx) != 0)
+		return SC_ERROR_INVALID_ARGUMENTS;
+	if (in_len == 0)
+		return SC_SUCCESS;
+
+	/* Only the IV is set again, the key schedule stays */
+	if (iv && EVP_CipherInit_ex(cctx, NULL, NULL, NULL, iv, cipher->encrypt) != 1)
+		return SC_ERROR_INTERNAL;
+	if (EVP_CipherUpdate(cctx, out, &out_len, in, (int)in_len) != 1
+			|| (size_t)out_len != in_len)
+		return SC_ERROR_INTERNAL;
+	return SC_SUCCESS;
+}
+
+void
+sc_sm_cipher_free(struct sm_cipher *cipher)
+{
+	if (cipher && cipher->evp_ctx) {
+		EVP_CIPHER_CTX_free(cipher->evp_ctx);
+		cipher->evp_ctx = NULL;
+	}
+}
+#else
+int
+sc_sm_cipher_init(struct sc_context *ctx, struct sm_cipher *cipher,
+		const char *algorithm, const unsigned char *key, int encrypt)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+int
+sc_sm_cipher_crypt(struct sm_cipher *cipher, const unsigned char *iv,
+		const unsigned char *in, size_t in_len, unsigned char *out)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void
+sc_sm_cipher_free(struct sm_cipher *cipher)
+{
+}
+#endif
+
 #else
 
 int
@@ -215,4 +313,23 @@ sc_sm_stop(struct sc_card *card)
 {
     return SC_ERROR_NOT_SUPPORTED;
 }
+
+int
+sc_sm_cipher_init(struct sc_context *ctx, struct sm_cipher *cipher,
+		const char *algorithm, const unsigned char *key, int encrypt)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+int
+sc_sm_cipher_crypt(struct sm_cipher *cipher, const unsigned char *iv,
+		const unsigned char *in, size_t in_len, unsigned char *out)
+{
+	return SC_ERROR_NOT_SUPPORTED;
+}
+
+void
+sc_sm_cipher_free(struct sm_cipher *cipher)
+{
+}
 #endif
@@ -92,6 +92,17 @@ extern "C" {
 typedef unsigned char sm_des_cblock[8];
 typedef /* const */ unsigned char sm_const_des_cblock[8];
 
+/*
+ * @struct sm_cipher
+ *	Block cipher keyed once for the life of an SM session:
+ *	- cipher context holding the key schedule;
+ *	- direction.
+ */
+struct sm_cipher {
+	void *evp_ctx;
+	int encrypt;
+};
+
 /* Global Platform (SCP01) data types */
 /*
  * @struct sm_type_params_gp
@@ -193,6 +204,10 @@ struct sm_cwa_session {
 	unsigned char session_enc[16];
 	unsigned char session_mac[16];
 
+	/* session keys ready for use, see sc_sm_cipher_init() */
+	struct sm_cipher enc_cipher, dec_cipher;
+	struct sm_cipher mac_cipher, mac3_cipher;
+
 	unsigned char ssc[8];
 
 	unsigned char host_challenge[SM_SMALL_CHALLENGE_LEN];
@@ -366,6 +381,44 @@ int sc_sm_single_transmit(struct sc_card *, struct sc_apdu *);
  */
 int sc_sm_stop(struct sc_card *card);
 
+/**
+ * @brief Keys a block cipher for the life of an SM session.
+ *
+ * Padding is disabled, a cipher that was keyed before is released first.
+ *
+ * @param[in] ctx       context
+ * @param[in] cipher    cipher to key
+ * @param[in] algorithm OpenSSL name of the cipher, for example "DES-EDE-CBC"
+ * @param[in] key       key of the length of the algorithm
+ * @param[in] encrypt   1 to encrypt, 0 to decrypt
+ *
+ * @return \c SC_SUCCESS or error code if an error occurred
+ */
+int sc_sm_cipher_init(struct sc_context *ctx, struct sm_cipher *cipher,
+		const char *algorithm, const unsigned char *key, int encrypt);
+
+/**
+ * @brief Encrypts or decrypts whole blocks with a keyed cipher.
+ *
+ * @param[in]  cipher keyed cipher
+ * @param[in]  iv     IV to start with, \c NULL to continue the chain of the
+ *                    previous call or for ECB
+ * @param[in]  in     input, a multiple of the block size
+ * @param[in]  in_len length of the input
+ * @param[out] out    output of \a in_len bytes, may be \a in
+ *
+ * @return \c SC_SUCCESS or error code if an error occurred
+ */
+int sc_sm_cipher_crypt(struct sm_cipher *cipher, const unsigned char *iv,
+		const unsigned char *in, size_t in_len, unsigned char *out);
+
+/**
+ * @brief Releases a keyed cipher and wipes its key schedule.
+ *
+ * @param[in] cipher cipher, may never have been keyed
+ */
+void sc_sm_cipher_free(struct sm_cipher *cipher);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,7 @@
  */
 
 #include "config.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -62,11 +63,16 @@ struct pkcs15_slot_data {
 	}                                       \
 	attr->ulValueLen = size;
 
-#define MAX_OBJECTS	128
 struct pkcs15_fw_data {
 	struct sc_pkcs15_card *		p15_card;
-	struct pkcs15_any_object *	objects[MAX_OBJECTS];
+	struct pkcs15_any_object **	objects;	/* grown as needed */
 	unsigned int			num_objects;
+	unsigned int			max_objects;
+	unsigned long			object_seq;
+	struct sc_pkcs11_handle_map	id_index;	/* buckets of objects by ID hash */
+	struct sc_pkcs11_handle_map	subject_index;	/* certificates by subject hash */
+	struct sc_pkcs11_handle_map	issuer_index;	/* certificates by issuer hash */
+	int				index_incomplete;	/* an object could not be indexed */
 	unsigned int			locked;
 	unsigned char user_puk[64];
 	unsigned int user_puk_len;
@@ -76,6 +82,7 @@ struct pkcs15_any_object {
 	struct sc_pkcs11_object		base;
 	unsigned int			refcount;
 	size_t				size;
+	unsigned long			seq;	/* order of creation in the fw_data */
 	struct sc_pkcs15_object *	p15_object;
 	struct pkcs15_pubkey_object *	related_pubkey;
 	struct pkcs15_cert_object *	related_cert;
@@ -204,6 +211,7 @@ static const struct {
 #endif
 
 static int	__pkcs15_release_object(struct pkcs15_any_object *);
+static void	fw_index_clear(struct pkcs15_fw_data *);
 static CK_RV	register_mechanisms(struct sc_pkcs11_card *p11card);
 static CK_RV	get_public_exponent(struct sc_pkcs15_pubkey *,
 					CK_ATTRIBUTE_PTR);
@@ -383,6 +391,9 @@ pkcs15_unbind(struct sc_pkcs11_card *p11card)
 				__pkcs15_release_object(obj);
 		}
 
+		free(fw_data->objects);
+		fw_index_clear(fw_data);
+
 		unlock_card(fw_data);
 
 		if (fw_data->p15_card) {
@@ -485,6 +496,165 @@ set_cka_label(CK_ATTRIBUTE_PTR attr, char *label)
 }
 #endif
 
+/*
+ * Index of the framework objects
+ *
+ * Private keys, public keys and certificates are hashed by their ID, and
+ * certificates by their subject and issuer once their data was read. Each
+ * hash maps to the bucket of the objects having it, in the order they were
+ * created. Buckets are only candidates: the values are still compared.
+ * Once an object could not be indexed, lookups go through all objects.
+ */
+static CK_ULONG
+fw_index_key(const u8 *value, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= value[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (CK_ULONG)h;
+}
+
+static struct sc_pkcs11_bucket *
+fw_index_find(const struct sc_pkcs11_handle_map *map, const u8 *value, size_t len)
+{
+	return sc_pkcs11_handle_map_get(map, fw_index_key(value, len));
+}
+
+static void
+fw_index_add(struct pkcs15_fw_data *fw_data, struct sc_pkcs11_handle_map *map,
+		const u8 *value, size_t len, struct pkcs15_any_object *obj)
+{
+	if (sc_pkcs11_bucket_map_add(map, fw_index_key(value, len), obj, obj->seq) != 0) {
+		sc_log(context, "Object %p not indexed, looking up all objects", obj);
+		fw_data->index_incomplete = 1;
+	}
+}
+
+static void
+fw_index_del(struct sc_pkcs11_handle_map *map, const u8 *value, size_t len,
+		struct pkcs15_any_object *obj)
+{
+	sc_pkcs11_bucket_map_del(map, fw_index_key(value, len), obj);
+}
+
+static void
+fw_index_clear(struct pkcs15_fw_data *fw_data)
+{
+	sc_pkcs11_bucket_map_clear(&fw_data->id_index);
+	sc_pkcs11_bucket_map_clear(&fw_data->subject_index);
+	sc_pkcs11_bucket_map_clear(&fw_data->issuer_index);
+	fw_data->index_incomplete = 0;
+}
+
+/* Candidates of a lookup: the bucket of the value, or all objects */
+struct fw_index_iter {
+	struct pkcs15_fw_data *fw_data;
+	struct sc_pkcs11_bucket *bucket;
+	int all;
+	size_t i;
+};
+
+static struct pkcs15_any_object *
+fw_index_next(struct fw_index_iter *it)
+{
+	if (it->all)
+		return it->i < it->fw_data->num_objects ? it->fw_data->objects[it->i++] : NULL;
+	if (it->bucket != NULL && it->i < it->bucket->count)
+		return it->bucket->entries[it->i++].ptr;
+	return NULL;
+}
+
+static struct pkcs15_any_object *
+fw_index_first(struct fw_index_iter *it, struct pkcs15_fw_data *fw_data,
+		const struct sc_pkcs11_handle_map *map, const u8 *value, size_t len)
+{
+	it->fw_data = fw_data;
+	it->all = fw_data->index_incomplete;
+	it->bucket = it->all ? NULL : fw_index_find(map, value, len);
+	it->i = 0;
+	return fw_index_next(it);
+}
+
+static const struct sc_pkcs15_id *
+fw_object_id(const struct pkcs15_any_object *obj)
+{
+	if (obj->p15_object == NULL || obj->p15_object->data == NULL)
+		return NULL;
+	if (is_privkey(obj))
+		return &((struct sc_pkcs15_prkey_info *) obj->p15_object->data)->id;
+	if (is_pubkey(obj))
+		return &((struct sc_pkcs15_pubkey_info *) obj->p15_object->data)->id;
+	if (is_cert(obj))
+		return &((struct sc_pkcs15_cert_info *) obj->p15_object->data)->id;
+	return NULL;
+}
+
+/* Subject and issuer of a certificate whose data was read */
+static void
+fw_index_cert_data(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
+{
+	struct sc_pkcs15_cert *data = cert->cert_data;
+
+	if (data == NULL || !is_cert(&cert->base))
+		return;
+	if (data->subject_len)
+		fw_index_add(fw_data, &fw_data->subject_index, data->subject, data->subject_len, &cert->base);
+	if (data->issuer_len)
+		fw_index_add(fw_data, &fw_data->issuer_index, data->issuer, data->issuer_len, &cert->base);
+}
+
+static void
+fw_index_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	const struct sc_pkcs15_id *id = fw_object_id(obj);
+
+	if (id != NULL)
+		fw_index_add(fw_data, &fw_data->id_index, id->value, id->len, obj);
+	if (is_cert(obj))
+		fw_index_cert_data(fw_data, (struct pkcs15_cert_object *) obj);
+}
+
+static void
+fw_unindex_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	const struct sc_pkcs15_id *id = fw_object_id(obj);
+
+	if (id != NULL)
+		fw_index_del(&fw_data->id_index, id->value, id->len, obj);
+	if (is_cert(obj) && ((struct pkcs15_cert_object *) obj)->cert_data) {
+		struct sc_pkcs15_cert *data = ((struct pkcs15_cert_object *) obj)->cert_data;
+
+		if (data->subject_len)
+			fw_index_del(&fw_data->subject_index, data->subject, data->subject_len, obj);
+		if (data->issuer_len)
+			fw_index_del(&fw_data->issuer_index, data->issuer, data->issuer_len, obj);
+	}
+}
+
+/* Appends an object to the fw_data and indexes it */
+static int
+fw_data_add_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object *obj)
+{
+	if (fw_data->num_objects == fw_data->max_objects) {
+		unsigned int max_objects = fw_data->max_objects ? fw_data->max_objects * 2 : 32;
+		struct pkcs15_any_object **objects;
+
+		objects = realloc(fw_data->objects, max_objects * sizeof(*objects));
+		if (objects == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		fw_data->objects = objects;
+		fw_data->max_objects = max_objects;
+	}
+	obj->seq = fw_data->object_seq++;
+	fw_data->objects[fw_data->num_objects++] = obj;
+	fw_index_object(fw_data, obj);
+	return SC_SUCCESS;
+}
+
 static int
 __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 		       struct pkcs15_any_object **result,
@@ -494,19 +664,19 @@ __pkcs15_create_object(struct pkcs15_fw_data *fw_data,
 {
 	struct pkcs15_any_object *obj;
 
-	if (fw_data->num_objects >= MAX_OBJECTS)
-		return SC_ERROR_TOO_MANY_OBJECTS;
-
 	if (!(obj = calloc(1, size)))
 		return SC_ERROR_OUT_OF_MEMORY;
 
-	fw_data->objects[fw_data->num_objects++] = obj;
-
 	obj->base.ops = ops;
 	obj->p15_object = p15_object;
 	obj->refcount = 1;
 	obj->size = size;
 
+	if (fw_data_add_object(fw_data, obj) != SC_SUCCESS) {
+		free(obj);
+		return SC_ERROR_OUT_OF_MEMORY;
+	}
+
 	*result = obj;
 	return SC_SUCCESS;
 }
@@ -517,6 +687,9 @@ __pkcs15_release_object(struct pkcs15_any_object *obj)
 	if (--(obj->refcount) != 0)
 		return obj->refcount;
 
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_release_verify_key(&obj->base);
+#endif
 	sc_mem_clear(obj, obj->size);
 	free(obj);
 
@@ -534,6 +707,7 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 
 	for (i = 0; i < fw_data->num_objects; ++i)   {
 		if (fw_data->objects[i] == obj) {
+			fw_unindex_object(fw_data, obj);
 			fw_data->objects[i] = fw_data->objects[--fw_data->num_objects];
 			if (__pkcs15_release_object(obj) > 0)
 				return SC_ERROR_INTERNAL;
@@ -542,15 +716,39 @@ __pkcs15_delete_object(struct pkcs15_fw_data *fw_data, struct pkcs15_any_object
 	}
 	return SC_ERROR_OBJECT_NOT_FOUND;
 }
+
+/* The ID of a PKCS#15 object is changed in place, so the objects using it
+ * are taken out of the index before and put back after */
+static void
+fw_index_p15_object(struct sc_pkcs11_card *p11card, struct sc_pkcs15_object *p15_object, int add)
+{
+	unsigned int idx, i;
+
+	for (idx = 0; idx < SC_PKCS11_FRAMEWORK_DATA_MAX_NUM; idx++) {
+		struct pkcs15_fw_data *fw_data = (struct pkcs15_fw_data *) p11card->fws_data[idx];
+
+		if (fw_data == NULL)
+			continue;
+		for (i = 0; i < fw_data->num_objects; i++) {
+			if (fw_data->objects[i]->p15_object != p15_object)
+				continue;
+			if (add)
+				fw_index_object(fw_data, fw_data->objects[i]);
+			else
+				fw_unindex_object(fw_data, fw_data->objects[i]);
+		}
+	}
+}
 #endif
 
 CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 {
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct pkcs15_fw_data *fw_data = NULL;
 	struct sc_pkcs15_object *auth;
 	const char *name;
-	CK_RV rv;
+	CK_RV rv, locked;
 
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
@@ -566,6 +764,11 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 		goto out;
 	}
 
+	/* The PIN status is read from the card */
+	rv = sc_pkcs11_enter_card(slot, &p11card);
+	if (rv != CKR_OK)
+		goto out;
+
 	if (slot->p11card == NULL) {
 		if (slot->slot_info.flags & CKF_TOKEN_PRESENT) {
 			rv = CKR_TOKEN_NOT_RECOGNIZED;
@@ -612,12 +815,14 @@ CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
 	memcpy(pInfo, &slot->token_info, sizeof(CK_TOKEN_INFO));
 
 out:
+	locked = sc_pkcs11_leave_card(p11card);
 	name = lookup_enum(RV_T, rv);
 	if (name)
 		sc_log(context, "C_GetTokenInfo(%lx) returns %s", slotID, name);
 	else
 		sc_log(context, "C_GetTokenInfo(%lx) returns 0x%08lX", slotID, rv);
-	sc_pkcs11_unlock();
+	if (locked == CKR_OK)
+		sc_pkcs11_unlock();
 
 	return rv;
 }
@@ -627,16 +832,14 @@ static int
 public_key_created(struct pkcs15_fw_data *fw_data, const struct sc_pkcs15_id *id,
 		struct pkcs15_any_object **obj2)
 {
-	size_t ii;
+	struct pkcs15_any_object *any_object;
+	struct fw_index_iter it;
 
-	for(ii=0; ii<fw_data->num_objects; ii++) {
-		struct pkcs15_any_object *any_object = fw_data->objects[ii];
+	for (any_object = fw_index_first(&it, fw_data, &fw_data->id_index, id->value, id->len);
+			any_object != NULL; any_object = fw_index_next(&it)) {
 		struct sc_pkcs15_object *p15_object = any_object->p15_object;
 
-		if (!p15_object)
-			continue;
-
-		if ((p15_object->type & SC_PKCS15_TYPE_CLASS_MASK) != SC_PKCS15_TYPE_PUBKEY)
+		if (!is_pubkey(any_object))
 			continue;
 
 		if (sc_pkcs15_compare_id(id, &((struct sc_pkcs15_pubkey_info *)p15_object->data)->id))   {
@@ -711,6 +914,7 @@ __pkcs15_create_cert_object(struct pkcs15_fw_data *fw_data, struct sc_pkcs15_obj
 
 	object->cert_info = p15_info;
 	object->cert_data = p15_cert;
+	fw_index_cert_data(fw_data, object);
 
 	/* Corresponding public key */
 	rv = public_key_created(fw_data, &p15_info->id, &any_object2);
@@ -898,16 +1102,23 @@ pkcs15_create_pkcs11_objects(struct pkcs15_fw_data *fw_data, int p15_type, const
 		int (*create)(struct pkcs15_fw_data *, struct sc_pkcs15_object *,
 			struct pkcs15_any_object **any_object))
 {
-	struct sc_pkcs15_object *p15_object[MAX_OBJECTS];
+	struct sc_pkcs15_object **p15_object = NULL;
 	int i, count, rv;
 
-	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, MAX_OBJECTS);
+	rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, NULL, 0);
+	if (count > 0) {
+		p15_object = calloc(count, sizeof(*p15_object));
+		if (p15_object == NULL)
+			return SC_ERROR_OUT_OF_MEMORY;
+		rv = count = sc_pkcs15_get_objects(fw_data->p15_card, p15_type, p15_object, count);
+	}
 	if (rv >= 0)
 		sc_log(context, "Found %d %s%s", count, name, (count == 1)? "" : "s");
 
 	for (i = 0; rv >= 0 && i < count; i++)
 		rv = create(fw_data, p15_object[i], NULL);
 
+	free(p15_object);
 	return count;
 }
 
@@ -916,13 +1127,14 @@ static void
 __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_object *pk)
 {
 	struct sc_pkcs15_id *id = &pk->prv_info->id;
-	unsigned int i;
+	struct pkcs15_any_object *obj;
+	struct fw_index_iter it;
 
 	sc_log(context, "Object is a private key and has id %s", sc_pkcs15_print_id(id));
 
-	for (i = 0; i < fw_data->num_objects; i++) {
-		struct pkcs15_any_object *obj = fw_data->objects[i];
-
+	/* Only objects with the same ID are related */
+	for (obj = fw_index_first(&it, fw_data, &fw_data->id_index, id->value, id->len);
+			obj != NULL; obj = fw_index_next(&it)) {
 		if (obj->base.flags & SC_PKCS11_OBJECT_HIDDEN)
 			continue;
 		if (is_privkey(obj) && obj != (struct pkcs15_any_object *) pk) {
@@ -943,7 +1155,7 @@ __pkcs15_prkey_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_prkey_
 
 			pubkey = (struct pkcs15_pubkey_object *) obj;
 			if (sc_pkcs15_compare_id(&pubkey->pub_info->id, id)) {
-				sc_log(context, "Associating object %d as public key", i);
+				sc_log(context, "Associating object %p as public key", obj);
 				pk->prv_pubkey = pubkey;
 				if (pubkey->pub_data) {
 					sc_pkcs15_dup_pubkey(context, pubkey->pub_data, &pk->pub_data);
@@ -961,42 +1173,46 @@ __pkcs15_cert_bind_related(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_ob
 {
 	struct sc_pkcs15_cert *c1 = cert->cert_data;
 	struct sc_pkcs15_id *id = &cert->cert_info->id;
-	unsigned int i;
+	struct pkcs15_any_object *obj;
+	struct fw_index_iter it;
 
 	sc_log(context, "Object is a certificate and has id %s", sc_pkcs15_print_id(id));
 
-	/* Loop over all objects to see if we find the certificate of
-	 * the issuer and the associated private key */
-	for (i = 0; i < fw_data->num_objects; i++) {
-		struct pkcs15_any_object *obj = fw_data->objects[i];
-
-		if (is_cert(obj) && obj != (struct pkcs15_any_object *) cert) {
-			struct pkcs15_cert_object *cert2;
+	/* The certificate of the issuer */
+	if (c1 && c1->issuer_len) {
+		for (obj = fw_index_first(&it, fw_data, &fw_data->subject_index, c1->issuer, c1->issuer_len);
+				obj != NULL; obj = fw_index_next(&it)) {
+			struct pkcs15_cert_object *cert2 = (struct pkcs15_cert_object *) obj;
 			struct sc_pkcs15_cert *c2;
 
-			cert2 = (struct pkcs15_cert_object *) obj;
-			c2 = cert2->cert_data;
-
-			if (!c1 || !c2 || !c1->issuer_len || !c2->subject_len)
+			if (cert2 == cert || !is_cert(obj) || !(c2 = cert2->cert_data))
 				continue;
 			if (c1->issuer_len == c2->subject_len
 			 && !memcmp(c1->issuer, c2->subject, c1->issuer_len)) {
-				sc_log(context, "Associating object %d (id %s) as issuer",
-						i, sc_pkcs15_print_id(&cert2->cert_info->id));
-				cert->cert_issuer = (struct pkcs15_cert_object *) obj;
-				return;
-			}
-		} else
-		if (is_privkey(obj) && !cert->cert_prvkey) {
-			struct pkcs15_prkey_object *pk;
-
-			pk = (struct pkcs15_prkey_object *) obj;
-			if (sc_pkcs15_compare_id(&pk->prv_info->id, id)) {
-				sc_log(context, "Associating object %d as private key", i);
-				cert->cert_prvkey = pk;
+				sc_log(context, "Associating object %p (id %s) as issuer",
+						cert2, sc_pkcs15_print_id(&cert2->cert_info->id));
+				cert->cert_issuer = cert2;
+				break;
 			}
 		}
 	}
+
+	/* The associated private key */
+	if (cert->cert_prvkey)
+		return;
+	for (obj = fw_index_first(&it, fw_data, &fw_data->id_index, id->value, id->len);
+			obj != NULL; obj = fw_index_next(&it)) {
+		struct pkcs15_prkey_object *pk;
+
+		if (!is_privkey(obj))
+			continue;
+		pk = (struct pkcs15_prkey_object *) obj;
+		if (sc_pkcs15_compare_id(&pk->prv_info->id, id)) {
+			sc_log(context, "Associating object %p as private key", obj);
+			cert->cert_prvkey = pk;
+			return;
+		}
+	}
 }
 
 static void
@@ -1025,7 +1241,8 @@ pkcs15_bind_related_objects(struct pkcs15_fw_data *fw_data)
 /* We deferred reading of the cert until needed, as it may be
  * a private object, so we must wait till login to read  */
 static int
-check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *cert)
+check_cert_data_read(struct sc_pkcs11_slot *slot, struct pkcs15_fw_data *fw_data,
+		struct pkcs15_cert_object *cert)
 {
 	struct pkcs15_pubkey_object *obj2;
 	int rv;
@@ -1048,9 +1265,24 @@ check_cert_data_read(struct pkcs15_fw_data *fw_data, struct pkcs15_cert_object *
 
 	/* Find missing labels for certificate */
 	pkcs15_cert_extract_label(cert);
+	slot_reindex_object(slot, &cert->base.base);
 
-	/* now that we have the cert and pub key, lets see if we can bind anything else */
-	pkcs15_bind_related_objects(fw_data);
+	/* now that we have the cert and pub key, lets see if we can bind anything else:
+	 * its issuer and the certificates it issued */
+	fw_index_cert_data(fw_data, cert);
+	if (!(cert->cert_flags & SC_PKCS11_OBJECT_HIDDEN))
+		__pkcs15_cert_bind_related(fw_data, cert);
+	if (cert->cert_data->subject_len) {
+		struct sc_pkcs15_cert *c1 = cert->cert_data;
+		struct pkcs15_any_object *obj;
+		struct fw_index_iter it;
+
+		for (obj = fw_index_first(&it, fw_data, &fw_data->issuer_index, c1->subject, c1->subject_len);
+				obj != NULL; obj = fw_index_next(&it)) {
+			if (obj != &cert->base && is_cert(obj) && !(obj->base.flags & SC_PKCS11_OBJECT_HIDDEN))
+				__pkcs15_cert_bind_related(fw_data, (struct pkcs15_cert_object *) obj);
+		}
+	}
 
 	return rv;
 }
@@ -1060,8 +1292,10 @@ static void
 pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 		  CK_OBJECT_HANDLE_PTR pHandle)
 {
-	unsigned int i;
 	struct pkcs15_fw_data *card_fw_data;
+	struct pkcs15_any_object *obj2;
+	struct fw_index_iter it;
+	const struct sc_pkcs15_id *id;
 	CK_OBJECT_HANDLE handle =
 		(CK_OBJECT_HANDLE)(uintptr_t)obj; /* cast pointer to long, will truncate on Win64 */
 
@@ -1070,16 +1304,18 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 	if (obj->base.flags & (SC_PKCS11_OBJECT_HIDDEN | SC_PKCS11_OBJECT_RECURS))
 		return;
 
-	if (list_contains(&slot->objects, obj))
+	if (slot_get_object(slot, handle) == &obj->base)
 		return;
 
-	if (pHandle != NULL)
-		*pHandle = handle;
-
-	list_append(&slot->objects, obj);
 	sc_log(context, "Slot:%lX Setting object handle of 0x%lx to 0x%lx",
 		   slot->id, obj->base.handle, handle);
 	obj->base.handle = handle;
+	if (slot_add_object(slot, &obj->base) != CKR_OK)
+		return;
+
+	if (pHandle != NULL)
+		*pHandle = handle;
+
 	obj->base.flags |= SC_PKCS11_OBJECT_SEEN;
 	obj->refcount++;
 
@@ -1100,8 +1336,10 @@ pkcs15_add_object(struct sc_pkcs11_slot *slot, struct pkcs15_any_object *obj,
 			if (!slot->p11card)
 				return;
 			card_fw_data = (struct pkcs15_fw_data *) slot->p11card->fws_data[slot->fw_data_idx];
-			for (i = 0; i < card_fw_data->num_objects; i++) {
-				struct pkcs15_any_object *obj2 = card_fw_data->objects[i];
+			/* The certificates of the key have its ID */
+			id = fw_object_id(obj);
+			obj2 = id ? fw_index_first(&it, card_fw_data, &card_fw_data->id_index, id->value, id->len) : NULL;
+			for (; obj2 != NULL; obj2 = fw_index_next(&it)) {
 				struct pkcs15_cert_object *cert;
 
 				if (!is_cert(obj2))
@@ -1538,10 +1776,14 @@ _add_pin_related_objects(struct sc_pkcs11_slot *slot, struct sc_pkcs15_object *p
 			continue;
 		}
 
-		if (move_to_fw && move_to_fw != fw_data && move_to_fw->num_objects < MAX_OBJECTS)   {
+		if (move_to_fw && move_to_fw != fw_data)   {
 			int tail = fw_data->num_objects - i - 1;
 
-			move_to_fw->objects[move_to_fw->num_objects++] = obj;
+			fw_unindex_object(fw_data, obj);
+			if (fw_data_add_object(move_to_fw, obj) != SC_SUCCESS) {
+				fw_index_object(fw_data, obj);
+				continue;
+			}
 			if (tail)
 				memcpy(&fw_data->objects[i], &fw_data->objects[i + 1], sizeof(fw_data->objects[0]) * tail);
 			i--;
@@ -1670,7 +1912,7 @@ pkcs15_create_tokens(struct sc_pkcs11_card *p11card, struct sc_app_info *app_inf
 	 *  - configuration impose to create slot for all PINs.
 	 */
 	if (!auth_user_pin || cs_flags & SC_PKCS11_SLOT_CREATE_ALL)   {
-		struct sc_pkcs15_object *auths[MAX_OBJECTS];
+		struct sc_pkcs15_object *auths[SC_PKCS15_MAX_PINS];
 		int auth_count;
 
 		memset(auths, 0, sizeof(auths));
@@ -3478,7 +3720,7 @@ pkcs15_skey_destroy(struct sc_pkcs11_session *session, void *object)
 
 	/* Oppose to pkcs15_add_object */
 	--any_obj->refcount; /* correct refcount */
-	list_delete(&session->slot->objects, any_obj);
+	slot_remove_object(session->slot, &any_obj->base);
 	/* Delete object in pkcs15 */
 	rv = __pkcs15_delete_object(fw_data, any_obj);
 
@@ -3548,7 +3790,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 				/* Unlink related public key FW object if it has no corresponding PKCS#15 object
 				 * and was created from certificate. */
 				--ao_pubkey->refcount;
-				list_delete(&session->slot->objects, ao_pubkey);
+				slot_remove_object(session->slot, &ao_pubkey->base);
 				/* Delete public key object in pkcs15 */
 				if (pubkey->pub_data)   {
 					sc_log(context, "Found pub_data %p", pubkey->pub_data);
@@ -3566,7 +3808,7 @@ pkcs15_any_destroy(struct sc_pkcs11_session *session, void *object)
 	if (rv >= 0) {
 		/* Oppose to pkcs15_add_object */
 		--any_obj->refcount; /* correct refcount */
-		list_delete(&session->slot->objects, any_obj);
+		slot_remove_object(session->slot, &any_obj->base);
 		/* Delete object in pkcs15 */
 		rv = __pkcs15_delete_object(fw_data, any_obj);
 	}
@@ -3682,8 +3924,10 @@ pkcs15_set_attrib(struct sc_pkcs11_session *session, struct sc_pkcs15_object *p1
 		}
 		memcpy(id.value, attr->pValue, attr->ulValueLen);
 		id.len = attr->ulValueLen;
+		fw_index_p15_object(p11card, p15_object, 0);
 		rv = sc_pkcs15init_change_attrib(fw_data->p15_card, profile, p15_object,
 				P15_ATTR_TYPE_ID, &id, sizeof(id));
+		fw_index_p15_object(p11card, p15_object, 1);
 		break;
 	case CKA_SUBJECT:
 		rv = SC_SUCCESS;
@@ -3770,7 +4014,7 @@ pkcs15_cert_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 		*(CK_BBOOL*)attr->pValue = FALSE;
 		break;
 	case CKA_LABEL:
-		if (check_cert_data_read(fw_data, cert) != 0) {
+		if (check_cert_data_read(session->slot, fw_data, cert) != 0) {
 			attr->ulValueLen = 0;
 			return CKR_OK;
 		}
@@ -3798,7 +4042,7 @@ pkcs15_cert_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 		*(CK_BBOOL*)attr->pValue = cert->cert_info->authority ? TRUE : FALSE;
 		break;
 	case CKA_VALUE:
-		if (check_cert_data_read(fw_data, cert) != 0) {
+		if (check_cert_data_read(session->slot, fw_data, cert) != 0) {
 			attr->ulValueLen = 0;
 			return CKR_OK;
 		}
@@ -3806,7 +4050,7 @@ pkcs15_cert_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 		memcpy(attr->pValue, cert->cert_data->data.value, cert->cert_data->data.len);
 		break;
 	case CKA_SERIAL_NUMBER:
-		if (check_cert_data_read(fw_data, cert) != 0) {
+		if (check_cert_data_read(session->slot, fw_data, cert) != 0) {
 			attr->ulValueLen = 0;
 			return CKR_OK;
 		}
@@ -3814,7 +4058,7 @@ pkcs15_cert_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 		memcpy(attr->pValue, cert->cert_data->serial, cert->cert_data->serial_len);
 		break;
 	case CKA_SUBJECT:
-		if (check_cert_data_read(fw_data, cert) != 0) {
+		if (check_cert_data_read(session->slot, fw_data, cert) != 0) {
 			attr->ulValueLen = 0;
 			return CKR_OK;
 		}
@@ -3822,7 +4066,7 @@ pkcs15_cert_get_attribute(struct sc_pkcs11_session *session, void *object, CK_AT
 		memcpy(attr->pValue, cert->cert_data->subject, cert->cert_data->subject_len);
 		return CKR_OK;
 	case CKA_ISSUER:
-		if (check_cert_data_read(fw_data, cert) != 0) {
+		if (check_cert_data_read(session->slot, fw_data, cert) != 0) {
 			attr->ulValueLen = 0;
 			return CKR_OK;
 		}
@@ -3865,7 +4109,7 @@ pkcs15_cert_cmp_attribute(struct sc_pkcs11_session *session,
 	 * in the ASN.1 encoded SEQUENCE OF SET,
 	 * while OpenSC just keeps the SET in the issuer/subject field. */
 	case CKA_ISSUER:
-		if (check_cert_data_read(fw_data, cert) != 0)
+		if (check_cert_data_read(session->slot, fw_data, cert) != 0)
 			break;
 		if (cert->cert_data->issuer_len == 0)
 			break;
@@ -3881,7 +4125,7 @@ pkcs15_cert_cmp_attribute(struct sc_pkcs11_session *session,
 		}
 		break;
 	case CKA_SUBJECT:
-		if (check_cert_data_read(fw_data, cert) != 0)
+		if (check_cert_data_read(session->slot, fw_data, cert) != 0)
 			break;
 		if (cert->cert_data->subject_len == 0)
 			break;
@@ -3917,7 +4161,8 @@ struct sc_pkcs11_object_ops pkcs15_cert_ops = {
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	NULL	/* sign_batch */
 };
 
 /*
@@ -3983,10 +4228,12 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 			key = prkey->pub_data;
 		} else {
 			/* Try to find public key or certificate with the public key */
-			unsigned int i;
+			struct sc_pkcs15_id *id = &prkey->prv_info->id;
+			struct pkcs15_any_object *obj;
+			struct fw_index_iter it;
 
-			for (i = 0; i < fw_data->num_objects; i++) {
-				struct pkcs15_any_object *obj = fw_data->objects[i];
+			for (obj = fw_index_first(&it, fw_data, &fw_data->id_index, id->value, id->len);
+					obj != NULL; obj = fw_index_next(&it)) {
 				struct pkcs15_cert_object *cert;
 
 				if (is_cert(obj))   {
@@ -3995,7 +4242,7 @@ pkcs15_prkey_get_attribute(struct sc_pkcs11_session *session,
 					if (cert->cert_prvkey != prkey)
 						continue;
 
-					if (check_cert_data_read(fw_data, cert) == 0)   {
+					if (check_cert_data_read(session->slot, fw_data, cert) == 0)   {
 						key = cert->cert_pubkey->pub_data;
 						sc_log(context, "found friend certificate's public key %p", key);
 					}
@@ -4203,74 +4450,45 @@ static int mgf2flags(CK_RSA_PKCS_MGF_TYPE mgf)
 
 
 static CK_RV
-pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
-			CK_MECHANISM_PTR pMechanism, CK_BYTE_PTR pData,
-			CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
-			CK_ULONG_PTR pulDataLen)
+pkcs15_prkey_sign_flags(CK_MECHANISM_PTR pMechanism, CK_ULONG ulDataLen, int *flags)
 {
-	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
-	struct sc_pkcs11_card *p11card = session->slot->p11card;
-	struct pkcs15_fw_data *fw_data = NULL;
 	CK_RV rv;
-	int flags = 0, prkey_has_path = 0, rc;
-	unsigned sign_flags = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
-			| SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
-
-	sc_log(context, "Initiating signing operation, mechanism 0x%lx.",
-		   pMechanism->mechanism);
-	if (!p11card)
-		return sc_to_cryptoki_error(SC_ERROR_INVALID_CARD, "C_Sign");
-	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
-	if (!fw_data)
-		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_Sign");
-	if (!fw_data->p15_card)
-		return sc_to_cryptoki_error(SC_ERROR_INVALID_CARD, "C_Sign");
-
-	/* See which of the alternative keys supports signing */
-	while (prkey && !(prkey->prv_info->usage & sign_flags))
-		prkey = prkey->prv_next;
-
-	if (prkey == NULL)
-		return CKR_KEY_FUNCTION_NOT_PERMITTED;
-
-	if (prkey->prv_info->path.len || prkey->prv_info->path.aid.len)
-		prkey_has_path = 1;
 
 	switch (pMechanism->mechanism) {
 	case CKM_RSA_PKCS:
-		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+		*flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
 		break;
 	case CKM_MD5_RSA_PKCS:
-		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_MD5;
+		*flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_MD5;
 		break;
 	case CKM_SHA1_RSA_PKCS:
-		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA1;
+		*flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA1;
 		break;
 	case CKM_SHA224_RSA_PKCS:
-		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA224;
+		*flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA224;
 		break;
 	case CKM_SHA256_RSA_PKCS:
-		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA256;
+		*flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA256;
 		break;
 	case CKM_SHA384_RSA_PKCS:
-		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA384;
+		*flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA384;
 		break;
 	case CKM_SHA512_RSA_PKCS:
-		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA512;
+		*flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_SHA512;
 		break;
 	case CKM_RIPEMD160_RSA_PKCS:
-		flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_RIPEMD160;
+		*flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_RIPEMD160;
 		break;
 	case CKM_RSA_X_509:
-		flags = SC_ALGORITHM_RSA_RAW;
+		*flags = SC_ALGORITHM_RSA_RAW;
 		break;
 	case CKM_RSA_PKCS_PSS:
-		flags = SC_ALGORITHM_RSA_PAD_PSS;
+		*flags = SC_ALGORITHM_RSA_PAD_PSS;
 		/* The hash was done outside of the module */
-		flags |= SC_ALGORITHM_RSA_HASH_NONE;
+		*flags |= SC_ALGORITHM_RSA_HASH_NONE;
 		/* Omitted parameter can use MGF1-SHA1 ? */
 		if (pMechanism->pParameter == NULL) {
-			flags |= SC_ALGORITHM_MGF1_SHA1;
+			*flags |= SC_ALGORITHM_MGF1_SHA1;
 			if (ulDataLen != SHA_DIGEST_LENGTH)
 				return CKR_MECHANISM_PARAM_INVALID;
 			break;
@@ -4285,7 +4503,7 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 		}
 
 		/* The MGF parameter was already verified in SignInit() */
-		flags |=  mgf2flags(((CK_RSA_PKCS_PSS_PARAMS*)pMechanism->pParameter)->mgf);
+		*flags |= mgf2flags(((CK_RSA_PKCS_PSS_PARAMS*)pMechanism->pParameter)->mgf);
 
 		/* Assuming salt is the size of hash */
 		break;
@@ -4294,73 +4512,115 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 	case CKM_SHA256_RSA_PKCS_PSS:
 	case CKM_SHA384_RSA_PKCS_PSS:
 	case CKM_SHA512_RSA_PKCS_PSS:
-		flags = SC_ALGORITHM_RSA_PAD_PSS;
+		*flags = SC_ALGORITHM_RSA_PAD_PSS;
 		/* Omitted parameter can use MGF1-SHA1 and SHA1 hash ? */
 		if (pMechanism->pParameter == NULL) {
-			flags |= SC_ALGORITHM_RSA_HASH_SHA1;
-			flags |= SC_ALGORITHM_MGF1_SHA1;
+			*flags |= SC_ALGORITHM_RSA_HASH_SHA1;
+			*flags |= SC_ALGORITHM_MGF1_SHA1;
 			break;
 		}
 
 		switch (((CK_RSA_PKCS_PSS_PARAMS*)pMechanism->pParameter)->hashAlg) {
 		case CKM_SHA_1:
-			flags |= SC_ALGORITHM_RSA_HASH_SHA1;
+			*flags |= SC_ALGORITHM_RSA_HASH_SHA1;
 			break;
 		case CKM_SHA224:
-			flags |= SC_ALGORITHM_RSA_HASH_SHA224;
+			*flags |= SC_ALGORITHM_RSA_HASH_SHA224;
 			break;
 		case CKM_SHA256:
-			flags |= SC_ALGORITHM_RSA_HASH_SHA256;
+			*flags |= SC_ALGORITHM_RSA_HASH_SHA256;
 			break;
 		case CKM_SHA384:
-			flags |= SC_ALGORITHM_RSA_HASH_SHA384;
+			*flags |= SC_ALGORITHM_RSA_HASH_SHA384;
 			break;
 		case CKM_SHA512:
-			flags |= SC_ALGORITHM_RSA_HASH_SHA512;
+			*flags |= SC_ALGORITHM_RSA_HASH_SHA512;
 			break;
 		default:
 			return CKR_MECHANISM_PARAM_INVALID;
 		}
 
 		/* The MGF parameter was already verified in SignInit() */
-		flags |= mgf2flags(((CK_RSA_PKCS_PSS_PARAMS*)pMechanism->pParameter)->mgf);
+		*flags |= mgf2flags(((CK_RSA_PKCS_PSS_PARAMS*)pMechanism->pParameter)->mgf);
 
 		break;
 	case CKM_GOSTR3410:
-		flags = SC_ALGORITHM_GOSTR3410_HASH_NONE;
+		*flags = SC_ALGORITHM_GOSTR3410_HASH_NONE;
 		break;
 	case CKM_GOSTR3410_WITH_GOSTR3411:
-		flags = SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411;
+		*flags = SC_ALGORITHM_GOSTR3410_HASH_GOSTR3411;
 		break;
 	case CKM_EDDSA:
-		flags = SC_ALGORITHM_EDDSA_RAW;
+		*flags = SC_ALGORITHM_EDDSA_RAW;
 		break;
 	case CKM_XEDDSA:
-		flags = SC_ALGORITHM_XEDDSA_RAW;
+		*flags = SC_ALGORITHM_XEDDSA_RAW;
 		break;
 	case CKM_ECDSA:
-		flags = SC_ALGORITHM_ECDSA_HASH_NONE;
+		*flags = SC_ALGORITHM_ECDSA_HASH_NONE;
 		break;
 	case CKM_ECDSA_SHA1:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA1;
+		*flags = SC_ALGORITHM_ECDSA_HASH_SHA1;
 		break;
 	case CKM_ECDSA_SHA224:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA224;
+		*flags = SC_ALGORITHM_ECDSA_HASH_SHA224;
 		break;
 	case CKM_ECDSA_SHA256:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA256;
+		*flags = SC_ALGORITHM_ECDSA_HASH_SHA256;
 		break;
 	case CKM_ECDSA_SHA384:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA384;
+		*flags = SC_ALGORITHM_ECDSA_HASH_SHA384;
 		break;
 	case CKM_ECDSA_SHA512:
-		flags = SC_ALGORITHM_ECDSA_HASH_SHA512;
+		*flags = SC_ALGORITHM_ECDSA_HASH_SHA512;
 		break;
 	default:
 		sc_log(context, "DEE - need EC for %lu", pMechanism->mechanism);
 		return CKR_MECHANISM_INVALID;
 	}
 
+	return CKR_OK;
+}
+
+
+static CK_RV
+pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
+			CK_MECHANISM_PTR pMechanism, CK_BYTE_PTR pData,
+			CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+			CK_ULONG_PTR pulDataLen)
+{
+	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
+	struct sc_pkcs11_card *p11card = session->slot->p11card;
+	struct pkcs15_fw_data *fw_data = NULL;
+	CK_RV rv;
+	int flags = 0, prkey_has_path = 0, rc;
+	unsigned sign_flags = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
+			| SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
+
+	sc_log(context, "Initiating signing operation, mechanism 0x%lx.",
+		   pMechanism->mechanism);
+	if (!p11card)
+		return sc_to_cryptoki_error(SC_ERROR_INVALID_CARD, "C_Sign");
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
+	if (!fw_data)
+		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_Sign");
+	if (!fw_data->p15_card)
+		return sc_to_cryptoki_error(SC_ERROR_INVALID_CARD, "C_Sign");
+
+	/* See which of the alternative keys supports signing */
+	while (prkey && !(prkey->prv_info->usage & sign_flags))
+		prkey = prkey->prv_next;
+
+	if (prkey == NULL)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+	if (prkey->prv_info->path.len || prkey->prv_info->path.aid.len)
+		prkey_has_path = 1;
+
+	rv = pkcs15_prkey_sign_flags(pMechanism, ulDataLen, &flags);
+	if (rv != CKR_OK)
+		return rv;
+
 	rc = sc_lock(p11card->card);
 	if (rc < 0)
 		return sc_to_cryptoki_error(rc, "C_Sign");
@@ -4395,6 +4655,90 @@ pkcs15_prkey_sign(struct sc_pkcs11_session *session, void *obj,
 }
 
 
+static CK_RV
+pkcs15_prkey_sign_batch(struct sc_pkcs11_session *session, void *obj,
+			CK_MECHANISM_PTR pMechanism, CK_ULONG ulCount,
+			CK_BYTE_PTR *ppData, CK_ULONG_PTR pulDataLen,
+			CK_BYTE_PTR *ppSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	struct pkcs15_prkey_object *prkey = (struct pkcs15_prkey_object *) obj;
+	struct sc_pkcs11_card *p11card = session->slot->p11card;
+	struct pkcs15_fw_data *fw_data = NULL;
+	struct sc_pkcs15_sign_request *requests = NULL;
+	CK_ULONG i, done = 0;
+	CK_RV rv = CKR_OK;
+	int flags = 0, prkey_has_path = 0, reselected = 0, rc = SC_SUCCESS;
+	unsigned sign_flags = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_SIGNRECOVER
+			| SC_PKCS15_PRKEY_USAGE_NONREPUDIATION;
+
+	sc_log(context, "Initiating batch of %lu signatures, mechanism 0x%lx.",
+		   ulCount, pMechanism->mechanism);
+	if (!p11card)
+		return sc_to_cryptoki_error(SC_ERROR_INVALID_CARD, "C_OpenSC_SignBatch");
+	fw_data = (struct pkcs15_fw_data *) p11card->fws_data[session->slot->fw_data_idx];
+	if (!fw_data)
+		return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "C_OpenSC_SignBatch");
+	if (!fw_data->p15_card)
+		return sc_to_cryptoki_error(SC_ERROR_INVALID_CARD, "C_OpenSC_SignBatch");
+
+	while (prkey && !(prkey->prv_info->usage & sign_flags))
+		prkey = prkey->prv_next;
+
+	if (prkey == NULL)
+		return CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+	if (prkey->prv_info->path.len || prkey->prv_info->path.aid.len)
+		prkey_has_path = 1;
+
+	requests = calloc(ulCount, sizeof(*requests));
+	if (requests == NULL)
+		return CKR_HOST_MEMORY;
+	for (i = 0; i < ulCount; i++) {
+		rv = pkcs15_prkey_sign_flags(pMechanism, pulDataLen[i], &flags);
+		if (rv != CKR_OK)
+			goto out;
+		requests[i].in = ppData[i];
+		requests[i].inlen = pulDataLen[i];
+		requests[i].out = ppSignature[i];
+		requests[i].outlen = pulSignatureLen[i];
+	}
+
+	rc = sc_lock(p11card->card);
+	if (rc < 0) {
+		rv = sc_to_cryptoki_error(rc, "C_OpenSC_SignBatch");
+		goto out;
+	}
+
+	while (done < ulCount) {
+		rc = sc_pkcs15_compute_signatures(fw_data->p15_card, prkey->prv_p15obj, flags,
+				requests + done, ulCount - done, pMechanism);
+		if (rc > 0) {
+			done += rc;
+			continue;
+		}
+		/* Another application may have changed the current DF, see pkcs15_prkey_sign() */
+		if (reselected || sc_pkcs11_conf.lock_login || prkey_has_path
+				|| reselect_app_df(fw_data->p15_card) != SC_SUCCESS)
+			break;
+		reselected = 1;
+	}
+
+	sc_unlock(p11card->card);
+
+	sc_log(context, "Batch complete, %lu of %lu signatures. Result %d.", done, ulCount, rc);
+	if (done < ulCount) {
+		rv = sc_to_cryptoki_error(rc, "C_OpenSC_SignBatch");
+		goto out;
+	}
+	for (i = 0; i < ulCount; i++)
+		pulSignatureLen[i] = requests[i].outlen;
+
+out:
+	free(requests);
+	return rv;
+}
+
+
 static CK_RV
 pkcs15_prkey_unwrap(struct sc_pkcs11_session *session, void *obj,
 			CK_MECHANISM_PTR pMechanism, CK_BYTE_PTR pWrappedKey,
@@ -4808,7 +5152,8 @@ struct sc_pkcs11_object_ops pkcs15_prkey_ops = {
 	pkcs15_prkey_derive,
 	pkcs15_prkey_can_do,
 	pkcs15_prkey_init_params,
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	pkcs15_prkey_sign_batch
 };
 
 /*
@@ -4867,7 +5212,7 @@ pkcs15_pubkey_get_attribute(struct sc_pkcs11_session *session, void *object, CK_
 		case CKA_EC_PARAMS:
 		case CKA_EC_POINT:
 			if (pubkey->pub_data == NULL)
-				if (SC_SUCCESS != check_cert_data_read(fw_data, cert))
+				if (SC_SUCCESS != check_cert_data_read(session->slot, fw_data, cert))
 					return sc_to_cryptoki_error(SC_ERROR_INTERNAL, "check_cert_data_read");
 			break;
 	}
@@ -5068,7 +5413,8 @@ struct sc_pkcs11_object_ops pkcs15_pubkey_ops = {
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	NULL	/* sign_batch */
 };
 
 
@@ -5251,7 +5597,8 @@ struct sc_pkcs11_object_ops pkcs15_dobj_ops = {
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	NULL	/* sign_batch */
 };
 
 /* PKCS#15 Data Object*/
@@ -5317,7 +5664,8 @@ struct sc_pkcs11_object_ops pkcs15_profile_ops = {
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	NULL	/* wrap_key */
+	NULL,	/* wrap_key */
+	NULL	/* sign_batch */
 };
 
 
@@ -5788,7 +6136,8 @@ struct sc_pkcs11_object_ops pkcs15_skey_ops = {
 	NULL,	/* derive */
 	NULL,	/* can_do */
 	NULL,	/* init_params */
-	pkcs15_skey_wrap /* wrap_key */
+	pkcs15_skey_wrap, /* wrap_key */
+	NULL	/* sign_batch */
 };
 
 /*
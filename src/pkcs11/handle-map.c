@@ -0,0 +1,257 @@
+/*
+ * handle-map.c: Hash index of PKCS#11 sessions and objects by handle, and
+ * the buckets of the object search indexes
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sc-pkcs11.h"
+
+/*
+ * Open addressing with linear probing. Entries with a NULL pointer are
+ * free; removal shifts the following entries of the cluster back, so
+ * lookups never need tombstones. The table is kept at most half full.
+ */
+#define HANDLE_MAP_MIN_SIZE	16
+
+static size_t
+handle_map_slot(const struct sc_pkcs11_handle_map *map, CK_ULONG handle)
+{
+	/* Handles are mostly pointer values, so mix the low bits in */
+	uint64_t h = (uint64_t)handle;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (size_t)h & (map->size - 1);
+}
+
+static int
+handle_map_resize(struct sc_pkcs11_handle_map *map, size_t size)
+{
+	struct sc_pkcs11_handle_entry *old = map->entries;
+	size_t old_size = map->size, i;
+
+	map->entries = calloc(size, sizeof(*map->entries));
+	if (map->entries == NULL) {
+		map->entries = old;
+		return -1;
+	}
+	map->size = size;
+	map->count = 0;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].ptr != NULL)
+			sc_pkcs11_handle_map_add(map, old[i].handle, old[i].ptr);
+	}
+	free(old);
+	return 0;
+}
+
+void
+sc_pkcs11_handle_map_init(struct sc_pkcs11_handle_map *map)
+{
+	memset(map, 0, sizeof(*map));
+}
+
+void
+sc_pkcs11_handle_map_clear(struct sc_pkcs11_handle_map *map)
+{
+	free(map->entries);
+	memset(map, 0, sizeof(*map));
+}
+
+/* Returns 0 on success, -1 if out of memory. An existing
+ * entry for the handle is replaced. */
+int
+sc_pkcs11_handle_map_add(struct sc_pkcs11_handle_map *map, CK_ULONG handle, void *ptr)
+{
+	size_t i;
+
+	if (ptr == NULL)
+		return -1;
+	if ((map->count + 1) * 2 > map->size
+			&& handle_map_resize(map, map->size ? map->size * 2 : HANDLE_MAP_MIN_SIZE) != 0)
+		return -1;
+
+	for (i = handle_map_slot(map, handle); map->entries[i].ptr != NULL; i = (i + 1) & (map->size - 1)) {
+		if (map->entries[i].handle == handle) {
+			map->entries[i].ptr = ptr;
+			return 0;
+		}
+	}
+	map->entries[i].handle = handle;
+	map->entries[i].ptr = ptr;
+	map->count++;
+	return 0;
+}
+
+void *
+sc_pkcs11_handle_map_get(const struct sc_pkcs11_handle_map *map, CK_ULONG handle)
+{
+	size_t i;
+
+	if (map->count == 0)
+		return NULL;
+
+	for (i = handle_map_slot(map, handle); map->entries[i].ptr != NULL; i = (i + 1) & (map->size - 1)) {
+		if (map->entries[i].handle == handle)
+			return map->entries[i].ptr;
+	}
+	return NULL;
+}
+
+void
+sc_pkcs11_handle_map_del(struct sc_pkcs11_handle_map *map, CK_ULONG handle)
+{
+	size_t mask = map->size - 1, i, j, k;
+
+	if (map->count == 0)
+		return;
+
+	for (i = handle_map_slot(map, handle); map->entries[i].ptr != NULL; i = (i + 1) & mask) {
+		if (map->entries[i].handle == handle)
+			break;
+	}
+	if (map->entries[i].ptr == NULL)
+		return;
+
+	/* Move back the entries that would no longer be reachable */
+	for (j = (i + 1) & mask; map->entries[j].ptr != NULL; j = (j + 1) & mask) {
+		k = handle_map_slot(map, map->entries[j].handle);
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			map->entries[i] = map->entries[j];
+			i = j;
+		}
+	}
+	map->entries[i].handle = 0;
+	map->entries[i].ptr = NULL;
+	map->count--;
+}
+
+/*
+ * Buckets of a hash index, kept in a handle map by hash. A bucket holds the
+ * pointers with the same hash in the order of their sequence numbers, which
+ * is the order in which searches return them.
+ */
+
+/* Returns 0 on success or if ptr is in the bucket already, -1 if out of memory */
+int
+sc_pkcs11_bucket_insert(struct sc_pkcs11_bucket *bucket, void *ptr, unsigned long seq)
+{
+	size_t i;
+
+	for (i = 0; i < bucket->count; i++)
+		if (bucket->entries[i].ptr == ptr)
+			return 0;
+	if (bucket->count == bucket->allocated) {
+		size_t allocated = bucket->allocated ? bucket->allocated * 2 : 4;
+		struct sc_pkcs11_bucket_entry *entries;
+
+		entries = realloc(bucket->entries, allocated * sizeof(*entries));
+		if (entries == NULL)
+			return -1;
+		bucket->entries = entries;
+		bucket->allocated = allocated;
+	}
+
+	for (i = bucket->count; i > 0 && bucket->entries[i - 1].seq > seq; i--)
+		bucket->entries[i] = bucket->entries[i - 1];
+	bucket->entries[i].seq = seq;
+	bucket->entries[i].ptr = ptr;
+	bucket->count++;
+	return 0;
+}
+
+void
+sc_pkcs11_bucket_remove(struct sc_pkcs11_bucket *bucket, void *ptr)
+{
+	size_t i;
+
+	for (i = 0; i < bucket->count; i++) {
+		if (bucket->entries[i].ptr == ptr) {
+			memmove(&bucket->entries[i], &bucket->entries[i + 1],
+					(bucket->count - i - 1) * sizeof(*bucket->entries));
+			bucket->count--;
+			break;
+		}
+	}
+}
+
+/* Returns 0 on success, -1 if out of memory */
+int
+sc_pkcs11_bucket_map_add(struct sc_pkcs11_handle_map *map, CK_ULONG key, void *ptr,
+		unsigned long seq)
+{
+	struct sc_pkcs11_bucket *bucket;
+
+	bucket = sc_pkcs11_handle_map_get(map, key);
+	if (bucket == NULL) {
+		bucket = calloc(1, sizeof(*bucket));
+		if (bucket == NULL)
+			return -1;
+		if (sc_pkcs11_handle_map_add(map, key, bucket) != 0) {
+			free(bucket);
+			return -1;
+		}
+	}
+	if (sc_pkcs11_bucket_insert(bucket, ptr, seq) != 0) {
+		if (bucket->count == 0) {
+			sc_pkcs11_handle_map_del(map, key);
+			free(bucket->entries);
+			free(bucket);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+void
+sc_pkcs11_bucket_map_del(struct sc_pkcs11_handle_map *map, CK_ULONG key, void *ptr)
+{
+	struct sc_pkcs11_bucket *bucket;
+
+	bucket = sc_pkcs11_handle_map_get(map, key);
+	if (bucket == NULL)
+		return;
+	sc_pkcs11_bucket_remove(bucket, ptr);
+	if (bucket->count == 0) {
+		sc_pkcs11_handle_map_del(map, key);
+		free(bucket->entries);
+		free(bucket);
+	}
+}
+
+void
+sc_pkcs11_bucket_map_clear(struct sc_pkcs11_handle_map *map)
+{
+	size_t i;
+
+	for (i = 0; i < map->size; i++) {
+		struct sc_pkcs11_bucket *bucket = map->entries[i].ptr;
+
+		if (bucket != NULL) {
+			free(bucket->entries);
+			free(bucket);
+		}
+	}
+	sc_pkcs11_handle_map_clear(map);
+}
@@ -20,6 +20,7 @@
 
 #include "config.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -41,6 +42,8 @@ struct operation_data {
 	sc_pkcs11_operation_t *md;
 	CK_BYTE			*buffer;
 	CK_ULONG		buffer_len;
+	CK_ULONG		buffer_size;
+	int			updated;	/* data was given with C_SignUpdate() */
 };
 
 static struct operation_data *
@@ -55,10 +58,14 @@ operation_data_release(struct operation_data *data)
 	if (!data)
 		return;
 	sc_pkcs11_release_operation(&data->md);
-	sc_mem_secure_clear_free(data->buffer, data->buffer_len);
+	sc_mem_secure_clear_free(data->buffer, data->buffer_size);
 	free(data);
 }
 
+/*
+ * The buffer grows geometrically, so that multipart data is copied a
+ * constant number of times on average instead of once per part
+ */
 static CK_RV
 signature_data_buffer_append(struct operation_data *data,
 		const CK_BYTE *in, CK_ULONG in_len)
@@ -71,16 +78,22 @@ signature_data_buffer_append(struct operation_data *data,
 	CK_ULONG new_len;
 	if (__builtin_uaddl_overflow(data->buffer_len, in_len, &new_len))
 		return CKR_ARGUMENTS_BAD;
-	CK_BYTE *new_buffer = sc_mem_secure_alloc(new_len);
-	if (!new_buffer)
-		return CKR_HOST_MEMORY;
-
-	if (data->buffer_len != 0)
-		memcpy(new_buffer, data->buffer, data->buffer_len);
-	memcpy(new_buffer+data->buffer_len, in, in_len);
+	if (new_len > data->buffer_size) {
+		CK_ULONG new_size = data->buffer_size < 256 ? 256 : data->buffer_size;
+		while (new_size < new_len)
+			new_size = new_size <= ULONG_MAX / 2 ? new_size * 2 : new_len;
+		CK_BYTE *new_buffer = sc_mem_secure_alloc(new_size);
+		if (!new_buffer)
+			return CKR_HOST_MEMORY;
+
+		if (data->buffer_len != 0)
+			memcpy(new_buffer, data->buffer, data->buffer_len);
+		sc_mem_secure_clear_free(data->buffer, data->buffer_size);
+		data->buffer = new_buffer;
+		data->buffer_size = new_size;
+	}
 
-	sc_mem_secure_clear_free(data->buffer, data->buffer_len);
-	data->buffer = new_buffer;
+	memcpy(data->buffer + data->buffer_len, in, in_len);
 	data->buffer_len = new_len;
 	return CKR_OK;
 }
@@ -568,8 +581,12 @@ sc_pkcs11_signature_update(sc_pkcs11_operation_t *operation,
 	LOG_FUNC_CALLED(context);
 	sc_log(context, "data part length %li", ulPartLen);
 	data = (struct operation_data *)operation->priv_data;
+	data->updated = 1;
 	if (data->md) {
+		unsigned long long start = sc_latency_begin(context);
+
 		rv = data->md->type->md_update(data->md, pPart, ulPartLen);
+		sc_latency_end(context, SC_LATENCY_HOST_CRYPTO, start);
 		LOG_FUNC_RETURN(context, (int) rv);
 	}
 
@@ -591,8 +608,10 @@ sc_pkcs11_signature_final(sc_pkcs11_operation_t *operation,
 		sc_pkcs11_operation_t	*md = data->md;
 		CK_BYTE hash[64];
 		CK_ULONG len = sizeof(hash);
+		unsigned long long start = sc_latency_begin(context);
 
 		rv = md->type->md_final(md, hash, &len);
+		sc_latency_end(context, SC_LATENCY_HOST_CRYPTO, start);
 		if (rv == CKR_BUFFER_TOO_SMALL)
 			rv = CKR_FUNCTION_FAILED;
 		if (rv != CKR_OK)
@@ -653,6 +672,113 @@ sc_pkcs11_signature_size(sc_pkcs11_operation_t *operation, CK_ULONG_PTR pLength)
 	LOG_FUNC_RETURN(context, (int) rv);
 }
 
+/*
+ * A batch signs whole inputs, so it cannot finish an operation which
+ * already has data from C_SignUpdate(). The operation is left active then.
+ */
+CK_RV
+sc_pkcs11_sign_batch_check(struct sc_pkcs11_session *session)
+{
+	sc_pkcs11_operation_t *op;
+	struct operation_data *data;
+	CK_RV rv;
+
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op);
+	if (rv != CKR_OK)
+		return rv;
+
+	if (op->type->sign_final != sc_pkcs11_signature_final) {
+		session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	}
+	data = (struct operation_data *)op->priv_data;
+	if (data->updated)
+		return CKR_OPERATION_ACTIVE;
+	return CKR_OK;
+}
+
+/*
+ * Sign several inputs within one signature operation. Inputs are hashed here
+ * if the mechanism needs it, then passed to the key at once so the framework
+ * can do them in a single card session.
+ */
+CK_RV
+sc_pkcs11_sign_batch(struct sc_pkcs11_session *session, CK_ULONG ulCount,
+		CK_BYTE_PTR *ppData, CK_ULONG_PTR pulDataLen,
+		CK_BYTE_PTR *ppSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	sc_pkcs11_operation_t *op, *md;
+	struct operation_data *data;
+	CK_BYTE (*hashes)[64] = NULL;
+	CK_BYTE_PTR *in = ppData;
+	CK_ULONG *in_len = pulDataLen, i;
+	CK_RV rv;
+
+	LOG_FUNC_CALLED(context);
+	rv = session_get_operation(session, SC_PKCS11_OPERATION_SIGN, &op);
+	if (rv != CKR_OK)
+		LOG_FUNC_RETURN(context, (int) rv);
+
+	if (op->type->sign_final != sc_pkcs11_signature_final) {
+		rv = CKR_FUNCTION_NOT_SUPPORTED;
+		goto done;
+	}
+	data = (struct operation_data *)op->priv_data;
+
+	if (data->md) {
+		hashes = calloc(ulCount, sizeof(*hashes));
+		in = calloc(ulCount, sizeof(*in));
+		in_len = calloc(ulCount, sizeof(*in_len));
+		if (hashes == NULL || in == NULL || in_len == NULL) {
+			rv = CKR_HOST_MEMORY;
+			goto done;
+		}
+		for (i = 0; i < ulCount && rv == CKR_OK; i++) {
+			unsigned long long start = sc_latency_begin(context);
+
+			md = sc_pkcs11_new_operation(session, data->info->hash_type);
+			if (md == NULL) {
+				rv = CKR_HOST_MEMORY;
+				break;
+			}
+			in[i] = hashes[i];
+			in_len[i] = sizeof(hashes[i]);
+			rv = md->type->md_init(md);
+			if (rv == CKR_OK)
+				rv = md->type->md_update(md, ppData[i], pulDataLen[i]);
+			if (rv == CKR_OK)
+				rv = md->type->md_final(md, in[i], &in_len[i]);
+			sc_pkcs11_release_operation(&md);
+			sc_latency_end(context, SC_LATENCY_HOST_CRYPTO, start);
+		}
+		if (rv == CKR_BUFFER_TOO_SMALL)
+			rv = CKR_FUNCTION_FAILED;
+		if (rv != CKR_OK)
+			goto done;
+	}
+
+	if (data->key->ops->sign_batch != NULL) {
+		rv = data->key->ops->sign_batch(op->session, data->key, &op->mechanism,
+				ulCount, in, in_len, ppSignature, pulSignatureLen);
+	} else {
+		for (i = 0; i < ulCount && rv == CKR_OK; i++)
+			rv = data->key->ops->sign(op->session, data->key, &op->mechanism,
+					in[i], in_len[i], ppSignature[i], &pulSignatureLen[i]);
+	}
+
+done:
+	if (hashes != NULL)
+		sc_mem_clear(hashes, ulCount * sizeof(*hashes));
+	free(hashes);
+	if (in != ppData)
+		free(in);
+	if (in_len != pulDataLen)
+		free(in_len);
+	session_stop_operation(session, SC_PKCS11_OPERATION_SIGN);
+
+	LOG_FUNC_RETURN(context, (int) rv);
+}
+
 static void
 sc_pkcs11_operation_release(sc_pkcs11_operation_t *operation)
 {
@@ -828,8 +954,12 @@ sc_pkcs11_verify_update(sc_pkcs11_operation_t *operation,
 	data = (struct operation_data *)operation->priv_data;
 	if (data->md) {
 		sc_pkcs11_operation_t	*md = data->md;
+		unsigned long long start = sc_latency_begin(context);
+		CK_RV rv;
 
-		return md->type->md_update(md, pPart, ulPartLen);
+		rv = md->type->md_update(md, pPart, ulPartLen);
+		sc_latency_end(context, SC_LATENCY_HOST_CRYPTO, start);
+		return rv;
 	}
 
 	/* This verification mechanism operates on the raw data */
@@ -849,6 +979,7 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 	CK_ATTRIBUTE attr = {CKA_VALUE, NULL, 0};
 	CK_ATTRIBUTE attr_key_type = {CKA_KEY_TYPE, &key_type, sizeof(key_type)};
 	CK_ATTRIBUTE attr_key_params = {CKA_GOSTR3410_PARAMS, &params, sizeof(params)};
+	unsigned long long start;
 	CK_RV rv;
 
 	data = (struct operation_data *)operation->priv_data;
@@ -863,20 +994,22 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 
 	if (key_type != CKK_GOSTR3410)
 		attr.type = CKA_SPKI;
-		
 
-	rv = key->ops->get_attribute(operation->session, key, &attr);
-	if (rv != CKR_OK)
-		return rv;
-	pubkey_value = calloc(1, attr.ulValueLen);
-	if (!pubkey_value) {
-		rv = CKR_HOST_MEMORY;
-		goto done;
+	/* Other keys than GOST ones are decoded once and kept with the object */
+	if (key_type == CKK_GOSTR3410 || key->verify_key == NULL) {
+		rv = key->ops->get_attribute(operation->session, key, &attr);
+		if (rv != CKR_OK)
+			return rv;
+		pubkey_value = calloc(1, attr.ulValueLen);
+		if (!pubkey_value) {
+			rv = CKR_HOST_MEMORY;
+			goto done;
+		}
+		attr.pValue = pubkey_value;
+		rv = key->ops->get_attribute(operation->session, key, &attr);
+		if (rv != CKR_OK)
+			goto done;
 	}
-	attr.pValue = pubkey_value;
-	rv = key->ops->get_attribute(operation->session, key, &attr);
-	if (rv != CKR_OK)
-		goto done;
 
 	if (key_type == CKK_GOSTR3410) {
 		rv = key->ops->get_attribute(operation->session, key, &attr_key_params);
@@ -884,10 +1017,12 @@ sc_pkcs11_verify_final(sc_pkcs11_operation_t *operation,
 			goto done;
 	}
 
-	rv = sc_pkcs11_verify_data(pubkey_value, attr.ulValueLen,
+	start = sc_latency_begin(context);
+	rv = sc_pkcs11_verify_data(key, pubkey_value, attr.ulValueLen,
 		params, sizeof(params),
 		&operation->mechanism, data->md,
 		data->buffer, data->buffer_len, pSignature, ulSignatureLen);
+	sc_latency_end(context, SC_LATENCY_HOST_CRYPTO, start);
 
 done:
 	free(pubkey_value);
@@ -178,6 +178,8 @@ CK_RV reset_login_state(struct sc_pkcs11_slot *slot, CK_RV rv)
 			slot->login_user = -1;
 			pop_all_login_states(slot);
 		}
+		if (rv != CKR_OK || sc_pkcs11_conf.atomic)
+			slot_expire_session_state(slot);
 	}
 
 	return rv;
@@ -453,6 +455,7 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	scconf_block *conf_block = NULL;
 	char *unblock_style = NULL;
 	char *create_slots_for_pins = NULL, *op, *tmp;
+	int max_age, threads;
 
 	/* Set defaults */
 	conf->max_virtual_slots = 16;
@@ -467,6 +470,9 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 	conf->pin_unblock_style = SC_PKCS11_PIN_UNBLOCK_NOT_ALLOWED;
 	conf->create_puk_slot = 0;
 	conf->create_slots_flags = SC_PKCS11_SLOT_CREATE_ALL;
+	conf->slot_locking = 0;
+	conf->session_state_max_age = 1000;
+	conf->card_detect_threads = 4;
 
 	conf_block = sc_get_conf_block(ctx, "pkcs11", NULL, 1);
 	if (!conf_block)
@@ -480,6 +486,11 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 		conf->lock_login = 1;
 	conf->lock_login = scconf_get_bool(conf_block, "lock_login", conf->lock_login);
 	conf->init_sloppy = scconf_get_bool(conf_block, "init_sloppy", conf->init_sloppy);
+	conf->slot_locking = scconf_get_bool(conf_block, "slot_locking", conf->slot_locking);
+	max_age = scconf_get_int(conf_block, "session_state_max_age", conf->session_state_max_age);
+	conf->session_state_max_age = max_age > 0 ? max_age : 0;
+	threads = scconf_get_int(conf_block, "card_detect_threads", conf->card_detect_threads);
+	conf->card_detect_threads = threads > 1 ? threads : 1;
 
 	unblock_style = (char *)scconf_get_str(conf_block, "user_pin_unblock_style", NULL);
 	if (unblock_style && !strcmp(unblock_style, "set_pin_in_unlogged_session"))
@@ -508,8 +519,10 @@ void load_pkcs11_parameters(struct sc_pkcs11_config *conf, sc_context_t * ctx)
 
 	sc_log(ctx, "PKCS#11 options: max_virtual_slots=%d slots_per_card=%d "
 		 "lock_login=%d atomic=%d pin_unblock_style=%d "
-		 "create_slots_flags=0x%X",
+		 "create_slots_flags=0x%X slot_locking=%d session_state_max_age=%u "
+		 "card_detect_threads=%u",
 		 conf->max_virtual_slots, conf->slots_per_card,
 		 conf->lock_login, conf->atomic, conf->pin_unblock_style,
-		 conf->create_slots_flags);
+		 conf->create_slots_flags, conf->slot_locking,
+		 conf->session_state_max_age, conf->card_detect_threads);
 }
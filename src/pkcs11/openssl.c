@@ -428,6 +428,56 @@ static void sc_pkcs11_openssl_md_release(sc_pkcs11_operation_t *op)
 	}
 }
 
+/*
+ * Digests for verification are fetched by C_Initialize() and kept until
+ * C_Finalize(), the decoded public keys are kept with their objects
+ */
+static struct {
+	const char *name;
+	EVP_MD *md;
+} verify_mds[] = {
+	{ "sha1", NULL },
+	{ "sha224", NULL },
+	{ "sha256", NULL },
+	{ "sha384", NULL },
+	{ "sha512", NULL },
+};
+
+static const EVP_MD *verify_md(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(verify_mds) / sizeof(verify_mds[0]); i++)
+		if (strcmp(verify_mds[i].name, name) == 0)
+			return verify_mds[i].md;
+	return NULL;
+}
+
+/* Called by C_Initialize(), so that verify_mds is only read afterwards */
+void sc_pkcs11_init_openssl(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(verify_mds) / sizeof(verify_mds[0]); i++)
+		verify_mds[i].md = sc_evp_md(context, verify_mds[i].name);
+}
+
+void sc_pkcs11_release_verify_key(struct sc_pkcs11_object *object)
+{
+	EVP_PKEY_free(object->verify_key);
+	object->verify_key = NULL;
+}
+
+void sc_pkcs11_release_openssl(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(verify_mds) / sizeof(verify_mds[0]); i++) {
+		sc_evp_md_free(verify_mds[i].md);
+		verify_mds[i].md = NULL;
+	}
+}
+
 #if !defined(OPENSSL_NO_EC)
 
 static void reverse(unsigned char *buf, size_t len)
@@ -575,7 +625,8 @@ static CK_RV gostr3410_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len
  * If a hash function was used, we can make a big shortcut by
  *   finishing with EVP_VerifyFinal().
  */
-CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
+CK_RV sc_pkcs11_verify_data(struct sc_pkcs11_object *key,
+			const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 			const CK_BYTE_PTR pubkey_params, CK_ULONG pubkey_params_len,
 			CK_MECHANISM_PTR mech, sc_pkcs11_operation_t *md,
 			CK_BYTE_PTR data, CK_ULONG data_len,
@@ -605,11 +656,14 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 	 * And we need to support more then just RSA.
 	 * We can use d2i_PUBKEY which works for SPKI and any key type.
 	 */
-	pubkey_tmp = pubkey; /* pass in so pubkey pointer is not modified */
+	if (key->verify_key == NULL) {
+		pubkey_tmp = pubkey; /* pass in so pubkey pointer is not modified */
 
-	pkey = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
-	if (pkey == NULL)
-		return CKR_GENERAL_ERROR;
+		key->verify_key = d2i_PUBKEY(NULL, &pubkey_tmp, pubkey_len);
+		if (key->verify_key == NULL)
+			return CKR_GENERAL_ERROR;
+	}
+	pkey = key->verify_key;
 
 	if (md != NULL && (mech->mechanism == CKM_SHA1_RSA_PKCS
 		|| mech->mechanism == CKM_MD5_RSA_PKCS
@@ -652,7 +706,6 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 		} else {
 			res = -1;
 		}
-		EVP_PKEY_free(pkey);
 		if (res == 1)
 			return CKR_OK;
 		else if (res == 0) {
@@ -689,51 +742,43 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 		    || mech->mechanism == CKM_ECDSA_SHA384
 		    || mech->mechanism == CKM_ECDSA_SHA512) {
 			EVP_MD_CTX *mdctx;
-			EVP_MD *md = NULL;
+			const EVP_MD *md = NULL;
 			switch (mech->mechanism) {
 				case CKM_ECDSA_SHA1:
-					md = sc_evp_md(context, "sha1");
+					md = verify_md("sha1");
 					break;
 				case CKM_ECDSA_SHA224:
-					md = sc_evp_md(context, "sha224");
+					md = verify_md("sha224");
 					break;
 				case CKM_ECDSA_SHA256:
-					md = sc_evp_md(context, "sha256");
+					md = verify_md("sha256");
 					break;
 				case CKM_ECDSA_SHA384:
-					md = sc_evp_md(context, "sha384");
+					md = verify_md("sha384");
 					break;
 				case CKM_ECDSA_SHA512:
-					md = sc_evp_md(context, "sha512");
+					md = verify_md("sha512");
 					break;
 				default:
-					EVP_PKEY_free(pkey);
 					return CKR_GENERAL_ERROR;
 			}
 			mdbuf_len = EVP_MD_size(md);
 			mdbuf = calloc(1, mdbuf_len);
 			if (mdbuf == NULL) {
-				EVP_PKEY_free(pkey);
-				sc_evp_md_free(md);
 				return CKR_DEVICE_MEMORY;
 			}
 			if ((mdctx = EVP_MD_CTX_new()) == NULL) {
 				free(mdbuf);
-				EVP_PKEY_free(pkey);
-				sc_evp_md_free(md);
 				return CKR_GENERAL_ERROR;
 			}
 			if (!EVP_DigestInit(mdctx, md)
 				|| !EVP_DigestUpdate(mdctx, data, data_len)
 				|| !EVP_DigestFinal(mdctx, mdbuf, &mdbuf_len)) {
-				EVP_PKEY_free(pkey);
 				EVP_MD_CTX_free(mdctx);
-				sc_evp_md_free(md);
 				free(mdbuf);
 				return CKR_GENERAL_ERROR;
 			}
 			EVP_MD_CTX_free(mdctx);
-			sc_evp_md_free(md);
 			data = mdbuf;
 			data_len = mdbuf_len;
 		}
@@ -746,7 +791,6 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 			res = EVP_PKEY_verify(ctx, signat_tmp, signat_len_tmp, data, data_len);
 
 		EVP_PKEY_CTX_free(ctx);
-		EVP_PKEY_free(pkey);
 		free(signat_tmp);
 		free(mdbuf);
 
@@ -762,7 +806,6 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 		size_t rsa_outlen = 0;
 		EVP_PKEY_CTX *ctx = sc_evp_pkey_ctx_new(context, pkey);
 		if (!ctx) {
-			EVP_PKEY_free(pkey);
 			return CKR_DEVICE_MEMORY;
 		}
 
@@ -785,7 +828,6 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 			pad = RSA_NO_PADDING;
 			break;
 		default:
-			EVP_PKEY_free(pkey);
 			EVP_PKEY_CTX_free(ctx);
 			return CKR_ARGUMENTS_BAD;
 		}
@@ -793,20 +835,17 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 		if ( EVP_PKEY_verify_recover_init(ctx) != 1 ||
 			EVP_PKEY_CTX_set_rsa_padding(ctx, pad) != 1) {
 			EVP_PKEY_CTX_free(ctx);
-			EVP_PKEY_free(pkey);
 			return CKR_GENERAL_ERROR;
 		}
 
 		rsa_outlen = EVP_PKEY_size(pkey);
 		rsa_out = calloc(1, rsa_outlen);
 		if (rsa_out == NULL) {
-			EVP_PKEY_free(pkey);
 			EVP_PKEY_CTX_free(ctx);
 			return CKR_DEVICE_MEMORY;
 		}
 		if (EVP_PKEY_verify_recover(ctx, rsa_out, &rsa_outlen, signat, signat_len) != 1) {
 			free(rsa_out);
-			EVP_PKEY_free(pkey);
 			EVP_PKEY_CTX_free(ctx);
 			sc_log(context, "RSA_public_decrypt() returned %d\n", (int) rsa_outlen);
 			return CKR_GENERAL_ERROR;
@@ -822,12 +861,11 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 		    mech->mechanism == CKM_SHA384_RSA_PKCS_PSS ||
 		    mech->mechanism == CKM_SHA512_RSA_PKCS_PSS) {
 			CK_RSA_PKCS_PSS_PARAMS* param = NULL;
-			EVP_MD *mgf_md = NULL, *pss_md = NULL;
+			const EVP_MD *mgf_md = NULL, *pss_md = NULL;
 			unsigned char digest[EVP_MAX_MD_SIZE];
 
 			if (mech->pParameter == NULL) {
 				free(rsa_out);
-				EVP_PKEY_free(pkey);
 				sc_log(context, "PSS mechanism requires parameter");
 				return CKR_MECHANISM_PARAM_INVALID;
 			}
@@ -835,46 +873,43 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 			param = (CK_RSA_PKCS_PSS_PARAMS*)mech->pParameter;
 			switch (param->mgf) {
 			case CKG_MGF1_SHA1:
-				mgf_md = sc_evp_md(context, "sha1");
+				mgf_md = verify_md("sha1");
 				break;
 			case CKG_MGF1_SHA224:
-				mgf_md = sc_evp_md(context, "sha224");
+				mgf_md = verify_md("sha224");
 				break;
 			case CKG_MGF1_SHA256:
-				mgf_md = sc_evp_md(context, "sha256");
+				mgf_md = verify_md("sha256");
 				break;
 			case CKG_MGF1_SHA384:
-				mgf_md = sc_evp_md(context, "sha384");
+				mgf_md = verify_md("sha384");
 				break;
 			case CKG_MGF1_SHA512:
-				mgf_md = sc_evp_md(context, "sha512");
+				mgf_md = verify_md("sha512");
 				break;
 			default:
 				free(rsa_out);
-				EVP_PKEY_free(pkey);
 				return CKR_MECHANISM_PARAM_INVALID;
 			}
 
 			switch (param->hashAlg) {
 			case CKM_SHA_1:
-				pss_md = sc_evp_md(context, "sha1");
+				pss_md = verify_md("sha1");
 				break;
 			case CKM_SHA224:
-				pss_md = sc_evp_md(context, "sha224");
+				pss_md = verify_md("sha224");
 				break;
 			case CKM_SHA256:
-				pss_md = sc_evp_md(context, "sha256");
+				pss_md = verify_md("sha256");
 				break;
 			case CKM_SHA384:
-				pss_md = sc_evp_md(context, "sha384");
+				pss_md = verify_md("sha384");
 				break;
 			case CKM_SHA512:
-				pss_md = sc_evp_md(context, "sha512");
+				pss_md = verify_md("sha512");
 				break;
 			default:
-				sc_evp_md_free(mgf_md);
 				free(rsa_out);
-				EVP_PKEY_free(pkey);
 				return CKR_MECHANISM_PARAM_INVALID;
 			}
 
@@ -888,10 +923,7 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 				unsigned int tmp_len;
 
 				if (!md_ctx || !EVP_DigestFinal(md_ctx, tmp, &tmp_len)) {
-					sc_evp_md_free(mgf_md);
-					sc_evp_md_free(pss_md);
 					free(rsa_out);
-					EVP_PKEY_free(pkey);
 					return CKR_GENERAL_ERROR;
 				}
 				data = tmp;
@@ -914,10 +946,7 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 				EVP_PKEY_CTX_set_rsa_pss_saltlen(ctx, sLen) != 1 ||
 				EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, mgf_md) != 1) {
 				sc_log(context, "Failed to initialize EVP_PKEY_CTX");
-				sc_evp_md_free(mgf_md);
-				sc_evp_md_free(pss_md);
 				free(rsa_out);
-				EVP_PKEY_free(pkey);
 				EVP_PKEY_CTX_free(ctx);
 				return rv;
 			}
@@ -925,15 +954,10 @@ CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 			if (data_len == (unsigned int) EVP_MD_size(pss_md) &&
 					EVP_PKEY_verify(ctx, signat, signat_len, data, data_len) == 1)
 				rv = CKR_OK;
-			EVP_PKEY_free(pkey);
 			EVP_PKEY_CTX_free(ctx);
-			sc_evp_md_free(mgf_md);
-			sc_evp_md_free(pss_md);
 			free(rsa_out);
 			sc_log(context, "Returning %lu", rv);
 			return rv;
-		} else {
-			EVP_PKEY_free(pkey);
 		}
 
 		if ((unsigned int) rsa_outlen == data_len && memcmp(rsa_out, data, data_len) == 0)
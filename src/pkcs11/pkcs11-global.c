@@ -52,6 +52,7 @@
 sc_context_t *context = NULL;
 struct sc_pkcs11_config sc_pkcs11_conf;
 list_t sessions;
+struct sc_pkcs11_handle_map session_map;
 list_t virtual_slots;
 #if !defined(_WIN32)
 pid_t initialized_pid = (pid_t)-1;
@@ -355,12 +356,17 @@ CK_RV C_Initialize(CK_VOID_PTR pInitArgs)
 	/* Load configuration */
 	load_pkcs11_parameters(&sc_pkcs11_conf, context);
 
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_init_openssl();
+#endif
+
 	/* List of sessions */
 	if (0 != list_init(&sessions)) {
 		rv = CKR_HOST_MEMORY;
 		goto out;
 	}
 	list_attributes_seeker(&sessions, session_list_seeker);
+	sc_pkcs11_handle_map_init(&session_map);
 
 	/* List of slots */
 	if (0 != list_init(&virtual_slots)) {
@@ -377,6 +383,9 @@ out:
 
 	if (rv != CKR_OK) {
 		if (context != NULL) {
+#ifdef ENABLE_OPENSSL
+			sc_pkcs11_release_openssl();
+#endif
 			sc_release_context(context);
 			context = NULL;
 		}
@@ -424,6 +433,7 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	while ((p = list_fetch(&sessions)))
 		free(p);
 	list_destroy(&sessions);
+	sc_pkcs11_handle_map_clear(&session_map);
 
 	while ((slot = list_fetch(&virtual_slots))) {
 		list_destroy(&slot->objects);
@@ -432,6 +442,9 @@ CK_RV C_Finalize(CK_VOID_PTR pReserved)
 	}
 	list_destroy(&virtual_slots);
 
+#ifdef ENABLE_OPENSSL
+	sc_pkcs11_release_openssl();
+#endif
 	sc_release_context(context);
 	context = NULL;
 
@@ -585,7 +598,7 @@ out:
 	return rv;
 }
 
-static sc_timestamp_t get_current_time(void)
+sc_timestamp_t get_current_time(void)
 {
 #if HAVE_GETTIMEOFDAY
 	struct timeval tv;
@@ -757,7 +770,10 @@ CK_RV C_InitToken(CK_SLOT_ID slotID,
 		}
 	}
 
+	/* C_GetTokenInfo() may be using the card without the global lock */
+	sc_pkcs11_card_lock(slot->p11card);
 	rv = slot->p11card->framework->init_token(slot, slot->fw_data, pPin, ulPinLen, pLabel);
+	sc_pkcs11_card_unlock(slot->p11card);
 	if (rv == CKR_OK) {
 		/* Now we should re-bind all tokens so they get the
 		 * corresponding function vector and flags */
@@ -841,11 +857,17 @@ out:
 /*
  * Interfaces
  */
-#define NUM_INTERFACES 2
+static CK_OPENSC_FUNCTION_LIST opensc_function_list = {
+	{ 1, 0 },
+	C_OpenSC_SignBatch
+};
+
+#define NUM_INTERFACES 3
 #define DEFAULT_INTERFACE 0
 CK_INTERFACE interfaces[NUM_INTERFACES] = {
 	{"PKCS 11", (void *)&pkcs11_function_list_3_0, 0},
-	{"PKCS 11", (void *)&pkcs11_function_list, 0}
+	{"PKCS 11", (void *)&pkcs11_function_list, 0},
+	{OPENSC_INTERFACE_NAME, (void *)&opensc_function_list, 0}
 };
 
 CK_RV C_GetInterfaceList(CK_INTERFACE_PTR pInterfacesList,  /* returned interfaces */
@@ -992,8 +1014,11 @@ CK_RV sc_pkcs11_lock(void)
 	if (!global_lock)
 		return CKR_OK;
 	if (global_locking)  {
+		unsigned long long start = sc_latency_begin(context);
+
 		while (global_locking->LockMutex(global_lock) != CKR_OK)
 			;
+		sc_latency_end(context, SC_LATENCY_PKCS11_LOCK, start);
 	}
 
 	return CKR_OK;
@@ -1040,6 +1065,203 @@ void sc_pkcs11_free_lock(void)
 	global_locking = NULL;
 }
 
+/*
+ * Whether the module may start threads of its own: only with locking, which
+ * makes libopensc thread safe, and if the application did not forbid it
+ */
+int sc_pkcs11_may_create_threads(void)
+{
+	return global_locking != NULL
+		&& !(app_locking.flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS);
+}
+
+/*
+ * Per-card locking
+ *
+ * With `slot_locking` enabled, the global lock only protects the slot and
+ * session tables. Everything reachable from a card (its sessions, objects
+ * and framework data) is protected by the lock of the card, which session
+ * calls hold across the card I/O instead of the global lock. Calls on
+ * different cards thus run in parallel. The lock owning each field of a
+ * slot is noted in struct sc_pkcs11_slot.
+ *
+ * Lock order: a thread holding a card lock never waits for the global lock.
+ * Threads holding the global lock may wait for a card lock, which is what
+ * sc_pkcs11_card_lock() does before sessions of the card are closed or the
+ * card is released.
+ */
+CK_RV sc_pkcs11_card_init_lock(struct sc_pkcs11_card *p11card)
+{
+	if (!sc_pkcs11_conf.slot_locking || !global_locking)
+		return CKR_OK;
+	/* Calls still waiting for the card when the module is finalized
+	 * use the lock after global_locking is gone */
+	p11card->locking = *global_locking;
+	return p11card->locking.CreateMutex(&p11card->lock);
+}
+
+static void
+card_lock_mutex(struct sc_pkcs11_card *p11card)
+{
+	while (p11card->locking.LockMutex(p11card->lock) != CKR_OK)
+		;
+}
+
+static void
+card_unlock_mutex(struct sc_pkcs11_card *p11card)
+{
+	while (p11card->locking.UnlockMutex(p11card->lock) != CKR_OK)
+		;
+}
+
+static void
+card_free(struct sc_pkcs11_card *p11card)
+{
+	if (p11card->lock)
+		p11card->locking.DestroyMutex(p11card->lock);
+	free(p11card);
+}
+
+/*
+ * Drop the last reference of a released card. Called with the global lock
+ * held, when the card was released or a call stopped using it.
+ */
+void sc_pkcs11_card_put(struct sc_pkcs11_card *p11card)
+{
+	if (!p11card->removed || p11card->refs > 0)
+		return;
+	card_free(p11card);
+}
+
+/*
+ * Wait until no call is using the card and keep it locked. Calls that were
+ * waiting for the card will look up their session again. Called with the
+ * global lock held.
+ */
+void sc_pkcs11_card_lock(struct sc_pkcs11_card *p11card)
+{
+	if (p11card == NULL || p11card->lock == NULL)
+		return;
+	card_lock_mutex(p11card);
+	p11card->epoch++;
+}
+
+void sc_pkcs11_card_unlock(struct sc_pkcs11_card *p11card)
+{
+	if (p11card == NULL || p11card->lock == NULL)
+		return;
+	card_unlock_mutex(p11card);
+}
+
+static CK_RV
+enter_card(struct sc_pkcs11_slot *slot, CK_SESSION_HANDLE hSession,
+		struct sc_pkcs11_session **session, struct sc_pkcs11_card **entered)
+{
+	struct sc_pkcs11_card *p11card;
+	unsigned int epoch;
+	unsigned long long start;
+	CK_RV rv;
+
+	*entered = NULL;
+	if (session) {
+		rv = get_session(hSession, session);
+		if (rv != CKR_OK)
+			return rv;
+	}
+	while (1) {
+		if (session)
+			slot = (*session)->slot;
+		p11card = slot->p11card;
+		if (p11card == NULL || p11card->lock == NULL)
+			return CKR_OK;
+
+		/* The reference keeps the card alive if it is released
+		 * while we wait for it without holding the global lock */
+		p11card->refs++;
+		epoch = p11card->epoch;
+		sc_pkcs11_unlock();
+		start = sc_latency_begin(context);
+		card_lock_mutex(p11card);
+		sc_latency_end(context, SC_LATENCY_PKCS11_LOCK, start);
+		if (p11card->epoch == epoch) {
+			*entered = p11card;
+			return CKR_OK;
+		}
+
+		/* Sessions were closed or the card was removed meanwhile */
+		card_unlock_mutex(p11card);
+		rv = sc_pkcs11_lock();
+		if (rv != CKR_OK) {
+			/* Finalized meanwhile: hand the card to the caller, whose
+			 * sc_pkcs11_leave_card() drops it and reports the failure */
+			card_lock_mutex(p11card);
+			*entered = p11card;
+			return rv;
+		}
+		p11card->refs--;
+		sc_pkcs11_card_put(p11card);
+		if (session) {
+			rv = get_session(hSession, session);
+			if (rv != CKR_OK)
+				return rv;
+		}
+	}
+}
+
+/*
+ * Trade the global lock for the lock of the card in the slot. Called with
+ * the global lock held. On success, *entered is the card to be passed to
+ * sc_pkcs11_leave_card(), or NULL if the global lock is still held because
+ * slot locking is disabled or there is no card.
+ */
+CK_RV sc_pkcs11_enter_card(struct sc_pkcs11_slot *slot, struct sc_pkcs11_card **entered)
+{
+	return enter_card(slot, 0, NULL, entered);
+}
+
+/*
+ * Look up the session and enter its card as sc_pkcs11_enter_card() does.
+ * The session is looked up again if it could have been closed while
+ * waiting for the card.
+ */
+CK_RV sc_pkcs11_enter_session_card(CK_SESSION_HANDLE hSession,
+		struct sc_pkcs11_session **session, struct sc_pkcs11_card **entered)
+{
+	return enter_card(NULL, hSession, session, entered);
+}
+
+/*
+ * Give the card back and take the global lock again. Session and objects
+ * of the card must not be used by the caller after this. Returns CKR_OK
+ * when the global lock is held again, which the caller then releases with
+ * sc_pkcs11_unlock(), or an error when the module was finalized meanwhile.
+ */
+CK_RV sc_pkcs11_leave_card(struct sc_pkcs11_card *entered)
+{
+	unsigned int refs;
+	CK_RV rv;
+
+	if (entered == NULL)
+		return CKR_OK;
+	card_unlock_mutex(entered);
+	rv = sc_pkcs11_lock();
+	if (rv == CKR_OK) {
+		entered->refs--;
+		sc_pkcs11_card_put(entered);
+		return rv;
+	}
+
+	/* Finalized meanwhile, which removed the card. Without the global
+	 * lock, the calls still referencing the card drop their references
+	 * under the card lock, and the last one frees it. */
+	card_lock_mutex(entered);
+	refs = --entered->refs;
+	card_unlock_mutex(entered);
+	if (refs == 0)
+		card_free(entered);
+	return rv;
+}
+
 CK_FUNCTION_LIST pkcs11_function_list = {
 	{ 2, 20 }, /* Note: NSS/Firefox ignores this version number and uses C_GetInfo() */
 	C_Initialize,
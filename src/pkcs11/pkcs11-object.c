@@ -72,36 +72,48 @@ sc_find_release(sc_pkcs11_operation_t *operation)
 }
 
 
+/* The objects of a slot are protected by the card lock */
+static CK_RV
+get_object(struct sc_pkcs11_session *session, CK_OBJECT_HANDLE hObject,
+		struct sc_pkcs11_object **object)
+{
+	*object = slot_get_object(session->slot, hObject);
+	if (!*object)
+		return CKR_OBJECT_HANDLE_INVALID;
+	return CKR_OK;
+}
+
+/* Enters the card of the session, to be left by the caller
+ * with sc_pkcs11_leave_card() */
 static CK_RV
 get_object_from_session(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
-		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object)
+		struct sc_pkcs11_session **session, struct sc_pkcs11_object **object,
+		struct sc_pkcs11_card **p11card)
 {
 	struct sc_pkcs11_session *sess;
 	CK_RV rv;
 
-	rv = get_session(hSession, &sess);
+	rv = sc_pkcs11_enter_session_card(hSession, &sess, p11card);
 	if (rv != CKR_OK)
 		return rv;
 
-	*object = list_seek(&sess->slot->objects, &hObject);
-	if (!*object)
-		return CKR_OBJECT_HANDLE_INVALID;
+	rv = get_object(sess, hObject, object);
+	if (rv != CKR_OK)
+		return rv;
 	*session = sess;
 	return CKR_OK;
 }
 
 /* C_CreateObject can be called from C_DeriveKey
- * which is holding the sc_pkcs11_lock
- * So dont get the lock again. */
+ * which is holding the sc_pkcs11_lock and the card
+ * So dont get the locks again. */
 static
-CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle */
+CK_RV sc_create_object_int(struct sc_pkcs11_session *session,
 		CK_ATTRIBUTE_PTR pTemplate,		/* the object's template */
 		CK_ULONG ulCount,			/* attributes in template */
-		CK_OBJECT_HANDLE_PTR phObject,		/* receives new object's handle. */
-		int use_lock)
+		CK_OBJECT_HANDLE_PTR phObject)		/* receives new object's handle. */
 {
 	CK_RV rv = CKR_OK;
-	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_card *card;
 	CK_BBOOL is_token = FALSE;
 
@@ -109,20 +121,8 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 	if (pTemplate == NULL_PTR || ulCount == 0)
 		return CKR_ARGUMENTS_BAD;
 
-	if (use_lock) {
-	    rv = sc_pkcs11_lock();
-	    if (rv != CKR_OK)
-		return rv;
-	}
-
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_CreateObject()", pTemplate, ulCount);
 
-	session = list_seek(&sessions, &hSession);
-	if (!session) {
-		rv = CKR_SESSION_HANDLE_INVALID;
-		goto out;
-	}
-
 	rv = attr_find(pTemplate, ulCount, CKA_TOKEN, &is_token, NULL);
 	if (rv != CKR_TEMPLATE_INCOMPLETE && rv != CKR_OK) {
 		goto out;
@@ -146,9 +146,6 @@ CK_RV sc_create_object_int(CK_SESSION_HANDLE hSession,	/* the session's handle *
 		rv = card->framework->create_object(session->slot, pTemplate, ulCount, phObject);
 
 out:
-	if (use_lock)
-		sc_pkcs11_unlock();
-
 	return rv;
 }
 
@@ -158,7 +155,21 @@ C_CreateObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		CK_ULONG ulCount,		/* attributes in template */
 		CK_OBJECT_HANDLE_PTR phObject)
 {
-	return sc_create_object_int(hSession, pTemplate, ulCount, phObject, 1);
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
+	if (rv == CKR_OK)
+		rv = sc_create_object_int(session, pTemplate, ulCount, phObject);
+
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
+	return rv;
 }
 
 
@@ -179,6 +190,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_BBOOL is_token = FALSE;
 	CK_ATTRIBUTE token_attribute = {CKA_TOKEN, &is_token, sizeof(is_token)};
@@ -188,7 +200,7 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_DestroyObject(hSession=0x%lx, hObject=0x%lx)", hSession, hObject);
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, &session, &object, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -210,7 +222,8 @@ C_DestroyObject(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = object->ops->destroy_object(session, object);
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -241,6 +254,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV j;
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV res;
 	CK_RV res_type;
@@ -254,7 +268,7 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, &session, &object, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -297,7 +311,8 @@ out:
 		sc_log(context, "C_GetAttributeValue(hSession=0x%lx, hObject=0x%lx) = 0x%lx",
                         hSession, hObject, rv);
 
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -311,6 +326,7 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	unsigned int i;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 
 	if (pTemplate == NULL_PTR || ulCount == 0)
@@ -322,7 +338,7 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_SetAttributeValue", pTemplate, ulCount);
 
-	rv = get_object_from_session(hSession, hObject, &session, &object);
+	rv = get_object_from_session(hSession, hObject, &session, &object, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -339,10 +355,15 @@ C_SetAttributeValue(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			if (rv != CKR_OK)
 				break;
 		}
+		slot_reindex_object(session->slot, object);
+#ifdef ENABLE_OPENSSL
+		sc_pkcs11_release_verify_key(object);
+#endif
 	}
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -356,12 +377,14 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_BBOOL is_private = TRUE;
 	CK_ATTRIBUTE private_attribute = { CKA_PRIVATE, &is_private, sizeof(is_private) };
 	int match, hide_private;
-	unsigned int i, j;
+	unsigned int j;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_operation *op = NULL;
+	struct sc_pkcs11_candidates candidates;
 
 	if (pTemplate == NULL_PTR && ulCount > 0)
 		return CKR_ARGUMENTS_BAD;
@@ -370,7 +393,7 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -394,9 +417,15 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if ((slot->login_user == -1) && (slot->token_info.flags & CKF_LOGIN_REQUIRED))
 		hide_private = 1;
 
+	/* Only compare the objects the index finds for the template */
+	rv = slot_find_candidates(session, pTemplate, ulCount, &candidates);
+	if (rv != CKR_OK)
+		goto out;
+	sc_log(context, "Searching %"SC_FORMAT_LEN_SIZE_T"u of %u objects",
+	       candidates.count, list_size(&slot->objects));
+
 	/* For each object in token do */
-	for (i=0; i<list_size(&slot->objects); i++) {
-		object = (struct sc_pkcs11_object *)list_get_at(&slot->objects, i);
+	while ((object = slot_next_candidate(slot, &candidates)) != NULL) {
 		sc_log(context, "Object with handle 0x%lx", object->handle);
 
 		/* User not logged in and private object? */
@@ -452,7 +481,8 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	sc_log(context, "%d matching objects\n", operation->num_handles);
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -466,6 +496,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	CK_ULONG to_return;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_find_operation *operation;
 	struct sc_pkcs11_operation *op = NULL;
 
@@ -476,7 +507,7 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -495,7 +526,9 @@ C_FindObjects(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	operation->current_handle += to_return;
 
-out:	sc_pkcs11_unlock();
+out:
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -505,12 +538,13 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -518,7 +552,9 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)	/* the session's handle */
 	if (rv == CKR_OK)
 		session_stop_operation(session, SC_PKCS11_OPERATION_FIND);
 
-out:	sc_pkcs11_unlock();
+out:
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -532,6 +568,7 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	if (pMechanism == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
@@ -541,12 +578,13 @@ C_DigestInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_DigestInit(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_init(session, pMechanism);
 
 	SC_LOG_RV("C_DigestInit() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -560,6 +598,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG  ulBuflen = 0;
 
 	rv = sc_pkcs11_lock();
@@ -567,7 +606,7 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		return rv;
 
 	sc_log(context, "C_Digest(hSession=0x%lx)", hSession);
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -591,7 +630,8 @@ C_Digest(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	SC_LOG_RV("C_Digest = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -603,17 +643,19 @@ C_DigestUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_update(session, pPart, ulPartLen);
 
 	SC_LOG_RV("C_DigestUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -633,17 +675,19 @@ C_DigestFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_md_final(session, pDigest, pulDigestLen);
 
 	SC_LOG_RV("C_DigestFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -658,6 +702,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	CK_ATTRIBUTE sign_attribute = { CKA_SIGN, &can_sign, sizeof(can_sign) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
 
@@ -668,7 +713,7 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -695,7 +740,8 @@ C_SignInit(CK_SESSION_HANDLE hSession,		/* the session's handle */
 
 out:
 	SC_LOG_RV("C_SignInit() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -709,13 +755,16 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG length;
+	unsigned long long start;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
+	start = sc_latency_begin(context);
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -740,10 +789,72 @@ C_Sign(CK_SESSION_HANDLE hSession,		/* the session's handle */
 			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
 		rv = reset_login_state(session->slot, rv);
 	}
+	sc_latency_end(context, SC_LATENCY_PKCS11_SIGN, start);
 
 out:
 	SC_LOG_RV("C_Sign() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
+	return rv;
+}
+
+
+CK_RV
+C_OpenSC_SignBatch(CK_SESSION_HANDLE hSession,	/* the session's handle */
+		CK_ULONG ulCount,		/* number of inputs */
+		CK_BYTE_PTR *ppData,		/* the data (digests) to be signed */
+		CK_ULONG_PTR pulDataLen,	/* byte counts of the inputs */
+		CK_BYTE_PTR *ppSignature,	/* receive the signatures */
+		CK_ULONG_PTR pulSignatureLen)	/* receive byte counts of signatures */
+{
+	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
+	CK_ULONG length, i;
+	int too_small = 0;
+
+	if (ulCount == 0 || ppData == NULL_PTR || pulDataLen == NULL_PTR
+			|| pulSignatureLen == NULL_PTR)
+		return CKR_ARGUMENTS_BAD;
+	for (i = 0; i < ulCount; i++)
+		if (ppData[i] == NULL_PTR && pulDataLen[i] > 0)
+			return CKR_ARGUMENTS_BAD;
+
+	rv = sc_pkcs11_lock();
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
+		goto out;
+
+	if ((rv = sc_pkcs11_sign_batch_check(session)) != CKR_OK)
+		goto out;
+	/* As in C_Sign(), a length inquiry leaves the operation active */
+	if ((rv = sc_pkcs11_sign_size(session, &length)) != CKR_OK)
+		goto out;
+
+	for (i = 0; i < ulCount; i++) {
+		if (ppSignature == NULL || ppSignature[i] == NULL || length > pulSignatureLen[i])
+			too_small = 1;
+	}
+	if (too_small) {
+		for (i = 0; i < ulCount; i++)
+			pulSignatureLen[i] = length;
+		rv = ppSignature ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+		goto out;
+	}
+
+	rv = restore_login_state(session->slot);
+	if (rv == CKR_OK)
+		rv = sc_pkcs11_sign_batch(session, ulCount, ppData, pulDataLen,
+				ppSignature, pulSignatureLen);
+	rv = reset_login_state(session->slot, rv);
+
+out:
+	SC_LOG_RV("C_OpenSC_SignBatch() = %s", rv);
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -755,17 +866,19 @@ C_SignUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_sign_update(session, pPart, ulPartLen);
 
 	SC_LOG_RV("C_SignUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -776,14 +889,17 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		CK_ULONG_PTR pulSignatureLen)	/* receives byte count of signature */
 {
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_ULONG length;
+	unsigned long long start;
 	CK_RV rv;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
+	start = sc_latency_begin(context);
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -803,11 +919,13 @@ C_SignFinal(CK_SESSION_HANDLE hSession,		/* the session's handle */
 		if (rv == CKR_OK)
 			rv = sc_pkcs11_sign_final(session, pSignature, pulSignatureLen);
 		rv = reset_login_state(session->slot, rv);
+		sc_latency_end(context, SC_LATENCY_PKCS11_SIGN, start);
 	}
 
 out:
 	SC_LOG_RV("C_SignFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -842,6 +960,7 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE encrypt_attribute = {CKA_ENCRYPT, &can_encrypt, sizeof(can_encrypt)};
 	CK_ATTRIBUTE key_type_attr = {CKA_KEY_TYPE, &key_type, sizeof(key_type)};
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
 
@@ -852,7 +971,7 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -877,7 +996,8 @@ C_EncryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = sc_pkcs11_encr_init(session, pMechanism, object, key_type);
 out:
 	SC_LOG_RV("C_EncryptInit() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -890,12 +1010,13 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives encrypted byte count */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -904,7 +1025,8 @@ CK_RV C_Encrypt(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	SC_LOG_RV("C_Encrypt() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -916,18 +1038,20 @@ CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives encrypted byte count */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_encr_update(session, pPart, ulPartLen,
 				pEncryptedPart, pulEncryptedPartLen);
 
 	SC_LOG_RV("C_EncryptUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -937,12 +1061,13 @@ CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* receives byte count */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -951,7 +1076,8 @@ CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	SC_LOG_RV("C_EncryptFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -965,6 +1091,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE,	&key_type,	sizeof(key_type) };
 	CK_ATTRIBUTE unwrap_attribute = { CKA_UNWRAP,	&can_unwrap,	sizeof(can_unwrap) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	CK_RV rv;
 
@@ -975,7 +1102,7 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1006,7 +1133,8 @@ CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	SC_LOG_RV("C_DecryptInit() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1019,12 +1147,15 @@ C_Decrypt(CK_SESSION_HANDLE hSession,	     /* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
+	unsigned long long start;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
+	start = sc_latency_begin(context);
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK) {
@@ -1032,10 +1163,12 @@ C_Decrypt(CK_SESSION_HANDLE hSession,	     /* the session's handle */
 					ulEncryptedDataLen, pData, pulDataLen);
 		}
 		rv = reset_login_state(session->slot, rv);
+		sc_latency_end(context, SC_LATENCY_PKCS11_DECRYPT, start);
 	}
 
 	SC_LOG_RV("C_Decrypt() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1048,18 +1181,20 @@ C_DecryptUpdate(CK_SESSION_HANDLE hSession,  /* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_decr_update(session, pEncryptedPart, ulEncryptedPartLen,
 				pPart, pulPartLen);
 
 	SC_LOG_RV("C_DecryptUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1070,12 +1205,13 @@ C_DecryptFinal(CK_SESSION_HANDLE hSession,   /* the session's handle */
 {
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK) {
@@ -1087,7 +1223,8 @@ C_DecryptFinal(CK_SESSION_HANDLE hSession,   /* the session's handle */
 	}
 
 	SC_LOG_RV("C_DecryptFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1147,6 +1284,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* gets priv. key handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 
 	if (pMechanism == NULL_PTR
@@ -1161,7 +1299,7 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PrivKey attrs", pPrivateKeyTemplate, ulPrivateKeyAttributeCount);
 	dump_template(SC_LOG_DEBUG_NORMAL, "C_GenerateKeyPair(), PubKey attrs", pPublicKeyTemplate, ulPublicKeyAttributeCount);
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1185,7 +1323,8 @@ CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1205,6 +1344,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE extractable_attribute = { CKA_EXTRACTABLE, &can_be_wrapped, sizeof(can_be_wrapped) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *wrapping_object;
 	struct sc_pkcs11_object *key_object;
 
@@ -1216,7 +1356,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 	/* Check if the wrapping key is OK to do wrapping */
-	rv = get_object_from_session(hSession, hWrappingKey, &session, &wrapping_object);
+	rv = get_object_from_session(hSession, hWrappingKey, &session, &wrapping_object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1239,7 +1379,7 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	/* Check if the key to be wrapped exists and is extractable*/
-	rv = get_object_from_session(hSession, hKey, &session, &key_object);
+	rv = get_object(session, hKey, &key_object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1260,7 +1400,8 @@ CK_RV C_WrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = reset_login_state(session->slot, rv);
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1279,6 +1420,7 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE unwrap_attribute = { CKA_UNWRAP, &can_unwrap, sizeof(can_unwrap) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_object *key_object;
 
@@ -1289,7 +1431,7 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hUnwrappingKey, &session, &object);
+	rv = get_object_from_session(hSession, hUnwrappingKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1312,12 +1454,12 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	/* Create the target object in memory */
-	rv = sc_create_object_int(hSession, pTemplate, ulAttributeCount, phKey, 0);
+	rv = sc_create_object_int(session, pTemplate, ulAttributeCount, phKey);
 
 	if (rv != CKR_OK)
 	    goto out;
 
-	rv = get_object_from_session(hSession, *phKey, &session, &key_object);
+	rv = get_object(session, *phKey, &key_object);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1332,7 +1474,8 @@ CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	rv = reset_login_state(session->slot, rv);
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1351,6 +1494,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE derive_attribute = { CKA_DERIVE, &can_derive, sizeof(can_derive) };
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 	struct sc_pkcs11_object *key_object;
 
@@ -1361,7 +1505,7 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_object_from_session(hSession, hBaseKey, &session, &object);
+	rv = get_object_from_session(hSession, hBaseKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1391,11 +1535,11 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	    case CKK_EC:
 	    case CKK_EC_MONTGOMERY:
 
-		rv = sc_create_object_int(hSession, pTemplate, ulAttributeCount, phKey, 0);
+		rv = sc_create_object_int(session, pTemplate, ulAttributeCount, phKey);
 		if (rv != CKR_OK)
 		    goto out;
 
-		rv = get_object_from_session(hSession, *phKey, &session, &key_object);
+		rv = get_object(session, *phKey, &key_object);
 		if (rv != CKR_OK) {
 			if (rv == CKR_OBJECT_HANDLE_INVALID)
 				rv = CKR_KEY_HANDLE_INVALID;
@@ -1415,7 +1559,8 @@ CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1432,13 +1577,14 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 {				/* number of bytes to be generated */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_slot *slot;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		slot = session->slot;
 		if (slot == NULL || slot->p11card == NULL || slot->p11card->framework == NULL
@@ -1449,7 +1595,8 @@ CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	SC_LOG_RV("C_GenerateRandom() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -1474,6 +1621,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_ATTRIBUTE key_type_attr = { CKA_KEY_TYPE, &key_type, sizeof(key_type) };
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	struct sc_pkcs11_object *object;
 
 	if (pMechanism == NULL_PTR)
@@ -1484,7 +1632,7 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		return rv;
 
 
-	rv = get_object_from_session(hSession, hKey, &session, &object);
+	rv = get_object_from_session(hSession, hKey, &session, &object, &p11card);
 	if (rv != CKR_OK) {
 		if (rv == CKR_OBJECT_HANDLE_INVALID)
 			rv = CKR_KEY_HANDLE_INVALID;
@@ -1500,7 +1648,8 @@ CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	SC_LOG_RV("C_VerifyInit() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 #endif
 }
@@ -1516,12 +1665,13 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -1535,7 +1685,8 @@ CK_RV C_Verify(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 out:
 	SC_LOG_RV("C_Verify() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 #endif
 }
@@ -1549,17 +1700,19 @@ CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK)
 		rv = sc_pkcs11_verif_update(session, pPart, ulPartLen);
 
 	SC_LOG_RV("C_VerifyUpdate() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 #endif
 }
@@ -1573,12 +1726,13 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 #else
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv == CKR_OK) {
 		rv = restore_login_state(session->slot);
 		if (rv == CKR_OK)
@@ -1587,7 +1741,8 @@ CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 	SC_LOG_RV("C_VerifyFinal() = %s", rv);
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 #endif
 }
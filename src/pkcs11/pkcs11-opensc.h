@@ -25,5 +25,29 @@
  * to set userConsent=1 for other objects than private keys via PKCS#11. */
 #define CKA_OPENSC_ALWAYS_AUTH_ANY_OBJECT (CKA_VENDOR_DEFINED | SC_VENDOR_DEFINED | 3UL)
 
+/*
+ * OpenSC vendor interface, returned by C_GetInterface() for this name.
+ *
+ * C_OpenSC_SignBatch() finishes a signature operation started with
+ * C_SignInit() like C_Sign(), but signs ulCount inputs with the key and
+ * mechanism given there. The card is locked and the security environment set
+ * up once for the whole batch. pulSignatureLen[i] holds the size of
+ * ppSignature[i] on input and the length of the signature on output. If
+ * ppSignature is NULL or any buffer is too small, only the lengths are
+ * returned as with C_Sign(). On error none of the signatures can be relied on.
+ * An operation given data with C_SignUpdate() is left active and
+ * CKR_OPERATION_ACTIVE returned.
+ */
+#define OPENSC_INTERFACE_NAME		"Vendor OpenSC"
+
+typedef CK_RV (*CK_OPENSC_C_SignBatch)(CK_SESSION_HANDLE hSession, CK_ULONG ulCount,
+		CK_BYTE_PTR *ppData, CK_ULONG_PTR pulDataLen,
+		CK_BYTE_PTR *ppSignature, CK_ULONG_PTR pulSignatureLen);
+
+typedef struct CK_OPENSC_FUNCTION_LIST {
+	CK_VERSION version;
+	CK_OPENSC_C_SignBatch C_OpenSC_SignBatch;
+} CK_OPENSC_FUNCTION_LIST;
+
 
 #endif
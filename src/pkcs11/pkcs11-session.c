@@ -29,7 +29,7 @@
 
 CK_RV get_session(CK_SESSION_HANDLE hSession, struct sc_pkcs11_session **session)
 {
-	*session = list_seek(&sessions, &hSession);
+	*session = sc_pkcs11_handle_map_get(&session_map, hSession);
 	if (!*session)
 		return CKR_SESSION_HANDLE_INVALID;
 	return CKR_OK;
@@ -41,9 +41,11 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 		    CK_NOTIFY Notify,	/* notification callback function */
 		    CK_SESSION_HANDLE_PTR phSession)
 {				/* receives new session handle */
-	CK_RV rv;
+	CK_RV rv, locked;
 	struct sc_pkcs11_slot *slot;
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
+	int so_logged_in = 0;
 
 	if (!(flags & CKF_SERIAL_SESSION))
 		return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
@@ -61,8 +63,23 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	if (rv != CKR_OK)
 		goto out;
 
+	/* The login state belongs to the card, see struct sc_pkcs11_slot */
+	rv = sc_pkcs11_enter_card(slot, &p11card);
+	if (rv == CKR_OK)
+		so_logged_in = (slot->login_user == CKU_SO);
+	locked = sc_pkcs11_leave_card(p11card);
+	if (locked != CKR_OK)
+		return locked;
+	if (rv != CKR_OK)
+		goto out;
+	if (!(slot->slot_info.flags & CKF_TOKEN_PRESENT)) {
+		/* The card was removed while we waited for it */
+		rv = CKR_TOKEN_NOT_PRESENT;
+		goto out;
+	}
+
 	/* Check that no conflicting sessions exist */
-	if (!(flags & CKF_RW_SESSION) && (slot->login_user == CKU_SO)) {
+	if (!(flags & CKF_RW_SESSION) && so_logged_in) {
 		rv = CKR_SESSION_READ_WRITE_SO_EXISTS;
 		goto out;
 	}
@@ -75,7 +92,7 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 
 	/* make session handle from pointer and check its uniqueness */
 	session->handle = (CK_SESSION_HANDLE)(uintptr_t)session;
-	if (list_seek(&sessions, &session->handle) != NULL) {
+	if (sc_pkcs11_handle_map_get(&session_map, session->handle) != NULL) {
 		sc_log(context, "C_OpenSession handle 0x%lx already exists", session->handle);
 
 		free(session);
@@ -88,6 +105,11 @@ CK_RV C_OpenSession(CK_SLOT_ID slotID,	/* the slot's ID */
 	session->notify_callback = Notify;
 	session->notify_data = pApplication;
 	session->flags = flags;
+	if (sc_pkcs11_handle_map_add(&session_map, session->handle, session) != 0) {
+		free(session);
+		rv = CKR_HOST_MEMORY;
+		goto out;
+	}
 	slot->nsessions++;
 	list_append(&sessions, session);
 	*phSession = session->handle;
@@ -100,7 +122,7 @@ out:
 }
 
 /* Internal version of C_CloseSession that gets called with
- * the global lock held */
+ * the global lock and the card lock held */
 static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 {
 	struct sc_pkcs11_slot *slot;
@@ -108,7 +130,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "real C_CloseSession(0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = sc_pkcs11_handle_map_get(&session_map, hSession);
 	if (!session)
 		return CKR_SESSION_HANDLE_INVALID;
 
@@ -129,6 +151,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 	for (size_t i = 0; i < SC_PKCS11_OPERATION_MAX; i++)
 		sc_pkcs11_release_operation(&session->operation[i]);
 
+	sc_pkcs11_handle_map_del(&session_map, hSession);
 	if (list_delete(&sessions, session) != 0)
 		sc_log(context, "Could not delete session from list!");
 	free(session);
@@ -136,7 +159,7 @@ static CK_RV sc_pkcs11_close_session(CK_SESSION_HANDLE hSession)
 }
 
 /* Internal version of C_CloseAllSessions that gets called with
- * the global lock held */
+ * the global lock and the card lock held */
 CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 {
 	CK_RV rv = CKR_OK, error;
@@ -155,6 +178,8 @@ CK_RV sc_pkcs11_close_all_sessions(CK_SLOT_ID slotID)
 CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 {				/* the session's handle */
 	CK_RV rv;
+	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
@@ -162,8 +187,16 @@ CK_RV C_CloseSession(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "C_CloseSession(0x%lx)", hSession);
 
+	rv = get_session(hSession, &session);
+	if (rv != CKR_OK)
+		goto out;
+
+	p11card = session->slot->p11card;
+	sc_pkcs11_card_lock(p11card);
 	rv = sc_pkcs11_close_session(hSession);
+	sc_pkcs11_card_unlock(p11card);
 
+out:
 	sc_pkcs11_unlock();
 	return rv;
 }
@@ -183,7 +216,9 @@ CK_RV C_CloseAllSessions(CK_SLOT_ID slotID)
 	if (rv != CKR_OK)
 		goto out;
 
+	sc_pkcs11_card_lock(slot->p11card);
 	rv = sc_pkcs11_close_all_sessions(slotID);
+	sc_pkcs11_card_unlock(slot->p11card);
 
 out:
 	sc_pkcs11_unlock();
@@ -195,13 +230,14 @@ CK_RV C_SessionCancel(CK_SESSION_HANDLE hSession,  /* the session's handle */
 		      CK_FLAGS flags)      /* flags control which sessions are cancelled */
 {
 	struct sc_pkcs11_session *session;
+	struct sc_pkcs11_card *p11card = NULL;
 	CK_RV rv;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	rv = get_session(hSession, &session);
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
 	if (rv != CKR_OK)
 		goto out;
 
@@ -242,18 +278,21 @@ CK_RV C_SessionCancel(CK_SESSION_HANDLE hSession,  /* the session's handle */
 	}
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
 CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		       CK_SESSION_INFO_PTR pInfo)
 {				/* receives session information */
-	CK_RV rv;
+	CK_RV rv, locked;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 	const char *name;
 	int card_status = 0, logged_out = 0;
+	sc_timestamp_t now;
 
 	if (pInfo == NULL_PTR)
 		return CKR_ARGUMENTS_BAD;
@@ -264,7 +303,7 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	sc_log(context, "C_GetSessionInfo(hSession:0x%lx)", hSession);
 
-	session = list_seek(&sessions, &hSession);
+	session = sc_pkcs11_handle_map_get(&session_map, hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -275,18 +314,38 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	pInfo->flags = session->flags;
 	pInfo->ulDeviceError = 0;
 
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
+		goto out;
 	slot = session->slot;
-	card_status = slot_get_card_state(slot);
+
+	/* Polling applications are answered without talking to the card */
+	now = get_current_time();
+	if (now == 0 || now >= slot->session_state_expires) {
+		card_status = slot_get_card_state(slot);
+		if ((card_status & SC_READER_CARD_PRESENT) && !(card_status & SC_READER_CARD_CHANGED))
+			slot_set_session_state(slot, card_status, slot_get_logged_in_state(slot));
+	} else {
+		card_status = slot->card_state;
+	}
+
 	if (!(card_status & SC_READER_CARD_PRESENT) || card_status & SC_READER_CARD_CHANGED) {
 		/* Card was removed or reinserted, invalidate all sessions */
+		slot_expire_session_state(slot);
+		rv = sc_pkcs11_leave_card(p11card);
+		p11card = NULL;
+		if (rv != CKR_OK)
+			return rv;
+		sc_pkcs11_card_lock(slot->p11card);
 		slot->login_user = -1;
-		sc_pkcs11_close_all_sessions(session->slot->id);
+		sc_pkcs11_close_all_sessions(slot->id);
+		sc_pkcs11_card_unlock(slot->p11card);
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
 	}
 
 	/* Check whether the user is logged in the card */
-	logged_out = (slot_get_logged_in_state(slot) == SC_PIN_STATE_LOGGED_OUT);
+	logged_out = (slot->login_state == SC_PIN_STATE_LOGGED_OUT);
 	if (slot->login_user == CKU_SO && !logged_out) {
 		pInfo->state = CKS_RW_SO_FUNCTIONS;
 	} else if ((slot->login_user == CKU_USER && !logged_out) || !(slot->token_info.flags & CKF_LOGIN_REQUIRED)) {
@@ -298,12 +357,14 @@ CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	}
 
 out:
+	locked = sc_pkcs11_leave_card(p11card);
 	name = lookup_enum(RV_T, rv);
 	if (name)
 		sc_log(context, "C_GetSessionInfo(0x%lx) = %s", hSession, name);
 	else
 		sc_log(context, "C_GetSessionInfo(0x%lx) = 0x%lx", hSession, rv);
-	sc_pkcs11_unlock();
+	if (locked == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -331,6 +392,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	if (pPin == NULL_PTR && ulPinLen > 0)
 		return CKR_ARGUMENTS_BAD;
@@ -343,7 +405,7 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = CKR_USER_TYPE_INVALID;
 		goto out;
 	}
-	session = list_seek(&sessions, &hSession);
+	session = sc_pkcs11_handle_map_get(&session_map, hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -351,6 +413,10 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 
 	sc_log(context, "C_Login(0x%lx, %lu)", hSession, userType);
 
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
+		goto out;
+
 	slot = session->slot;
 
 	if (!(slot->token_info.flags & CKF_USER_PIN_INITIALIZED) && userType == CKU_USER) {
@@ -383,8 +449,10 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 		rv = restore_login_state(slot);
 		if (rv == CKR_OK) {
 			sc_log(context, "C_Login() userType %li", userType);
-			if (slot->p11card == NULL)
-				return CKR_TOKEN_NOT_RECOGNIZED;
+			if (slot->p11card == NULL) {
+				rv = CKR_TOKEN_NOT_RECOGNIZED;
+				goto out;
+			}
 			rv = slot->p11card->framework->login(slot, userType, pPin, ulPinLen);
 			sc_log(context, "fLogin() rv %li", rv);
 		}
@@ -392,12 +460,16 @@ CK_RV C_Login(CK_SESSION_HANDLE hSession,	/* the session's handle */
 			rv = push_login_state(slot, userType, pPin, ulPinLen);
 		if (rv == CKR_OK) {
 			slot->login_user = (int) userType;
+			slot_set_session_state(slot, SC_READER_CARD_PRESENT, SC_PIN_STATE_LOGGED_IN);
+			/* Private attributes of objects can be hashed now */
+			slot_retry_index(slot);
 		}
 		rv = reset_login_state(slot, rv);
 	}
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -417,12 +489,13 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	rv = sc_pkcs11_lock();
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
+	session = sc_pkcs11_handle_map_get(&session_map, hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -430,6 +503,10 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 
 	sc_log(context, "C_Logout(hSession:0x%lx)", hSession);
 
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
+		goto out;
+
 	slot = session->slot;
 
 	if (slot->login_user >= 0) {
@@ -437,15 +514,22 @@ CK_RV C_Logout(CK_SESSION_HANDLE hSession)
 		if (sc_pkcs11_conf.atomic)
 			pop_all_login_states(slot);
 		else {
-			if (!slot->p11card)
-				return CKR_TOKEN_NOT_RECOGNIZED;
+			if (!slot->p11card) {
+				rv = CKR_TOKEN_NOT_RECOGNIZED;
+				goto out;
+			}
 			rv = slot->p11card->framework->logout(slot);
 		}
+		if (rv == CKR_OK)
+			slot_set_session_state(slot, SC_READER_CARD_PRESENT, SC_PIN_STATE_LOGGED_OUT);
+		else
+			slot_expire_session_state(slot);
 	} else
 		rv = CKR_USER_NOT_LOGGED_IN;
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -454,6 +538,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	sc_log(context, "C_InitPIN() called, pin '%s'", pPin ? (char *) pPin : "<null>");
 	if (pPin == NULL_PTR && ulPinLen > 0)
@@ -463,7 +548,7 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
+	session = sc_pkcs11_handle_map_get(&session_map, hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -474,6 +559,10 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 		goto out;
 	}
 
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
+		goto out;
+
 	slot = session->slot;
 	if (slot->login_user != CKU_SO) {
 		rv = CKR_USER_NOT_LOGGED_IN;
@@ -489,7 +578,8 @@ CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_CHAR_PTR pPin, CK_ULONG ulPinLen)
 	}
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
 
@@ -499,6 +589,7 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	CK_RV rv;
 	struct sc_pkcs11_session *session;
 	struct sc_pkcs11_slot *slot;
+	struct sc_pkcs11_card *p11card = NULL;
 
 	if ((pOldPin == NULL_PTR && ulOldLen > 0) || (pNewPin == NULL_PTR && ulNewLen > 0))
 		return CKR_ARGUMENTS_BAD;
@@ -507,7 +598,7 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 	if (rv != CKR_OK)
 		return rv;
 
-	session = list_seek(&sessions, &hSession);
+	session = sc_pkcs11_handle_map_get(&session_map, hSession);
 	if (!session) {
 		rv = CKR_SESSION_HANDLE_INVALID;
 		goto out;
@@ -521,15 +612,22 @@ CK_RV C_SetPIN(CK_SESSION_HANDLE hSession,
 		goto out;
 	}
 
+	rv = sc_pkcs11_enter_session_card(hSession, &session, &p11card);
+	if (rv != CKR_OK)
+		goto out;
+	slot = session->slot;
+
 	rv = restore_login_state(slot);
 	if (rv == CKR_OK) {
 		if (slot->p11card == NULL)
-			return CKR_TOKEN_NOT_RECOGNIZED;
-		rv = slot->p11card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
+			rv = CKR_TOKEN_NOT_RECOGNIZED;
+		else
+			rv = slot->p11card->framework->change_pin(slot, pOldPin, ulOldLen, pNewPin, ulNewLen);
 	}
 	rv = reset_login_state(slot, rv);
 
 out:
-	sc_pkcs11_unlock();
+	if (sc_pkcs11_leave_card(p11card) == CKR_OK)
+		sc_pkcs11_unlock();
 	return rv;
 }
@@ -74,6 +74,9 @@ struct sc_pkcs11_config {
 	unsigned int create_puk_slot;
 	unsigned int create_slots_flags;
 	unsigned char ignore_pin_length;
+	unsigned char slot_locking;
+	unsigned int session_state_max_age;
+	unsigned int card_detect_threads;
 };
 
 /*
@@ -125,6 +128,12 @@ struct sc_pkcs11_object_ops {
 			void*,
 			CK_BYTE_PTR pData, CK_ULONG_PTR ulDataLen);
 
+	/* Signs ulCount inputs of one C_OpenSC_SignBatch() call, NULL to sign them one by one */
+	CK_RV (*sign_batch)(struct sc_pkcs11_session *, void *,
+			CK_MECHANISM_PTR, CK_ULONG ulCount,
+			CK_BYTE_PTR *ppData, CK_ULONG_PTR pulDataLen,
+			CK_BYTE_PTR *ppSignature, CK_ULONG_PTR pulSignatureLen);
+
 	/* Others to be added when implemented */
 };
 
@@ -132,12 +141,61 @@ struct sc_pkcs11_object {
 	CK_OBJECT_HANDLE handle;
 	int flags;
 	struct sc_pkcs11_object_ops *ops;
+	void *verify_key;	/* EVP_PKEY decoded by sc_pkcs11_verify_data() */
 };
 
 #define SC_PKCS11_OBJECT_SEEN	0x0001
 #define SC_PKCS11_OBJECT_HIDDEN	0x0002
 #define SC_PKCS11_OBJECT_RECURS	0x8000
 
+/*
+ * Hash index of sessions and objects by handle, kept next to the lists
+ * which preserve their order. See handle-map.c
+ */
+struct sc_pkcs11_handle_entry {
+	CK_ULONG handle;
+	void *ptr;
+};
+
+struct sc_pkcs11_handle_map {
+	struct sc_pkcs11_handle_entry *entries;
+	size_t size;			/* Power of two, or 0 */
+	size_t count;
+};
+
+/* Pointers with the same hash in a handle map, ordered by seq */
+struct sc_pkcs11_bucket_entry {
+	unsigned long seq;
+	void *ptr;
+};
+
+struct sc_pkcs11_bucket {
+	struct sc_pkcs11_bucket_entry *entries;
+	size_t count, allocated;
+};
+
+/*
+ * Object of a slot. The attributes searched most often are hashed into
+ * the search index of the slot, see slot_find_candidates()
+ */
+#define SC_PKCS11_INDEX_KEYS	3	/* CKA_CLASS, CKA_ID, CKA_LABEL */
+
+struct sc_pkcs11_slot_object {
+	struct sc_pkcs11_object *object;
+	unsigned long seq;		/* Order in which objects were added */
+	int indexed;
+	int scanned;			/* In the objects_scanned of the slot */
+	unsigned int keys_mask;		/* Attributes present in keys */
+	CK_ULONG keys[SC_PKCS11_INDEX_KEYS];
+};
+
+/* Objects a search compares with its template, see slot_next_candidate() */
+struct sc_pkcs11_candidates {
+	struct sc_pkcs11_bucket *bucket;	/* NULL to compare all objects */
+	struct sc_pkcs11_bucket *scanned;
+	size_t count;
+	size_t i, j;
+};
 
 /*
  * PKCS#11 smart card Framework abstraction
@@ -201,6 +259,14 @@ struct sc_pkcs11_card {
 	/* List of supported mechanisms */
 	struct sc_pkcs11_mechanism_type **mechanisms;
 	unsigned int nmechanisms;
+
+	/* Card lock used with `slot_locking`, see sc_pkcs11_enter_card() */
+	void *lock;
+	/* Mutex functions of the lock, which outlive C_Finalize() */
+	CK_C_INITIALIZE_ARGS locking;
+	unsigned int refs;		/* Calls waiting for or holding the lock */
+	unsigned int epoch;		/* Bumped when sessions are closed or the card is removed */
+	int removed;			/* Card released while still referenced */
 };
 
 /* If the slot did already show with `C_GetSlotList`, then we need to keep this
@@ -209,39 +275,54 @@ struct sc_pkcs11_card {
  * visibility to the application */
 #define SC_PKCS11_SLOT_FLAG_SEEN 1
 
+/*
+ * With `slot_locking`, the fields of a slot belong to one of the locks:
+ *  - global: held while reading or writing the field.
+ *  - card: the lock of the card in the slot, held by calls that entered
+ *    the card. Calls holding only the global lock enter the card too,
+ *    unless the slot has no card.
+ *  - both: written holding the global and the card lock, read holding
+ *    either of them.
+ */
 struct sc_pkcs11_slot {
-	CK_SLOT_ID id;			/* ID of the slot */
-	int login_user;			/* Currently logged in user */
-	CK_SLOT_INFO slot_info;		/* Slot specific information (information about reader) */
-	CK_TOKEN_INFO token_info;	/* Token specific information (information about card) */
-	sc_reader_t *reader;		/* same as card->reader if there's a card present */
-	struct sc_pkcs11_card *p11card;	/* The card associated with this slot */
-	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} */
-	void *fw_data;			/* Framework specific data */  /* TODO: get know how it used */
-	list_t objects;			/* Objects in this slot */
-	unsigned int nsessions;		/* Number of sessions using this slot */
-	sc_timestamp_t slot_state_expires;
-
-	int fw_data_idx;		/* Index of framework data */
-	struct sc_app_info *app_info;	/* Application associated to slot */
-	list_t logins;			/* tracks all calls to C_Login if atomic operations are requested */
-	int flags;
+	CK_SLOT_ID id;			/* ID of the slot (global) */
+	int login_user;			/* Currently logged in user (card) */
+	CK_SLOT_INFO slot_info;		/* Slot specific information (information about reader) (global) */
+	CK_TOKEN_INFO token_info;	/* Token specific information (information about card) (card) */
+	sc_reader_t *reader;		/* same as card->reader if there's a card present (global) */
+	struct sc_pkcs11_card *p11card;	/* The card associated with this slot (both) */
+	unsigned int events;		/* Card events SC_EVENT_CARD_{INSERTED,REMOVED} (global) */
+	void *fw_data;			/* Framework specific data (card) */  /* TODO: get know how it used */
+	list_t objects;			/* Objects in this slot (card) */
+	struct sc_pkcs11_handle_map object_map;	/* Slot objects by handle (card) */
+	struct sc_pkcs11_handle_map object_index;	/* Index buckets by attribute hash (card) */
+	unsigned long object_seq;	/* (card) */
+	unsigned int objects_unindexed;	/* (card) */
+	/* Objects not fully indexed, compared on every search (card) */
+	struct sc_pkcs11_bucket objects_scanned;
+	unsigned int nsessions;		/* Number of sessions using this slot (global) */
+	sc_timestamp_t slot_state_expires;	/* (global) */
+	int card_state;			/* Card and login state cached for C_GetSessionInfo() (card) */
+	int login_state;
+	sc_timestamp_t session_state_expires;
+
+	int fw_data_idx;		/* Index of framework data (both) */
+	struct sc_app_info *app_info;	/* Application associated to slot (card) */
+	list_t logins;			/* tracks all calls to C_Login if atomic operations are requested (card) */
+	int flags;			/* (global) */
 };
 typedef struct sc_pkcs11_slot sc_pkcs11_slot_t;
 
 #define SC_LOG_RV(fmt, rv)\
 do {\
-        const char *name = lookup_enum(RV_T, (rv));\
-        if (name)\
-                sc_log(context, (fmt), name);\
-        else {\
-                size_t needed = snprintf(NULL, 0, "0x%08lX", (rv)) + 1;\
-                char *buffer = malloc(needed);\
-                if (buffer) {\
-                        sprintf(buffer, "0x%08lX", (rv));\
-                        sc_log(context, (fmt), buffer);\
-                        free(buffer);\
+        if (SC_LOG_ENABLED(context, SC_LOG_DEBUG_NORMAL)) {\
+                const char *name = lookup_enum(RV_T, (rv));\
+                char buffer[24];\
+                if (name == NULL) {\
+                        snprintf(buffer, sizeof(buffer), "0x%08lX", (rv));\
+                        name = buffer;\
                 }\
+                sc_log(context, (fmt), name);\
         }\
 } while(0)
 
@@ -385,6 +466,7 @@ typedef struct sc_pkcs11_session sc_pkcs11_session_t;
 extern struct sc_context *context;
 extern struct sc_pkcs11_config sc_pkcs11_conf;
 extern list_t sessions;
+extern struct sc_pkcs11_handle_map session_map;
 extern list_t virtual_slots;
 extern list_t cards;
 
@@ -401,6 +483,19 @@ void sc_pkcs11_card_free(struct sc_pkcs11_card *p11card);
 		sc_pkcs11_print_attrs(level, FILENAME, __LINE__, __FUNCTION__, \
 				info, pTemplate, ulCount)
 
+/* Handle maps */
+void sc_pkcs11_handle_map_init(struct sc_pkcs11_handle_map *map);
+void sc_pkcs11_handle_map_clear(struct sc_pkcs11_handle_map *map);
+int sc_pkcs11_handle_map_add(struct sc_pkcs11_handle_map *map, CK_ULONG handle, void *ptr);
+void *sc_pkcs11_handle_map_get(const struct sc_pkcs11_handle_map *map, CK_ULONG handle);
+void sc_pkcs11_handle_map_del(struct sc_pkcs11_handle_map *map, CK_ULONG handle);
+int sc_pkcs11_bucket_insert(struct sc_pkcs11_bucket *bucket, void *ptr, unsigned long seq);
+void sc_pkcs11_bucket_remove(struct sc_pkcs11_bucket *bucket, void *ptr);
+int sc_pkcs11_bucket_map_add(struct sc_pkcs11_handle_map *map, CK_ULONG key, void *ptr,
+		unsigned long seq);
+void sc_pkcs11_bucket_map_del(struct sc_pkcs11_handle_map *map, CK_ULONG key, void *ptr);
+void sc_pkcs11_bucket_map_clear(struct sc_pkcs11_handle_map *map);
+
 /* Slot and card handling functions */
 CK_RV card_removed(sc_reader_t *reader);
 CK_RV card_detect_all(void);
@@ -412,8 +507,18 @@ CK_RV slot_get_token(CK_SLOT_ID id, struct sc_pkcs11_slot **);
 CK_RV slot_token_removed(CK_SLOT_ID id);
 CK_RV slot_allocate(struct sc_pkcs11_slot **, struct sc_pkcs11_card *);
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask);
+CK_RV slot_add_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_remove_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+struct sc_pkcs11_object *slot_get_object(struct sc_pkcs11_slot *, CK_OBJECT_HANDLE);
+void slot_reindex_object(struct sc_pkcs11_slot *, struct sc_pkcs11_object *);
+void slot_retry_index(struct sc_pkcs11_slot *);
+CK_RV slot_find_candidates(struct sc_pkcs11_session *, CK_ATTRIBUTE_PTR, CK_ULONG,
+		struct sc_pkcs11_candidates *);
+struct sc_pkcs11_object *slot_next_candidate(struct sc_pkcs11_slot *, struct sc_pkcs11_candidates *);
 int slot_get_logged_in_state(struct sc_pkcs11_slot *slot);
 int slot_get_card_state(struct sc_pkcs11_slot *slot);
+void slot_set_session_state(struct sc_pkcs11_slot *slot, int card_state, int login_state);
+void slot_expire_session_state(struct sc_pkcs11_slot *slot);
 
 /* Login tracking functions */
 CK_RV restore_login_state(struct sc_pkcs11_slot *slot);
@@ -468,6 +573,11 @@ CK_RV sc_pkcs11_sign_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 CK_RV sc_pkcs11_sign_update(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG);
 CK_RV sc_pkcs11_sign_final(struct sc_pkcs11_session *, CK_BYTE_PTR, CK_ULONG_PTR);
 CK_RV sc_pkcs11_sign_size(struct sc_pkcs11_session *, CK_ULONG_PTR);
+CK_RV C_OpenSC_SignBatch(CK_SESSION_HANDLE, CK_ULONG, CK_BYTE_PTR *, CK_ULONG_PTR,
+				CK_BYTE_PTR *, CK_ULONG_PTR);
+CK_RV sc_pkcs11_sign_batch_check(struct sc_pkcs11_session *);
+CK_RV sc_pkcs11_sign_batch(struct sc_pkcs11_session *, CK_ULONG, CK_BYTE_PTR *, CK_ULONG_PTR,
+				CK_BYTE_PTR *, CK_ULONG_PTR);
 #ifdef ENABLE_OPENSSL
 CK_RV sc_pkcs11_verif_init(struct sc_pkcs11_session *, CK_MECHANISM_PTR,
 				struct sc_pkcs11_object *, CK_KEY_TYPE);
@@ -507,21 +617,39 @@ CK_RV sc_pkcs11_register_sign_and_hash_mechanism(struct sc_pkcs11_card *,
 				sc_pkcs11_mechanism_type_t *);
 
 #ifdef ENABLE_OPENSSL
-CK_RV sc_pkcs11_verify_data(const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
+CK_RV sc_pkcs11_verify_data(struct sc_pkcs11_object *key,
+	const CK_BYTE_PTR pubkey, CK_ULONG pubkey_len,
 	const CK_BYTE_PTR pubkey_params, CK_ULONG pubkey_params_len,
 	CK_MECHANISM_PTR mech, sc_pkcs11_operation_t *md,
 	CK_BYTE_PTR inp, CK_ULONG inp_len,
 	CK_BYTE_PTR signat, CK_ULONG signat_len);
+void sc_pkcs11_release_verify_key(struct sc_pkcs11_object *);
+void sc_pkcs11_init_openssl(void);
+void sc_pkcs11_release_openssl(void);
 #endif
 
 /* Load configuration defaults */
 void load_pkcs11_parameters(struct sc_pkcs11_config *, struct sc_context *);
 
+/* Milliseconds of the wall clock, 0 if it is not available */
+sc_timestamp_t get_current_time(void);
+
 /* Locking primitives at the pkcs11 level */
 CK_RV sc_pkcs11_init_lock(CK_C_INITIALIZE_ARGS_PTR);
 CK_RV sc_pkcs11_lock(void);
 void sc_pkcs11_unlock(void);
 void sc_pkcs11_free_lock(void);
+int sc_pkcs11_may_create_threads(void);
+
+/* Per-card locking (slot_locking) */
+CK_RV sc_pkcs11_card_init_lock(struct sc_pkcs11_card *);
+void sc_pkcs11_card_put(struct sc_pkcs11_card *);
+void sc_pkcs11_card_lock(struct sc_pkcs11_card *);
+void sc_pkcs11_card_unlock(struct sc_pkcs11_card *);
+CK_RV sc_pkcs11_enter_card(struct sc_pkcs11_slot *, struct sc_pkcs11_card **);
+CK_RV sc_pkcs11_enter_session_card(CK_SESSION_HANDLE, struct sc_pkcs11_session **,
+		struct sc_pkcs11_card **);
+CK_RV sc_pkcs11_leave_card(struct sc_pkcs11_card *);
 
 #ifdef __cplusplus
 }
@@ -22,8 +22,14 @@
 #include "config.h"
 #include "libopensc/opensc.h"
 
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
 
 #include "sc-pkcs11.h"
 
@@ -118,6 +124,319 @@ static int object_list_seeker(const void *el, const void *key)
 	return 0;
 }
 
+/*
+ * Search index of the slot objects
+ *
+ * The values of CKA_CLASS, CKA_ID and CKA_LABEL are hashed, and each hash
+ * maps to the bucket of the objects having it. Objects are hashed on the
+ * first search after they were added or changed, not by slot_add_object():
+ * their attributes can only be read with a session, and reading the label
+ * of a certificate reads the certificate from the card, which binding
+ * leaves to the first use. Buckets are only candidates: the caller still
+ * compares the whole template with each object.
+ *
+ * Objects with an attribute that could not be hashed, e.g. the label of a
+ * certificate not read before login, are kept in objects_scanned instead,
+ * which every search compares too.
+ */
+static const CK_ATTRIBUTE_TYPE index_types[SC_PKCS11_INDEX_KEYS] = {
+	CKA_CLASS, CKA_ID, CKA_LABEL
+};
+
+static CK_ULONG
+index_key(CK_ATTRIBUTE_TYPE type, const void *value, CK_ULONG len)
+{
+	const u8 *p = value;
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	CK_ULONG i;
+
+	for (i = 0; i < sizeof(type); i++) {
+		h ^= (type >> (8 * i)) & 0xff;
+		h *= 0x100000001b3ULL;
+	}
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return (CK_ULONG)h;
+}
+
+static int
+index_type(CK_ATTRIBUTE_TYPE type)
+{
+	int i;
+
+	for (i = 0; i < SC_PKCS11_INDEX_KEYS; i++)
+		if (index_types[i] == type)
+			return i;
+	return -1;
+}
+
+static void
+unindex_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot_object *so)
+{
+	int i;
+
+	for (i = 0; i < SC_PKCS11_INDEX_KEYS; i++)
+		if (so->keys_mask & (1 << i))
+			sc_pkcs11_bucket_map_del(&slot->object_index, so->keys[i], so);
+	so->keys_mask = 0;
+	if (so->scanned) {
+		sc_pkcs11_bucket_remove(&slot->objects_scanned, so);
+		so->scanned = 0;
+	}
+}
+
+static void
+index_object(struct sc_pkcs11_session *session, struct sc_pkcs11_slot_object *so)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_object *object = so->object;
+	CK_ATTRIBUTE attr;
+	CK_RV rv;
+	u8 buf[256], *value;
+	int i, complete = 1;
+
+	for (i = 0; i < SC_PKCS11_INDEX_KEYS; i++) {
+		attr.type = index_types[i];
+		attr.pValue = NULL;
+		attr.ulValueLen = 0;
+		rv = object->ops->get_attribute(session, object, &attr);
+		if (rv == CKR_ATTRIBUTE_TYPE_INVALID)
+			continue;	/* No template with the attribute matches */
+		/* An empty label may only be unknown yet */
+		if (rv != CKR_OK || (attr.type == CKA_LABEL && attr.ulValueLen == 0)) {
+			complete = 0;
+			continue;
+		}
+
+		value = attr.ulValueLen <= sizeof(buf) ? buf : malloc(attr.ulValueLen);
+		if (value == NULL) {
+			complete = 0;
+			continue;
+		}
+		attr.pValue = value;
+		if (object->ops->get_attribute(session, object, &attr) == CKR_OK) {
+			so->keys[i] = index_key(attr.type, attr.pValue, attr.ulValueLen);
+			if (sc_pkcs11_bucket_map_add(&slot->object_index, so->keys[i], so, so->seq) == 0)
+				so->keys_mask |= 1 << i;
+			else
+				complete = 0;
+		} else {
+			complete = 0;
+		}
+		if (value != buf)
+			free(value);
+	}
+
+	if (!complete) {
+		if (sc_pkcs11_bucket_insert(&slot->objects_scanned, so, so->seq) != 0) {
+			/* Left unindexed, searches compare all objects */
+			unindex_object(slot, so);
+			return;
+		}
+		so->scanned = 1;
+	}
+	so->indexed = 1;
+}
+
+/*
+ * Hash the objects added or changed since the last search. Objects are only
+ * marked as changed meanwhile, so that the buckets do not change while a
+ * search goes through them.
+ */
+static void
+index_objects(struct sc_pkcs11_session *session)
+{
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_slot_object *so;
+	unsigned int unindexed = 0;
+	size_t i;
+
+	if (slot->objects_unindexed == 0)
+		return;
+	for (i = 0; i < slot->object_map.size; i++) {
+		so = slot->object_map.entries[i].ptr;
+		if (so == NULL || so->indexed)
+			continue;
+		unindex_object(slot, so);
+		index_object(session, so);
+	}
+	/* Count again, as reading attributes may change other objects */
+	for (i = 0; i < slot->object_map.size; i++) {
+		so = slot->object_map.entries[i].ptr;
+		if (so != NULL && !so->indexed)
+			unindexed++;
+	}
+	slot->objects_unindexed = unindexed;
+}
+
+/*
+ * Find the objects that can match the template: the smallest bucket of the
+ * indexed attributes of the template, and the objects not fully indexed.
+ * candidates->bucket is NULL if all objects must be compared.
+ */
+CK_RV slot_find_candidates(struct sc_pkcs11_session *session, CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount, struct sc_pkcs11_candidates *candidates)
+{
+	static struct sc_pkcs11_bucket none;
+	struct sc_pkcs11_slot *slot = session->slot;
+	struct sc_pkcs11_bucket *bucket;
+	CK_ULONG j;
+
+	memset(candidates, 0, sizeof(*candidates));
+	index_objects(session);
+
+	if (slot->objects_unindexed == 0) {
+		for (j = 0; j < ulCount; j++) {
+			if (index_type(pTemplate[j].type) < 0)
+				continue;
+			if (pTemplate[j].pValue == NULL && pTemplate[j].ulValueLen > 0)
+				continue;
+
+			bucket = sc_pkcs11_handle_map_get(&slot->object_index,
+					index_key(pTemplate[j].type, pTemplate[j].pValue, pTemplate[j].ulValueLen));
+			if (bucket == NULL) {
+				candidates->bucket = &none;
+				break;
+			}
+			if (candidates->bucket == NULL || bucket->count < candidates->bucket->count)
+				candidates->bucket = bucket;
+		}
+	}
+
+	if (candidates->bucket != NULL) {
+		candidates->scanned = &slot->objects_scanned;
+		candidates->count = candidates->bucket->count + candidates->scanned->count;
+	} else {
+		candidates->count = list_size(&slot->objects);
+	}
+	return CKR_OK;
+}
+
+/* Next candidate of slot_find_candidates() in the order objects were added, or NULL */
+struct sc_pkcs11_object *slot_next_candidate(struct sc_pkcs11_slot *slot,
+		struct sc_pkcs11_candidates *candidates)
+{
+	struct sc_pkcs11_slot_object *a = NULL, *b = NULL;
+
+	if (candidates->bucket == NULL) {
+		if (candidates->i >= (size_t)list_size(&slot->objects))
+			return NULL;
+		return list_get_at(&slot->objects, (unsigned int)candidates->i++);
+	}
+
+	if (candidates->i < candidates->bucket->count)
+		a = candidates->bucket->entries[candidates->i].ptr;
+	if (candidates->j < candidates->scanned->count)
+		b = candidates->scanned->entries[candidates->j].ptr;
+	if (a != NULL && (b == NULL || a->seq < b->seq)) {
+		candidates->i++;
+		return a->object;
+	}
+	if (b == NULL)
+		return NULL;
+	/* Objects not fully indexed can be in a bucket too */
+	if (a == b)
+		candidates->i++;
+	candidates->j++;
+	return b->object;
+}
+
+/* Objects are kept in the list for the order of C_FindObjectsInit() results,
+ * and indexed by handle for the lookups of all other calls */
+CK_RV slot_add_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_slot_object *so;
+
+	so = calloc(1, sizeof(*so));
+	if (so == NULL)
+		return CKR_HOST_MEMORY;
+	so->object = object;
+	so->seq = slot->object_seq++;
+
+	if (sc_pkcs11_handle_map_add(&slot->object_map, object->handle, so) != 0) {
+		free(so);
+		return CKR_HOST_MEMORY;
+	}
+	if (list_append(&slot->objects, object) < 0) {
+		sc_pkcs11_handle_map_del(&slot->object_map, object->handle);
+		free(so);
+		return CKR_HOST_MEMORY;
+	}
+	slot->objects_unindexed++;
+	return CKR_OK;
+}
+
+void slot_remove_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_slot_object *so;
+
+	so = sc_pkcs11_handle_map_get(&slot->object_map, object->handle);
+	if (so != NULL && so->object == object) {
+		unindex_object(slot, so);
+		if (!so->indexed)
+			slot->objects_unindexed--;
+		sc_pkcs11_handle_map_del(&slot->object_map, object->handle);
+		free(so);
+	}
+	list_delete(&slot->objects, object);
+}
+
+struct sc_pkcs11_object *slot_get_object(struct sc_pkcs11_slot *slot, CK_OBJECT_HANDLE handle)
+{
+	struct sc_pkcs11_slot_object *so;
+
+	so = sc_pkcs11_handle_map_get(&slot->object_map, handle);
+	return so ? so->object : NULL;
+}
+
+static void
+slot_mark_unindexed(struct sc_pkcs11_slot *slot, struct sc_pkcs11_slot_object *so)
+{
+	if (so->indexed) {
+		so->indexed = 0;
+		slot->objects_unindexed++;
+	}
+}
+
+/*
+ * Called when attributes of the object were changed, also while a search
+ * goes through the candidates. The object is hashed again on the next search.
+ */
+void slot_reindex_object(struct sc_pkcs11_slot *slot, struct sc_pkcs11_object *object)
+{
+	struct sc_pkcs11_slot_object *so;
+
+	so = sc_pkcs11_handle_map_get(&slot->object_map, object->handle);
+	if (so != NULL && so->object == object)
+		slot_mark_unindexed(slot, so);
+}
+
+/* Called after login, when attributes that could not be read may be readable */
+void slot_retry_index(struct sc_pkcs11_slot *slot)
+{
+	size_t i;
+
+	for (i = 0; i < slot->objects_scanned.count; i++)
+		slot_mark_unindexed(slot, slot->objects_scanned.entries[i].ptr);
+}
+
+static void
+slot_release_objects(struct sc_pkcs11_slot *slot)
+{
+	size_t i;
+
+	for (i = 0; i < slot->object_map.size; i++)
+		free(slot->object_map.entries[i].ptr);
+	sc_pkcs11_handle_map_clear(&slot->object_map);
+
+	sc_pkcs11_bucket_map_clear(&slot->object_index);
+	free(slot->objects_scanned.entries);
+	memset(&slot->objects_scanned, 0, sizeof(slot->objects_scanned));
+	slot->objects_unindexed = 0;
+}
+
 CK_RV create_slot(sc_reader_t *reader)
 {
 	/* find unused slots previously allocated for the same reader */
@@ -138,6 +457,8 @@ CK_RV create_slot(sc_reader_t *reader)
 			return CKR_HOST_MEMORY;
 		}
 		list_attributes_seeker(&slot->objects, object_list_seeker);
+		sc_pkcs11_handle_map_init(&slot->object_map);
+		sc_pkcs11_handle_map_init(&slot->object_index);
 
 		if (0 != list_init(&slot->logins)) {
 			return CKR_HOST_MEMORY;
@@ -148,7 +469,6 @@ CK_RV create_slot(sc_reader_t *reader)
 		/* reuse the old list of logins/objects since they should be empty */
 		list_t logins = slot->logins;
 		list_t objects = slot->objects;
-
 		memset(slot, 0, sizeof *slot);
 
 		slot->logins = logins;
@@ -179,7 +499,10 @@ void sc_pkcs11_card_free(struct sc_pkcs11_card *p11card)
 			free(p11card->mechanisms[i]);
 		}
 		free(p11card->mechanisms);
-		free(p11card);
+		p11card->mechanisms = NULL;
+		p11card->nmechanisms = 0;
+		p11card->removed = 1;
+		sc_pkcs11_card_put(p11card);
 	}
 }
 
@@ -190,16 +513,23 @@ CK_RV card_removed(sc_reader_t * reader)
 	/* Mark all slots as "token not present" */
 	sc_log(context, "%s: card removed", reader->name);
 
+	/* Save the "card" object */
+	for (i=0; i < list_size(&virtual_slots); i++) {
+		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+		if (slot->reader == reader && slot->p11card) {
+			p11card = slot->p11card;
+			break;
+		}
+	}
 
+	/* Wait for calls still using the card */
+	sc_pkcs11_card_lock(p11card);
 	for (i=0; i < list_size(&virtual_slots); i++) {
 		sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-		if (slot->reader == reader) {
-			/* Save the "card" object */
-			if (slot->p11card)
-				p11card = slot->p11card;
+		if (slot->reader == reader)
 			slot_token_removed(slot->id);
-		}
 	}
+	sc_pkcs11_card_unlock(p11card);
 
 	sc_pkcs11_card_free(p11card);
 
@@ -207,14 +537,37 @@ CK_RV card_removed(sc_reader_t * reader)
 }
 
 
-CK_RV card_detect(sc_reader_t *reader)
+/*
+ * Detection of the card in one reader. It runs in three steps, so that
+ * card_detect_all() can connect and bind the cards of several readers in
+ * parallel: card_detect_begin() checks the presence of the card and looks
+ * up its slots, card_detect_bind() connects the card and binds its
+ * applications without touching any slot, card_detect_finish() creates the
+ * tokens in the slots. Only card_detect_bind() may run outside of the
+ * global lock.
+ */
+struct card_detect_job {
+	sc_reader_t *reader;
+	struct sc_pkcs11_card *p11card;
+	int free_p11card;
+	int pending;			/* card_detect_bind() has work to do */
+	int connected;			/* card connected by card_detect_bind() */
+	int bound;			/* framework bound by card_detect_bind() */
+	int card_locked;		/* known card held against calls that entered it */
+	struct sc_app_info *app_generic;
+	CK_RV bind_rv[SC_MAX_CARD_APPS];
+	CK_RV rv;
+	sc_timestamp_t connect_ms, bind_ms;
+};
+
+static CK_RV
+card_detect_begin(struct card_detect_job *job)
 {
+	sc_reader_t *reader = job->reader;
 	struct sc_pkcs11_card *p11card = NULL;
-	int free_p11card = 0;
+	unsigned int i;
 	int rc;
 	CK_RV rv;
-	unsigned int i;
-	int j;
 
 	sc_log(context, "%s: Detecting smart card", reader->name);
 	/* Check if someone inserted a card */
@@ -257,56 +610,74 @@ again:
 		p11card = (struct sc_pkcs11_card *)calloc(1, sizeof(struct sc_pkcs11_card));
 		if (!p11card)
 			return CKR_HOST_MEMORY;
-		free_p11card = 1;
 		p11card->reader = reader;
+		rv = sc_pkcs11_card_init_lock(p11card);
+		if (rv != CKR_OK) {
+			free(p11card);
+			return rv;
+		}
+		job->free_p11card = 1;
 	}
 
+	job->p11card = p11card;
+	job->pending = p11card->card == NULL || p11card->framework == NULL;
+	job->rv = CKR_OK;
+	/* With slot_locking, calls that entered a known card may be using it
+	 * until card_detect_finish() */
+	if (job->pending && !job->free_p11card) {
+		sc_pkcs11_card_lock(p11card);
+		job->card_locked = 1;
+	}
+	return CKR_OK;
+}
+
+static void
+card_detect_bind(struct card_detect_job *job)
+{
+	struct sc_pkcs11_card *p11card = job->p11card;
+	sc_reader_t *reader = job->reader;
+	sc_timestamp_t start = get_current_time();
+	unsigned int i;
+	int j, rc;
+	CK_RV rv;
+
 	if (p11card->card == NULL) {
 		sc_log(context, "%s: Connecting ... ", reader->name);
 		rc = sc_connect_card(reader, &p11card->card);
+		job->connect_ms = get_current_time() - start;
 		if (rc != SC_SUCCESS) {
 			sc_log(context, "%s: SC connect card error %i", reader->name, rc);
-			rv = sc_to_cryptoki_error(rc, NULL);
-			goto fail;
+			job->rv = sc_to_cryptoki_error(rc, NULL);
+			return;
 		}
-
-		/* escape commands are only guaranteed to be working with a card
-		 * inserted. That's why by now, after sc_connect_card() the reader's
-		 * metadata may have changed. We re-initialize the metadata for every
-		 * slot of this reader here. */
-		if (reader->flags & SC_READER_ENABLE_ESCAPE) {
-			for (i = 0; i<list_size(&virtual_slots); i++) {
-				sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
-				if (slot->reader == reader)
-					init_slot_info(&slot->slot_info, reader);
-			}
-		}
-
+		job->connected = 1;
 		sc_log(context, "%s: Connected SC card %p", reader->name, p11card->card);
 	}
 
 	/* Detect the framework */
 	if (p11card->framework == NULL) {
-		struct sc_app_info *app_generic = sc_pkcs15_get_application_by_type(p11card->card, "generic");
+		start = get_current_time();
+		job->app_generic = sc_pkcs15_get_application_by_type(p11card->card, "generic");
 
 		sc_log(context, "%s: Detecting Framework. %i on-card applications", reader->name, p11card->card->app_count);
-		sc_log(context, "%s: generic application %s", reader->name, app_generic ? app_generic->label : "<none>");
+		sc_log(context, "%s: generic application %s", reader->name, job->app_generic ? job->app_generic->label : "<none>");
 
 		for (i = 0; frameworks[i]; i++)
 			if (frameworks[i]->bind != NULL)
 				break;
 		/*TODO: only first framework is used: pkcs15init framework is not reachable here */
 		if (frameworks[i] == NULL) {
-			rv = CKR_GENERAL_ERROR;
-			goto fail;
+			job->rv = CKR_GENERAL_ERROR;
+			return;
 		}
 
 		p11card->framework = frameworks[i];
+		job->bound = 1;
 
 		/* Initialize framework */
-		sc_log(context, "%s: Detected framework %d. Creating tokens.", reader->name, i);
+		sc_log(context, "%s: Detected framework %d. Binding applications.", reader->name, i);
 		/* Bind 'generic' application or (emulated?) card without applications */
-		if (app_generic || !p11card->card->app_count)   {
+		if (job->app_generic || !p11card->card->app_count)   {
 			scconf_block *conf_block = NULL;
 			int enable_InitToken = 0;
 
@@ -320,7 +691,7 @@ again:
 				"pkcs11_enable_InitToken", 0);
 
 			sc_log(context, "%s: Try to bind 'generic' token.", reader->name);
-			rv = frameworks[i]->bind(p11card, app_generic);
+			rv = frameworks[i]->bind(p11card, job->app_generic);
 			if (rv == CKR_TOKEN_NOT_RECOGNIZED && enable_InitToken)   {
 				sc_log(context, "%s: 'InitToken' enabled -- accept non-binded card", reader->name);
 				rv = CKR_OK;
@@ -329,11 +700,59 @@ again:
 				sc_log(context,
 				       "%s: cannot bind 'generic' token: rv 0x%lX",
 				       reader->name, rv);
-				goto fail;
+				job->rv = rv;
+				job->bind_ms = get_current_time() - start;
+				return;
 			}
+		}
+
+		/* Now bind the rest of applications that are not 'generic' */
+		for (j = 0; j < p11card->card->app_count && j < SC_MAX_CARD_APPS; j++)   {
+			struct sc_app_info *app_info = p11card->card->app[j];
+			char *app_name = app_info ? app_info->label : "<anonymous>";
+
+			if (job->app_generic && job->app_generic == p11card->card->app[j])
+				continue;
 
+			sc_log(context, "%s: Binding %s token.", reader->name, app_name);
+			job->bind_rv[j] = frameworks[i]->bind(p11card, app_info);
+			if (job->bind_rv[j] != CKR_OK)
+				sc_log(context, "%s: bind %s token error Ox%lX",
+				       reader->name, app_name, job->bind_rv[j]);
+		}
+		job->bind_ms = get_current_time() - start;
+	}
+}
+
+static CK_RV
+card_detect_finish(struct card_detect_job *job)
+{
+	struct sc_pkcs11_card *p11card = job->p11card;
+	sc_reader_t *reader = job->reader;
+	sc_timestamp_t start = get_current_time();
+	unsigned int i;
+	int j;
+	CK_RV rv = job->rv;
+
+	if (rv != CKR_OK)
+		goto fail;
+
+	/* escape commands are only guaranteed to be working with a card
+	 * inserted. That's why by now, after sc_connect_card() the reader's
+	 * metadata may have changed. We re-initialize the metadata for every
+	 * slot of this reader here. */
+	if (job->connected && (reader->flags & SC_READER_ENABLE_ESCAPE)) {
+		for (i = 0; i<list_size(&virtual_slots); i++) {
+			sc_pkcs11_slot_t *slot = (sc_pkcs11_slot_t *) list_get_at(&virtual_slots, i);
+			if (slot->reader == reader)
+				init_slot_info(&slot->slot_info, reader);
+		}
+	}
+
+	if (job->bound) {
+		if (job->app_generic || !p11card->card->app_count)   {
 			sc_log(context, "%s: Creating 'generic' token.", reader->name);
-			rv = frameworks[i]->create_tokens(p11card, app_generic);
+			rv = p11card->framework->create_tokens(p11card, job->app_generic);
 			if (rv != CKR_OK)   {
 				sc_log(context,
 				       "%s: create 'generic' token error 0x%lX",
@@ -341,27 +760,20 @@ again:
 				goto fail;
 			}
 			/* p11card is now bound to some slot */
-			free_p11card = 0;
+			job->free_p11card = 0;
 		}
 
-		/* Now bind the rest of applications that are not 'generic' */
-		for (j = 0; j < p11card->card->app_count; j++)   {
+		for (j = 0; j < p11card->card->app_count && j < SC_MAX_CARD_APPS; j++)   {
 			struct sc_app_info *app_info = p11card->card->app[j];
 			char *app_name = app_info ? app_info->label : "<anonymous>";
 
-			if (app_generic && app_generic == p11card->card->app[j])
+			if (job->app_generic && job->app_generic == p11card->card->app[j])
 				continue;
-
-			sc_log(context, "%s: Binding %s token.", reader->name, app_name);
-			rv = frameworks[i]->bind(p11card, app_info);
-			if (rv != CKR_OK)   {
-				sc_log(context, "%s: bind %s token error Ox%lX",
-				       reader->name, app_name, rv);
+			if (job->bind_rv[j] != CKR_OK)
 				continue;
-			}
 
 			sc_log(context, "%s: Creating %s token.", reader->name, app_name);
-			rv = frameworks[i]->create_tokens(p11card, app_info);
+			rv = p11card->framework->create_tokens(p11card, app_info);
 			if (rv != CKR_OK)   {
 				sc_log(context,
 				       "%s: create %s token error 0x%lX",
@@ -369,7 +781,7 @@ again:
 				goto fail;
 			}
 			/* p11card is now bound to some slot */
-			free_p11card = 0;
+			job->free_p11card = 0;
 		}
 	}
 
@@ -377,22 +789,176 @@ again:
 	rv = CKR_OK;
 
 fail:
-	if (free_p11card) {
+	if (job->pending)
+		sc_log(context, "%s: connect %lu ms, bind %lu ms, tokens %lu ms, rv 0x%lX",
+		       reader->name, (unsigned long)job->connect_ms,
+		       (unsigned long)job->bind_ms,
+		       (unsigned long)(get_current_time() - start), rv);
+	if (job->card_locked) {
+		sc_pkcs11_card_unlock(p11card);
+		job->card_locked = 0;
+	}
+	if (job->free_p11card) {
 		sc_pkcs11_card_free(p11card);
 	}
+	job->p11card = NULL;
 
 	return rv;
 }
 
+CK_RV card_detect(sc_reader_t *reader)
+{
+	struct card_detect_job job;
+	CK_RV rv;
+
+	memset(&job, 0, sizeof(job));
+	job.reader = reader;
+	rv = card_detect_begin(&job);
+	if (rv != CKR_OK)
+		return rv;
+	card_detect_bind(&job);
+	return card_detect_finish(&job);
+}
+
+/*
+ * Bounded pool of threads for card_detect_bind(), see card_detect_threads in
+ * opensc.conf. The calling thread takes part and does all the work when no
+ * thread can be started.
+ */
+#define CARD_DETECT_MAX_THREADS	16
+
+struct card_detect_pool {
+	struct card_detect_job **jobs;
+	size_t count;
+	size_t next;
+};
+
+#if defined(HAVE_PTHREAD)
+static pthread_mutex_t card_detect_m = PTHREAD_MUTEX_INITIALIZER;
+#define card_detect_lock()	pthread_mutex_lock(&card_detect_m)
+#define card_detect_unlock()	pthread_mutex_unlock(&card_detect_m)
+#elif defined(_WIN32)
+static SRWLOCK card_detect_m = SRWLOCK_INIT;
+#define card_detect_lock()	AcquireSRWLockExclusive(&card_detect_m)
+#define card_detect_unlock()	ReleaseSRWLockExclusive(&card_detect_m)
+#endif
+
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+static void
+card_detect_work(struct card_detect_pool *pool)
+{
+	struct card_detect_job *job;
+
+	for (;;) {
+		card_detect_lock();
+		job = pool->next < pool->count ? pool->jobs[pool->next++] : NULL;
+		card_detect_unlock();
+		if (job == NULL)
+			break;
+		card_detect_bind(job);
+	}
+}
+
+#if defined(HAVE_PTHREAD)
+static void *
+card_detect_worker(void *arg)
+{
+	card_detect_work(arg);
+	return NULL;
+}
+#else
+static DWORD WINAPI
+card_detect_worker(LPVOID arg)
+{
+	card_detect_work(arg);
+	return 0;
+}
+#endif
+
+static void
+card_detect_run(struct card_detect_job **jobs, size_t count, unsigned int threads)
+{
+	struct card_detect_pool pool;
+#if defined(HAVE_PTHREAD)
+	pthread_t tids[CARD_DETECT_MAX_THREADS];
+#else
+	HANDLE tids[CARD_DETECT_MAX_THREADS];
+#endif
+	unsigned int i, started = 0;
+
+	if (count == 0)
+		return;
+	pool.jobs = jobs;
+	pool.count = count;
+	pool.next = 0;
+	if (threads > count)
+		threads = (unsigned int)count;
+	if (threads > CARD_DETECT_MAX_THREADS)
+		threads = CARD_DETECT_MAX_THREADS;
+
+	/* The calling thread is one of the workers */
+	for (i = 1; i < threads; i++) {
+#if defined(HAVE_PTHREAD)
+		if (pthread_create(&tids[started], NULL, card_detect_worker, &pool) != 0)
+			break;
+#else
+		tids[started] = CreateThread(NULL, 0, card_detect_worker, &pool, 0, NULL);
+		if (tids[started] == NULL)
+			break;
+#endif
+		started++;
+	}
+	sc_log(context, "Binding %lu cards with %u threads",
+	       (unsigned long)count, started + 1);
+	card_detect_work(&pool);
+
+	for (i = 0; i < started; i++) {
+#if defined(HAVE_PTHREAD)
+		pthread_join(tids[i], NULL);
+#else
+		WaitForSingleObject(tids[i], INFINITE);
+		CloseHandle(tids[i]);
+#endif
+	}
+}
+#else
+static void
+card_detect_run(struct card_detect_job **jobs, size_t count, unsigned int threads)
+{
+	size_t k;
+
+	for (k = 0; k < count; k++)
+		card_detect_bind(jobs[k]);
+}
+#endif
 
 CK_RV
 card_detect_all(void)
 {
-	unsigned int i, j;
+	struct card_detect_job *jobs = NULL, **pending = NULL;
+	unsigned int threads = sc_pkcs11_conf.card_detect_threads;
+	size_t njobs = 0, npending = 0, k;
+	sc_timestamp_t start = get_current_time();
+	unsigned int i, j, count;
+	CK_RV rv = CKR_OK;
 
 	sc_log(context, "Detect all cards");
+	count = sc_ctx_get_reader_count(context);
+	if (!sc_pkcs11_may_create_threads())
+		threads = 1;
+	if (threads > 1 && count > 1) {
+		jobs = calloc(count, sizeof(*jobs));
+		pending = calloc(count, sizeof(*pending));
+		if (jobs == NULL || pending == NULL) {
+			free(jobs);
+			free(pending);
+			jobs = NULL;
+			pending = NULL;
+		}
+	}
+
 	/* Detect cards in all initialized readers */
-	for (i=0; i< sc_ctx_get_reader_count(context); i++) {
+	for (i=0; i < count; i++) {
 		sc_reader_t *reader = sc_ctx_get_reader(context, i);
 
 		if (reader->flags & SC_READER_REMOVED) {
@@ -419,18 +985,41 @@ card_detect_all(void)
 					break;
 				}
 			}
+			/* Slots are created in the order of the readers, whatever
+			 * order the cards are bound in, so that slot IDs are stable */
 			if (!found) {
 				for (j = 0; j < sc_pkcs11_conf.slots_per_card; j++) {
-					CK_RV rv = create_slot(reader);
+					rv = create_slot(reader);
 					if (rv != CKR_OK)
-						return rv;
+						break;
 				}
+				if (rv != CKR_OK)
+					break;
+			}
+			if (jobs == NULL) {
+				card_detect(reader);
+				continue;
 			}
-			card_detect(reader);
+			jobs[njobs].reader = reader;
+			if (card_detect_begin(&jobs[njobs]) != CKR_OK)
+				continue;
+			if (jobs[njobs].pending)
+				pending[npending++] = &jobs[njobs];
+			njobs++;
 		}
 	}
-	sc_log(context, "All cards detected");
-	return CKR_OK;
+
+	if (jobs != NULL) {
+		card_detect_run(pending, npending, threads);
+		/* Tokens are created in the order of the readers */
+		for (k = 0; k < njobs; k++)
+			card_detect_finish(&jobs[k]);
+		free(jobs);
+		free(pending);
+	}
+	sc_log(context, "All cards detected in %lu ms",
+	       (unsigned long)(get_current_time() - start));
+	return rv;
 }
 
 /* Allocates an existing slot to a card */
@@ -508,6 +1097,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	/* Terminate active sessions */
 	sc_pkcs11_close_all_sessions(id);
 
+	slot_release_objects(slot);
 	while ((object = list_fetch(&slot->objects))) {
 		if (object->ops->release)
 			object->ops->release(object);
@@ -527,6 +1117,7 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
 	slot->login_user = -1;
 	pop_all_login_states(slot);
+	slot_expire_session_state(slot);
 
 	if (token_was_present)
 		slot->events = SC_EVENT_CARD_REMOVED;
@@ -536,6 +1127,25 @@ CK_RV slot_token_removed(CK_SLOT_ID id)
 	return CKR_OK;
 }
 
+/*
+ * C_GetSessionInfo() answers from the card and login state kept here until
+ * it expires, instead of asking the reader and the card on every call.
+ * Card events, logins and failed operations update or expire it early.
+ */
+void slot_set_session_state(struct sc_pkcs11_slot *slot, int card_state, int login_state)
+{
+	sc_timestamp_t now = get_current_time();
+
+	slot->card_state = card_state;
+	slot->login_state = login_state;
+	slot->session_state_expires = now ? now + sc_pkcs11_conf.session_state_max_age : 0;
+}
+
+void slot_expire_session_state(struct sc_pkcs11_slot *slot)
+{
+	slot->session_state_expires = 0;
+}
+
 /* Called from C_WaitForSlotEvent */
 CK_RV slot_find_changed(CK_SLOT_ID_PTR idp, int mask)
 {
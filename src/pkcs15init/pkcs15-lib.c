@@ -4115,7 +4115,8 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 {
 	struct sc_context *ctx = p15card->card->ctx;
 	struct sc_file	*selected_file = NULL;
-	void		*copy = NULL;
+	void		*zeros = NULL;
+	size_t		zap_len = 0;
 	int		r, need_to_zap = 0;
 
 	LOG_FUNC_CALLED(ctx);
@@ -4159,23 +4160,27 @@ sc_pkcs15init_update_file(struct sc_profile *profile,
 			LOG_FUNC_RETURN(ctx, SC_ERROR_INTERNAL);
 		}
 
-		copy = calloc(1, selected_file->size);
-		if (copy == NULL) {
+		/* The tail is written on its own, the data is not copied
+		 * into a buffer of the file size */
+		zap_len = selected_file->size - datalen;
+		zeros = calloc(1, zap_len);
+		if (zeros == NULL) {
 			sc_file_free(selected_file);
 			return SC_ERROR_OUT_OF_MEMORY;
 		}
-		memcpy(copy, data, datalen);
-		datalen = selected_file->size;
-		data = copy;
 	}
 
 	/* Present authentication info needed */
 	r = sc_pkcs15init_authenticate(profile, p15card, selected_file, SC_AC_OP_UPDATE);
 	if (r >= 0 && datalen)
 		r = sc_update_binary(p15card->card, 0, (const unsigned char *) data, datalen, 0);
+	if (r >= 0 && zap_len) {
+		r = sc_update_binary(p15card->card, datalen, zeros, zap_len, 0);
+		if (r >= 0)
+			r += datalen;
+	}
 
-	if (copy)
-		free(copy);
+	free(zeros);
 	sc_file_free(selected_file);
 	LOG_FUNC_RETURN(ctx, r);
 }
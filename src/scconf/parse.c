@@ -114,6 +114,10 @@ static scconf_item *scconf_item_add_internal(scconf_parser * parser, int type)
 	item->key = parser->key;
 	parser->key = NULL;
 
+	/* The index of the block does not know the new item */
+	free(parser->block->index);
+	parser->block->index = NULL;
+
 	if (parser->last_item) {
 		parser->last_item->next = item;
 	} else {
@@ -31,6 +31,141 @@
 
 #include "scconf.h"
 
+/*
+ * Hash index of the item keys of a block. The entries of a bucket are in
+ * the order of the items, so lookups find the same items in the same order
+ * as walking the block. The index is a single allocation.
+ */
+struct scconf_index_entry {
+	unsigned int hash;
+	scconf_item *item;
+	struct scconf_index_entry *next;
+};
+
+struct _scconf_index {
+	unsigned int mask;
+	struct scconf_index_entry **buckets;
+	struct scconf_index_entry *entries;
+};
+
+/* Items of a block with a given type and key, with or without an index */
+typedef struct {
+	const scconf_block *block;
+	int type;
+	const char *key;
+	unsigned int hash;
+	const struct scconf_index_entry *entry;
+	scconf_item *item;
+} scconf_item_iter;
+
+/* FNV-1a, case insensitive like the lookups */
+static unsigned int scconf_key_hash(const char *key)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *key; key++) {
+		hash ^= (unsigned char) tolower((unsigned char) *key);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void scconf_item_iter_init(scconf_item_iter *iter, const scconf_block *block, int type, const char *key)
+{
+	iter->block = block;
+	iter->type = type;
+	iter->key = key;
+	if (block->index) {
+		iter->hash = scconf_key_hash(key);
+		iter->entry = block->index->buckets[iter->hash & block->index->mask];
+	} else {
+		iter->item = block->items;
+	}
+}
+
+static scconf_item *scconf_item_iter_next(scconf_item_iter *iter)
+{
+	const struct scconf_index_entry *entry;
+	scconf_item *item;
+
+	if (iter->block->index) {
+		while ((entry = iter->entry) != NULL) {
+			iter->entry = entry->next;
+			if (entry->hash == iter->hash && entry->item->type == iter->type &&
+			    strcasecmp(iter->key, entry->item->key) == 0) {
+				return entry->item;
+			}
+		}
+		return NULL;
+	}
+	while ((item = iter->item) != NULL) {
+		iter->item = item->next;
+		if (item->type == iter->type && strcasecmp(iter->key, item->key) == 0) {
+			return item;
+		}
+	}
+	return NULL;
+}
+
+static int scconf_block_compile(scconf_block *block)
+{
+	struct scconf_index_entry *entry;
+	scconf_index *index;
+	scconf_item *item;
+	unsigned int count = 0, size = 4, i;
+	int r = 1;
+
+	free(block->index);
+	block->index = NULL;
+	for (item = block->items; item; item = item->next) {
+		if (item->type == SCCONF_ITEM_TYPE_BLOCK && item->value.block &&
+		    !scconf_block_compile(item->value.block)) {
+			r = 0;
+		}
+		if (item->key) {
+			count++;
+		}
+	}
+	if (count == 0) {
+		return r;
+	}
+	while (size < 2 * count) {
+		size *= 2;
+	}
+
+	index = calloc(1, sizeof(scconf_index) + size * sizeof(struct scconf_index_entry *)
+			+ count * sizeof(struct scconf_index_entry));
+	if (!index) {
+		return 0;
+	}
+	index->mask = size - 1;
+	index->buckets = (struct scconf_index_entry **) (index + 1);
+	index->entries = (struct scconf_index_entry *) (index->buckets + size);
+
+	for (i = 0, item = block->items; item; item = item->next) {
+		if (item->key) {
+			index->entries[i].hash = scconf_key_hash(item->key);
+			index->entries[i++].item = item;
+		}
+	}
+	/* Push the items last to first, so every bucket keeps their order */
+	while (i-- > 0) {
+		entry = &index->entries[i];
+		entry->next = index->buckets[entry->hash & index->mask];
+		index->buckets[entry->hash & index->mask] = entry;
+	}
+	block->index = index;
+	return r;
+}
+
+int scconf_compile(scconf_context * config)
+{
+	if (!config || !config->root) {
+		return 0;
+	}
+	return scconf_block_compile(config->root);
+}
+
 scconf_context *scconf_new(const char *filename)
 {
 	scconf_context *config;
@@ -64,6 +199,7 @@ void scconf_free(scconf_context * config)
 
 const scconf_block *scconf_find_block(const scconf_context * config, const scconf_block * block, const char *item_name)
 {
+	scconf_item_iter iter;
 	scconf_item *item;
 
 	if (!block) {
@@ -72,19 +208,16 @@ const scconf_block *scconf_find_block(const scconf_context * config, const sccon
 	if (!item_name) {
 		return NULL;
 	}
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
-			return item->value.block;
-		}
-	}
-	return NULL;
+	scconf_item_iter_init(&iter, block, SCCONF_ITEM_TYPE_BLOCK, item_name);
+	item = scconf_item_iter_next(&iter);
+	return item ? item->value.block : NULL;
 }
 
 scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_block * block, const char *item_name, const char *key)
 {
 	scconf_block **blocks = NULL, **tmp;
 	int alloc_size, size;
+	scconf_item_iter iter;
 	scconf_item *item;
 
 	if (!block) {
@@ -102,25 +235,23 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 	}
 	blocks = tmp;
 
-	for (item = block->items; item; item = item->next) {
-		if (item->type == SCCONF_ITEM_TYPE_BLOCK &&
-		    strcasecmp(item_name, item->key) == 0) {
-			if (!item->value.block)
-				continue;
-			if (key && strcasecmp(key, item->value.block->name->data)) {
-				continue;
-			}
-			if (size + 1 >= alloc_size) {
-				alloc_size *= 2;
-				tmp = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
-				if (!tmp) {
-					free(blocks);
-					return NULL;
-				}
-				blocks = tmp;
+	scconf_item_iter_init(&iter, block, SCCONF_ITEM_TYPE_BLOCK, item_name);
+	while ((item = scconf_item_iter_next(&iter)) != NULL) {
+		if (!item->value.block)
+			continue;
+		if (key && strcasecmp(key, item->value.block->name->data)) {
+			continue;
+		}
+		if (size + 1 >= alloc_size) {
+			alloc_size *= 2;
+			tmp = (scconf_block **) realloc(blocks, sizeof(scconf_block *) * alloc_size);
+			if (!tmp) {
+				free(blocks);
+				return NULL;
 			}
-			blocks[size++] = item->value.block;
+			blocks = tmp;
 		}
+		blocks[size++] = item->value.block;
 	}
 	blocks[size] = NULL;
 	return blocks;
@@ -128,15 +259,15 @@ scconf_block **scconf_find_blocks(const scconf_context * config, const scconf_bl
 
 const scconf_list *scconf_find_list(const scconf_block * block, const char *option)
 {
+	scconf_item_iter iter;
 	scconf_item *item;
 
 	if (!block)
 		return NULL;
 
-	for (item = block->items; item; item = item->next)
-		if (item->type == SCCONF_ITEM_TYPE_VALUE && strcasecmp(option, item->key) == 0)
-			return item->value.list;
-	return NULL;
+	scconf_item_iter_init(&iter, block, SCCONF_ITEM_TYPE_VALUE, option);
+	item = scconf_item_iter_next(&iter);
+	return item ? item->value.list : NULL;
 }
 
 const char *scconf_get_str(const scconf_block * block, const char *option, const char *def)
@@ -301,6 +432,7 @@ void scconf_block_destroy(scconf_block * block)
 	if (block) {
 		scconf_list_destroy(block->name);
 		scconf_item_destroy(block->items);
+		free(block->index);
 		free(block);
 	}
 }
@@ -54,10 +54,13 @@ typedef struct _scconf_item {
 	} value;
 } scconf_item;
 
+typedef struct _scconf_index scconf_index;
+
 struct _scconf_block {
 	scconf_block *parent;
 	scconf_list *name;
 	scconf_item *items;
+	scconf_index *index;	/* hash of the item keys, see scconf_compile() */
 };
 
 typedef struct {
@@ -86,6 +89,12 @@ extern int scconf_parse(scconf_context * config);
  */
 extern int scconf_parse_string(scconf_context * config, const char *string);
 
+/* Index the keys of all blocks by hash, for the lookups below
+ * Blocks that get items added later are searched item by item again
+ * Returns 1 = ok, 0 = out of memory (lookups still work)
+ */
+extern int scconf_compile(scconf_context * config);
+
 /* Write config to a file
  * If the filename is NULL, use the config->filename
  * Returns 0 = ok, else = errno
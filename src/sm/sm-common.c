@@ -510,10 +510,10 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	unsigned char icv[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 	EVP_CIPHER_CTX *cctx = NULL;
 	EVP_CIPHER *alg = NULL;
-	int tmplen;
+	int tmplen, last_len;
 #endif
-	unsigned char *data;
-	size_t data_len;
+	unsigned char last[16];
+	size_t data_len, full_len;
 
 	SC_FUNC_CALLED(ctx, SC_LOG_DEBUG_SM);
 	sc_debug(ctx, SC_LOG_DEBUG_SM,
@@ -528,26 +528,22 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	*out = NULL;
 	*out_len = 0;
 
-	data = malloc(in_len + 8);
-	if (data == NULL)
-		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM encrypt_des_cbc3: allocation error");
-
-	if (in)
-		memcpy(data, in, in_len);
-
-	memcpy(data + in_len, "\x80\0\0\0\0\0\0\0", 8);
+	/* Full blocks are encrypted straight from the input, only the last
+	 * partial block gets padded here */
+	full_len = in_len - in_len % 8;
+	if (in_len % 8)
+		memcpy(last, in + full_len, in_len % 8);
+	memcpy(last + in_len % 8, "\x80\0\0\0\0\0\0\0", 8);
 	data_len = in_len + (not_force_pad ? 7 : 8);
 	data_len -= (data_len%8);
 	sc_debug(ctx, SC_LOG_DEBUG_SM,
 	       "SM encrypt_des_cbc3: data to encrypt (len:%"SC_FORMAT_LEN_SIZE_T"u,%s)",
-	       data_len, sc_dump_hex(data, data_len));
+	       data_len, sc_dump_hex(in, in_len));
 
 	*out_len = data_len;
 	*out = calloc(data_len + 8, sizeof(unsigned char));
-	if (*out == NULL) {
-		free(data);
+	if (*out == NULL)
 		LOG_TEST_RET(ctx, SC_ERROR_OUT_OF_MEMORY, "SM encrypt_des_cbc3: failure");
-	}
 
 #if OPENSSL_VERSION_NUMBER < 0x30000000L
 	memcpy(&kk, key, 8);
@@ -557,7 +553,8 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	DES_set_key_unchecked(&k2,&ks2);
 
 	for (st=0; st<data_len; st+=8)
-		DES_3cbc_encrypt((sm_des_cblock *)(data + st), (sm_des_cblock *)(*out + st), 8, &ks, &ks2, &icv, DES_ENCRYPT);
+		DES_3cbc_encrypt((sm_des_cblock *)(st < full_len ? in + st : last + st - full_len),
+				(sm_des_cblock *)(*out + st), 8, &ks, &ks2, &icv, DES_ENCRYPT);
 #else
 	cctx = EVP_CIPHER_CTX_new();
 	alg = sc_evp_cipher(ctx, "DES-EDE-CBC");
@@ -569,13 +566,16 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	}
 	/* Disable padding, otherwise it will fail to decrypt non-padded inputs */
 	EVP_CIPHER_CTX_set_padding(cctx, 0);
-	if (!EVP_EncryptUpdate(cctx, *out, &tmplen, data, data_len)) {
+	tmplen = last_len = 0;
+	if ((full_len && !EVP_EncryptUpdate(cctx, *out, &tmplen, in, (int)full_len))
+			|| (data_len > full_len && !EVP_EncryptUpdate(cctx, *out + tmplen,
+					&last_len, last, (int)(data_len - full_len)))) {
 		free(*out);
 		EVP_CIPHER_CTX_free(cctx);
 		sc_evp_cipher_free(alg);
 		SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_SM, SC_ERROR_INTERNAL);
 	}
-	*out_len = tmplen;
+	*out_len = tmplen + last_len;
 
 	if (!EVP_EncryptFinal_ex(cctx, *out + *out_len, &tmplen)) {
 		free(*out);
@@ -588,7 +588,7 @@ sm_encrypt_des_cbc3(struct sc_context *ctx, unsigned char *key,
 	sc_evp_cipher_free(alg);
 #endif
 
-	free(data);
+	sc_mem_clear(last, sizeof(last));
 	SC_FUNC_RETURN(ctx, SC_LOG_DEBUG_SM, SC_SUCCESS);
 }
 
@@ -1524,11 +1524,22 @@ increment_ssc(struct eac_sm_ctx *eacsmctx)
 	return SC_SUCCESS;
 }
 
+/* Lend data to OpenPACE without copying it, which only reads its input */
+static const BUF_MEM *
+eac_buf_wrap(BUF_MEM *buf, const u8 *data, size_t len)
+{
+	memset(buf, 0, sizeof *buf);
+	buf->data = (char *) data;
+	buf->length = len;
+	buf->max = len;
+	return buf;
+}
+
 static int
 eac_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *data, size_t datalen, u8 **enc)
 {
-	BUF_MEM *encbuf = NULL, *databuf = NULL;
+	BUF_MEM *encbuf = NULL, databuf;
 	u8 *p = NULL;
 	int r;
 	struct eac_sm_ctx *eacsmctx;
@@ -1539,9 +1550,8 @@ eac_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	databuf = BUF_MEM_create_init(data, datalen);
-	encbuf = EAC_encrypt(eacsmctx->ctx, databuf);
-	if (!databuf || !encbuf || !encbuf->length) {
+	encbuf = EAC_encrypt(eacsmctx->ctx, eac_buf_wrap(&databuf, data, datalen));
+	if (!encbuf || !encbuf->length) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not encrypt data.");
 		ssl_error(card->ctx);
 		r = SC_ERROR_INTERNAL;
@@ -1558,7 +1568,6 @@ eac_sm_encrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = encbuf->length;
 
 err:
-	BUF_MEM_clear_free(databuf);
 	if (encbuf)
 		BUF_MEM_free(encbuf);
 
@@ -1569,7 +1578,7 @@ static int
 eac_sm_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *enc, size_t enclen, u8 **data)
 {
-	BUF_MEM *encbuf = NULL, *databuf = NULL;
+	BUF_MEM encbuf, *databuf = NULL;
 	u8 *p = NULL;
 	int r;
 	struct eac_sm_ctx *eacsmctx;
@@ -1580,9 +1589,8 @@ eac_sm_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	encbuf = BUF_MEM_create_init(enc, enclen);
-	databuf = EAC_decrypt(eacsmctx->ctx, encbuf);
-	if (!encbuf || !databuf || !databuf->length) {
+	databuf = EAC_decrypt(eacsmctx->ctx, eac_buf_wrap(&encbuf, enc, enclen));
+	if (!databuf || !databuf->length) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE, "Could not decrypt data.");
 		ssl_error(card->ctx);
 		r = SC_ERROR_INTERNAL;
@@ -1600,8 +1608,6 @@ eac_sm_decrypt(sc_card_t *card, const struct iso_sm_ctx *ctx,
 
 err:
 	BUF_MEM_clear_free(databuf);
-	if (encbuf)
-		BUF_MEM_free(encbuf);
 
 	return r;
 }
@@ -1610,7 +1616,7 @@ static int
 eac_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *data, size_t datalen, u8 **macdata)
 {
-	BUF_MEM *inbuf = NULL, *macbuf = NULL;
+	BUF_MEM inbuf, *macbuf = NULL;
 	u8 *p = NULL;
 	int r;
 	struct eac_sm_ctx *eacsmctx;
@@ -1621,13 +1627,7 @@ eac_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	inbuf = BUF_MEM_create_init(data, datalen);
-	if (!inbuf) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto err;
-	}
-
-	macbuf = EAC_authenticate(eacsmctx->ctx, inbuf);
+	macbuf = EAC_authenticate(eacsmctx->ctx, eac_buf_wrap(&inbuf, data, datalen));
 	if (!macbuf || !macbuf->length) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE,
 				"Could not compute message authentication code (MAC).");
@@ -1646,8 +1646,6 @@ eac_sm_authenticate(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = macbuf->length;
 
 err:
-	if (inbuf)
-		BUF_MEM_free(inbuf);
 	if (macbuf)
 		BUF_MEM_free(macbuf);
 
@@ -1660,7 +1658,7 @@ eac_sm_verify_authentication(sc_card_t *card, const struct iso_sm_ctx *ctx,
 		const u8 *macdata, size_t macdatalen)
 {
 	int r;
-	BUF_MEM *inbuf = NULL, *my_mac = NULL;
+	BUF_MEM inbuf, *my_mac = NULL;
 	struct eac_sm_ctx *eacsmctx;
 
 	if (!card || !ctx || !ctx->priv_data) {
@@ -1669,13 +1667,8 @@ eac_sm_verify_authentication(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	}
 	eacsmctx = ctx->priv_data;
 
-	inbuf = BUF_MEM_create_init(macdata, macdatalen);
-	if (!inbuf) {
-		r = SC_ERROR_OUT_OF_MEMORY;
-		goto err;
-	}
-
-	my_mac = EAC_authenticate(eacsmctx->ctx, inbuf);
+	my_mac = EAC_authenticate(eacsmctx->ctx,
+			eac_buf_wrap(&inbuf, macdata, macdatalen));
 	if (!my_mac) {
 		sc_debug(card->ctx, SC_LOG_DEBUG_VERBOSE,
 				"Could not compute message authentication code (MAC) for verification.");
@@ -1697,8 +1690,6 @@ eac_sm_verify_authentication(sc_card_t *card, const struct iso_sm_ctx *ctx,
 	r = SC_SUCCESS;
 
 err:
-	if (inbuf)
-		BUF_MEM_free(inbuf);
 	if (my_mac)
 		BUF_MEM_free(my_mac);
 
@@ -0,0 +1,195 @@
+/*
+ * Benchmark of encoding PKCS#15 directory files: sc_pkcs15_encode_df() on
+ * PrKDFs and CDFs with hundreds of objects, against joining the entries
+ * with a realloc() per entry as sc_pkcs15_encode_df() did before
+ *
+ * Usage: asn1bench [rounds]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+
+static int add_objects(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *prkdf,
+		struct sc_pkcs15_df *cdf, int n)
+{
+	struct sc_pkcs15_prkey_info *prkey;
+	struct sc_pkcs15_cert_info *cert;
+	struct sc_pkcs15_object *obj;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		prkey = calloc(1, sizeof(*prkey));
+		obj = calloc(1, sizeof(*obj));
+		if (prkey == NULL || obj == NULL)
+			return -1;
+		prkey->id.len = 20;
+		memset(prkey->id.value, i & 0xFF, prkey->id.len);
+		prkey->id.value[0] = i >> 8;
+		prkey->usage = SC_PKCS15_PRKEY_USAGE_SIGN | SC_PKCS15_PRKEY_USAGE_DECRYPT;
+		prkey->native = 1;
+		prkey->key_reference = i;
+		prkey->modulus_length = 2048;
+		sc_format_path("3F0050154400", &prkey->path);
+		prkey->path.value[prkey->path.len - 1] = i & 0xFF;
+		snprintf(obj->label, sizeof(obj->label), "Private key %d", i);
+		obj->type = SC_PKCS15_TYPE_PRKEY_RSA;
+		obj->flags = SC_PKCS15_CO_FLAG_PRIVATE;
+		obj->auth_id.len = 1;
+		obj->auth_id.value[0] = 1;
+		obj->data = prkey;
+		obj->df = prkdf;
+		sc_pkcs15_add_object(p15card, obj);
+
+		cert = calloc(1, sizeof(*cert));
+		obj = calloc(1, sizeof(*obj));
+		if (cert == NULL || obj == NULL)
+			return -1;
+		cert->id = prkey->id;
+		sc_format_path("3F0050154500", &cert->path);
+		cert->path.value[cert->path.len - 1] = i & 0xFF;
+		snprintf(obj->label, sizeof(obj->label), "Certificate %d", i);
+		obj->type = SC_PKCS15_TYPE_CERT_X509;
+		obj->data = cert;
+		obj->df = cdf;
+		sc_pkcs15_add_object(p15card, obj);
+	}
+	return 0;
+}
+
+/* What sc_pkcs15_encode_df() did before */
+static int encode_df_realloc(sc_context_t *ctx, struct sc_pkcs15_card *p15card,
+		struct sc_pkcs15_df *df, u8 **buf_out, size_t *bufsize_out)
+{
+	const struct sc_pkcs15_object *obj;
+	u8 *buf = NULL, *tmp = NULL, *p;
+	size_t bufsize = 0, tmpsize;
+	int r;
+
+	for (obj = p15card->obj_list; obj != NULL; obj = obj->next) {
+		if (obj->df != df)
+			continue;
+		if (df->type == SC_PKCS15_PRKDF)
+			r = sc_pkcs15_encode_prkdf_entry(ctx, obj, &tmp, &tmpsize);
+		else
+			r = sc_pkcs15_encode_cdf_entry(ctx, obj, &tmp, &tmpsize);
+		if (r) {
+			free(tmp);
+			free(buf);
+			return r;
+		}
+		p = realloc(buf, bufsize + tmpsize);
+		if (p == NULL) {
+			free(tmp);
+			free(buf);
+			return SC_ERROR_OUT_OF_MEMORY;
+		}
+		buf = p;
+		memcpy(buf + bufsize, tmp, tmpsize);
+		free(tmp);
+		tmp = NULL;
+		bufsize += tmpsize;
+	}
+	*buf_out = buf;
+	*bufsize_out = bufsize;
+	return 0;
+}
+
+static double run(sc_context_t *ctx, struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df,
+		int (*encode)(sc_context_t *, struct sc_pkcs15_card *, struct sc_pkcs15_df *,
+			u8 **, size_t *), unsigned long rounds, size_t *len)
+{
+	struct timeval tv1, tv2;
+	unsigned long i;
+	u8 *buf;
+	double s;
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < rounds; i++) {
+		if (encode(ctx, p15card, df, &buf, len) != SC_SUCCESS)
+			return 0;
+		free(buf);
+	}
+	gettimeofday(&tv2, NULL);
+	s = (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+	return rounds / s;
+}
+
+/* Both ways must give the same DF */
+static int compare(sc_context_t *ctx, struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	u8 *buf1 = NULL, *buf2 = NULL;
+	size_t len1 = 0, len2 = 0;
+	int r = -1;
+
+	if (encode_df_realloc(ctx, p15card, df, &buf1, &len1) == SC_SUCCESS
+			&& sc_pkcs15_encode_df(ctx, p15card, df, &buf2, &len2) == SC_SUCCESS
+			&& len1 == len2 && memcmp(buf1, buf2, len1) == 0)
+		r = 0;
+	free(buf1);
+	free(buf2);
+	return r;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = { 100, 250, 500, 1000 };
+	struct sc_pkcs15_card *p15card;
+	struct sc_pkcs15_df *df;
+	sc_context_param_t param;
+	sc_context_t *ctx = NULL;
+	sc_path_t path;
+	unsigned long rounds = 20;
+	double before, after;
+	size_t i, len;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 10);
+
+	memset(&param, 0, sizeof(param));
+	param.app_name = "asn1bench";
+	if (sc_context_create(&ctx, &param) != SC_SUCCESS)
+		return 1;
+
+	printf("%-6s %8s %7s %12s %13s %8s\n", "DF", "objects", "bytes",
+			"realloc DF/s", "two-pass DF/s", "speedup");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		p15card = sc_pkcs15_card_new();
+		if (p15card == NULL)
+			return 1;
+		sc_format_path("3F0050154401", &path);
+		sc_pkcs15_add_df(p15card, SC_PKCS15_PRKDF, &path);
+		sc_format_path("3F0050154402", &path);
+		sc_pkcs15_add_df(p15card, SC_PKCS15_CDF, &path);
+		if (add_objects(p15card, p15card->df_list, p15card->df_list->next, sizes[i]) != 0)
+			return 1;
+
+		for (df = p15card->df_list; df != NULL; df = df->next) {
+			before = run(ctx, p15card, df, encode_df_realloc, rounds, &len);
+			after = run(ctx, p15card, df, sc_pkcs15_encode_df, rounds, &len);
+			if (before == 0 || after == 0) {
+				fprintf(stderr, "Encoding failed\n");
+				return 1;
+			}
+			if (compare(ctx, p15card, df) != 0) {
+				fprintf(stderr, "Encodings differ\n");
+				return 1;
+			}
+			printf("%-6s %8d %7lu %12.1f %13.1f %7.2fx\n",
+					df->type == SC_PKCS15_PRKDF ? "PrKDF" : "CDF", sizes[i],
+					(unsigned long)len, before, after, after / before);
+		}
+		sc_pkcs15_card_free(p15card);
+	}
+
+	sc_release_context(ctx);
+	return 0;
+}
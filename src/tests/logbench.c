@@ -0,0 +1,113 @@
+/*
+ * Benchmark of the logging overhead per APDU: READ BINARY through
+ * sc_read_binary() against a reader that answers every command
+ * immediately, once with debugging off and once logging to a null device
+ *
+ * Usage: logbench [apdus]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/log.h"
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+static int null_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	size_t len = apdu->le < apdu->resplen ? apdu->le : apdu->resplen;
+
+	(void)reader;
+	memset(apdu->resp, 0x5A, len);
+	apdu->resplen = len;
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	return SC_SUCCESS;
+}
+
+static double elapsed_ns(struct timeval *tv1, struct timeval *tv2, unsigned long n)
+{
+	double us = (tv2->tv_sec - tv1->tv_sec) * 1000000.0 + (tv2->tv_usec - tv1->tv_usec);
+
+	return us * 1000.0 / n;
+}
+
+static double read_loop(sc_card_t *card, unsigned long apdus)
+{
+	struct timeval tv1, tv2;
+	u8 buf[128];
+	unsigned long i;
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < apdus; i++) {
+		if (sc_read_binary(card, 0, buf, sizeof(buf), 0) != (int)sizeof(buf)) {
+			fprintf(stderr, "READ BINARY failed\n");
+			exit(1);
+		}
+	}
+	gettimeofday(&tv2, NULL);
+	return elapsed_ns(&tv1, &tv2, apdus);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+	sc_context_param_t param;
+	sc_context_t *ctx = NULL;
+	sc_reader_t reader;
+	sc_card_t card;
+	unsigned long apdus = 200000;
+	double off, on;
+
+	if (argc > 1)
+		apdus = strtoul(argv[1], NULL, 10);
+	if (apdus < 100)
+		return 1;
+
+	memset(&param, 0, sizeof(param));
+	param.app_name = "logbench";
+	if (sc_context_create(&ctx, &param) != SC_SUCCESS)
+		return 1;
+
+	memset(&reader_ops, 0, sizeof(reader_ops));
+	reader_ops.transmit = null_transmit;
+	memset(&reader, 0, sizeof(reader));
+	reader.ctx = ctx;
+	reader.name = "Null Reader";
+	reader.ops = &reader_ops;
+	reader.active_protocol = SC_PROTO_T1;
+
+	card_ops = *sc_get_iso7816_driver()->ops;
+	memset(&card, 0, sizeof(card));
+	card.ctx = ctx;
+	card.reader = &reader;
+	card.ops = &card_ops;
+
+	ctx->debug = 0;
+	off = read_loop(&card, apdus);
+
+	ctx->debug = SC_LOG_DEBUG_NORMAL;
+	if (sc_ctx_log_to_file(ctx, NULL_DEVICE) != SC_SUCCESS)
+		return 1;
+	on = read_loop(&card, apdus / 10);
+	ctx->debug = 0;
+
+	printf("%-24s %12s\n", "debug", "ns/APDU");
+	printf("%-24s %12.1f\n", "0", off);
+	printf("%-24s %12.1f\n", "3 (" NULL_DEVICE ")", on);
+
+	sc_release_context(ctx);
+	return 0;
+}
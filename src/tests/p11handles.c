@@ -0,0 +1,99 @@
+/*
+ * Benchmark of the PKCS#11 session and object handle lookups: the
+ * linear simclist seek used before and the hash index of handle-map.c
+ *
+ * Usage: p11handles [lookups]
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include "pkcs11/sc-pkcs11.h"
+
+static int object_seeker(const void *el, const void *key)
+{
+	const struct sc_pkcs11_object *object = el;
+
+	if (el == NULL || key == NULL)
+		return 0;
+	return object->handle == *(CK_OBJECT_HANDLE *)key;
+}
+
+static double elapsed_ns(struct timeval *tv1, struct timeval *tv2, unsigned long n)
+{
+	double us = (tv2->tv_sec - tv1->tv_sec) * 1000000.0 + (tv2->tv_usec - tv1->tv_usec);
+
+	return us * 1000.0 / n;
+}
+
+int main(int argc, char *argv[])
+{
+	static const size_t counts[] = { 16, 128, 1024, 8192 };
+	unsigned long lookups = 1000000, l;
+	struct sc_pkcs11_object *objects;
+	struct sc_pkcs11_handle_map map;
+	struct timeval tv1, tv2;
+	list_t list;
+	size_t c, i, n;
+	unsigned long found;
+
+	if (argc > 1)
+		lookups = strtoul(argv[1], NULL, 10);
+	if (lookups < 100)
+		return 1;
+
+	printf("%8s %14s %14s\n", "handles", "list ns/op", "map ns/op");
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		n = counts[c];
+		objects = calloc(n, sizeof(*objects));
+		if (objects == NULL || list_init(&list) != 0)
+			return 1;
+		list_attributes_seeker(&list, object_seeker);
+		sc_pkcs11_handle_map_init(&map);
+
+		for (i = 0; i < n; i++) {
+			objects[i].handle = (CK_OBJECT_HANDLE)(uintptr_t)&objects[i];
+			list_append(&list, &objects[i]);
+			if (sc_pkcs11_handle_map_add(&map, objects[i].handle, &objects[i]) != 0)
+				return 1;
+		}
+
+		/* The list is only seeked for a fraction of the lookups */
+		found = 0;
+		gettimeofday(&tv1, NULL);
+		for (l = 0; l < lookups / 100; l++) {
+			CK_OBJECT_HANDLE h = objects[(l * 7919) % n].handle;
+			found += list_seek(&list, &h) != NULL;
+		}
+		gettimeofday(&tv2, NULL);
+		printf("%8lu %14.1f", (unsigned long)n, elapsed_ns(&tv1, &tv2, lookups / 100));
+
+		gettimeofday(&tv1, NULL);
+		for (l = 0; l < lookups; l++)
+			found += sc_pkcs11_handle_map_get(&map, objects[(l * 7919) % n].handle) != NULL;
+		gettimeofday(&tv2, NULL);
+		printf(" %14.1f\n", elapsed_ns(&tv1, &tv2, lookups));
+
+		if (found != lookups / 100 + lookups) {
+			fprintf(stderr, "Lookup failed\n");
+			return 1;
+		}
+
+		for (i = 0; i < n; i++)
+			sc_pkcs11_handle_map_del(&map, objects[i].handle);
+		if (map.count != 0) {
+			fprintf(stderr, "Delete failed\n");
+			return 1;
+		}
+		sc_pkcs11_handle_map_clear(&map);
+		list_destroy(&list);
+		free(objects);
+	}
+	return 0;
+}
@@ -32,6 +32,7 @@
 #include "p11test_case_wait.h"
 #include "p11test_case_pss_oaep.h"
 #include "p11test_case_interface.h"
+#include "p11test_case_sign_batch.h"
 #include "p11test_case_wrap.h"
 #include "p11test_case_secret.h"
 
@@ -78,6 +79,10 @@ int main(int argc, char** argv) {
 		cmocka_unit_test_setup_teardown(multipart_tests,
 			user_login_setup, after_test_cleanup),
 
+		/* Batch signatures through the OpenSC vendor interface */
+		cmocka_unit_test_setup_teardown(sign_batch_tests,
+			user_login_setup, after_test_cleanup),
+
 		/* Regression test Sign&Verify with various data lengths */
 		cmocka_unit_test_setup_teardown(ec_sign_size_test,
 			user_login_setup, after_test_cleanup),
@@ -55,8 +55,8 @@ void interface_test(void **state)
 	/* Get the count of interfaces */
 	rv = C_GetInterfaceList(NULL, &count);
 	assert_int_equal(rv, CKR_OK);
-	/* XXX assuming two interfaces, PKCS#11 3.0 and 2.20 */
-	assert_int_equal(count, 2);
+	/* XXX assuming three interfaces, PKCS#11 3.0, 2.20 and the OpenSC vendor one */
+	assert_int_equal(count, 3);
 
 	interfaces = malloc(count * sizeof(CK_INTERFACE));
 	assert_non_null(interfaces);
@@ -80,6 +80,9 @@ void interface_test(void **state)
 	assert_int_equal(((CK_VERSION *)interfaces[1].pFunctionList)->major, 2);
 	assert_int_equal(((CK_VERSION *)interfaces[1].pFunctionList)->minor, 20);
 	assert_int_equal(interfaces[1].flags, 0);
+	assert_string_equal(interfaces[2].pInterfaceName, "Vendor OpenSC");
+	assert_int_equal(((CK_VERSION *)interfaces[2].pFunctionList)->major, 1);
+	assert_int_equal(((CK_VERSION *)interfaces[2].pFunctionList)->minor, 0);
 
 	/* GetInterface with NULL name should give us default PKCS 11 one */
 	rv = C_GetInterface(NULL, NULL, &interface, 0);
@@ -0,0 +1,158 @@
+/*
+ * p11test_case_sign_batch.c: Batch signatures through the OpenSC vendor
+ * interface
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "p11test_case_sign_batch.h"
+#include "pkcs11/pkcs11-opensc.h"
+#include <dlfcn.h>
+
+#define BATCH_SIZE	5
+
+extern void *pkcs11_so;
+
+/* Mechanisms hashing the data on their own, so any message can be signed */
+static int hashing_mechanism(CK_MECHANISM_TYPE mech)
+{
+	switch (mech) {
+	case CKM_SHA1_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS:
+	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS:
+	case CKM_ECDSA_SHA1:
+	case CKM_ECDSA_SHA224:
+	case CKM_ECDSA_SHA256:
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
+		return 1;
+	}
+	return 0;
+}
+
+/* Signs BATCH_SIZE different messages in one C_OpenSC_SignBatch() call and
+ * verifies every signature with the public key of the object.
+ *
+ * Returns 1 for success, 0 for skipped key or mechanism, -1 otherwise. */
+static int sign_batch_test(test_cert_t *o, token_info_t *info, test_mech_t *mech,
+    CK_OPENSC_FUNCTION_LIST *ofp)
+{
+	CK_FUNCTION_LIST_PTR fp = info->function_pointer;
+	CK_MECHANISM sign_mechanism = { mech->mech, NULL_PTR, 0 };
+	CK_BYTE messages[BATCH_SIZE][64];
+	CK_BYTE_PTR data[BATCH_SIZE], sigs[BATCH_SIZE];
+	CK_ULONG data_len[BATCH_SIZE], sig_len[BATCH_SIZE];
+	CK_RV rv;
+	int i, ret = 1;
+
+	if (o->private_handle == CK_INVALID_HANDLE || !hashing_mechanism(mech->mech))
+		return 0;
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		data_len[i] = snprintf((char *)messages[i], sizeof(messages[i]),
+			"Batch message %d for signing & verifying", i);
+		data[i] = messages[i];
+		sigs[i] = NULL;
+		sig_len[i] = 0;
+	}
+
+	rv = fp->C_SignInit(info->session_handle, &sign_mechanism, o->private_handle);
+	if (rv != CKR_OK) {
+		debug_print(" [SKIP %s ] C_SignInit: rv = 0x%.8lX", o->id_str, rv);
+		return 0;
+	}
+	always_authenticate(o, info);
+
+	/* Query the lengths first, as with C_Sign() */
+	rv = ofp->C_OpenSC_SignBatch(info->session_handle, BATCH_SIZE,
+		data, data_len, NULL, sig_len);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "  C_OpenSC_SignBatch: rv = 0x%.8lX\n", rv);
+		return -1;
+	}
+	for (i = 0; i < BATCH_SIZE; i++) {
+		sigs[i] = malloc(sig_len[i]);
+		assert_non_null(sigs[i]);
+	}
+	rv = ofp->C_OpenSC_SignBatch(info->session_handle, BATCH_SIZE,
+		data, data_len, sigs, sig_len);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "  C_OpenSC_SignBatch: rv = 0x%.8lX\n", rv);
+		ret = -1;
+	}
+
+	for (i = 0; ret == 1 && i < BATCH_SIZE; i++) {
+		debug_print(" [ KEY %s ] Verify signature %d of the batch", o->id_str, i);
+		if (verify_message(o, info, data[i], data_len[i], mech,
+				sigs[i], sig_len[i], 0) != 1) {
+			fprintf(stderr, "  Signature %d of the batch does not verify"
+				" with key %s\n", i, o->id_str);
+			ret = -1;
+		}
+	}
+	for (i = 0; i < BATCH_SIZE; i++)
+		free(sigs[i]);
+	return ret;
+}
+
+void sign_batch_tests(void **state) {
+
+	token_info_t *info = (token_info_t *) *state;
+	CK_RV (*C_GetInterface)(CK_UTF8CHAR_PTR, CK_VERSION_PTR, CK_INTERFACE_PTR_PTR, CK_FLAGS);
+	CK_INTERFACE_PTR interface;
+	CK_OPENSC_FUNCTION_LIST *ofp;
+	unsigned int i;
+	int j, rv, errors = 0;
+	test_certs_t objects;
+
+	test_certs_init(&objects);
+
+	P11TEST_START(info);
+	C_GetInterface = (CK_RV (*)(CK_UTF8CHAR_PTR, CK_VERSION_PTR, CK_INTERFACE_PTR_PTR, CK_FLAGS))
+		dlsym(pkcs11_so, "C_GetInterface");
+	if (C_GetInterface == NULL
+			|| C_GetInterface((CK_UTF8CHAR_PTR)OPENSC_INTERFACE_NAME, NULL, &interface, 0) != CKR_OK) {
+		/* Not the OpenSC module */
+		P11TEST_SKIP(info);
+	}
+	ofp = (CK_OPENSC_FUNCTION_LIST *)interface->pFunctionList;
+	assert_non_null(ofp->C_OpenSC_SignBatch);
+
+	search_for_all_objects(&objects, info);
+
+	debug_print("\nCheck functionality of C_OpenSC_SignBatch");
+	for (i = 0; i < objects.count; i++) {
+		test_cert_t *o = &objects.data[i];
+
+		if (o->type != EVP_PKEY_RSA && o->type != EVP_PKEY_EC)
+			continue;
+		for (j = 0; j < o->num_mechs; j++) {
+			if ((o->mechs[j].usage_flags & CKF_SIGN) == 0)
+				continue;
+			rv = sign_batch_test(o, info, &o->mechs[j], ofp);
+			if (rv < 0)
+				errors++;
+			printf("[%-6s] [%-20s] [%s]\n", o->id_str,
+				get_mechanism_name(o->mechs[j].mech),
+				rv > 0 ? "./" : rv < 0 ? "FAIL" : "SKIP");
+		}
+	}
+
+	clean_all_objects(&objects);
+	if (errors > 0)
+		P11TEST_FAIL(info, "%d batches did not verify", errors);
+	P11TEST_PASS(info);
+}
@@ -0,0 +1,205 @@
+/*
+ * Benchmark of sc_mem_secure_alloc() against a page of its own locked per
+ * allocation, with the allocation patterns of the PKCS#11 module: PIN
+ * copies of C_Login, input buffers of C_Sign and C_Decrypt, the buffer
+ * that C_SignUpdate grows and PINs kept by many sessions at once
+ *
+ * Usage: secmembench [iterations]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "libopensc/opensc.h"
+
+#define SESSIONS	64
+
+typedef void *(*alloc_fn)(size_t len);
+typedef void (*free_fn)(void *ptr, size_t len);
+
+static size_t page_size;
+
+/* What sc_mem_secure_alloc() did for every buffer before the pools */
+static void *page_alloc(size_t len)
+{
+	void *p;
+
+	len = (len + page_size - 1) / page_size * page_size;
+	p = calloc(1, len);
+	if (p == NULL)
+		return NULL;
+#ifdef _WIN32
+	VirtualLock(p, len);
+#else
+	mlock(p, len);
+#endif
+	return p;
+}
+
+static void page_free(void *ptr, size_t len)
+{
+	if (ptr == NULL)
+		return;
+	sc_mem_clear(ptr, len);
+#ifdef _WIN32
+	VirtualUnlock(ptr, len);
+#else
+	munlock(ptr, len);
+#endif
+	free(ptr);
+}
+
+static unsigned long login(alloc_fn alloc, free_fn release, unsigned long n)
+{
+	unsigned long i;
+	u8 *pin;
+
+	for (i = 0; i < n; i++) {
+		pin = alloc(8);
+		if (pin == NULL)
+			return 0;
+		memcpy(pin, "12345678", 8);
+		release(pin, 8);
+	}
+	return n;
+}
+
+static unsigned long sign(alloc_fn alloc, free_fn release, unsigned long n)
+{
+	unsigned long i;
+	u8 *buf;
+
+	for (i = 0; i < n; i++) {
+		buf = alloc(512);
+		if (buf == NULL)
+			return 0;
+		memset(buf, 0x5A, 512);
+		release(buf, 512);
+	}
+	return n;
+}
+
+/* C_SignUpdate with 64 bytes at a time up to 1 KiB, see mechanism.c */
+static unsigned long sign_update(alloc_fn alloc, free_fn release, unsigned long n)
+{
+	unsigned long i;
+	size_t len, new_len;
+	u8 *buf, *new_buf;
+
+	for (i = 0; i < n; i += 16) {
+		buf = NULL;
+		for (len = 0; len < 1024; len = new_len) {
+			new_len = len + 64;
+			new_buf = alloc(new_len);
+			if (new_buf == NULL)
+				return 0;
+			if (len != 0)
+				memcpy(new_buf, buf, len);
+			memset(new_buf + len, 0x11, 64);
+			release(buf, len);
+			buf = new_buf;
+		}
+		release(buf, len);
+	}
+	return i;
+}
+
+static unsigned long sessions(alloc_fn alloc, free_fn release, unsigned long n)
+{
+	u8 *pins[SESSIONS];
+	unsigned long i;
+	int j, k;
+
+	for (i = 0; i < n; i += SESSIONS) {
+		for (j = 0; j < SESSIONS; j++) {
+			pins[j] = alloc(6 + j % 10);
+			if (pins[j] == NULL)
+				return 0;
+		}
+		/* Sessions end in another order than they logged in */
+		for (j = 0; j < SESSIONS; j++) {
+			k = (j * 7) % SESSIONS;
+			release(pins[k], 6 + k % 10);
+		}
+	}
+	return i;
+}
+
+static double run(unsigned long (*flow)(alloc_fn, free_fn, unsigned long),
+		alloc_fn alloc, free_fn release, unsigned long n)
+{
+	struct timeval tv1, tv2;
+	unsigned long done;
+	double s;
+
+	gettimeofday(&tv1, NULL);
+	done = flow(alloc, release, n);
+	gettimeofday(&tv2, NULL);
+	if (done == 0)
+		return 0;
+	s = (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+	return done / s;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		unsigned long (*flow)(alloc_fn, free_fn, unsigned long);
+	} flows[] = {
+		{ "login", login },
+		{ "sign", sign },
+		{ "sign-update", sign_update },
+		{ "sessions", sessions },
+	};
+	struct sc_mem_secure_stats stats;
+	unsigned long n = 100000;
+	double pages, pooled;
+	size_t i;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+#ifdef _WIN32
+	{
+		SYSTEM_INFO system_info;
+		GetSystemInfo(&system_info);
+		page_size = system_info.dwPageSize;
+	}
+#else
+	page_size = sysconf(_SC_PAGESIZE);
+#endif
+
+	printf("%-12s %14s %14s %8s\n", "flow", "page allocs/s", "pool allocs/s", "speedup");
+	for (i = 0; i < sizeof(flows) / sizeof(flows[0]); i++) {
+		pages = run(flows[i].flow, page_alloc, page_free, n);
+		pooled = run(flows[i].flow, sc_mem_secure_alloc, sc_mem_secure_free, n);
+		if (pages == 0 || pooled == 0) {
+			fprintf(stderr, "%s: out of memory\n", flows[i].name);
+			return 1;
+		}
+		printf("%-12s %14.0f %14.0f %7.1fx\n", flows[i].name, pages, pooled, pooled / pages);
+	}
+
+	if (sc_mem_secure_get_stats(&stats) != SC_SUCCESS)
+		return 1;
+	printf("\nallocations %lu (pooled %lu, own pages %lu), frees %lu\n",
+			stats.allocs, stats.pool_allocs, stats.page_allocs, stats.frees);
+	printf("pools %lu, %lu bytes, %lu locked, %lu lock failures\n", stats.pools,
+			(unsigned long)stats.pool_bytes, (unsigned long)stats.pool_locked_bytes,
+			stats.lock_failures);
+	printf("in use %lu bytes, peak %lu bytes\n",
+			(unsigned long)stats.pool_used_bytes, (unsigned long)stats.pool_peak_bytes);
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Benchmark of batch signing: RSA signatures through
+ * sc_pkcs15_compute_signature() one by one and through
+ * sc_pkcs15_compute_signatures() in batches, with and without
+ * SC_CARD_CAP_KEEPS_SECURITY_ENV, against a reader that answers every command
+ * after a fixed delay
+ *
+ * Usage: signbench [signatures [us per APDU]]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "libopensc/opensc.h"
+#include "libopensc/pkcs15.h"
+
+#define BATCH	32
+
+static unsigned long apdu_us = 200;
+static unsigned long apdus;
+
+static int delay_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	size_t len = 0;
+
+	(void)reader;
+	apdus++;
+	if (apdu_us)
+		usleep(apdu_us);
+	if (apdu->ins == 0x2A) {
+		len = apdu->le < apdu->resplen ? apdu->le : apdu->resplen;
+		memset(apdu->resp, 0x5A, len);
+	}
+	apdu->resplen = len;
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	return SC_SUCCESS;
+}
+
+static double elapsed_s(struct timeval *tv1, struct timeval *tv2)
+{
+	return (tv2->tv_sec - tv1->tv_sec) + (tv2->tv_usec - tv1->tv_usec) / 1000000.0;
+}
+
+static void report(const char *name, struct timeval *tv1, struct timeval *tv2,
+		unsigned long signatures)
+{
+	double s = elapsed_s(tv1, tv2);
+
+	printf("%-16s %12.1f %12.2f\n", name, signatures / s, (double)apdus / signatures);
+	apdus = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+	struct sc_pkcs15_sign_request requests[BATCH];
+	struct sc_pkcs15_prkey_info prkey;
+	struct sc_pkcs15_object obj;
+	struct sc_pkcs15_card *p15card;
+	struct timeval tv1, tv2;
+	sc_algorithm_info_t alg;
+	sc_context_param_t param;
+	sc_context_t *ctx = NULL;
+	sc_reader_t reader;
+	sc_card_t card;
+	unsigned long signatures = 1000, i, j;
+	unsigned long flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+	u8 digest[35], sig[BATCH][256];
+	int mode, r;
+
+	if (argc > 1)
+		signatures = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		apdu_us = strtoul(argv[2], NULL, 10);
+	if (signatures < BATCH)
+		return 1;
+	signatures -= signatures % BATCH;
+
+	memset(&param, 0, sizeof(param));
+	param.app_name = "signbench";
+	if (sc_context_create(&ctx, &param) != SC_SUCCESS)
+		return 1;
+
+	memset(&reader_ops, 0, sizeof(reader_ops));
+	reader_ops.transmit = delay_transmit;
+	memset(&reader, 0, sizeof(reader));
+	reader.ctx = ctx;
+	reader.name = "Delay Reader";
+	reader.ops = &reader_ops;
+	reader.active_protocol = SC_PROTO_T1;
+
+	memset(&alg, 0, sizeof(alg));
+	alg.algorithm = SC_ALGORITHM_RSA;
+	alg.key_length = 2048;
+	alg.flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+
+	card_ops = *sc_get_iso7816_driver()->ops;
+	memset(&card, 0, sizeof(card));
+	card.ctx = ctx;
+	card.reader = &reader;
+	card.ops = &card_ops;
+	card.algorithms = &alg;
+	card.algorithm_count = 1;
+
+	memset(&prkey, 0, sizeof(prkey));
+	prkey.usage = SC_PKCS15_PRKEY_USAGE_SIGN;
+	prkey.native = 1;
+	prkey.key_reference = 1;
+	prkey.modulus_length = 2048;
+	memset(&obj, 0, sizeof(obj));
+	obj.type = SC_PKCS15_TYPE_PRKEY_RSA;
+	obj.data = &prkey;
+
+	p15card = sc_pkcs15_card_new();
+	if (p15card == NULL)
+		return 1;
+	p15card->card = &card;
+	memset(digest, 0x11, sizeof(digest));
+
+	gettimeofday(&tv1, NULL);
+	for (i = 0; i < signatures; i++) {
+		r = sc_pkcs15_compute_signature(p15card, &obj, flags, digest, sizeof(digest),
+				sig[0], sizeof(sig[0]), NULL);
+		if (r != (int)sizeof(sig[0])) {
+			fprintf(stderr, "Signature failed: %d\n", r);
+			return 1;
+		}
+	}
+	gettimeofday(&tv2, NULL);
+	printf("%-16s %12s %12s\n", "mode", "sig/s", "APDU/sig");
+	report("single", &tv1, &tv2, signatures);
+
+	for (mode = 0; mode < 2; mode++) {
+		/* The second round lets the batch keep the security environment */
+		if (mode == 1)
+			card.caps |= SC_CARD_CAP_KEEPS_SECURITY_ENV;
+		gettimeofday(&tv1, NULL);
+		for (i = 0; i < signatures; i += BATCH) {
+			for (j = 0; j < BATCH; j++) {
+				requests[j].in = digest;
+				requests[j].inlen = sizeof(digest);
+				requests[j].out = sig[j];
+				requests[j].outlen = sizeof(sig[j]);
+			}
+			r = sc_pkcs15_compute_signatures(p15card, &obj, flags, requests, BATCH, NULL);
+			if (r != BATCH) {
+				fprintf(stderr, "Batch failed: %d\n", r);
+				return 1;
+			}
+		}
+		gettimeofday(&tv2, NULL);
+		report(mode == 0 ? "batch" : "batch keep env", &tv1, &tv2, signatures);
+	}
+
+	sc_pkcs15_card_free(p15card);
+	sc_release_context(ctx);
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * apdu-trace.c: Unit tests for the APDU trace ring
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <signal.h>
+
+#include "torture.h"
+#include "libopensc/internal.h"
+
+static int ok_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	(void)reader;
+	apdu->resplen = 0;
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	return SC_SUCCESS;
+}
+
+static void torture_trace_ring(void **state)
+{
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+	struct sigaction sa;
+	sc_context_t *ctx = NULL;
+	sc_reader_t reader;
+	sc_card_t card;
+	sc_apdu_t apdu;
+	FILE *out;
+	int i;
+
+	(void)state;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	assert_int_equal(sc_establish_context(&ctx, "apdutrace"), SC_SUCCESS);
+	memset(&reader_ops, 0, sizeof(reader_ops));
+	memset(&reader, 0, sizeof(reader));
+	memset(&card, 0, sizeof(card));
+	reader_ops.transmit = ok_transmit;
+	reader.name = "Test Reader 00 00";
+	reader.ops = &reader_ops;
+	reader.active_protocol = SC_PROTO_T1;
+	card_ops = *sc_get_iso7816_driver()->ops;
+	card.ctx = ctx;
+	card.reader = &reader;
+	card.ops = &card_ops;
+
+	/* A signal the application ignores is left alone */
+	signal(SIGUSR2, SIG_IGN);
+	assert_int_equal(sc_apdu_trace_enable(16, 0, "/nonexistent/trace"), SC_SUCCESS);
+	assert_int_equal(sigaction(SIGUSR2, NULL, &sa), 0);
+	assert_true(sa.sa_handler == SIG_IGN);
+
+	/* Later calls do not change the ring */
+	assert_int_equal(sc_apdu_trace_enable(1024, 1, NULL), SC_SUCCESS);
+	for (i = 0; i < 40; i++) {
+		sc_format_apdu(&card, &apdu, SC_APDU_CASE_1, 0x70, 0x00, (u8)i);
+		assert_int_equal(sc_transmit_apdu(&card, &apdu), SC_SUCCESS);
+	}
+	out = tmpfile();
+	assert_non_null(out);
+	assert_int_equal(sc_apdu_trace_print(out), 16);
+	fclose(out);
+
+	sc_release_context(ctx);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test(torture_trace_ring),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -375,6 +375,46 @@ static void torture_asn1_decode_entry_octet_string_pre_allocated_truncate(void *
 	assert_memory_equal(result, octet_string, resultlen);
 }
 
+/* The borrowed value points into the input, padding zero stripped */
+static void torture_asn1_decode_entry_octet_string_borrow(void **state)
+{
+	sc_context_t *ctx = *state;
+	/* Skipped the Tag and Length (0x02, 0x03) */
+	const u8 octet_string[] = {0x00, 0x80, 0x01};
+	struct sc_asn1_entry asn1_struct[2] = {
+		{ "r",          SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER,
+			SC_ASN1_BORROW | SC_ASN1_UNSIGNED, NULL, NULL },
+		{ NULL, 0, 0, 0, NULL, NULL }
+	};
+	const u8 *result = NULL;
+	size_t resultlen = 0;
+	int rv;
+
+	/* set the pointers to the expected results */
+	sc_format_asn1_entry(asn1_struct, &result, &resultlen, 0);
+	rv = asn1_decode_entry(ctx, asn1_struct, octet_string, sizeof(octet_string), DEPTH);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_ptr_equal(result, octet_string + 1);
+	assert_int_equal(resultlen, sizeof(octet_string) - 1);
+}
+
+/* ECDSA-Sig-Value with r and s borrowed from the sequence */
+static void torture_asn1_decode_sig_value_borrow(void **state)
+{
+	sc_context_t *ctx = *state;
+	const u8 sig[] = {0x30, 0x08, 0x02, 0x03, 0x00, 0x80, 0x01, 0x02, 0x01, 0x7f};
+	const u8 expected[] = {0x00, 0x80, 0x01, 0x00, 0x00, 0x7f};
+	u8 rs[6];
+	int rv;
+
+	rv = sc_asn1_sig_value_sequence_to_rs(ctx, sig, sizeof(sig), rs, sizeof(rs));
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_memory_equal(rs, expected, sizeof(expected));
+
+	rv = sc_asn1_sig_value_sequence_to_rs(ctx, sig, sizeof(sig), rs, 2);
+	assert_int_equal(rv, SC_ERROR_BUFFER_TOO_SMALL);
+}
+
 static void torture_asn1_decode_entry_bit_string_empty(void **state)
 {
 	sc_context_t *ctx = *state;
@@ -599,6 +639,110 @@ static void torture_asn1_encode_simple(void **state)
 	free(outptr);
 }
 
+/* Nested structures are written in place, with lengths of their contents
+ * known before any of it is written */
+static void torture_asn1_encode_nested(void **state)
+{
+	sc_context_t *ctx = *state;
+	struct sc_asn1_entry asn1_inner[] = {
+		{ "integer", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_INTEGER, SC_ASN1_UNSIGNED, NULL, NULL },
+		{ "absent", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, SC_ASN1_OPTIONAL, NULL, NULL },
+		{ "long", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, 0, NULL, NULL },
+		{ NULL , 0 , 0 , 0 , NULL , NULL }
+	};
+	struct sc_asn1_entry asn1_outer[] = {
+		{ "boolean", SC_ASN1_BOOLEAN, SC_ASN1_TAG_BOOLEAN, 0, NULL, NULL },
+		{ "inner", SC_ASN1_STRUCT, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
+		{ "empty", SC_ASN1_STRUCT, SC_ASN1_CTX | 1 | SC_ASN1_CONS, 0, NULL, NULL },
+		{ NULL , 0 , 0 , 0 , NULL , NULL }
+	};
+	struct sc_asn1_entry asn1_empty[] = {
+		{ "absent", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, SC_ASN1_OPTIONAL, NULL, NULL },
+		{ NULL , 0 , 0 , 0 , NULL , NULL }
+	};
+	struct sc_asn1_entry asn1[] = {
+		{ "outer", SC_ASN1_STRUCT, SC_ASN1_TAG_SEQUENCE | SC_ASN1_CONS, 0, NULL, NULL },
+		{ NULL , 0 , 0 , 0 , NULL , NULL }
+	};
+	u8 integer[] = {0x80, 0x01}, data[200], expected[3 + 3 + 3 + 5 + 3 + sizeof(data) + 2];
+	size_t integer_len = sizeof(integer), data_len = sizeof(data);
+	int boolean = 1;
+	u8 *outptr = NULL, *p = expected;
+	size_t outlen = 0;
+	int rv;
+
+	memset(data, 0x5A, sizeof(data));
+	*p++ = 0x30; *p++ = 0x81; *p++ = sizeof(expected) - 3;
+	*p++ = 0x01; *p++ = 0x01; *p++ = 0xFF;
+	*p++ = 0x30; *p++ = 0x81; *p++ = 5 + 3 + sizeof(data);
+	*p++ = 0x02; *p++ = 0x03; *p++ = 0x00; *p++ = 0x80; *p++ = 0x01;
+	*p++ = 0x04; *p++ = 0x81; *p++ = sizeof(data);
+	memcpy(p, data, sizeof(data));
+	p += sizeof(data);
+	*p++ = 0xA1; *p++ = 0x00;
+
+	sc_format_asn1_entry(asn1_inner + 0, integer, &integer_len, 1);
+	sc_format_asn1_entry(asn1_inner + 2, data, &data_len, 1);
+	sc_format_asn1_entry(asn1_outer + 0, &boolean, NULL, 1);
+	sc_format_asn1_entry(asn1_outer + 1, asn1_inner, NULL, 1);
+	sc_format_asn1_entry(asn1_outer + 2, asn1_empty, NULL, 1);
+	sc_format_asn1_entry(asn1 + 0, asn1_outer, NULL, 1);
+	rv = sc_asn1_encode(ctx, asn1, &outptr, &outlen);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(outlen, sizeof(expected));
+	assert_memory_equal(expected, outptr, sizeof(expected));
+	free(outptr);
+
+	/* A missing mandatory element fails the whole encoding */
+	asn1_inner[2].flags &= ~SC_ASN1_PRESENT;
+	rv = sc_asn1_encode(ctx, asn1, &outptr, &outlen);
+	assert_int_equal(rv, SC_ERROR_INVALID_ASN1_OBJECT);
+}
+
+/* Appended encodings are written one after the other into one buffer */
+static void torture_asn1_encode_append(void **state)
+{
+	sc_context_t *ctx = *state;
+	struct sc_asn1_entry asn1[] = {
+		{ "octstr", SC_ASN1_OCTET_STRING, SC_ASN1_TAG_OCTET_STRING, 0, NULL, NULL },
+		{ NULL , 0 , 0 , 0 , NULL , NULL }
+	};
+	struct sc_asn1_encoding enc;
+	u8 first[] = {0x01, 0x02}, *second;
+	u8 expected[] = {0x04, 0x02, 0x01, 0x02, 0x04, 0x03, 0x03, 0x04, 0x05};
+	size_t first_len = sizeof(first), second_len = 3;
+	u8 *outptr = NULL;
+	size_t outlen = 0;
+	int rv;
+
+	_sc_asn1_encoding_init(&enc);
+	sc_format_asn1_entry(asn1 + 0, first, &first_len, 1);
+	rv = _sc_asn1_encode_append(ctx, asn1, &enc);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(enc.len, 4);
+
+	/* The contents of a temporary buffer stay valid until written */
+	second = malloc(second_len);
+	assert_non_null(second);
+	second[0] = 0x03; second[1] = 0x04; second[2] = 0x05;
+	assert_int_equal(_sc_asn1_encoding_keep(&enc, second), SC_SUCCESS);
+	sc_format_asn1_entry(asn1 + 0, second, &second_len, 1);
+	rv = _sc_asn1_encode_append(ctx, asn1, &enc);
+	assert_int_equal(rv, SC_SUCCESS);
+
+	/* A failed element leaves the encoding as it was */
+	asn1[0].flags &= ~SC_ASN1_PRESENT;
+	rv = _sc_asn1_encode_append(ctx, asn1, &enc);
+	assert_int_equal(rv, SC_ERROR_INVALID_ASN1_OBJECT);
+
+	rv = _sc_asn1_encoding_finish(&enc, &outptr, &outlen);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(outlen, sizeof(expected));
+	assert_memory_equal(expected, outptr, sizeof(expected));
+	_sc_asn1_encoding_free(&enc);
+	free(outptr);
+}
+
 int main(void)
 {
 	int rc;
@@ -654,6 +798,10 @@ int main(void)
 			setup_sc_context, teardown_sc_context),
 		cmocka_unit_test_setup_teardown(torture_asn1_decode_entry_octet_string_pre_allocated_truncate,
 			setup_sc_context, teardown_sc_context),
+		cmocka_unit_test_setup_teardown(torture_asn1_decode_entry_octet_string_borrow,
+			setup_sc_context, teardown_sc_context),
+		cmocka_unit_test_setup_teardown(torture_asn1_decode_sig_value_borrow,
+			setup_sc_context, teardown_sc_context),
 		/* decode_entry(): BIT STRING */
 		cmocka_unit_test_setup_teardown(torture_asn1_decode_entry_bit_string_empty,
 			setup_sc_context, teardown_sc_context),
@@ -669,6 +817,10 @@ int main(void)
 		/* encode() */
 		cmocka_unit_test_setup_teardown(torture_asn1_encode_simple,
 			setup_sc_context, teardown_sc_context),
+		cmocka_unit_test_setup_teardown(torture_asn1_encode_nested,
+			setup_sc_context, teardown_sc_context),
+		cmocka_unit_test_setup_teardown(torture_asn1_encode_append,
+			setup_sc_context, teardown_sc_context),
 	};
 
 	rc = cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,330 @@
+/*
+ * atr-index.c: Unit tests for matching ATRs of card_atr blocks and the ATR
+ * to driver memo
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libopensc/internal.h"
+
+static char conf_file[PATH_MAX];
+
+static const char conf[] =
+	"app default {\n"
+	"	card_atr 3b:8f:80:01 { driver = \"openpgp\"; name = \"exact\"; }\n"
+	"	card_atr 3b:00:80:01 { driver = \"PIV-II\"; atrmask = \"ff:00:ff:ff\"; name = \"masked\"; }\n"
+	"	card_atr 3b:8f:80:02 { name = \"default\"; }\n"
+	"	card_atr 3B8F8003 { driver = \"openpgp\"; name = \"no colons\"; }\n"
+	"	card_atr 3b:8f:80:04 { driver = \"openpgp\"; atrmask = \"ff:ff\"; name = \"short mask\"; }\n"
+	"}\n";
+
+static int setup_conf(void **state)
+{
+	sc_context_t *ctx = NULL;
+	FILE *f;
+	int fd;
+
+	strcpy(conf_file, "/tmp/opensc-atr-XXXXXX");
+	fd = mkstemp(conf_file);
+	if (fd < 0)
+		return -1;
+	f = fdopen(fd, "w");
+	if (f == NULL || fputs(conf, f) < 0 || fclose(f) != 0)
+		return -1;
+	setenv("OPENSC_CONF", conf_file, 1);
+
+	if (sc_establish_context(&ctx, "atrindex") != SC_SUCCESS)
+		return -1;
+	*state = ctx;
+	return 0;
+}
+
+static int teardown_conf(void **state)
+{
+	sc_release_context(*state);
+	unlink(conf_file);
+	return 0;
+}
+
+static const char *match(sc_context_t *ctx, const char *hex)
+{
+	struct sc_atr atr;
+	scconf_block *block;
+
+	atr.len = sizeof(atr.value);
+	if (sc_hex_to_bin(hex, atr.value, &atr.len) != SC_SUCCESS)
+		return NULL;
+	block = _sc_match_atr_block(ctx, NULL, &atr);
+	if (block == NULL)
+		return NULL;
+	return scconf_get_str(block, "name", NULL);
+}
+
+static void torture_atr_exact(void **state)
+{
+	assert_string_equal(match(*state, "3B:11:80:01"), "masked");
+	assert_string_equal(match(*state, "3b:8f:80:02"), "default");
+	assert_null(match(*state, "3b:8f:80"));
+	assert_null(match(*state, "3b:8f:80:01:00"));
+}
+
+static void torture_atr_driver_order(void **state)
+{
+	/* Both entries match, the PIV driver comes before the OpenPGP one */
+	assert_string_equal(match(*state, "3b:8f:80:01"), "masked");
+}
+
+static void torture_atr_malformed(void **state)
+{
+	assert_null(match(*state, "3b:8f:80:03"));
+	assert_null(match(*state, "3b:8f:80:04"));
+}
+
+/*
+ * ATR to driver memo: sc_connect_card() with three test drivers. "probe"
+ * never matches, "learned" matches the card and initializes with
+ * learned_init_r, "fallback" takes any card.
+ */
+static char cache_dir[PATH_MAX];
+static char memo_file[PATH_MAX + 16];
+static int probes, learned_init_r;
+
+static int probe_match_card(sc_card_t *card)
+{
+	(void)card;
+	probes++;
+	return 0;
+}
+
+static int match_any_card(sc_card_t *card)
+{
+	(void)card;
+	return 1;
+}
+
+static int learned_init(sc_card_t *card)
+{
+	(void)card;
+	return learned_init_r;
+}
+
+static int fallback_init(sc_card_t *card)
+{
+	(void)card;
+	return SC_SUCCESS;
+}
+
+static struct sc_card_operations probe_ops, learned_ops, fallback_ops;
+static struct sc_card_driver probe_drv = { "Probe", "probe", &probe_ops, NULL, 0, NULL };
+static struct sc_card_driver learned_drv = { "Learned", "learned", &learned_ops, NULL, 0, NULL };
+static struct sc_card_driver fallback_drv = { "Fallback", "fallback", &fallback_ops, NULL, 0, NULL };
+
+static int fake_connect(sc_reader_t *reader)
+{
+	(void)reader;
+	return SC_SUCCESS;
+}
+
+static int fake_disconnect(sc_reader_t *reader)
+{
+	(void)reader;
+	return SC_SUCCESS;
+}
+
+static int setup_memo(void **state)
+{
+	FILE *f;
+	int fd;
+
+	(void)state;
+	strcpy(cache_dir, "/tmp/opensc-memo-XXXXXX");
+	if (mkdtemp(cache_dir) == NULL)
+		return -1;
+	snprintf(memo_file, sizeof(memo_file), "%s/atr_drivers", cache_dir);
+	strcpy(conf_file, "/tmp/opensc-atr-XXXXXX");
+	fd = mkstemp(conf_file);
+	if (fd < 0)
+		return -1;
+	f = fdopen(fd, "w");
+	if (f == NULL || fprintf(f, "app default {\n"
+				"	card_driver_memo = true;\n"
+				"	framework pkcs15 { file_cache_dir = \"%s\"; }\n"
+				"}\n", cache_dir) < 0 || fclose(f) != 0)
+		return -1;
+	setenv("OPENSC_CONF", conf_file, 1);
+
+	probe_ops.match_card = probe_match_card;
+	learned_ops.match_card = match_any_card;
+	learned_ops.init = learned_init;
+	fallback_ops.match_card = match_any_card;
+	fallback_ops.init = fallback_init;
+	probes = 0;
+	learned_init_r = SC_SUCCESS;
+	return 0;
+}
+
+static int teardown_memo(void **state)
+{
+	(void)state;
+	unlink(memo_file);
+	rmdir(cache_dir);
+	unlink(conf_file);
+	return 0;
+}
+
+/* Connects a card in a new context with the given drivers and returns the
+ * short name of the driver that took it */
+static const char *connect_with(struct sc_card_driver **drivers)
+{
+	struct sc_card_driver *saved[SC_MAX_CARD_DRIVERS];
+	struct sc_reader_operations reader_ops;
+	const char *name = NULL;
+	sc_context_t *ctx = NULL;
+	sc_reader_t reader;
+	sc_card_t *card = NULL;
+	int i;
+
+	assert_int_equal(sc_establish_context(&ctx, "atrindex"), SC_SUCCESS);
+	memcpy(saved, ctx->card_drivers, sizeof(saved));
+	memset(ctx->card_drivers, 0, sizeof(ctx->card_drivers));
+	for (i = 0; drivers[i] != NULL; i++)
+		ctx->card_drivers[i] = drivers[i];
+
+	memset(&reader_ops, 0, sizeof(reader_ops));
+	reader_ops.connect = fake_connect;
+	reader_ops.disconnect = fake_disconnect;
+	memset(&reader, 0, sizeof(reader));
+	reader.ctx = ctx;
+	reader.name = "Test Reader 00 00";
+	reader.ops = &reader_ops;
+	reader.atr.len = sizeof(reader.atr.value);
+	assert_int_equal(sc_hex_to_bin("3b:8f:80:01:80:4f:0c:a0", reader.atr.value, &reader.atr.len),
+			SC_SUCCESS);
+
+	probes = 0;
+	if (sc_connect_card(&reader, &card) == SC_SUCCESS) {
+		name = card->driver->short_name;
+		sc_disconnect_card(card);
+	}
+
+	memcpy(ctx->card_drivers, saved, sizeof(saved));
+	sc_release_context(ctx);
+	return name;
+}
+
+static struct sc_card_driver *all_drivers[] = { &probe_drv, &learned_drv, &fallback_drv, NULL };
+
+static void torture_atr_memo_hit(void **state)
+{
+	(void)state;
+
+	/* Probed the first time and remembered in the cache directory */
+	assert_string_equal(connect_with(all_drivers), "learned");
+	assert_int_equal(probes, 1);
+	assert_int_equal(access(memo_file, R_OK), 0);
+
+	/* A new context reads the memo and skips the probes */
+	assert_string_equal(connect_with(all_drivers), "learned");
+	assert_int_equal(probes, 0);
+}
+
+static void torture_atr_memo_stale(void **state)
+{
+	struct sc_card_driver *other_drivers[] = { &probe_drv, &fallback_drv, &learned_drv, NULL };
+
+	(void)state;
+	assert_string_equal(connect_with(all_drivers), "learned");
+
+	/* The learned driver does not take the card any more: all drivers are
+	 * probed again and the memo follows the new driver */
+	learned_init_r = SC_ERROR_INVALID_CARD;
+	assert_string_equal(connect_with(all_drivers), "fallback");
+	assert_int_equal(probes, 1);
+	learned_init_r = SC_SUCCESS;
+	assert_string_equal(connect_with(all_drivers), "fallback");
+	assert_int_equal(probes, 0);
+
+	/* The memo of another driver list is not used */
+	assert_string_equal(connect_with(other_drivers), "fallback");
+	assert_int_equal(probes, 1);
+}
+
+static void write_memo(const char *content)
+{
+	FILE *f = fopen(memo_file, "w");
+
+	assert_non_null(f);
+	assert_true(fputs(content, f) >= 0);
+	assert_int_equal(fclose(f), 0);
+}
+
+static void torture_atr_memo_corrupt(void **state)
+{
+	char header[256];
+	FILE *f;
+
+	(void)state;
+
+	/* Garbage instead of the header */
+	write_memo("\x01\x02 not a memo\n3b:8f:80:01:80:4f:0c:a0 fallback\n");
+	assert_string_equal(connect_with(all_drivers), "learned");
+	assert_int_equal(probes, 1);
+
+	/* The valid header of the rewritten file, with broken entries */
+	f = fopen(memo_file, "r");
+	assert_non_null(f);
+	assert_non_null(fgets(header, sizeof(header), f));
+	fclose(f);
+	assert_int_equal(strncmp(header, "# OpenSC ATR drivers ", 21), 0);
+	strcat(header, "zz:8f:80:01:80:4f:0c:a0 fallback\n"
+			"3b:8f:80:01:80:4f:0c:a0\n"
+			"3b:8f:80:01:80:4f:0c:a0:");
+	write_memo(header);
+	assert_string_equal(connect_with(all_drivers), "learned");
+	assert_int_equal(probes, 1);
+
+	/* An entry of a driver that is not loaded */
+	header[strcspn(header, "\n") + 1] = '\0';
+	strcat(header, "3b:8f:80:01:80:4f:0c:a0 nonexistent\n");
+	write_memo(header);
+	assert_string_equal(connect_with(all_drivers), "learned");
+	assert_int_equal(probes, 1);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_atr_exact,
+				setup_conf, teardown_conf),
+		cmocka_unit_test_setup_teardown(torture_atr_driver_order,
+				setup_conf, teardown_conf),
+		cmocka_unit_test_setup_teardown(torture_atr_malformed,
+				setup_conf, teardown_conf),
+		cmocka_unit_test_setup_teardown(torture_atr_memo_hit,
+				setup_memo, teardown_memo),
+		cmocka_unit_test_setup_teardown(torture_atr_memo_stale,
+				setup_memo, teardown_memo),
+		cmocka_unit_test_setup_teardown(torture_atr_memo_corrupt,
+				setup_memo, teardown_memo),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -325,6 +325,121 @@ static void torture_compression_decompress_zlib_good(void **state)
 
 
 
+/* Streaming decompression */
+static void torture_compression_stream_chunks(void **state)
+{
+	struct sc_decompress_stream *stream;
+	u8 out[5], *buf = NULL;
+	size_t buflen = 0, i;
+	int rv;
+
+	stream = sc_decompress_stream_new();
+	assert_non_null(stream);
+
+	/* One byte at a time into a buffer of the exact size */
+	rv = sc_decompress_stream_start(stream, COMPRESSION_AUTO, out, sizeof(out), 0);
+	assert_int_equal(rv, SC_SUCCESS);
+	for (i = 0; i < sizeof(valid_data); i++) {
+		rv = sc_decompress_stream_update(stream, valid_data + i, 1);
+		assert_int_equal(rv, SC_SUCCESS);
+	}
+	rv = sc_decompress_stream_finish(stream, &buf, &buflen);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_ptr_equal(buf, out);
+	assert_int_equal(buflen, 5);
+	assert_memory_equal(out, "test\x0a", 5);
+
+	/* The same stream with an allocated buffer and trailing garbage */
+	rv = sc_decompress_stream_start(stream, COMPRESSION_ZLIB, NULL, 0, 0);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_update(stream, invalid_zlib_suffix_data, 7);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_update(stream, invalid_zlib_suffix_data + 7,
+			sizeof(invalid_zlib_suffix_data) - 7);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_finish(stream, &buf, &buflen);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(buflen, 5);
+	assert_memory_equal(buf, "test\x0a", 5);
+	free(buf);
+
+	sc_decompress_stream_free(stream);
+}
+
+static void torture_compression_stream_truncated(void **state)
+{
+	struct sc_decompress_stream *stream;
+	u8 *buf = NULL;
+	size_t buflen = 0;
+	int rv;
+
+	stream = sc_decompress_stream_new();
+	assert_non_null(stream);
+
+	rv = sc_decompress_stream_start(stream, COMPRESSION_AUTO, NULL, 0, 0);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_update(stream, valid_data, sizeof(valid_data) - 10);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_finish(stream, &buf, &buflen);
+	assert_int_equal(rv, SC_ERROR_UNKNOWN_DATA_RECEIVED);
+	assert_null(buf);
+	assert_int_equal(buflen, 0);
+
+	/* Nothing is inflated from the fuzzer data */
+	rv = sc_decompress_stream_start(stream, COMPRESSION_AUTO, NULL, 0, 0);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_update(stream, invalid_data, sizeof(invalid_data));
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_finish(stream, &buf, &buflen);
+	assert_int_equal(rv, SC_ERROR_UNKNOWN_DATA_RECEIVED);
+	assert_null(buf);
+
+	sc_decompress_stream_free(stream);
+}
+
+static void torture_compression_stream_bounds(void **state)
+{
+	struct sc_decompress_stream *stream;
+	u8 data[8192], packed[256], out[4], *buf = NULL;
+	uLongf packedlen = sizeof(packed);
+	size_t buflen = 0;
+	int rv;
+
+	memset(data, 'a', sizeof(data));
+	assert_int_equal(compress(packed, &packedlen, data, sizeof(data)), Z_OK);
+
+	stream = sc_decompress_stream_new();
+	assert_non_null(stream);
+
+	/* A buffer of the caller is never grown */
+	rv = sc_decompress_stream_start(stream, COMPRESSION_AUTO, out, sizeof(out), 0);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_update(stream, valid_data, sizeof(valid_data));
+	assert_int_equal(rv, SC_ERROR_BUFFER_TOO_SMALL);
+	rv = sc_decompress_stream_finish(stream, &buf, &buflen);
+	assert_int_equal(rv, SC_ERROR_BUFFER_TOO_SMALL);
+
+	/* Allocated buffers grow from the hint up to the limit */
+	rv = sc_decompress_stream_start(stream, COMPRESSION_ZLIB, NULL, 100, sizeof(data) - 1);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_update(stream, packed, packedlen);
+	assert_int_equal(rv, SC_ERROR_BUFFER_TOO_SMALL);
+
+	rv = sc_decompress_stream_start(stream, COMPRESSION_ZLIB, NULL, 100, sizeof(data));
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_update(stream, packed, packedlen);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_decompress_stream_finish(stream, &buf, &buflen);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(buflen, sizeof(data));
+	assert_memory_equal(buf, data, sizeof(data));
+	free(buf);
+
+	sc_decompress_stream_free(stream);
+}
+
+
+
 int main(void)
 {
 	int rc;
@@ -348,6 +463,10 @@ int main(void)
 		cmocka_unit_test(torture_compression_decompress_invalid_suffix),
 		cmocka_unit_test(torture_compression_decompress_valid),
 		cmocka_unit_test(torture_compression_decompress_zlib_good),
+		/* Streaming */
+		cmocka_unit_test(torture_compression_stream_chunks),
+		cmocka_unit_test(torture_compression_stream_truncated),
+		cmocka_unit_test(torture_compression_stream_bounds),
 	};
 
 	rc = cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,137 @@
+/*
+ * framework-index.c: Unit tests for the object index of the PKCS#15
+ * framework of the PKCS#11 module
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "pkcs11/framework-pkcs15.c"
+
+struct index_state {
+	struct sc_pkcs11_card p11card;
+	struct pkcs15_fw_data fw_data;
+	struct sc_pkcs15_object p15_objects[3];
+	struct sc_pkcs15_prkey_info infos[2];
+	struct sc_pkcs15_pubkey_info pubkey_info;
+};
+
+static int setup(void **state)
+{
+	struct index_state *s = calloc(1, sizeof(*s));
+
+	if (s == NULL)
+		return -1;
+	s->p11card.fws_data[0] = &s->fw_data;
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct index_state *s = *state;
+
+	while (s->fw_data.num_objects > 0)
+		__pkcs15_delete_object(&s->fw_data, s->fw_data.objects[0]);
+	fw_index_clear(&s->fw_data);
+	free(s->fw_data.objects);
+	free(s);
+	return 0;
+}
+
+static struct pkcs15_any_object *
+add_prkey(struct index_state *s, int i, const char *id)
+{
+	struct pkcs15_any_object *obj = NULL;
+
+	s->p15_objects[i].type = SC_PKCS15_TYPE_PRKEY_RSA;
+	s->p15_objects[i].data = &s->infos[i];
+	sc_pkcs15_format_id(id, &s->infos[i].id);
+	assert_int_equal(__pkcs15_create_object(&s->fw_data, &obj, &s->p15_objects[i],
+			&pkcs15_prkey_ops, sizeof(struct pkcs15_prkey_object)), SC_SUCCESS);
+	return obj;
+}
+
+static void torture_change_id(void **state)
+{
+	struct index_state *s = *state;
+	struct pkcs15_any_object *obj1, *obj2;
+	struct sc_pkcs11_bucket *bucket;
+
+	obj1 = add_prkey(s, 0, "01");
+	obj2 = add_prkey(s, 1, "01");
+	bucket = fw_index_find(&s->fw_data.id_index, (const u8 *)"\x01", 1);
+	assert_non_null(bucket);
+	assert_int_equal(bucket->count, 2);
+
+	/* As C_SetAttributeValue(CKA_ID) does */
+	fw_index_p15_object(&s->p11card, obj1->p15_object, 0);
+	sc_pkcs15_format_id("02", &s->infos[0].id);
+	fw_index_p15_object(&s->p11card, obj1->p15_object, 1);
+
+	bucket = fw_index_find(&s->fw_data.id_index, (const u8 *)"\x01", 1);
+	assert_non_null(bucket);
+	assert_int_equal(bucket->count, 1);
+	assert_ptr_equal(bucket->entries[0].ptr, obj2);
+	bucket = fw_index_find(&s->fw_data.id_index, (const u8 *)"\x02", 1);
+	assert_non_null(bucket);
+	assert_int_equal(bucket->count, 1);
+	assert_ptr_equal(bucket->entries[0].ptr, obj1);
+
+	/* Nothing is left behind in any bucket */
+	assert_int_equal(__pkcs15_delete_object(&s->fw_data, obj1), SC_SUCCESS);
+	assert_null(fw_index_find(&s->fw_data.id_index, (const u8 *)"\x02", 1));
+	bucket = fw_index_find(&s->fw_data.id_index, (const u8 *)"\x01", 1);
+	assert_non_null(bucket);
+	assert_int_equal(bucket->count, 1);
+	assert_ptr_equal(bucket->entries[0].ptr, obj2);
+}
+
+static void torture_unindexed_object(void **state)
+{
+	struct index_state *s = *state;
+	struct pkcs15_any_object *obj = NULL, *found = NULL;
+	struct sc_pkcs15_id id;
+
+	s->p15_objects[2].type = SC_PKCS15_TYPE_PUBKEY_RSA;
+	s->p15_objects[2].data = &s->pubkey_info;
+	sc_pkcs15_format_id("03", &s->pubkey_info.id);
+	assert_int_equal(__pkcs15_create_object(&s->fw_data, &obj, &s->p15_objects[2],
+			&pkcs15_pubkey_ops, sizeof(struct pkcs15_pubkey_object)), SC_SUCCESS);
+	id = s->pubkey_info.id;
+	assert_int_equal(public_key_created(&s->fw_data, &id, &found), SC_SUCCESS);
+	assert_ptr_equal(found, obj);
+
+	/* As if adding it to the bucket had failed */
+	fw_index_del(&s->fw_data.id_index, id.value, id.len, obj);
+	assert_int_equal(public_key_created(&s->fw_data, &id, &found), SC_ERROR_OBJECT_NOT_FOUND);
+	s->fw_data.index_incomplete = 1;
+	found = NULL;
+	assert_int_equal(public_key_created(&s->fw_data, &id, &found), SC_SUCCESS);
+	assert_ptr_equal(found, obj);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_change_id,
+				setup, teardown),
+		cmocka_unit_test_setup_teardown(torture_unindexed_object,
+				setup, teardown),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
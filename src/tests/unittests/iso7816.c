@@ -0,0 +1,191 @@
+/*
+ * iso7816.c: Unit tests for the select cache of the ISO 7816 driver
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/internal.h"
+
+/* A card with one transparent EF 3F00/5015/4400 of EF_SIZE bytes */
+#define EF_SIZE	64
+
+struct iso7816_state {
+	sc_context_t *ctx;
+	sc_reader_t reader;
+	sc_card_t card;
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+};
+
+static unsigned int apdus;
+static u8 last_p2;
+
+static int ef_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	static const u8 fcp[] = {0x62, 0x07, 0x80, 0x02, 0x00, EF_SIZE, 0x82, 0x01, 0x01};
+	size_t offset = (apdu->p1 << 8) | apdu->p2, len = 0;
+
+	(void)reader;
+	apdus++;
+	last_p2 = apdu->p2;
+	if (apdu->ins == 0xA4) {
+		len = MIN(sizeof(fcp), apdu->resplen);
+		memcpy(apdu->resp, fcp, len);
+	} else if (apdu->ins == 0xB0 && offset < EF_SIZE) {
+		len = MIN(EF_SIZE - offset, apdu->le ? apdu->le : 256);
+		len = MIN(len, apdu->resplen);
+		memset(apdu->resp, 0, len);
+	}
+	apdu->resplen = len;
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	return SC_SUCCESS;
+}
+
+static int setup(void **state)
+{
+	struct iso7816_state *s;
+
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	s = calloc(1, sizeof(*s));
+	if (s == NULL || sc_establish_context(&s->ctx, "iso7816") != SC_SUCCESS)
+		return -1;
+	s->reader_ops.transmit = ef_transmit;
+	s->reader.name = "Test Reader 00 00";
+	s->reader.ops = &s->reader_ops;
+	s->reader.active_protocol = SC_PROTO_T1;
+	s->card_ops = *sc_get_iso7816_driver()->ops;
+	s->card.ctx = s->ctx;
+	s->card.reader = &s->reader;
+	s->card.ops = &s->card_ops;
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct iso7816_state *s = *state;
+
+	sc_release_context(s->ctx);
+	free(s);
+	return 0;
+}
+
+static void torture_select_cache(void **state)
+{
+	struct iso7816_state *s = *state;
+	sc_file_t *file = NULL;
+	sc_path_t ef, df, path;
+
+	sc_format_path("3F0050154400", &ef);
+	sc_format_path("3F005015", &df);
+
+	assert_int_equal(sc_lock(&s->card), SC_SUCCESS);
+	apdus = 0;
+	assert_int_equal(sc_select_file(&s->card, &ef, &file), SC_SUCCESS);
+	assert_int_equal(apdus, 1);
+	assert_int_equal(file->size, EF_SIZE);
+	sc_file_free(file);
+
+	/* Already selected, with or without the FCI */
+	assert_int_equal(sc_select_file(&s->card, &ef, NULL), SC_SUCCESS);
+	assert_int_equal(sc_select_file(&s->card, &ef, &file), SC_SUCCESS);
+	assert_int_equal(apdus, 1);
+	assert_int_equal(file->size, EF_SIZE);
+	sc_file_free(file);
+
+	/* Selected again without asking for the FCI it had */
+	assert_int_equal(sc_select_file(&s->card, &df, NULL), SC_SUCCESS);
+	assert_int_equal(sc_select_file(&s->card, &ef, &file), SC_SUCCESS);
+	assert_int_equal(apdus, 3);
+	assert_int_equal(last_p2, 0x0C);
+	assert_int_equal(file->size, EF_SIZE);
+	sc_file_free(file);
+
+	/* Commands that may change the file system drop the cache */
+	sc_format_path("4400", &path);
+	path.type = SC_PATH_TYPE_FILE_ID;
+	assert_int_equal(sc_delete_file(&s->card, &path), SC_SUCCESS);
+	assert_int_equal(apdus, 4);
+	assert_int_equal(sc_select_file(&s->card, &ef, &file), SC_SUCCESS);
+	assert_int_equal(apdus, 5);
+	assert_int_not_equal(last_p2, 0x0C);
+	sc_file_free(file);
+
+	/* Nothing is cached while the cache is not valid */
+	s->card.cache.valid = 0;
+	assert_int_equal(sc_select_file(&s->card, &ef, NULL), SC_SUCCESS);
+	assert_int_equal(apdus, 6);
+	s->card.cache.valid = 1;
+
+	assert_int_equal(sc_unlock(&s->card), SC_SUCCESS);
+	assert_int_equal(s->card.cache.selected, 0);
+	assert_null(s->card.cache.fci[0]);
+	assert_int_equal(sc_select_file(&s->card, &ef, NULL), SC_SUCCESS);
+	assert_int_equal(apdus, 7);
+}
+
+static void torture_select_cache_clear(void **state)
+{
+	static const u8 ins[] = {
+		0x46,	/* GENERATE ASYMMETRIC KEY PAIR */
+		0x47,
+		0xD4,	/* RESIZE FILE */
+		0xE2,	/* APPEND RECORD */
+	};
+	struct iso7816_state *s = *state;
+	sc_file_t *file = NULL;
+	sc_path_t ef, df;
+	sc_apdu_t apdu;
+	size_t i;
+
+	sc_format_path("3F0050154400", &ef);
+	sc_format_path("3F005015", &df);
+
+	assert_int_equal(sc_lock(&s->card), SC_SUCCESS);
+	for (i = 0; i < sizeof(ins); i++) {
+		assert_int_equal(sc_select_file(&s->card, &ef, &file), SC_SUCCESS);
+		sc_file_free(file);
+		assert_int_equal(sc_select_file(&s->card, &df, NULL), SC_SUCCESS);
+		assert_non_null(s->card.cache.fci[0]);
+
+		sc_format_apdu(&s->card, &apdu, SC_APDU_CASE_1, ins[i], 0x00, 0x00);
+		assert_int_equal(sc_transmit_apdu(&s->card, &apdu), SC_SUCCESS);
+		assert_int_equal(s->card.cache.selected, 0);
+		assert_null(s->card.cache.fci[0]);
+
+		/* The FCI of the EF is asked for again */
+		apdus = 0;
+		assert_int_equal(sc_select_file(&s->card, &ef, &file), SC_SUCCESS);
+		assert_int_equal(apdus, 1);
+		assert_int_not_equal(last_p2, 0x0C);
+		sc_file_free(file);
+	}
+	assert_int_equal(sc_unlock(&s->card), SC_SUCCESS);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_select_cache,
+				setup, teardown),
+		cmocka_unit_test_setup_teardown(torture_select_cache_clear,
+				setup, teardown),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,265 @@
+/*
+ * piv-cache.c: Unit tests for the file cache of the PIV driver
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libopensc/internal.h"
+
+#define CERT_SIZE	600
+
+static char cache_dir[PATH_MAX], conf_file[PATH_MAX + 16];
+
+/* A PIV card with a CHUID and the certificate for PIV Authentication */
+static const u8 chuid[] = {
+	0x53, 0x12, 0x34, 0x10,
+	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+	0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10
+};
+static u8 cert[CERT_SIZE];
+
+static const u8 *pending;	/* left for GET RESPONSE */
+static size_t pending_len;
+static int pending_cert;
+static unsigned int cert_apdus;
+
+static void make_cert(u8 serial)
+{
+	size_t i;
+
+	/* 53 { 70 { certificate } 71 { 00 } FE { } } */
+	cert[0] = 0x53;
+	cert[1] = 0x82;
+	cert[2] = (CERT_SIZE - 4) >> 8;
+	cert[3] = (CERT_SIZE - 4) & 0xFF;
+	cert[4] = 0x70;
+	cert[5] = 0x82;
+	cert[6] = (CERT_SIZE - 13) >> 8;
+	cert[7] = (CERT_SIZE - 13) & 0xFF;
+	for (i = 8; i < CERT_SIZE - 5; i++)
+		cert[i] = (u8)i;
+	cert[20] = serial;
+	memcpy(cert + CERT_SIZE - 5, "\x71\x01\x00\xFE\x00", 5);
+}
+
+static void respond(sc_apdu_t *apdu)
+{
+	size_t len = MIN(pending_len, apdu->le ? apdu->le : 256);
+
+	len = MIN(len, apdu->resplen);
+	memcpy(apdu->resp, pending, len);
+	apdu->resplen = len;
+	pending += len;
+	pending_len -= len;
+	apdu->sw1 = pending_len ? 0x61 : 0x90;
+	apdu->sw2 = pending_len > 0xFF ? 0x00 : pending_len;
+}
+
+static int piv_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	static const u8 apt[] = {
+		0x61, 0x11, 0x4F, 0x06, 0x00, 0x00, 0x10, 0x00, 0x01, 0x00,
+		0x79, 0x07, 0x4F, 0x05, 0xA0, 0x00, 0x00, 0x03, 0x08
+	};
+
+	(void)reader;
+	if (apdu->ins == 0xC0) {
+		cert_apdus += pending_cert;
+		respond(apdu);
+		return SC_SUCCESS;
+	}
+	pending_len = 0;
+	pending_cert = 0;
+	if (apdu->ins == 0xA4 && apdu->p1 == 0x04) {
+		pending = apt;
+		pending_len = sizeof(apt);
+	} else if (apdu->ins == 0xCB && apdu->datalen == 5) {
+		if (memcmp(apdu->data, "\x5C\x03\x5F\xC1\x02", 5) == 0) {
+			pending = chuid;
+			pending_len = sizeof(chuid);
+		} else if (memcmp(apdu->data, "\x5C\x03\x5F\xC1\x05", 5) == 0) {
+			pending = cert;
+			pending_len = sizeof(cert);
+			pending_cert = 1;
+			cert_apdus++;
+		}
+	}
+	if (pending_len == 0) {
+		apdu->resplen = 0;
+		apdu->sw1 = 0x6A;
+		apdu->sw2 = 0x82;
+		return SC_SUCCESS;
+	}
+	respond(apdu);
+	return SC_SUCCESS;
+}
+
+static int fake_connect(sc_reader_t *reader)
+{
+	static const u8 atr[] = {0x3B, 0x80, 0x80, 0x01, 0x01};
+
+	memcpy(reader->atr.value, atr, sizeof(atr));
+	reader->atr.len = sizeof(atr);
+	return SC_SUCCESS;
+}
+
+static int fake_disconnect(sc_reader_t *reader)
+{
+	(void)reader;
+	return SC_SUCCESS;
+}
+
+static struct sc_reader_operations reader_ops = {
+	.connect = fake_connect,
+	.disconnect = fake_disconnect,
+	.transmit = piv_transmit,
+};
+
+struct piv_state {
+	sc_context_t *ctx;
+	sc_reader_t reader;
+};
+
+static int setup(void **state)
+{
+	struct piv_state *s;
+	FILE *f;
+
+	strcpy(cache_dir, "/tmp/opensc-piv-XXXXXX");
+	if (mkdtemp(cache_dir) == NULL)
+		return -1;
+	snprintf(conf_file, sizeof(conf_file), "%s/opensc.conf", cache_dir);
+	f = fopen(conf_file, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "app default {\n\tcard_driver PIV-II {\n\t\tuse_file_caching = true;\n\t}\n}\n");
+	fclose(f);
+	setenv("OPENSC_CONF", conf_file, 1);
+	setenv("XDG_CACHE_HOME", cache_dir, 1);
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL || sc_establish_context(&s->ctx, "pivcache") != SC_SUCCESS)
+		return -1;
+	if (sc_set_card_driver(s->ctx, "PIV-II") != SC_SUCCESS)
+		return -1;
+	s->reader.ctx = s->ctx;
+	s->reader.name = "Test Reader 00 00";
+	s->reader.ops = &reader_ops;
+	s->reader.flags = SC_READER_CARD_PRESENT;
+	s->reader.active_protocol = SC_PROTO_T1;
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct piv_state *s = *state;
+	char dname[PATH_MAX + 8], fname[PATH_MAX + 300];
+	struct dirent *de;
+	DIR *dir;
+
+	snprintf(dname, sizeof(dname), "%s/opensc", cache_dir);
+	dir = opendir(dname);
+	while (dir && (de = readdir(dir)) != NULL) {
+		snprintf(fname, sizeof(fname), "%s/%s", dname, de->d_name);
+		unlink(fname);
+	}
+	if (dir)
+		closedir(dir);
+	rmdir(dname);
+	unlink(conf_file);
+	rmdir(cache_dir);
+
+	sc_release_context(s->ctx);
+	free(s);
+	return 0;
+}
+
+static int count_cache_files(void)
+{
+	char dname[PATH_MAX + 8];
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	snprintf(dname, sizeof(dname), "%s/opensc", cache_dir);
+	dir = opendir(dname);
+	if (dir == NULL)
+		return 0;
+	while ((de = readdir(dir)) != NULL)
+		if (de->d_name[0] != '.')
+			n++;
+	closedir(dir);
+	return n;
+}
+
+/* Reads the certificate object in a new card handle, as a new process would */
+static void read_cert(struct piv_state *s)
+{
+	sc_card_t *card = NULL;
+	sc_file_t *file = NULL;
+	sc_path_t path;
+	u8 buf[CERT_SIZE];
+
+	assert_int_equal(sc_connect_card(&s->reader, &card), SC_SUCCESS);
+	sc_format_path("0101", &path);
+	cert_apdus = 0;
+	assert_int_equal(sc_select_file(card, &path, &file), SC_SUCCESS);
+	assert_int_equal(file->size, CERT_SIZE);
+	sc_file_free(file);
+	assert_int_equal(sc_read_binary(card, 0, buf, sizeof(buf), 0), CERT_SIZE);
+	assert_memory_equal(buf, cert, CERT_SIZE);
+	assert_int_equal(sc_disconnect_card(card), SC_SUCCESS);
+}
+
+static void torture_file_cache(void **state)
+{
+	struct piv_state *s = *state;
+	unsigned int card_apdus;
+
+	make_cert(1);
+	read_cert(s);
+	card_apdus = cert_apdus;
+	assert_true(card_apdus > 1);
+	assert_int_equal(count_cache_files(), 1);
+
+	/* Checked with the first response of the object only */
+	read_cert(s);
+	assert_int_equal(cert_apdus, 1);
+
+	/* Replaced on the card, with the same CHUID and length */
+	make_cert(2);
+	read_cert(s);
+	assert_int_equal(cert_apdus, 1 + card_apdus);
+
+	/* The file was written again with the new certificate */
+	read_cert(s);
+	assert_int_equal(cert_apdus, 1);
+	assert_int_equal(count_cache_files(), 1);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_file_cache, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
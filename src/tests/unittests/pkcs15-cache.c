@@ -0,0 +1,471 @@
+/*
+ * pkcs15-cache.c: Unit tests for the PKCS#15 file cache and object snapshot
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libopensc/internal.h"
+#include "libopensc/pkcs15.h"
+
+static char cache_dir[PATH_MAX];
+
+struct snapshot_state {
+	sc_context_t *ctx;
+	sc_reader_t reader;
+	sc_card_t card;
+};
+
+static int setup_snapshot(void **state)
+{
+	struct snapshot_state *s;
+
+	strcpy(cache_dir, "/tmp/opensc-snapshot-XXXXXX");
+	if (mkdtemp(cache_dir) == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	setenv("XDG_CACHE_HOME", cache_dir, 1);
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL || sc_establish_context(&s->ctx, "pkcs15cache") != SC_SUCCESS)
+		return -1;
+	s->reader.name = "Test Reader 00 00";
+	s->card.ctx = s->ctx;
+	s->card.reader = &s->reader;
+	*state = s;
+	return 0;
+}
+
+static int teardown_snapshot(void **state)
+{
+	struct snapshot_state *s = *state;
+	char dname[PATH_MAX + 8], fname[PATH_MAX + 300];
+	struct dirent *de;
+	DIR *dir;
+
+	snprintf(dname, sizeof(dname), "%s/opensc", cache_dir);
+	dir = opendir(dname);
+	while (dir && (de = readdir(dir)) != NULL) {
+		snprintf(fname, sizeof(fname), "%s/%s", dname, de->d_name);
+		unlink(fname);
+	}
+	if (dir)
+		closedir(dir);
+	rmdir(dname);
+	rmdir(cache_dir);
+
+	sc_release_context(s->ctx);
+	free(s);
+	return 0;
+}
+
+static struct sc_pkcs15_card *new_card(struct snapshot_state *s)
+{
+	struct sc_pkcs15_card *p15card = sc_pkcs15_card_new();
+	sc_path_t path;
+
+	assert_non_null(p15card);
+	p15card->card = &s->card;
+	p15card->opts.use_file_cache = SC_PKCS15_OPTS_CACHE_PUBLIC_FILES;
+	p15card->tokeninfo->serial_number = strdup("0011");
+	p15card->file_app = sc_file_new();
+	assert_non_null(p15card->file_app);
+	sc_format_path("3F005015", &p15card->file_app->path);
+
+	sc_format_path("3F0050154401", &path);
+	assert_int_equal(sc_pkcs15_add_df(p15card, SC_PKCS15_PRKDF, &path), SC_SUCCESS);
+	sc_format_path("3F0050154402", &path);
+	assert_int_equal(sc_pkcs15_add_df(p15card, SC_PKCS15_CDF, &path), SC_SUCCESS);
+	sc_format_path("3F0050154403", &path);
+	assert_int_equal(sc_pkcs15_add_df(p15card, SC_PKCS15_AODF, &path), SC_SUCCESS);
+	return p15card;
+}
+
+static struct sc_pkcs15_object *
+add_object(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df, unsigned int type,
+		const char *label, void *data)
+{
+	struct sc_pkcs15_object *obj = calloc(1, sizeof(*obj));
+
+	assert_non_null(obj);
+	obj->type = type;
+	strcpy(obj->label, label);
+	obj->data = data;
+	obj->df = df;
+	sc_pkcs15_add_object(p15card, obj);
+	df->enumerated = 1;
+	df->parsed = 1;
+	return obj;
+}
+
+static void fill_card(struct sc_pkcs15_card *p15card)
+{
+	struct sc_pkcs15_df *prkdf = p15card->df_list, *cdf = prkdf->next, *aodf = cdf->next;
+	struct sc_pkcs15_prkey_info *prkey = calloc(1, sizeof(*prkey));
+	struct sc_pkcs15_cert_info *cert = calloc(1, sizeof(*cert));
+	struct sc_pkcs15_auth_info *auth = calloc(1, sizeof(*auth));
+	struct sc_pkcs15_object *obj;
+
+	assert_non_null(prkey);
+	assert_non_null(cert);
+	assert_non_null(auth);
+
+	prkey->id.len = 1;
+	prkey->id.value[0] = 0x45;
+	prkey->modulus_length = 2048;
+	prkey->subject.value = (u8 *)strdup("subject");
+	prkey->subject.len = 7;
+	add_object(p15card, prkdf, SC_PKCS15_TYPE_PRKEY_RSA, "Key", prkey);
+
+	cert->id = prkey->id;
+	cert->value.value = (u8 *)strdup("certificate");
+	cert->value.len = 11;
+	add_object(p15card, cdf, SC_PKCS15_TYPE_CERT_X509, "Certificate", cert);
+
+	auth->auth_type = SC_PKCS15_PIN_AUTH_TYPE_PIN;
+	auth->attrs.pin.reference = 1;
+	auth->tries_left = 3;
+	auth->logged_in = SC_PIN_STATE_LOGGED_IN;
+	obj = add_object(p15card, aodf, SC_PKCS15_TYPE_AUTH_PIN, "PIN", auth);
+	/* The PIN cache must never make it to the disk */
+	obj->content.value = (u8 *)strdup("123456");
+	obj->content.len = 6;
+}
+
+static void torture_snapshot_roundtrip(void **state)
+{
+	struct snapshot_state *s = *state;
+	struct sc_pkcs15_card *p15card;
+	struct sc_pkcs15_object *obj;
+	struct sc_pkcs15_prkey_info *prkey;
+	struct sc_pkcs15_cert_info *cert;
+	struct sc_pkcs15_auth_info *auth;
+	struct sc_pkcs15_df *df;
+	int rv;
+
+	p15card = new_card(s);
+	fill_card(p15card);
+	rv = sc_pkcs15_cache_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	sc_pkcs15_card_free(p15card);
+
+	p15card = new_card(s);
+	rv = sc_pkcs15_read_cached_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	for (df = p15card->df_list; df; df = df->next)
+		assert_int_equal(df->enumerated, 1);
+
+	obj = p15card->obj_list;
+	assert_non_null(obj);
+	assert_int_equal(obj->type, SC_PKCS15_TYPE_PRKEY_RSA);
+	assert_string_equal(obj->label, "Key");
+	assert_ptr_equal(obj->df, p15card->df_list);
+	prkey = obj->data;
+	assert_int_equal(prkey->modulus_length, 2048);
+	assert_int_equal(prkey->subject.len, 7);
+	assert_memory_equal(prkey->subject.value, "subject", 7);
+
+	obj = obj->next;
+	assert_non_null(obj);
+	assert_string_equal(obj->label, "Certificate");
+	cert = obj->data;
+	assert_int_equal(cert->id.value[0], 0x45);
+	assert_int_equal(cert->value.len, 11);
+	assert_memory_equal(cert->value.value, "certificate", 11);
+
+	obj = obj->next;
+	assert_non_null(obj);
+	assert_string_equal(obj->label, "PIN");
+	assert_null(obj->content.value);
+	auth = obj->data;
+	assert_int_equal(auth->attrs.pin.reference, 1);
+	assert_int_equal(auth->tries_left, -1);
+	assert_int_equal(auth->logged_in, SC_PIN_STATE_UNKNOWN);
+	assert_null(obj->next);
+
+	sc_pkcs15_card_free(p15card);
+}
+
+static void torture_snapshot_df_mismatch(void **state)
+{
+	struct snapshot_state *s = *state;
+	struct sc_pkcs15_card *p15card;
+	int rv;
+
+	p15card = new_card(s);
+	fill_card(p15card);
+	rv = sc_pkcs15_cache_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	sc_pkcs15_card_free(p15card);
+
+	/* A DF already enumerated is not replaced by the snapshot */
+	p15card = new_card(s);
+	p15card->df_list->enumerated = 1;
+	rv = sc_pkcs15_read_cached_objects(p15card);
+	assert_int_equal(rv, SC_ERROR_CORRUPTED_DATA);
+	assert_null(p15card->obj_list);
+	assert_int_equal(p15card->df_list->next->enumerated, 0);
+	sc_pkcs15_card_free(p15card);
+}
+
+static void torture_snapshot_skips_unparsed(void **state)
+{
+	struct snapshot_state *s = *state;
+	struct sc_pkcs15_card *p15card;
+	int rv;
+
+	p15card = new_card(s);
+	fill_card(p15card);
+	/* The CDF could not be decoded completely */
+	p15card->df_list->next->parsed = 0;
+	rv = sc_pkcs15_cache_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	sc_pkcs15_card_free(p15card);
+
+	p15card = new_card(s);
+	rv = sc_pkcs15_read_cached_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(p15card->df_list->enumerated, 1);
+	assert_int_equal(p15card->df_list->next->enumerated, 0);
+	assert_string_equal(p15card->obj_list->label, "Key");
+	assert_string_equal(p15card->obj_list->next->label, "PIN");
+	sc_pkcs15_card_free(p15card);
+}
+
+static void torture_snapshot_corrupted(void **state)
+{
+	struct snapshot_state *s = *state;
+	struct sc_pkcs15_card *p15card;
+	char fname[PATH_MAX + 64];
+	FILE *f;
+	int rv;
+
+	p15card = new_card(s);
+	fill_card(p15card);
+	rv = sc_pkcs15_cache_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	sc_pkcs15_card_free(p15card);
+
+	snprintf(fname, sizeof(fname), "%s/opensc/0011_NODATE_5015_objects", cache_dir);
+	f = fopen(fname, "r+b");
+	assert_non_null(f);
+	fseek(f, 100, SEEK_SET);
+	fputc(fgetc(f) ^ 0xFF, f);
+	fclose(f);
+
+	p15card = new_card(s);
+	rv = sc_pkcs15_read_cached_objects(p15card);
+	assert_int_equal(rv, SC_ERROR_CORRUPTED_DATA);
+	assert_null(p15card->obj_list);
+	sc_pkcs15_card_free(p15card);
+}
+
+static int count_cache_files(void)
+{
+	char dname[PATH_MAX + 8];
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	snprintf(dname, sizeof(dname), "%s/opensc", cache_dir);
+	dir = opendir(dname);
+	assert_non_null(dir);
+	while ((de = readdir(dir)) != NULL)
+		if (de->d_name[0] != '.')
+			n++;
+	closedir(dir);
+	return n;
+}
+
+static void torture_snapshot_rewrite(void **state)
+{
+	struct snapshot_state *s = *state;
+	struct sc_pkcs15_card *p15card;
+	char fname[PATH_MAX + 64];
+	struct stat old_st, st;
+	FILE *f;
+	int rv;
+
+	p15card = new_card(s);
+	fill_card(p15card);
+	rv = sc_pkcs15_cache_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+
+	/* The snapshot is replaced, not truncated under its readers */
+	snprintf(fname, sizeof(fname), "%s/opensc/0011_NODATE_5015_objects", cache_dir);
+	f = fopen(fname, "rb");
+	assert_non_null(f);
+	rv = sc_pkcs15_cache_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	sc_pkcs15_card_free(p15card);
+	assert_int_equal(fstat(fileno(f), &old_st), 0);
+	assert_int_equal(stat(fname, &st), 0);
+	assert_true(old_st.st_ino != st.st_ino);
+	assert_int_equal(old_st.st_size, st.st_size);
+	fclose(f);
+	assert_int_equal(count_cache_files(), 1);
+
+	p15card = new_card(s);
+	rv = sc_pkcs15_read_cached_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_string_equal(p15card->obj_list->label, "Key");
+	sc_pkcs15_card_free(p15card);
+}
+
+static void torture_pack_files(void **state)
+{
+	struct snapshot_state *s = *state;
+	struct sc_pkcs15_card *p15card;
+	sc_path_t odf, tokeninfo, cert;
+	u8 *buf = NULL, small[4];
+	size_t len = 0;
+	int rv;
+
+	p15card = new_card(s);
+	p15card->use_file_cache_pack = 1;
+	sc_format_path("3F0050155031", &odf);
+	sc_format_path("3F0050155032", &tokeninfo);
+	sc_format_path("3F0050154402", &cert);
+
+	rv = sc_pkcs15_read_cached_file(p15card, &odf, &buf, &len);
+	assert_int_equal(rv, SC_ERROR_FILE_NOT_FOUND);
+
+	rv = sc_pkcs15_cache_file(p15card, &tokeninfo, (const u8 *)"tokeninfo", 9);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_pkcs15_cache_file(p15card, &odf, (const u8 *)"odf", 3);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_pkcs15_cache_file(p15card, &cert, (const u8 *)"certificate", 11);
+	assert_int_equal(rv, SC_SUCCESS);
+	/* Replaced in place */
+	rv = sc_pkcs15_cache_file(p15card, &odf, (const u8 *)"new odf", 7);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(count_cache_files(), 1);
+	sc_pkcs15_card_free(p15card);
+
+	/* Another process maps the same pack */
+	p15card = new_card(s);
+	p15card->use_file_cache_pack = 1;
+	rv = sc_pkcs15_read_cached_file(p15card, &odf, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, 7);
+	assert_memory_equal(buf, "new odf", 7);
+	free(buf);
+
+	buf = NULL;
+	rv = sc_pkcs15_read_cached_file(p15card, &tokeninfo, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, 9);
+	assert_memory_equal(buf, "tokeninfo", 9);
+	free(buf);
+
+	/* Part of a file into the caller's buffer */
+	cert.index = 4;
+	cert.count = 4;
+	buf = small;
+	len = sizeof(small);
+	rv = sc_pkcs15_read_cached_file(p15card, &cert, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_ptr_equal(buf, small);
+	assert_int_equal(len, 4);
+	assert_memory_equal(small, "ific", 4);
+
+	cert.index = 8;
+	rv = sc_pkcs15_read_cached_file(p15card, &cert, &buf, &len);
+	assert_int_equal(rv, SC_ERROR_FILE_NOT_FOUND);
+	sc_pkcs15_card_free(p15card);
+}
+
+static void torture_shared_cache(void **state)
+{
+	struct snapshot_state *s = *state;
+	struct sc_pkcs15_card *p15card, *other;
+	sc_path_t path;
+	u8 *buf = NULL;
+	size_t len = 0;
+	int rv;
+
+	p15card = new_card(s);
+	p15card->opts.use_file_cache = SC_PKCS15_OPTS_CACHE_NO_FILES;
+	p15card->use_shared_cache = 1;
+	fill_card(p15card);
+	rv = sc_pkcs15_shared_cache_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	sc_format_path("3F0050154402", &path);
+	rv = sc_pkcs15_shared_cache_file(p15card, &path, (const u8 *)"certificate", 11);
+	assert_int_equal(rv, SC_SUCCESS);
+
+	/* A card bound in another context gets the same content */
+	other = new_card(s);
+	other->use_shared_cache = 1;
+	rv = sc_pkcs15_shared_read_objects(other);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_string_equal(other->obj_list->label, "Key");
+	assert_ptr_equal(other->shared_entry, p15card->shared_entry);
+	rv = sc_pkcs15_shared_read_file(other, &path, &buf, &len);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, 11);
+	assert_memory_equal(buf, "certificate", 11);
+	free(buf);
+	sc_pkcs15_card_free(other);
+
+	/* A new lastUpdate replaces the entry */
+	other = new_card(s);
+	other->use_shared_cache = 1;
+	other->tokeninfo->last_update.gtime = strdup("20260101000000Z");
+	rv = sc_pkcs15_shared_read_objects(other);
+	assert_int_equal(rv, SC_ERROR_FILE_NOT_FOUND);
+	assert_null(other->obj_list);
+	sc_pkcs15_card_free(other);
+
+	/* The card in the reader changed */
+	rv = sc_pkcs15_shared_cache_objects(p15card);
+	assert_int_equal(rv, SC_SUCCESS);
+	sc_pkcs15_shared_cache_invalidate(s->reader.name);
+	other = new_card(s);
+	other->use_shared_cache = 1;
+	rv = sc_pkcs15_shared_read_objects(other);
+	assert_int_equal(rv, SC_ERROR_FILE_NOT_FOUND);
+	sc_pkcs15_card_free(other);
+
+	sc_pkcs15_card_free(p15card);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_snapshot_roundtrip,
+				setup_snapshot, teardown_snapshot),
+		cmocka_unit_test_setup_teardown(torture_snapshot_df_mismatch,
+				setup_snapshot, teardown_snapshot),
+		cmocka_unit_test_setup_teardown(torture_snapshot_skips_unparsed,
+				setup_snapshot, teardown_snapshot),
+		cmocka_unit_test_setup_teardown(torture_snapshot_corrupted,
+				setup_snapshot, teardown_snapshot),
+		cmocka_unit_test_setup_teardown(torture_snapshot_rewrite,
+				setup_snapshot, teardown_snapshot),
+		cmocka_unit_test_setup_teardown(torture_pack_files,
+				setup_snapshot, teardown_snapshot),
+		cmocka_unit_test_setup_teardown(torture_shared_cache,
+				setup_snapshot, teardown_snapshot),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,189 @@
+/*
+ * pkcs15-df-data.c: Unit tests for DF entries pointing into the DF contents
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/internal.h"
+#include "libopensc/pkcs15.h"
+
+#define CDF_PATH	"3F0050154403"
+
+/* Fake card with a single transparent EF holding the CDF */
+static u8 *cdf;
+static size_t cdf_len;
+
+static int cdf_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	u8 fcp[] = {0x62, 0x07, 0x80, 0x02, 0x00, 0x00, 0x82, 0x01, 0x01};
+	size_t offset = (apdu->p1 << 8) | apdu->p2, len = 0;
+
+	(void)reader;
+	if (apdu->ins == 0xA4) {
+		fcp[4] = (cdf_len >> 8) & 0xFF;
+		fcp[5] = cdf_len & 0xFF;
+		len = MIN(sizeof(fcp), apdu->resplen);
+		memcpy(apdu->resp, fcp, len);
+	} else if (apdu->ins == 0xB0 && offset < cdf_len) {
+		len = MIN(cdf_len - offset, apdu->le ? apdu->le : 256);
+		len = MIN(len, apdu->resplen);
+		memcpy(apdu->resp, cdf + offset, len);
+	}
+	apdu->resplen = len;
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	return SC_SUCCESS;
+}
+
+struct df_data_state {
+	sc_context_t *ctx;
+	sc_reader_t reader;
+	sc_card_t card;
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+};
+
+static int setup(void **state)
+{
+	struct df_data_state *s;
+
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	s = calloc(1, sizeof(*s));
+	if (s == NULL || sc_establish_context(&s->ctx, "pkcs15dfdata") != SC_SUCCESS)
+		return -1;
+	s->reader_ops.transmit = cdf_transmit;
+	s->reader.name = "Test Reader 00 00";
+	s->reader.ops = &s->reader_ops;
+	s->reader.active_protocol = SC_PROTO_T1;
+	s->card_ops = *sc_get_iso7816_driver()->ops;
+	s->card.ctx = s->ctx;
+	s->card.reader = &s->reader;
+	s->card.ops = &s->card_ops;
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct df_data_state *s = *state;
+
+	free(cdf);
+	cdf = NULL;
+	sc_release_context(s->ctx);
+	free(s);
+	return 0;
+}
+
+/* Two certificates stored in the CDF and one stored in an EF of its own */
+static void encode_cdf(struct df_data_state *s)
+{
+	struct sc_pkcs15_cert_info info;
+	struct sc_pkcs15_object obj;
+	struct sc_pkcs15_card *p15card;
+	sc_path_t path;
+	int i;
+
+	p15card = sc_pkcs15_card_new();
+	assert_non_null(p15card);
+	p15card->card = &s->card;
+	sc_format_path(CDF_PATH, &path);
+	assert_int_equal(sc_pkcs15_add_df(p15card, SC_PKCS15_CDF, &path), SC_SUCCESS);
+	for (i = 0; i < 3; i++) {
+		memset(&info, 0, sizeof(info));
+		memset(&obj, 0, sizeof(obj));
+		info.id.len = 1;
+		info.id.value[0] = i;
+		if (i < 2) {
+			info.value.len = 100 + i;
+			info.value.value = malloc(info.value.len);
+			assert_non_null(info.value.value);
+			memset(info.value.value, 0xC0 + i, info.value.len);
+		} else {
+			sc_format_path("3F0050154500", &info.path);
+		}
+		snprintf(obj.label, sizeof(obj.label), "Certificate %d", i);
+		assert_int_equal(sc_pkcs15emu_add_x509_cert(p15card, &obj, &info), SC_SUCCESS);
+	}
+	/* sc_pkcs15emu_add_x509_cert() puts them into the CDF of the card */
+	assert_int_equal(sc_pkcs15_encode_df(s->ctx, p15card, p15card->df_list,
+			&cdf, &cdf_len), SC_SUCCESS);
+	assert_true(cdf_len > 0);
+	sc_pkcs15_card_free(p15card);
+}
+
+static void torture_cdf_borrow(void **state)
+{
+	struct df_data_state *s = *state;
+	struct sc_pkcs15_cert_info *info[3];
+	struct sc_pkcs15_df_data *df_data = NULL;
+	struct sc_pkcs15_card *p15card;
+	struct sc_pkcs15_object *obj;
+	sc_path_t path;
+	size_t i, n = 0;
+
+	encode_cdf(s);
+
+	p15card = sc_pkcs15_card_new();
+	assert_non_null(p15card);
+	p15card->card = &s->card;
+	p15card->file_app = sc_file_new();
+	assert_non_null(p15card->file_app);
+	sc_format_path("3F005015", &p15card->file_app->path);
+	sc_format_path(CDF_PATH, &path);
+	assert_int_equal(sc_pkcs15_add_df(p15card, SC_PKCS15_CDF, &path), SC_SUCCESS);
+	assert_int_equal(sc_pkcs15_parse_df(p15card, p15card->df_list), SC_SUCCESS);
+
+	for (obj = p15card->obj_list; obj != NULL && n < 3; obj = obj->next)
+		info[n++] = obj->data;
+	assert_int_equal(n, 3);
+	assert_null(obj);
+
+	/* The stored certificates point into the same DF contents */
+	for (i = 0; i < 2; i++) {
+		assert_non_null(info[i]->value_data);
+		df_data = info[i]->value_data;
+		assert_int_equal(info[i]->value.len, 100 + i);
+		assert_true(info[i]->value.value >= df_data->data);
+		assert_true(info[i]->value.value + info[i]->value.len
+				<= df_data->data + df_data->len);
+		assert_int_equal(info[i]->value.value[0], 0xC0 + i);
+		assert_int_equal(info[i]->value.value[info[i]->value.len - 1], 0xC0 + i);
+	}
+	assert_ptr_equal(info[0]->value_data, info[1]->value_data);
+	assert_int_equal(df_data->refs, 2);
+	assert_null(info[2]->value_data);
+	assert_null(info[2]->value.value);
+
+	/* The contents are kept until the last certificate is freed */
+	obj = p15card->obj_list;
+	sc_pkcs15_remove_object(p15card, obj);
+	sc_pkcs15_free_object(obj);
+	assert_int_equal(df_data->refs, 1);
+	assert_int_equal(info[1]->value.value[0], 0xC1);
+
+	sc_pkcs15_card_free(p15card);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_cdf_borrow,
+				setup, teardown),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
@@ -0,0 +1,201 @@
+/*
+ * pkcs15-readahead.c: Unit tests for reading PKCS#15 directory files ahead
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/internal.h"
+#include "libopensc/pkcs15.h"
+
+/* A card with transparent EFs of EF_SIZE bytes in every DF */
+#define EF_SIZE	64
+
+struct readahead_state {
+	sc_context_t *ctx;
+	sc_reader_t reader;
+	sc_card_t card;
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+};
+
+static unsigned int apdus;
+
+static int ef_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	static const u8 fcp[] = {0x62, 0x07, 0x80, 0x02, 0x00, EF_SIZE, 0x82, 0x01, 0x01};
+	size_t offset = (apdu->p1 << 8) | apdu->p2, len = 0;
+
+	(void)reader;
+	apdus++;
+	if (apdu->ins == 0xA4) {
+		len = MIN(sizeof(fcp), apdu->resplen);
+		memcpy(apdu->resp, fcp, len);
+	} else if (apdu->ins == 0xB0 && offset < EF_SIZE) {
+		len = MIN(EF_SIZE - offset, apdu->le ? apdu->le : 256);
+		len = MIN(len, apdu->resplen);
+		/* Empty directory files */
+		memset(apdu->resp, 0, len);
+	}
+	apdu->resplen = len;
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	return SC_SUCCESS;
+}
+
+static int setup(void **state)
+{
+	struct readahead_state *s;
+
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	s = calloc(1, sizeof(*s));
+	if (s == NULL || sc_establish_context(&s->ctx, "pkcs15readahead") != SC_SUCCESS)
+		return -1;
+	s->reader_ops.transmit = ef_transmit;
+	s->reader.name = "Test Reader 00 00";
+	s->reader.ops = &s->reader_ops;
+	s->reader.active_protocol = SC_PROTO_T1;
+	s->card_ops = *sc_get_iso7816_driver()->ops;
+	s->card.ctx = s->ctx;
+	s->card.reader = &s->reader;
+	s->card.ops = &s->card_ops;
+	*state = s;
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct readahead_state *s = *state;
+
+	sc_release_context(s->ctx);
+	free(s);
+	return 0;
+}
+
+static struct sc_pkcs15_df *
+add_df(struct sc_pkcs15_card *p15card, unsigned int type, const char *str, int index)
+{
+	struct sc_pkcs15_df *df;
+	sc_path_t path;
+
+	sc_format_path(str, &path);
+	path.index = index;
+	path.count = EF_SIZE / 2;
+	assert_int_equal(sc_pkcs15_add_df(p15card, type, &path), SC_SUCCESS);
+	for (df = p15card->df_list; df->next != NULL; df = df->next)
+		;
+	return df;
+}
+
+static void torture_readahead(void **state)
+{
+	struct readahead_state *s = *state;
+	struct sc_pkcs15_search_key sk;
+	struct sc_pkcs15_card *p15card;
+	struct sc_pkcs15_df *df;
+	sc_path_t path;
+	u8 *buf = NULL;
+	size_t len = 0;
+	int rv;
+
+	p15card = sc_pkcs15_card_new();
+	assert_non_null(p15card);
+	p15card->card = &s->card;
+	add_df(p15card, SC_PKCS15_PRKDF, "3F0050154400", 0);
+	add_df(p15card, SC_PKCS15_CDF, "3F0050154400", EF_SIZE / 2);
+
+	/* Both DFs in the same EF with one SELECT and one READ BINARY */
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_CERT;
+	apdus = 0;
+	rv = sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
+	assert_int_equal(rv, 0);
+	assert_int_equal(apdus, 2);
+	for (df = p15card->df_list; df != NULL; df = df->next)
+		assert_true(df->enumerated);
+	/* Nothing is kept after the DFs were parsed */
+	assert_int_equal(p15card->readahead.active, 0);
+	assert_null(p15card->readahead.efs);
+
+	/* Single reads still go to the card */
+	sc_format_path("3F0050154400", &path);
+	path.count = EF_SIZE / 2;
+	apdus = 0;
+	rv = sc_pkcs15_read_file(p15card, &path, &buf, &len, 0);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_int_equal(len, EF_SIZE / 2);
+	assert_int_equal(apdus, 2);
+	free(buf);
+
+	sc_pkcs15_card_free(p15card);
+}
+
+static struct sc_pkcs15_df *parsed[4];
+static size_t parsed_count;
+
+static int record_parse_df(struct sc_pkcs15_card *p15card, struct sc_pkcs15_df *df)
+{
+	if (parsed_count < sizeof(parsed) / sizeof(parsed[0]))
+		parsed[parsed_count++] = df;
+	return sc_pkcs15_parse_df(p15card, df);
+}
+
+static void torture_readahead_interleaved(void **state)
+{
+	struct readahead_state *s = *state;
+	struct sc_pkcs15_search_key sk;
+	struct sc_pkcs15_card *p15card;
+	struct sc_pkcs15_df *prkdf, *cdf, *aodf;
+	int rv;
+
+	p15card = sc_pkcs15_card_new();
+	assert_non_null(p15card);
+	p15card->card = &s->card;
+	p15card->ops.parse_df = record_parse_df;
+	prkdf = add_df(p15card, SC_PKCS15_PRKDF, "3F0050154400", 0);
+	cdf = add_df(p15card, SC_PKCS15_CDF, "3F0050164400", 0);
+	aodf = add_df(p15card, SC_PKCS15_AODF, "3F0050154400", EF_SIZE / 2);
+
+	/* The DFs are parsed in the order of EF(ODF), the EF shared by the
+	 * first and the third one is still read only once */
+	memset(&sk, 0, sizeof(sk));
+	sk.class_mask = SC_PKCS15_SEARCH_CLASS_PRKEY | SC_PKCS15_SEARCH_CLASS_CERT
+		| SC_PKCS15_SEARCH_CLASS_AUTH;
+	apdus = 0;
+	parsed_count = 0;
+	rv = sc_pkcs15_search_objects(p15card, &sk, NULL, 0);
+	assert_int_equal(rv, 0);
+	assert_int_equal(apdus, 4);
+	assert_int_equal(parsed_count, 3);
+	assert_ptr_equal(parsed[0], prkdf);
+	assert_ptr_equal(parsed[1], cdf);
+	assert_ptr_equal(parsed[2], aodf);
+	assert_null(p15card->readahead.efs);
+
+	sc_pkcs15_card_free(p15card);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_readahead,
+				setup, teardown),
+		cmocka_unit_test_setup_teardown(torture_readahead_interleaved,
+				setup, teardown),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
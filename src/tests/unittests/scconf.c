@@ -0,0 +1,249 @@
+/*
+ * scconf.c: Unit tests for compiled configurations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+#include "scconf/scconf.h"
+
+static const char conf[] =
+	"app default {\n"
+	"	debug = 3;\n"
+	"	Debug = 5;\n"
+	"	card_driver piv { name = \"first\"; }\n"
+	"	card_atr 3b:00 { name = \"atr\"; }\n"
+	"	CARD_DRIVER openpgp { name = \"second\"; }\n"
+	"	card_driver piv { name = \"third\"; }\n"
+	"}\n"
+	"app opensc-pkcs11 { framework pkcs15 { use_file_caching = yes; } }\n";
+
+static int setup_conf(void **state)
+{
+	scconf_context *config = scconf_new(NULL);
+
+	if (config == NULL || scconf_parse_string(config, conf) != 1)
+		return -1;
+	*state = config;
+	return 0;
+}
+
+static int teardown_conf(void **state)
+{
+	scconf_free(*state);
+	return 0;
+}
+
+static void check_lookups(scconf_context *config)
+{
+	const scconf_block *app, *framework;
+	scconf_block **blocks;
+
+	blocks = scconf_find_blocks(config, NULL, "app", "default");
+	assert_non_null(blocks);
+	app = blocks[0];
+	assert_non_null(app);
+	assert_null(blocks[1]);
+	free(blocks);
+
+	/* The first value and the blocks in order, regardless of the case */
+	assert_int_equal(scconf_get_int(app, "DEBUG", 0), 3);
+	assert_int_equal(scconf_get_int(app, "missing", 7), 7);
+	blocks = scconf_find_blocks(config, app, "card_driver", NULL);
+	assert_non_null(blocks);
+	assert_string_equal(scconf_get_str(blocks[0], "name", NULL), "first");
+	assert_string_equal(scconf_get_str(blocks[1], "name", NULL), "second");
+	assert_string_equal(scconf_get_str(blocks[2], "name", NULL), "third");
+	assert_null(blocks[3]);
+	free(blocks);
+	blocks = scconf_find_blocks(config, app, "card_driver", "piv");
+	assert_non_null(blocks);
+	assert_string_equal(scconf_get_str(blocks[0], "name", NULL), "first");
+	assert_string_equal(scconf_get_str(blocks[1], "name", NULL), "third");
+	assert_null(blocks[2]);
+	free(blocks);
+	/* Values and blocks of the same name are told apart */
+	assert_null(scconf_find_list(app, "card_driver"));
+	assert_null(scconf_find_block(config, app, "debug"));
+
+	blocks = scconf_find_blocks(config, NULL, "app", "opensc-pkcs11");
+	assert_non_null(blocks);
+	framework = scconf_find_block(config, blocks[0], "framework");
+	free(blocks);
+	assert_non_null(framework);
+	assert_int_equal(scconf_get_bool(framework, "use_file_caching", 0), 1);
+}
+
+static void torture_compile_lookups(void **state)
+{
+	scconf_context *config = *state;
+
+	check_lookups(config);
+	assert_int_equal(scconf_compile(config), 1);
+	check_lookups(config);
+}
+
+static void torture_compile_add(void **state)
+{
+	scconf_context *config = *state;
+	scconf_block **blocks, *app;
+	scconf_list *name = NULL;
+
+	assert_int_equal(scconf_compile(config), 1);
+	blocks = scconf_find_blocks(config, NULL, "app", "default");
+	assert_non_null(blocks);
+	app = blocks[0];
+	free(blocks);
+
+	scconf_put_str(app, "lock_login", "true");
+	assert_int_equal(scconf_get_bool(app, "lock_login", 0), 1);
+	scconf_list_add(&name, "added");
+	assert_non_null(scconf_block_add(config, app, "card_driver", name));
+	scconf_list_destroy(name);
+	blocks = scconf_find_blocks(config, app, "card_driver", NULL);
+	assert_non_null(blocks);
+	assert_non_null(blocks[3]);
+	assert_string_equal(blocks[0]->name->data, "piv");
+	assert_string_equal(blocks[3]->name->data, "added");
+	assert_null(blocks[4]);
+	free(blocks);
+	assert_int_equal(scconf_get_int(app, "debug", 0), 3);
+}
+
+static char conf_file[PATH_MAX];
+
+static int write_conf(const char *text)
+{
+	FILE *f = fopen(conf_file, "w");
+
+	if (f == NULL || fputs(text, f) < 0 || fclose(f) != 0)
+		return -1;
+	return 0;
+}
+
+static void torture_shared_conf(void **state)
+{
+	sc_context_t *ctx1 = NULL, *ctx2 = NULL;
+	int fd;
+
+	(void)state;
+	strcpy(conf_file, "/tmp/opensc-conf-XXXXXX");
+	fd = mkstemp(conf_file);
+	assert_true(fd >= 0);
+	close(fd);
+	assert_int_equal(write_conf("app default { card_drivers = old; }\n"), 0);
+	setenv("OPENSC_CONF", conf_file, 1);
+
+	/* Parsed once for both contexts */
+	assert_int_equal(sc_establish_context(&ctx1, "scconf"), SC_SUCCESS);
+	assert_int_equal(sc_establish_context(&ctx2, "scconf"), SC_SUCCESS);
+	assert_non_null(ctx1->conf);
+	assert_ptr_equal(ctx1->conf, ctx2->conf);
+	sc_release_context(ctx2);
+	assert_string_equal(scconf_get_str(ctx1->conf_blocks[0], "card_drivers", NULL), "old");
+
+	/* Parsed again after the file changed, the old one is still in use */
+	assert_int_equal(write_conf("app default { card_drivers = internal; }\n"), 0);
+	assert_int_equal(sc_establish_context(&ctx2, "scconf"), SC_SUCCESS);
+	assert_string_equal(scconf_get_str(ctx2->conf_blocks[0], "card_drivers", NULL), "internal");
+	assert_string_equal(scconf_get_str(ctx1->conf_blocks[0], "card_drivers", NULL), "old");
+	sc_release_context(ctx1);
+	sc_release_context(ctx2);
+	unlink(conf_file);
+}
+
+static void torture_private_conf(void **state)
+{
+	sc_context_t *ctx1 = NULL, *ctx2 = NULL;
+	sc_context_param_t ctx_param;
+	int fd;
+
+	(void)state;
+	strcpy(conf_file, "/tmp/opensc-conf-XXXXXX");
+	fd = mkstemp(conf_file);
+	assert_true(fd >= 0);
+	close(fd);
+	assert_int_equal(write_conf("app default { card_drivers = old; }\n"), 0);
+	setenv("OPENSC_CONF", conf_file, 1);
+
+	/* Changes to a private configuration are not seen by other contexts */
+	assert_int_equal(sc_establish_context(&ctx1, "scconf"), SC_SUCCESS);
+	memset(&ctx_param, 0, sizeof(ctx_param));
+	ctx_param.app_name = "scconf";
+	ctx_param.flags = SC_CTX_FLAG_PRIVATE_CONF;
+	assert_int_equal(sc_context_create(&ctx2, &ctx_param), SC_SUCCESS);
+	assert_non_null(ctx2->conf);
+	assert_ptr_not_equal(ctx1->conf, ctx2->conf);
+	scconf_put_str(ctx2->conf_blocks[0], "card_drivers", "internal");
+	assert_string_equal(scconf_get_str(ctx1->conf_blocks[0], "card_drivers", NULL), "old");
+	sc_release_context(ctx2);
+	assert_string_equal(scconf_get_str(ctx1->conf_blocks[0], "card_drivers", NULL), "old");
+	sc_release_context(ctx1);
+	unlink(conf_file);
+}
+
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+static void torture_conf_mtime_nsec(void **state)
+{
+	struct timespec times[2] = {{1000000000, 1}, {1000000000, 1}};
+	sc_context_t *ctx1 = NULL, *ctx2 = NULL;
+	int fd;
+
+	(void)state;
+	strcpy(conf_file, "/tmp/opensc-conf-XXXXXX");
+	fd = mkstemp(conf_file);
+	assert_true(fd >= 0);
+	close(fd);
+	assert_int_equal(write_conf("app default { card_drivers = old; }\n"), 0);
+	assert_int_equal(utimensat(AT_FDCWD, conf_file, times, 0), 0);
+	setenv("OPENSC_CONF", conf_file, 1);
+	assert_int_equal(sc_establish_context(&ctx1, "scconf"), SC_SUCCESS);
+
+	/* Rewritten with the same size in the same second */
+	assert_int_equal(write_conf("app default { card_drivers = new; }\n"), 0);
+	times[0].tv_nsec = times[1].tv_nsec = 2;
+	assert_int_equal(utimensat(AT_FDCWD, conf_file, times, 0), 0);
+	assert_int_equal(sc_establish_context(&ctx2, "scconf"), SC_SUCCESS);
+	assert_ptr_not_equal(ctx1->conf, ctx2->conf);
+	assert_string_equal(scconf_get_str(ctx2->conf_blocks[0], "card_drivers", NULL), "new");
+	sc_release_context(ctx1);
+	sc_release_context(ctx2);
+	unlink(conf_file);
+}
+#endif
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_compile_lookups,
+				setup_conf, teardown_conf),
+		cmocka_unit_test_setup_teardown(torture_compile_add,
+				setup_conf, teardown_conf),
+		cmocka_unit_test(torture_shared_conf),
+		cmocka_unit_test(torture_private_conf),
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+		cmocka_unit_test(torture_conf_mtime_nsec),
+#endif
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
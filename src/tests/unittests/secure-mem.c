@@ -0,0 +1,118 @@
+/*
+ * secure-mem.c: Unit tests for the pools of sc_mem_secure_alloc()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/opensc.h"
+
+#define MANY	2048
+
+static void assert_zero(const u8 *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		assert_int_equal(p[i], 0);
+}
+
+static void torture_secure_zeroed(void **state)
+{
+	struct sc_mem_secure_stats before, after;
+	u8 *a, *b, *c;
+
+	(void)state;
+	assert_int_equal(sc_mem_secure_get_stats(&before), SC_SUCCESS);
+	a = sc_mem_secure_alloc(8);
+	b = sc_mem_secure_alloc(100);
+	assert_non_null(a);
+	assert_non_null(b);
+	assert_true(a + 8 <= b || b + 100 <= a);
+	assert_zero(a, 8);
+	assert_zero(b, 100);
+	assert_int_equal(sc_mem_secure_get_stats(&after), SC_SUCCESS);
+	assert_int_equal(after.pool_allocs - before.pool_allocs, 2);
+	assert_int_equal(after.pool_used_bytes - before.pool_used_bytes, 32 + 128);
+
+	/* The freed memory is wiped and handed out first again */
+	memset(b, 0xA5, 100);
+	sc_mem_secure_free(b, 100);
+	c = sc_mem_secure_alloc(90);
+	assert_ptr_equal(b, c);
+	assert_zero(c, 100);
+
+	sc_mem_secure_free(c, 90);
+	sc_mem_secure_free(a, 8);
+	assert_int_equal(sc_mem_secure_get_stats(&after), SC_SUCCESS);
+	assert_int_equal(after.pool_used_bytes, before.pool_used_bytes);
+}
+
+static void torture_secure_large(void **state)
+{
+	struct sc_mem_secure_stats before, after;
+	u8 *p;
+
+	(void)state;
+	assert_int_equal(sc_mem_secure_get_stats(&before), SC_SUCCESS);
+	p = sc_mem_secure_alloc(65536);
+	assert_non_null(p);
+	assert_zero(p, 65536);
+	sc_mem_secure_free(p, 65536);
+	assert_int_equal(sc_mem_secure_get_stats(&after), SC_SUCCESS);
+	assert_int_equal(after.page_allocs - before.page_allocs, 1);
+	assert_int_equal(after.pool_used_bytes, before.pool_used_bytes);
+}
+
+static void torture_secure_pools(void **state)
+{
+	struct sc_mem_secure_stats before, after;
+	u8 **p;
+	int i;
+
+	(void)state;
+	p = calloc(MANY, sizeof(*p));
+	assert_non_null(p);
+	assert_int_equal(sc_mem_secure_get_stats(&before), SC_SUCCESS);
+	for (i = 0; i < MANY; i++) {
+		p[i] = sc_mem_secure_alloc(24);
+		assert_non_null(p[i]);
+		memset(p[i], 0x5A, 24);
+	}
+	assert_int_equal(sc_mem_secure_get_stats(&after), SC_SUCCESS);
+	assert_true(after.pools > 1);
+	assert_true(after.pool_peak_bytes >= before.pool_used_bytes + MANY * 32);
+
+	for (i = 0; i < MANY; i += 2)
+		sc_mem_secure_free(p[i], 24);
+	for (i = 1; i < MANY; i += 2)
+		sc_mem_secure_free(p[i], 24);
+	assert_int_equal(sc_mem_secure_get_stats(&after), SC_SUCCESS);
+	assert_int_equal(after.pool_used_bytes, before.pool_used_bytes);
+	assert_int_equal(after.pools, 1);
+	free(p);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test(torture_secure_zeroed),
+		cmocka_unit_test(torture_secure_large),
+		cmocka_unit_test(torture_secure_pools),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
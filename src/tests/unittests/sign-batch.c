@@ -0,0 +1,206 @@
+/*
+ * sign-batch.c: Unit tests for sc_pkcs15_compute_signatures()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "torture.h"
+#include "libopensc/internal.h"
+#include "libopensc/pkcs15.h"
+
+#define BATCH		8
+#define KEY_REF		0x05
+#define DEFAULT_KEY	0x01
+
+/* Fake card: MSE:SET selects the key, PSO:CDS answers with the key
+ * reference in every byte of the signature */
+struct fake_card {
+	int forget_env;		/* go back to the default key after each PSO */
+	int fail_default;	/* refuse to sign with the default key */
+	u8 key;
+	int mse, pso;
+};
+
+static struct fake_card fake;
+
+static int fake_transmit(sc_reader_t *reader, sc_apdu_t *apdu)
+{
+	size_t i, len = 0;
+
+	(void)reader;
+	apdu->sw1 = 0x90;
+	apdu->sw2 = 0x00;
+	if (apdu->ins == 0x22 && apdu->p1 == 0x41) {
+		fake.mse++;
+		for (i = 0; i + 2 < apdu->datalen; i += 2 + apdu->data[i + 1]) {
+			if (apdu->data[i] == 0x84 && apdu->data[i + 1] == 1)
+				fake.key = apdu->data[i + 2];
+		}
+	} else if (apdu->ins == 0x2A && apdu->p1 == 0x9E) {
+		fake.pso++;
+		if (fake.fail_default && fake.key == DEFAULT_KEY) {
+			apdu->sw1 = 0x6A;
+			apdu->sw2 = 0x88;
+		} else {
+			len = apdu->le < apdu->resplen ? apdu->le : apdu->resplen;
+			memset(apdu->resp, fake.key, len);
+		}
+		if (fake.forget_env)
+			fake.key = DEFAULT_KEY;
+	}
+	apdu->resplen = len;
+	return SC_SUCCESS;
+}
+
+struct sign_batch_state {
+	struct sc_reader_operations reader_ops;
+	struct sc_card_operations card_ops;
+	struct sc_pkcs15_prkey_info prkey;
+	struct sc_pkcs15_object obj;
+	struct sc_pkcs15_card *p15card;
+	sc_algorithm_info_t alg;
+	sc_context_t *ctx;
+	sc_reader_t reader;
+	sc_card_t card;
+};
+
+static int setup_sign_batch(void **state)
+{
+	struct sign_batch_state *s = calloc(1, sizeof(struct sign_batch_state));
+
+	if (s == NULL)
+		return -1;
+	setenv("OPENSC_CONF", "/nonexistent", 1);
+	if (sc_establish_context(&s->ctx, "signbatch") != SC_SUCCESS)
+		return -1;
+	s->reader_ops.transmit = fake_transmit;
+	s->reader.ctx = s->ctx;
+	s->reader.name = "Test Reader 00 00";
+	s->reader.ops = &s->reader_ops;
+	s->reader.active_protocol = SC_PROTO_T1;
+
+	s->alg.algorithm = SC_ALGORITHM_RSA;
+	s->alg.key_length = 2048;
+	s->alg.flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+
+	s->card_ops = *sc_get_iso7816_driver()->ops;
+	s->card.ctx = s->ctx;
+	s->card.reader = &s->reader;
+	s->card.ops = &s->card_ops;
+	s->card.algorithms = &s->alg;
+	s->card.algorithm_count = 1;
+
+	s->prkey.usage = SC_PKCS15_PRKEY_USAGE_SIGN;
+	s->prkey.native = 1;
+	s->prkey.key_reference = KEY_REF;
+	s->prkey.modulus_length = 2048;
+	s->obj.type = SC_PKCS15_TYPE_PRKEY_RSA;
+	s->obj.data = &s->prkey;
+
+	s->p15card = sc_pkcs15_card_new();
+	if (s->p15card == NULL)
+		return -1;
+	s->p15card->card = &s->card;
+
+	memset(&fake, 0, sizeof(fake));
+	fake.key = DEFAULT_KEY;
+	*state = s;
+	return 0;
+}
+
+static int teardown_sign_batch(void **state)
+{
+	struct sign_batch_state *s = *state;
+
+	s->p15card->card = NULL;
+	sc_pkcs15_card_free(s->p15card);
+	sc_release_context(s->ctx);
+	free(s);
+	return 0;
+}
+
+/* Signs a batch and checks that every signature was made with KEY_REF */
+static void sign_batch(struct sign_batch_state *s)
+{
+	struct sc_pkcs15_sign_request requests[BATCH];
+	unsigned long flags = SC_ALGORITHM_RSA_PAD_PKCS1 | SC_ALGORITHM_RSA_HASH_NONE;
+	u8 digest[35], sig[BATCH][256], expected[256];
+	int i;
+
+	memset(digest, 0x11, sizeof(digest));
+	memset(expected, KEY_REF, sizeof(expected));
+	for (i = 0; i < BATCH; i++) {
+		requests[i].in = digest;
+		requests[i].inlen = sizeof(digest);
+		requests[i].out = sig[i];
+		requests[i].outlen = sizeof(sig[i]);
+	}
+	assert_int_equal(sc_pkcs15_compute_signatures(s->p15card, &s->obj, flags,
+			requests, BATCH, NULL), BATCH);
+	for (i = 0; i < BATCH; i++) {
+		assert_int_equal(requests[i].outlen, sizeof(sig[i]));
+		assert_memory_equal(sig[i], expected, sizeof(expected));
+	}
+}
+
+/* A card that drops the environment after each PSO gets MSE every time */
+static void torture_sign_batch_forget_env(void **state)
+{
+	struct sign_batch_state *s = *state;
+
+	fake.forget_env = 1;
+	sign_batch(s);
+	assert_int_equal(fake.mse, BATCH);
+	assert_int_equal(fake.pso, BATCH);
+}
+
+/* A driver that keeps the environment sends it once per batch */
+static void torture_sign_batch_keep_env(void **state)
+{
+	struct sign_batch_state *s = *state;
+
+	s->card.caps |= SC_CARD_CAP_KEEPS_SECURITY_ENV;
+	sign_batch(s);
+	assert_int_equal(fake.mse, 1);
+	assert_int_equal(fake.pso, BATCH);
+}
+
+/* A refused PSO without MSE falls back to the full setup */
+static void torture_sign_batch_keep_env_fallback(void **state)
+{
+	struct sign_batch_state *s = *state;
+
+	s->card.caps |= SC_CARD_CAP_KEEPS_SECURITY_ENV;
+	fake.forget_env = 1;
+	fake.fail_default = 1;
+	sign_batch(s);
+	assert_int_equal(fake.mse, BATCH);
+	assert_int_equal(fake.pso, 2 * BATCH - 1);
+}
+
+int main(void)
+{
+	int rc;
+	struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(torture_sign_batch_forget_env,
+			setup_sign_batch, teardown_sign_batch),
+		cmocka_unit_test_setup_teardown(torture_sign_batch_keep_env,
+			setup_sign_batch, teardown_sign_batch),
+		cmocka_unit_test_setup_teardown(torture_sign_batch_keep_env_fallback,
+			setup_sign_batch, teardown_sign_batch),
+	};
+
+	rc = cmocka_run_group_tests(tests, NULL, NULL);
+	return rc;
+}
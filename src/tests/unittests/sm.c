@@ -172,6 +172,53 @@ static void torture_sm_crypt_des_cbc3_force_pad(void **state)
 	free(out);
 }
 
+static void torture_sc_sm_cipher_des_cbc3(void **state)
+{
+	/* same vectors as torture_sm_crypt_des_cbc3_multiblock, padded */
+	sc_context_t *ctx = *state;
+	unsigned char key[] = {
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, /* KEY1 */
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, /* KEY2 */};
+	unsigned char iv[8] = {0};
+	unsigned char plain[] = {
+		0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char ciphertext[] = {
+		0x95, 0xF8, 0xA5, 0xE5, 0xDD, 0x31, 0xD9, 0x00,
+		0xAF, 0xA0, 0x77, 0x1d, 0x35, 0xE1, 0xCC, 0x26};
+	unsigned char out[sizeof(ciphertext)];
+	struct sm_cipher enc = {0}, dec = {0};
+	int rv;
+
+	rv = sc_sm_cipher_init(ctx, &enc, "DES-EDE-CBC", key, 1);
+	assert_int_equal(rv, SC_SUCCESS);
+	rv = sc_sm_cipher_init(ctx, &dec, "DES-EDE-CBC", key, 0);
+	assert_int_equal(rv, SC_SUCCESS);
+
+	/* the IV is reset for every message */
+	rv = sc_sm_cipher_crypt(&enc, iv, plain, sizeof(plain), out);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_memory_equal(out, ciphertext, sizeof(ciphertext));
+	rv = sc_sm_cipher_crypt(&enc, iv, plain, sizeof(plain), out);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_memory_equal(out, ciphertext, sizeof(ciphertext));
+
+	/* in place */
+	rv = sc_sm_cipher_crypt(&dec, iv, out, sizeof(out), out);
+	assert_int_equal(rv, SC_SUCCESS);
+	assert_memory_equal(out, plain, sizeof(plain));
+
+	/* only whole blocks */
+	rv = sc_sm_cipher_crypt(&enc, iv, plain, 9, out);
+	assert_int_equal(rv, SC_ERROR_INVALID_ARGUMENTS);
+
+	sc_sm_cipher_free(&enc);
+	sc_sm_cipher_free(&dec);
+	assert_null(enc.evp_ctx);
+	/* freeing twice is harmless */
+	sc_sm_cipher_free(&enc);
+}
+
 static void torture_sm_encrypt_des_ecb3(void **state)
 {
 	sc_context_t *ctx = *state;
@@ -354,6 +401,9 @@ int main(void)
 			setup_sc_context, teardown_sc_context),
 		cmocka_unit_test_setup_teardown(torture_sm_crypt_des_cbc3_force_pad,
 			setup_sc_context, teardown_sc_context),
+		/* sc_sm_cipher_init and sc_sm_cipher_crypt */
+		cmocka_unit_test_setup_teardown(torture_sc_sm_cipher_des_cbc3,
+			setup_sc_context, teardown_sc_context),
 		/* sm_encrypt_des_ecb3 */
 		cmocka_unit_test_setup_teardown(torture_sm_encrypt_des_ecb3,
 			setup_sc_context, teardown_sc_context),
@@ -52,7 +52,10 @@ enum {
 	OPT_SERIAL = 0x100,
 	OPT_LIST_ALG,
 	OPT_VERSION,
-	OPT_RESET
+	OPT_RESET,
+	OPT_TRACE,
+	OPT_PRINT_TRACE,
+	OPT_LATENCY
 };
 
 static const struct option options[] = {
@@ -72,6 +75,9 @@ static const struct option options[] = {
 	{ "card-driver",	1, NULL,		'c' },
 	{ "list-algorithms",    0, NULL,	OPT_LIST_ALG },
 	{ "wait",		0, NULL,		'w' },
+	{ "trace",		0, NULL,	OPT_TRACE },
+	{ "print-trace",	1, NULL,	OPT_PRINT_TRACE },
+	{ "latency",		0, NULL,	OPT_LATENCY },
 	{ "verbose",		0, NULL,		'v' },
 	{ NULL, 0, NULL, 0 }
 };
@@ -93,6 +99,9 @@ static const char *option_help[] = {
 	"Forces a card driver (use '?' for list)",
 	"Lists algorithms supported by card",
 	"Wait for a card to be inserted",
+	"Prints the APDUs sent by this command at exit",
+	"Prints an APDU trace written on SIGUSR2",
+	"Prints latency statistics of this command at exit",
 	"Verbose operation, may be used several times",
 };
 
@@ -693,10 +702,13 @@ int main(int argc, char *argv[])
 	int do_print_name = 0;
 	int do_list_algorithms = 0;
 	int do_reset = 0;
+	int do_trace = 0;
+	int do_latency = 0;
 	int action_count = 0;
 	const char *opt_driver = NULL;
 	const char *opt_conf_entry = NULL;
 	const char *opt_reset_type = NULL;
+	const char *opt_trace_file = NULL;
 	char **p;
 	struct sc_reader *reader = NULL;
 	sc_context_param_t ctx_param;
@@ -793,6 +805,16 @@ int main(int argc, char *argv[])
 			opt_reset_type = optarg;
 			action_count++;
 			break;
+		case OPT_TRACE:
+			do_trace = 1;
+			break;
+		case OPT_PRINT_TRACE:
+			opt_trace_file = optarg;
+			action_count++;
+			break;
+		case OPT_LATENCY:
+			do_latency = 1;
+			break;
 		}
 	}
 	if (action_count == 0)
@@ -808,9 +830,26 @@ int main(int argc, char *argv[])
 		action_count--;
 	}
 
+	if (opt_trace_file) {
+		r = sc_apdu_trace_print_file(opt_trace_file, stdout);
+		if (r < 0) {
+			fprintf(stderr, "Failed to read APDU trace: %s\n", sc_strerror(r));
+			return 1;
+		}
+		action_count--;
+	}
+
+	if (do_trace && sc_apdu_trace_enable(256, 0, NULL) != SC_SUCCESS) {
+		fprintf(stderr, "Failed to enable APDU tracing\n");
+		return 1;
+	}
+
 	memset(&ctx_param, 0, sizeof(ctx_param));
 	ctx_param.ver      = 0;
 	ctx_param.app_name = app_name;
+	/* The configuration is changed and written back */
+	if (do_set_conf_entry)
+		ctx_param.flags |= SC_CTX_FLAG_PRIVATE_CONF;
 
 	r = sc_context_create(&ctx, &ctx_param);
 	if (r) {
@@ -820,6 +859,12 @@ int main(int argc, char *argv[])
 
 	ctx->flags |= SC_CTX_FLAG_ENABLE_DEFAULT_DRIVER;
 
+	if (do_latency && sc_latency_enable(ctx, NULL) != SC_SUCCESS) {
+		fprintf(stderr, "Failed to enable latency statistics\n");
+		err = 1;
+		goto end;
+	}
+
 	if (do_get_conf_entry) {
 		if ((err = opensc_get_conf_entry (opt_conf_entry)))
 			goto end;
@@ -922,6 +967,10 @@ int main(int argc, char *argv[])
 	}
 end:
 	sc_disconnect_card(card);
+	if (do_latency)
+		sc_latency_print(ctx, stdout);
 	sc_release_context(ctx);
+	if (do_trace)
+		sc_apdu_trace_print(stdout);
 	return err;
 }
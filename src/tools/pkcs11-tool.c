@@ -30,6 +30,7 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 #include <unistd.h>
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
@@ -94,6 +95,7 @@ extern CK_FUNCTION_LIST_3_0 pkcs11_function_list_3_0;
 
 #if defined(_WIN32) || defined(HAVE_PTHREAD)
 #define MAX_TEST_THREADS 10
+#define TEST_THREADS_SIGNATURES 20
 #endif
 
 #define NEED_SESSION_RO	0x01
@@ -456,9 +458,11 @@ static pthread_t test_threads_handles[MAX_TEST_THREADS];
 struct test_threads_data {
 	int tnum;
 	char * tests;
+	CK_RV rv;
 };
 static struct test_threads_data test_threads_datas[MAX_TEST_THREADS];
 static int test_threads_num = 0;
+static unsigned long test_threads_started_ms;
 #endif /* defined(_WIN32) || defined(HAVE_PTHREAD) */
 
 struct flag_info {
@@ -601,6 +605,8 @@ static void		test_fork(void);
 static void		test_threads();
 static int		test_threads_start(int tnum);
 static int		test_threads_cleanup();
+static unsigned long	test_threads_time_ms(void);
+static CK_RV		test_threads_sign(int tnum, CK_SLOT_ID slot);
 #ifdef _WIN32
 static DWORD WINAPI	test_threads_run(_In_ LPVOID pttd);
 #else
@@ -1505,7 +1511,8 @@ end:
 		 * initialized so that the command line options allow detailed
 		 * configuration when running with `--test-threads LT` */
 		test_threads();
-		test_threads_cleanup();
+		if (test_threads_cleanup())
+			err = 1;
 	}
 #endif /* defined(_WIN32) || defined(HAVE_PTHREAD) */
 
@@ -8639,6 +8646,20 @@ static void * test_threads_run(void * pttd)
 			}
 		}
 
+		/* Xn sign TEST_THREADS_SIGNATURES times with the first private key
+		 * of slot_index n, where n is 0 to 9, and report the throughput and
+		 * when the signing started and ended, in ms since the threads were
+		 * started. May be combined with `--pin=123456` */
+		else if (*pctest == 'X' && *(pctest + 1) >= '0' && *(pctest + 1) <= '9') {
+			if (l_slots && (CK_ULONG)(*(pctest + 1) - '0') < l_p11_num_slots) {
+				rv = test_threads_sign(ttd->tnum, l_p11_slots[(*(pctest + 1) - '0')]);
+			} else {
+				fprintf(stderr, "Test thread %d slot not available, unable to sign\n", ttd->tnum);
+				rv = CKR_TOKEN_NOT_PRESENT;
+				break;
+			}
+		}
+
 		/* LT login and test, just like as if `--login --test` was specified.
 		 * May be combined with `--pin=123456` */
 		else if (*pctest == 'L' && *(pctest + 1) == 'T') {
@@ -8646,9 +8667,11 @@ static void * test_threads_run(void * pttd)
 
 			rv = p11->C_OpenSession(opt_slot, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &session);
 			if (rv == CKR_OK) {
-				if (opt_login_type == -1)
-					opt_login_type = CKU_USER;
-				login(session, opt_login_type);
+				int login_type = opt_login_type;
+
+				if (login_type == -1)
+					login_type = CKU_USER;
+				login(session, login_type);
 
 				if (p11_test(session))
 					rv = CKR_GENERAL_ERROR;
@@ -8678,6 +8701,7 @@ static void * test_threads_run(void * pttd)
 
 	free(l_p11_slots);
 	fprintf(stderr, "Test thread %d returning rv:%s\n", ttd->tnum, CKR2Str(rv));
+	ttd->rv = rv == CKR_CRYPTOKI_ALREADY_INITIALIZED ? CKR_OK : rv;
 #ifdef _WIN32
 	ExitThread(0);
 #else
@@ -8685,10 +8709,80 @@ static void * test_threads_run(void * pttd)
 #endif
 }
 
-static int test_threads_cleanup()
+static unsigned long test_threads_time_ms(void)
 {
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timeval tv;
 
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+static CK_RV test_threads_sign(int tnum, CK_SLOT_ID slot)
+{
+	CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+	CK_OBJECT_HANDLE key;
+	CK_MECHANISM mech = { CKM_RSA_PKCS, NULL, 0 };
+	CK_BYTE data[32];
+	CK_BYTE sig[1024];
+	CK_ULONG sig_len;
+	unsigned long start, elapsed;
+	int login_type = opt_login_type;
 	int i;
+	CK_RV rv;
+
+	memset(data, 0x5A, sizeof(data));
+
+	rv = p11->C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "Test thread %d C_OpenSession returned %s\n", tnum, CKR2Str(rv));
+		return rv;
+	}
+	if (login_type == -1)
+		login_type = CKU_USER;
+	login(session, login_type);
+
+	if (!find_object(session, CKO_PRIVATE_KEY, &key, NULL, 0, 0)) {
+		fprintf(stderr, "Test thread %d no private key found on slot 0x%lx\n", tnum, slot);
+		rv = CKR_KEY_HANDLE_INVALID;
+		goto out;
+	}
+	if (getKEY_TYPE(session, key) == CKK_EC)
+		mech.mechanism = CKM_ECDSA;
+
+	start = test_threads_time_ms();
+	for (i = 0; i < TEST_THREADS_SIGNATURES; i++) {
+		rv = p11->C_SignInit(session, &mech, key);
+		if (rv == CKR_OK) {
+			sig_len = sizeof(sig);
+			rv = p11->C_Sign(session, data, sizeof(data), sig, &sig_len);
+		}
+		if (rv != CKR_OK)
+			break;
+	}
+	elapsed = test_threads_time_ms() - start;
+
+	if (rv == CKR_OK)
+		fprintf(stderr, "Test thread %d slot 0x%lx %d signatures in %lu ms (%.1f signatures/s) from %lu to %lu ms\n",
+			tnum, slot, i, elapsed, elapsed ? i * 1000.0 / elapsed : 0.0,
+			start - test_threads_started_ms, start + elapsed - test_threads_started_ms);
+	else
+		fprintf(stderr, "Test thread %d slot 0x%lx signature %d returned %s\n",
+			tnum, slot, i, CKR2Str(rv));
+
+out:
+	p11->C_CloseSession(session);
+	return rv;
+}
+
+/* Returns the number of threads that failed */
+static int test_threads_cleanup()
+{
+
+	int i, failed = 0;
 
 	fprintf(stderr,"test_threads cleanup starting\n");
 
@@ -8698,10 +8792,12 @@ static int test_threads_cleanup()
 #else
 		pthread_join(test_threads_handles[i], NULL);
 #endif
+		if (test_threads_datas[i].rv != CKR_OK)
+			failed++;
 	}
 
-	fprintf(stderr,"test_threads cleanup finished\n");
-	return 0;
+	fprintf(stderr,"test_threads cleanup finished, %d of %d threads failed\n", failed, test_threads_num);
+	return failed;
 }
 
 static int test_threads_start(int tnum)
@@ -8723,6 +8819,7 @@ static int test_threads_start(int tnum)
 	if (r != 0) {
 		fprintf(stderr,"test_threads pthread_create failed %d for thread %d\n", r, tnum);
 		/* system error */
+		test_threads_datas[tnum].rv = CKR_GENERAL_ERROR;
 	}
 	return r;
 }
@@ -8735,6 +8832,7 @@ static void test_threads()
 	/* call test_threads_start for each --test-thread option */
 
 	/* upon return, C_Initialize will be called, from main code */
+	test_threads_started_ms = test_threads_time_ms();
 	for (i = 0; i < test_threads_num && i < MAX_TEST_THREADS; i++) {
 		test_threads_start(i);
 	}
@@ -0,0 +1,72 @@
+#!/bin/bash
+SOURCE_PATH=${SOURCE_PATH:-..}
+
+source $SOURCE_PATH/tests/common.sh
+
+# Test our PKCS #11 module here
+P11LIB="../src/pkcs11/.libs/opensc-pkcs11.so"
+
+cat > slot_locking.conf <<EOF2
+app default {
+	framework pkcs15 {
+	}
+}
+app opensc-pkcs11 {
+	pkcs11 {
+		slot_locking = true;
+	}
+}
+EOF2
+export OPENSC_CONF=slot_locking.conf
+
+echo "======================================================="
+echo "Setup two tokens"
+echo "======================================================="
+TOKENS=$($PKCS11_TOOL -T --module="$P11LIB" 2>/dev/null | grep -c "token label")
+if [[ "$TOKENS" -lt 2 ]]; then
+	echo "WARNING: Two tokens with a private key are needed. Can not run this test"
+	rm -f slot_locking.conf
+	exit 77
+fi
+
+# Signs with the test threads and prints when each thread started and
+# ended signing, in ms
+function sign_times() {
+	$PKCS11_TOOL "$@" --pin=$PIN --module="$P11LIB" 2>&1 \
+		| sed -n 's/^Test thread .* signatures in .* from \([0-9]*\) to \([0-9]*\) ms$/\1 \2/p'
+	return ${PIPESTATUS[0]}
+}
+
+# Time from the first start to the last end of signing
+function elapsed() {
+	echo "$1" | awk 'NR == 1 || $1 < s { s = $1 } $2 > e { e = $2 } END { print e - s }'
+}
+
+echo "======================================================="
+echo "Sign on each token alone and on both in parallel"
+echo "======================================================="
+TIMES0=$(sign_times --test-threads ILSLX0)
+assert $? "Failed to sign on token 0"
+TIMES1=$(sign_times --test-threads ILSLX1)
+assert $? "Failed to sign on token 1"
+TIMES=$(sign_times --test-threads ILSLX0 --test-threads ILSLX1)
+assert $? "Failed to sign on both tokens"
+
+if [[ $ERRORS == 0 ]]; then
+	TIME0=$(elapsed "$TIMES0")
+	TIME1=$(elapsed "$TIMES1")
+	TIME=$(elapsed "$TIMES")
+	# One token after the other takes about TIME0 + TIME1, both in
+	# parallel about the longer of them. The middle is the limit.
+	if [[ $TIME0 -gt $TIME1 ]]; then
+		LIMIT=$((TIME0 + TIME1 / 2))
+	else
+		LIMIT=$((TIME1 + TIME0 / 2))
+	fi
+	echo "Token 0: $TIME0 ms, token 1: $TIME1 ms, both: $TIME ms (limit $LIMIT ms)"
+	[[ $TIME -lt $LIMIT ]]
+	assert $? "Tokens were not used in parallel"
+fi
+
+rm -f slot_locking.conf
+exit $ERRORS